@@ -0,0 +1,152 @@
+// SPDX-License-Identifier: GPL-3.0
+#define _GNU_SOURCE // (basename)
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "classparser.h"
+#include "hashmap.h"
+#include "utils.h"
+
+#define DEFAULT_NCLASSES 10000
+
+/*
+ * Measures how much memory loading many classes takes, the way userctld loads
+ * them: parsed into one arena, resolved together and flattened. The class
+ * files are generated into a temporary directory, each with a few numeric
+ * members, controls whose values are mostly shared between classes and one
+ * that is unique to the class. Every hundredth class inherits from the one
+ * before it.
+ */
+
+static void _write_classes(const char* dir, size_t nclasses);
+static void _remove_classes(const char* dir, size_t nclasses);
+
+int main(int argc, char* argv[])
+{
+    size_t nclasses = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_NCLASSES;
+    if (nclasses == 0)
+        die("Usage: classes [NCLASSES]");
+
+    char dir[] = "/tmp/userctl-bench.XXXXXX";
+    if (!mkdtemp(dir))
+        errno_die("Failed to create class directory");
+    _write_classes(dir, nclasses);
+
+    uint64_t resident_before = 0;
+    if (get_resident_bytes(&resident_before) < 0)
+        errno_die("Failed to read resident memory");
+    uint64_t start_usec = monotonic_usec();
+
+    struct dirent** class_files = NULL;
+    int num_files = 0;
+    if (list_class_files(dir, DEFAULT_CLASSEXT, &class_files, &num_files) < 0)
+        errno_die("Failed to list class files");
+
+    size_t nparsed = 0;
+    ClassProperties* classes = calloc(num_files + 1, sizeof *classes);
+    Arena* arena = create_arena();
+    if (!classes || !arena)
+        errno_die("Failed to load classes");
+    for (int i = 0; i < num_files; i++) {
+        if (create_unresolved_class(dir, class_files[i]->d_name,
+                &classes[nparsed], arena)
+            < 0)
+            errno_die("Failed to parse class");
+        nparsed++;
+    }
+    char** classnames = calloc(nparsed + 1, sizeof *classnames);
+    int* errors = calloc(nparsed + 1, sizeof *errors);
+    if (!classnames || !errors)
+        errno_die("Failed to load classes");
+    if (resolve_class_members(classes, nparsed, errors) < 0)
+        errno_die("Failed to resolve class members");
+    for (size_t n = 0; n < nparsed; n++)
+        classnames[n] = basename(classes[n].filepath);
+    if (flatten_classes(classes, classnames, nparsed, NULL, errors) < 0)
+        errno_die("Failed to flatten classes");
+
+    HashMap map;
+    if (create_hashmap(&map, sizeof(ClassProperties), nparsed) < 0)
+        errno_die("Failed to load classes");
+    for (size_t n = 0; n < nparsed; n++) {
+        if (add_hashmap_entry(&map, classnames[n], &classes[n]) < 0)
+            errno_die("Failed to load classes");
+    }
+
+    uint64_t load_usec = monotonic_usec() - start_usec;
+    uint64_t resident_after = 0;
+    if (get_resident_bytes(&resident_after) < 0)
+        errno_die("Failed to read resident memory");
+    size_t arena_used = 0;
+    size_t arena_reserved = 0;
+    get_arena_size(arena, &arena_used, &arena_reserved);
+
+    uint64_t resident = resident_after - resident_before;
+    printf("Loaded %zu classes in %.1f ms\n", get_hashmap_count(&map),
+        load_usec / 1000.0);
+    printf("Arena: %zu KiB used of %zu KiB reserved\n", arena_used / 1024,
+        arena_reserved / 1024);
+    printf("Resident: %lu KiB more, %lu bytes per class\n",
+        (unsigned long)(resident / 1024), (unsigned long)(resident / nparsed));
+
+    for (size_t n = 0; n < nparsed; n++)
+        destroy_class(&classes[n]);
+    destroy_hashmap(&map);
+    unref_arena(arena);
+    free(classes);
+    free(classnames);
+    free(errors);
+    for (int i = 0; i < num_files; i++)
+        free(class_files[i]);
+    free(class_files);
+    _remove_classes(dir, nclasses);
+    return 0;
+}
+
+/*
+ * Writes nclasses class files into dir, dying if any can't be written.
+ */
+static void
+_write_classes(const char* dir, size_t nclasses)
+{
+    char path[PATH_MAX];
+    for (size_t n = 0; n < nclasses; n++) {
+        snprintf(path, sizeof path, "%s/bench%06zu%s", dir, n, DEFAULT_CLASSEXT);
+        FILE* file = fopen(path, "w");
+        if (!file)
+            errno_die("Failed to write class file");
+        fprintf(file, "shared=%s\n", n % 2 ? "yes" : "no");
+        fprintf(file, "priority=%zu\n", n + 1);
+        fprintf(file, "users=%zu, %zu, %zu\n", 100000 + n * 3,
+            100000 + n * 3 + 1, 100000 + n * 3 + 2);
+        fprintf(file, "groups=%zu\n", 100000 + n);
+        if (n > 0 && n % 100 == 0)
+            fprintf(file, "inherit=bench%06zu\n", n - 1);
+        fprintf(file, "CPUQuota=%zu%%\n", (n % 8 + 1) * 25);
+        fprintf(file, "MemoryMax=%zuG\n", n % 16 + 1);
+        fprintf(file, "TasksMax=%zu\n", 1000 + n);
+        if (fclose(file) != 0)
+            errno_die("Failed to write class file");
+    }
+}
+
+/*
+ * Removes the class files written by _write_classes and their directory.
+ */
+static void
+_remove_classes(const char* dir, size_t nclasses)
+{
+    char path[PATH_MAX];
+    for (size_t n = 0; n < nclasses; n++) {
+        snprintf(path, sizeof path, "%s/bench%06zu%s", dir, n, DEFAULT_CLASSEXT);
+        unlink(path);
+    }
+    rmdir(dir);
+}
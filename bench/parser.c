@@ -0,0 +1,83 @@
+// SPDX-License-Identifier: GPL-3.0
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "classparser.h"
+#include "resolver.h"
+#include "utils.h"
+
+#define DEFAULT_NMEMBERS 100000
+
+/*
+ * Times parsing and resolving a class file whose users= line lists many
+ * usernames, the way userctld does with its resolver started. The names are
+ * generated, so most don't exist and cost a negative lookup each.
+ */
+
+static void _write_class(const char* path, size_t nmembers);
+
+int main(int argc, char* argv[])
+{
+    size_t nmembers = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_NMEMBERS;
+    if (nmembers == 0)
+        die("Usage: parser [NMEMBERS]");
+
+    char dir[] = "/tmp/userctl-bench.XXXXXX";
+    if (!mkdtemp(dir))
+        errno_die("Failed to create class directory");
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "%s/members%s", dir, DEFAULT_CLASSEXT);
+    _write_class(path, nmembers);
+
+    if (start_resolver(RESOLVER_THREADS, DEFAULT_NSS_TIMEOUT_MSEC * 1000ULL) < 0)
+        errno_die("Failed to start resolver");
+
+    ClassProperties props;
+    uint64_t start_usec = monotonic_usec();
+    if (create_unresolved_class(dir, "members" DEFAULT_CLASSEXT, &props, NULL) < 0)
+        errno_die("Failed to parse class");
+    uint64_t parse_usec = monotonic_usec() - start_usec;
+
+    start_usec = monotonic_usec();
+    int error = 0;
+    int r = resolve_class_members(&props, 1, &error);
+    int saved = r < 0 ? errno : error;
+    uint64_t resolve_usec = monotonic_usec() - start_usec;
+
+    printf("Parsed %zu members in %.1f ms\n", nmembers, parse_usec / 1000.0);
+    if (saved != 0)
+        printf("Failed to resolve them after %.1f ms: %s\n",
+            resolve_usec / 1000.0, strerror(saved));
+    else
+        printf("Resolved %zu of them in %.1f ms\n", props.users.count,
+            resolve_usec / 1000.0);
+
+    destroy_class(&props);
+    unlink(path);
+    rmdir(dir);
+    return 0;
+}
+
+/*
+ * Writes a class file with nmembers generated usernames on one users= line,
+ * dying if it can't be written.
+ */
+static void
+_write_class(const char* path, size_t nmembers)
+{
+    FILE* file = fopen(path, "w");
+    if (!file)
+        errno_die("Failed to write class file");
+    fprintf(file, "priority=1\nusers=");
+    for (size_t n = 0; n < nmembers; n++)
+        fprintf(file, "%sbench%06zu", n > 0 ? ", " : "", n);
+    fprintf(file, "\nCPUQuota=50%%\n");
+    if (fclose(file) != 0)
+        errno_die("Failed to write class file");
+}
@@ -0,0 +1,110 @@
+// SPDX-License-Identifier: GPL-3.0
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+#include <unistd.h>
+
+#include "queryclient.h"
+#include "utils.h"
+
+#define DEFAULT_NQUERIES 10000
+#define QUERY_TIMEOUT_USEC (5 * 1000000ULL)
+
+/*
+ * Times evaluating a uid N times over the query socket, with every query
+ * pipelined, against N Evaluate calls on the bus, each waiting on its reply
+ * like userctl eval does. Needs a running userctld.
+ */
+
+static const char* service_path = "/org/dylangardner/userctl";
+static const char* service_name = "org.dylangardner.userctl";
+
+static uint64_t _time_queries(uid_t uid, size_t nqueries);
+static uint64_t _time_bus_calls(uid_t uid, size_t nqueries);
+
+int main(int argc, char* argv[])
+{
+    size_t nqueries = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_NQUERIES;
+    uid_t uid = argc > 2 ? (uid_t)strtoul(argv[2], NULL, 10) : getuid();
+    if (nqueries == 0)
+        die("Usage: queries [NQUERIES] [UID]");
+
+    uint64_t socket_usec = _time_queries(uid, nqueries);
+    uint64_t bus_usec = _time_bus_calls(uid, nqueries);
+    printf("%zu evaluations of uid %u\n", nqueries, uid);
+    printf("Query socket: %.1f ms, %.2f us each\n", socket_usec / 1000.0,
+        (double)socket_usec / nqueries);
+    printf("Bus:          %.1f ms, %.2f us each\n", bus_usec / 1000.0,
+        (double)bus_usec / nqueries);
+    printf("Query socket is %.1fx faster\n", (double)bus_usec / socket_usec);
+    return 0;
+}
+
+/*
+ * Queues every evaluation before reading any response and returns how long
+ * it took to have all of them answered, dying if any failed.
+ */
+static uint64_t
+_time_queries(uid_t uid, size_t nqueries)
+{
+    QueryClient client;
+    if (connect_query_client(&client, NULL, QUERY_TIMEOUT_USEC) < 0)
+        errno_die("Failed to connect to the query socket");
+
+    uint64_t start_usec = monotonic_usec();
+    for (size_t n = 0; n < nqueries; n++) {
+        if (queue_query(&client, QUERY_EVALUATE, uid, NULL) < 0)
+            errno_die("Failed to queue query");
+    }
+    for (size_t n = 0; n < nqueries; n++) {
+        QueryResponse response;
+        if (read_query_response(&client, &response) < 0)
+            errno_die("Failed to read query response");
+        // Being in no class is still an answer
+        if (response.status < 0 && response.status != -ENOENT) {
+            errno = -response.status;
+            errno_die("Failed to evaluate");
+        }
+    }
+    uint64_t elapsed_usec = monotonic_usec() - start_usec;
+
+    close_query_client(&client);
+    return elapsed_usec;
+}
+
+/*
+ * Calls Evaluate one after the other and returns how long all of them took,
+ * dying if any failed for a reason other than the user being in no class.
+ */
+static uint64_t
+_time_bus_calls(uid_t uid, size_t nqueries)
+{
+    sd_bus* bus = NULL;
+    int r = sd_bus_open_system(&bus);
+    if (r < 0) {
+        errno = -r;
+        errno_die("Failed to connect to system bus");
+    }
+
+    uint64_t start_usec = monotonic_usec();
+    for (size_t n = 0; n < nqueries; n++) {
+        sd_bus_error error = SD_BUS_ERROR_NULL;
+        sd_bus_message* msg = NULL;
+        r = sd_bus_call_method(bus, service_name, service_path, service_name,
+            "Evaluate", &error, &msg, "u", uid);
+        if (r < 0 && !sd_bus_error_has_name(&error, "org.dylangardner.NoClassForUser")) {
+            fprintf(stderr, "Failed to evaluate: %s\n", error.message);
+            exit(1);
+        }
+        sd_bus_error_free(&error);
+        sd_bus_message_unref(msg);
+    }
+    uint64_t elapsed_usec = monotonic_usec() - start_usec;
+
+    sd_bus_unref(bus);
+    return elapsed_usec;
+}
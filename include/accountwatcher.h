@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: GPL-3.0
+#ifndef ACCOUNTWATCHER_H
+#define ACCOUNTWATCHER_H
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <systemd/sd-event.h>
+
+#include "controller.h"
+
+// How long the user databases have to be quiet before memberships are checked
+#define ACCOUNT_DEBOUNCE_MSEC 1000
+// How often the user databases are polled, for changes inotify can't see
+#define DEFAULT_ACCOUNT_POLL_MSEC 30000
+// /etc, sssd's memory caches and sssd's databases
+#define ACCOUNT_DIRS 3
+
+/*
+ * Watches the local user and group databases and the sssd cache, and
+ * re-enforces on the active users whose membership in the groups of the
+ * classes changed since they were last enforced on. Changes are seen with
+ * inotify and, as a fallback, by polling the databases. The groups users were
+ * enforced with are kept in the context's membership. The groups are looked
+ * up on a thread of the watcher's own, so a slow NSS source never holds up
+ * the event loop.
+ */
+typedef struct AccountWatcher {
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    pthread_t checker;
+    bool checker_started;
+    // Whether the event loop asked for a check the checker hasn't started
+    bool check_requested;
+    bool stopping;
+    int fd;
+    // Watch descriptors of the ACCOUNT_DIRS directories; -1 if not watched
+    int wds[ACCOUNT_DIRS];
+    sd_event_source* io;
+    sd_event_source* debounce;
+    sd_event_source* poll;
+    uint64_t poll_usec;
+    // Hash of the stat of every database file as of the last check
+    uint64_t fingerprint;
+    Context* context;
+} AccountWatcher;
+
+/*
+ * Starts watching the user databases on the given event loop, polling them
+ * every poll_usec (or never if zero), and returns a 0 if successful, or -1 if
+ * not. If a -1 is returned, the issue should be looked up via errno; ENODATA
+ * means the context doesn't track its users' membership.
+ */
+int watch_accounts(AccountWatcher* watcher, sd_event* event, Context* context,
+    uint64_t poll_usec);
+
+/*
+ * Stops watching and destroys the given watcher, waiting for a check that's
+ * under way to finish looking up the user it's on.
+ */
+void destroy_account_watcher(AccountWatcher* watcher);
+
+#endif // ACCOUNTWATCHER_H
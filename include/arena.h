@@ -0,0 +1,90 @@
+// SPDX-License-Identifier: GPL-3.0
+#ifndef ARENA_H
+#define ARENA_H
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Size of the first chunk; each chunk after is twice the size of the last
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    size_t size;
+    size_t used;
+    _Alignas(ARENA_ALIGN) char data[];
+} ArenaChunk;
+
+/*
+ * A reference counted bump allocator for things that live and die together,
+ * such as the classes of a configuration generation. Strings can be interned,
+ * so identical ones are only stored once. Everything in the arena is freed at
+ * once when the last reference is dropped. Safe to use from multiple threads.
+ */
+typedef struct Arena {
+    // The chunk allocations are carved from; the first is part of the arena
+    ArenaChunk* chunks;
+    // Open addressed set of the interned strings
+    const char** strings;
+    size_t nstrings;
+    size_t string_slots;
+    // Bytes handed out and bytes taken from the system
+    size_t used;
+    size_t reserved;
+    atomic_size_t refs;
+    pthread_mutex_t lock;
+} Arena;
+
+/*
+ * Creates an arena with a single reference. Returns NULL if there was an
+ * error (and errno should be looked up).
+ */
+Arena* create_arena(void);
+
+/*
+ * Creates an arena like create_arena, but whose first chunk is size bytes,
+ * for arenas that only ever hold a little.
+ */
+Arena* create_sized_arena(size_t size);
+
+/*
+ * Takes another reference to the arena and returns it.
+ */
+Arena* ref_arena(Arena* arena);
+
+/*
+ * Drops a reference to the arena, freeing it and everything allocated from it
+ * if it was the last. The arena may be NULL.
+ */
+void unref_arena(Arena* arena);
+
+/*
+ * Allocates size bytes aligned to ARENA_ALIGN from the arena. The memory
+ * can't be freed on its own. Returns NULL if there was an error (and errno
+ * should be looked up).
+ */
+void* arena_alloc(Arena* arena, size_t size);
+
+/*
+ * Returns the arena's copy of the zero-terminated string, copying it into
+ * the arena if it isn't there yet. Returns NULL if there was an error (and
+ * errno should be looked up).
+ */
+const char* arena_intern(Arena* arena, const char* string);
+
+/*
+ * Interns the len bytes at string, which needn't be zero-terminated, like
+ * arena_intern. The arena's copy is zero-terminated.
+ */
+const char* arena_intern_len(Arena* arena, const char* string, size_t len);
+
+/*
+ * Passes back how many bytes were handed out of the arena and how many the
+ * arena took from the system. Either may be NULL.
+ */
+void get_arena_size(Arena* arena, size_t* used, size_t* reserved);
+
+#endif // ARENA_H
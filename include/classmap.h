@@ -0,0 +1,180 @@
+// SPDX-License-Identifier: GPL-3.0
+#ifndef CLASSMAP_H
+#define CLASSMAP_H
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/*
+ * The classmap is the class each logged in user was last evaluated into,
+ * published by userctld for tools that want to know without asking it. It is
+ * replaced as a whole (by renaming over it) whenever the classes or who is in
+ * them change, so a mapped classmap never changes under its readers.
+ *
+ * A classmap is a ClassMapHeader, followed by nusers ClassMapEntry's sorted
+ * by uid, followed by the NUL terminated class filepaths the entries point
+ * into. Integers are in host byte order.
+ *
+ * This header is all a reader needs; it doesn't depend on the rest of
+ * userctl.
+ */
+
+#define CLASSMAP_MAGIC "UCTLCMAP"
+// Bump whenever the layout of a classmap changes
+#define CLASSMAP_VERSION 1
+#define DEFAULT_CLASSMAP_PATH "/run/userctl/classmap"
+
+typedef struct ClassMapHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t size;
+    // The configuration generation of the classes the users were evaluated
+    // under
+    uint64_t generation;
+    uint32_t nusers;
+    // Where the filepaths start and how many bytes of them there are
+    uint32_t strings;
+    uint32_t strings_size;
+    uint32_t padding;
+} ClassMapHeader;
+
+typedef struct ClassMapEntry {
+    uint32_t uid;
+    // The offset of the class filepath in the strings
+    uint32_t classpath;
+} ClassMapEntry;
+
+/*
+ * A mapped classmap.
+ */
+typedef struct ClassMap {
+    const char* data;
+    size_t size;
+    const ClassMapHeader* header;
+    const ClassMapEntry* entries;
+    const char* strings;
+    // Which file was mapped, to tell whether it has been replaced since
+    dev_t dev;
+    ino_t ino;
+} ClassMap;
+
+/*
+ * Maps the classmap at path (or DEFAULT_CLASSMAP_PATH if NULL). If there is
+ * no classmap, errno is ENOENT. If it is corrupt or of another version, errno
+ * is EINVAL. Returns -1 if there was an error (and errno should be looked up),
+ * otherwise 0.
+ */
+static inline int open_classmap(ClassMap* map, const char* path)
+{
+    memset(map, 0, sizeof *map);
+    int fd = open(path ? path : DEFAULT_CLASSMAP_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(ClassMapHeader)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    int saved = errno;
+    close(fd);
+    if (data == MAP_FAILED) {
+        errno = saved;
+        return -1;
+    }
+
+    // Everything is checked once here, so lookups can trust the offsets
+    const ClassMapHeader* header = (const ClassMapHeader*)data;
+    size_t size = st.st_size;
+    size_t entries_end = sizeof *header
+        + (size_t)header->nusers * sizeof(ClassMapEntry);
+    bool valid = memcmp(header->magic, CLASSMAP_MAGIC, sizeof header->magic) == 0
+        && header->version == CLASSMAP_VERSION
+        && header->header_size == sizeof *header && header->size == size
+        && entries_end <= header->strings && header->strings <= size
+        && header->strings_size == size - header->strings
+        && (header->strings_size == 0 || ((const char*)data)[size - 1] == '\0');
+    const ClassMapEntry* entries = (const ClassMapEntry*)((const char*)data
+        + sizeof *header);
+    for (uint32_t n = 0; valid && n < header->nusers; n++)
+        valid = entries[n].classpath < header->strings_size
+            && (n == 0 || entries[n - 1].uid < entries[n].uid);
+    if (!valid) {
+        munmap(data, size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    map->data = data;
+    map->size = size;
+    map->header = header;
+    map->entries = entries;
+    map->strings = (const char*)data + header->strings;
+    map->dev = st.st_dev;
+    map->ino = st.st_ino;
+    return 0;
+}
+
+/*
+ * Unmaps the given classmap.
+ */
+static inline void close_classmap(ClassMap* map)
+{
+    if (map->data)
+        munmap((void*)map->data, map->size);
+    memset(map, 0, sizeof *map);
+}
+
+/*
+ * Returns the filepath of the class the uid was last evaluated into, which
+ * stays valid until the classmap is closed, or NULL if they aren't logged in
+ * or are in no class.
+ */
+static inline const char* lookup_classmap(const ClassMap* map, uid_t uid)
+{
+    size_t lo = 0;
+    size_t hi = map->header->nusers;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (map->entries[mid].uid < uid)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == map->header->nusers || map->entries[lo].uid != uid)
+        return NULL;
+    return map->strings + map->entries[lo].classpath;
+}
+
+/*
+ * Returns whether the classmap at path (or DEFAULT_CLASSMAP_PATH if NULL) was
+ * replaced since the given one was opened, in which case it should be closed
+ * and opened again to see the changes.
+ */
+static inline bool is_classmap_replaced(const ClassMap* map, const char* path)
+{
+    struct stat st;
+    if (stat(path ? path : DEFAULT_CLASSMAP_PATH, &st) < 0)
+        return true;
+    return st.st_dev != map->dev || st.st_ino != map->ino;
+}
+
+#endif // CLASSMAP_H
@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: GPL-3.0
+#ifndef CLASSMAPWRITER_H
+#define CLASSMAPWRITER_H
+#define _GNU_SOURCE
+
+#include <stdint.h>
+
+#include "classmap.h"
+#include "membership.h"
+
+/*
+ * Builds a classmap (see classmap.h) of the users in the membership as of the
+ * given configuration generation and atomically replaces the classmap at path
+ * with it, creating its directory if needed. Returns -1 if there was an error
+ * (and errno should be looked up), otherwise 0.
+ */
+int write_classmap(const char* path, Membership* membership,
+    uint64_t generation);
+
+#endif // CLASSMAPWRITER_H
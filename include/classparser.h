@@ -6,13 +6,18 @@
 #include <dirent.h>
 #include <pwd.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
+#include "arena.h"
 #include "hashmap.h"
+#include "typedvector.h"
 #include "vector.h"
 
-#define MAX_CONTROLS 128
-#define MAX_CLASSES 256
+// How many controls a class has room for before its controls have to grow
+#define DEFAULT_CONTROLS 8
+#define DEFAULT_CLASSDIR "/etc/userctl"
+#define DEFAULT_CLASSEXT ".class"
 
 /* The properties of a class */
 typedef struct
@@ -20,9 +25,23 @@ typedef struct
     const char* filepath;
     bool shared;
     double priority;
-    Vector groups;
-    Vector users;
+    // Sorted, so membership is a scan or binary search
+    GidVector groups;
+    UidVector users;
+    // Allocated names of members left to be resolved
+    StringVector groupnames;
+    StringVector usernames;
+    // Interned classnames of the classes it inherits controls from, in the
+    // order they were listed
+    StringVector parents;
     HashMap controls;
+    // FNV-1a hash of the class file's contents when it was parsed
+    uint64_t hash;
+    // Whether controls were set that aren't in the class file
+    bool transient;
+    // Holds the filepath and controls; usually shared by every class loaded
+    // at the same time
+    Arena* arena;
 } ClassProperties;
 
 /*
@@ -30,20 +49,80 @@ typedef struct
  */
 void destroy_class(ClassProperties* props);
 
+/*
+ * Initializes an empty class for the class file at filepath, allocated from
+ * the given arena (or an arena of its own if NULL). Returns -1 if there was
+ * an error (and errno should be looked up), otherwise 0.
+ */
+int init_class(const char* filepath, ClassProperties* props, Arena* arena);
+
 /*
  * Creates a ClassProperties struct for the given class in the given directory.
  * If there was an issue parsing the class file, returns a -1. In that case,
- * the result of props is undefined. Otherwise, a zero is returned.
+ * props has already been destroyed. Otherwise, a zero is returned.
  */
 int create_class(const char* dir, const char* filename, ClassProperties* props);
 
 /*
- * Parses a class file and passes a ClassProperties struct into props. If
- * there was an issue parsing the class file, returns a -1 and prints the
- * error. In that case, the result of props is undefined. Otherwise, a zero is
- * returned.
+ * Like create_class, but leaves the names of the class's users and groups to
+ * be resolved with resolve_class_members, so that many classes can be
+ * resolved at once. The class is allocated from the given arena, or an arena
+ * of its own if NULL.
+ */
+int create_unresolved_class(const char* dir, const char* filename,
+    ClassProperties* props, Arena* arena);
+
+/*
+ * Converts the usernames and groupnames of the given classes into their users
+ * and groups, resolving all of them in one go. Names that don't exist are
+ * skipped. A class with a name that couldn't be looked up (say, because NSS
+ * timed out) gets that errno in errors and is missing that member, so it
+ * shouldn't be loaded; the errors of the rest are zero. Returns -1 if there
+ * was an error (and errno should be looked up), otherwise 0.
  */
-int parse_classfile(const char* filename, ClassProperties* props);
+int resolve_class_members(ClassProperties* classes, size_t nclasses,
+    int* errors);
+
+/*
+ * Flattens the controls each class inherits through its inherit= key into
+ * the class's own controls, so that nothing is looked up once it's loaded.
+ * The class's own controls win over inherited ones, and later parents win
+ * over earlier ones. Each class is named by classnames, and its errno is in
+ * errors: classes whose errno is already set are skipped and treated as
+ * missing. Parents that aren't among the classes are looked up in flattened
+ * (if not NULL), whose classes must already be flattened. A class that
+ * inherits from a missing class fails with ENOENT, and one that inherits from
+ * itself, directly or not, fails with ELOOP. Returns -1 if there was an error
+ * (and errno should be looked up), otherwise 0.
+ */
+int flatten_classes(ClassProperties* classes, char** classnames,
+    size_t nclasses, HashMap* flattened, int* errors);
+
+/*
+ * Parses a class file and passes a ClassProperties struct into props, with
+ * its members left unresolved. Lines may be any length. If there was an issue
+ * parsing the class file, returns a -1 and prints the error. In that case,
+ * props has already been destroyed. Otherwise, a zero is returned. The class
+ * is allocated from the given arena, or an arena of its own if NULL.
+ */
+int parse_classfile(const char* filename, ClassProperties* props,
+    Arena* arena);
+
+/*
+ * Sets the resource control key of the class to value, replacing any value it
+ * had. The controls map keys to char*'s interned in the class's arena.
+ * Returns -1 if there was an error (and errno should be looked up),
+ * otherwise 0.
+ */
+int set_class_control(ClassProperties* props, char* key, const char* value);
+
+/*
+ * Removes the resource control key from the class. The key is kept with an
+ * empty value, which resets the control on the class's users when they're
+ * next enforced on. Returns -1 with errno ENOENT if the class has no such
+ * control (or it was already removed), otherwise 0.
+ */
+int remove_class_control(ClassProperties* props, const char* key);
 
 /*
  * Parses the given line into a key value pair. If there is a issue with
@@ -74,4 +153,11 @@ int list_class_files(const char* dir, const char* ext,
  */
 int evaluate(uid_t uid, HashMap* classes, ClassProperties* props);
 
+/*
+ * Evaluates a user like evaluate, but with the groups they're in already
+ * looked up, so that nothing waits on NSS. Returns the same as evaluate.
+ */
+int evaluate_with_groups(uid_t uid, gid_t* groups, int ngroups,
+    HashMap* classes, ClassProperties* props);
+
 #endif // CLASSPARSER_H
@@ -97,4 +97,46 @@ void edit(int argc, char* argv[]);
  */
 void show_edit_help();
 
+/*
+ * Compiles the class files into a snapshot for the daemon to start from.
+ */
+void compile(int argc, char* argv[]);
+
+/*
+ * Prints out the help for the compile command.
+ */
+void show_compile_help();
+
+/*
+ * Writes out the daemon's whole loaded configuration, as an export or as
+ * text.
+ */
+void export(int argc, char* argv[]);
+
+/*
+ * Prints out the help for the export command.
+ */
+void show_export_help();
+
+/*
+ * Runs many commands over one connection to the daemon, sending those that
+ * don't depend on each other without waiting for the replies.
+ */
+void batch(int argc, char* argv[]);
+
+/*
+ * Prints out the help for the batch command.
+ */
+void show_batch_help();
+
+/*
+ * Follows the daemon's change notifications, printing a line for each.
+ */
+void monitor(int argc, char* argv[]);
+
+/*
+ * Prints out the help for the monitor command.
+ */
+void show_monitor_help();
+
 #endif // COMMANDS_H
@@ -3,23 +3,76 @@
 #define CONTROLLER_H
 #define _GNU_SOURCE
 
+#include <pthread.h>
+#include <stdint.h>
 #include <systemd/sd-bus.h>
 
 #include "hashmap.h"
+#include "vector.h"
+
+struct Dispatcher;
+struct Membership;
+struct Notifier;
+
+// What GetClasses includes in its reply besides the ids of a class's members
+#define CLASS_INFO_NAMES (1 << 0)
+#define CLASS_INFO_CONTROLS (1 << 1)
+
+/*
+ * Counters exposed as properties on the bus.
+ */
+typedef struct Stats {
+    // How long enforcing on the users logged in at startup took
+    uint64_t reconcile_usec;
+    uint64_t reconciled_users;
+    // Memory held by the arenas of the loaded classes, and by the daemon as a
+    // whole, as of when the classes last changed
+    uint64_t arena_bytes;
+    uint64_t resident_bytes;
+} Stats;
 
 typedef struct Context {
     HashMap classes;
     char* classdir;
     char* classext;
+    // Where the classes are snapshotted for a fast startup; NULL if they
+    // aren't. Not owned by the context
+    const char* snapshot_path;
+    // Bumped whenever the classes change, so stale enforcement is dropped
+    uint64_t generation;
+    struct Dispatcher* dispatcher;
+    // Who is logged in and in which class; NULL if not tracked
+    struct Membership* membership;
+    // Sends signals when the classes or users' classes change; NULL if not
+    struct Notifier* notifier;
+    Stats stats;
 } Context;
 
-pthread_rwlock_t context_lock;
+extern pthread_rwlock_t context_lock;
 
 /*
- * Initializes the context.
+ * Initializes the context. The context lock isn't taken, so the context must
+ * not be shared yet. If the classes couldn't be loaded, -1 is returned (and
+ * errno should be looked up) and nothing is left to destroy, so the caller
+ * can go back to the classes it had. Otherwise, 0 is returned.
  */
 int init_context(Context* context);
 
+/*
+ * Initializes the context from the snapshot at the context's snapshot path,
+ * rather than parsing every class file. If the snapshot is missing, corrupt
+ * or out of date, -1 is returned (and errno should be looked up; see
+ * read_snapshot). Otherwise, 0 is returned.
+ */
+int init_context_from_snapshot(Context* context);
+
+/*
+ * Snapshots the context's classes to its snapshot path, if it has one. Classes
+ * with transient controls aren't snapshotted. If there was an error, -1 is
+ * returned (and errno should be looked up). Otherwise, 0 is returned.
+ */
+int save_snapshot(Context* context);
+
 /*
  * Destroys the Context struct by deallocating things.
  */
@@ -30,6 +83,14 @@ void destroy_context(Context* context);
  */
 int method_evaluate(sd_bus_message* m, void* userdata, sd_bus_error* ret_error);
 
+/*
+ * Returns the outcome of the last time a class was enforced on the uid: the
+ * class, the generation it was evaluated under, when it finished, how long it
+ * took and whether it succeeded.
+ */
+int method_get_user_status(sd_bus_message* m, void* userdata,
+    sd_bus_error* ret_error);
+
 /*
  * Lists the path of the classes known.
  */
@@ -42,6 +103,28 @@ int method_list_classes(sd_bus_message* m, void* userdata,
 int method_get_class(sd_bus_message* m, void* userdata,
     sd_bus_error* ret_error);
 
+/*
+ * Returns many classes at once, or every class if none are given, along with
+ * the names of their members and their controls if the flags (CLASS_INFO_*)
+ * ask for them. Classes that aren't loaded are left out.
+ */
+int method_get_classes(sd_bus_message* m, void* userdata,
+    sd_bus_error* ret_error);
+
+/*
+ * Returns a sealed memfd holding an export (see build_export) of every loaded
+ * class with its members and controls, as of the current generation, so that
+ * the whole configuration crosses the bus at once however large it is.
+ */
+int method_export_configuration(sd_bus_message* m, void* userdata,
+    sd_bus_error* ret_error);
+
+/*
+ * Lists the uids of the logged in users in the given class.
+ */
+int method_list_class_members(sd_bus_message* m, void* userdata,
+    sd_bus_error* ret_error);
+
 /*
  * Reloads a class.
  */
@@ -49,20 +132,90 @@ int method_reload_class(sd_bus_message* m, void* userdata,
     sd_bus_error* ret_error);
 
 /*
- * Reloads the daemon.
+ * Reloads the daemon. Every class file is loaded into a new set of classes
+ * before the old ones are swapped out under the lock.
  */
 int method_daemon_reload(sd_bus_message* m, void* userdata,
     sd_bus_error* ret_error);
 
 /*
- * Sets a transient resource control on a class.
+ * Sets a transient resource control on a class, or removes it if the value is
+ * empty.
  */
 int method_set_property(sd_bus_message* m, void* userdata,
     sd_bus_error* ret_error);
 
 /*
- * Enforces a class on the new user.
+ * Sets or removes (if the value is empty) many transient resource controls on
+ * a class at once. Either all of them are changed or, if any can't be, none
+ * are, and the class's users are enforced on once.
+ */
+int method_set_properties(sd_bus_message* m, void* userdata,
+    sd_bus_error* ret_error);
+
+/*
+ * Queues the new user on the dispatcher to have their class enforced.
  */
 int match_user_new(sd_bus_message* m, void* userdata, sd_bus_error* error);
 
+/*
+ * Forgets the user who logged out, so they no longer count as a member of
+ * their class.
+ */
+int match_user_removed(sd_bus_message* m, void* userdata,
+    sd_bus_error* error);
+
+/*
+ * Evaluates the given users and enforces their classes in a single pipelined
+ * pass, evaluating large batches in parallel. If classpaths is not NULL, only
+ * users evaluated into one of those class filepaths are enforced. If
+ * generation is not zero and no longer matches the context's generation,
+ * nothing is enforced, -1 is returned and errno is ECANCELED. Otherwise,
+ * returns the number of users whose class could not be evaluated or enforced.
+ */
+int enforce_users(Context* context, const uid_t* uids, size_t nuids,
+    Vector* classpaths, uint64_t generation);
+
+/*
+ * Evaluates and enforces classes on every user logind knows about, so that
+ * users who logged in while the daemon wasn't running get their limits. The
+ * time it took is recorded in the context's stats. If there was an error, -1
+ * is returned (and errno should be looked up). Otherwise, 0 is returned.
+ */
+int reconcile_active_users(Context* context);
+
+/*
+ * Reparses the given class filenames (char*'s) in the context's class
+ * directory, or every class file if filenames is NULL. Files whose contents
+ * haven't changed are skipped and files that no longer exist are removed. Only
+ * active users whose evaluated class changed are queued for enforcement. If
+ * there was an error, -1 is returned (and errno should be looked up).
+ * Otherwise, 0 is returned.
+ */
+int reload_changed_classes(Context* context, Vector* filenames);
+
+/*
+ * Reparses and resolves every class file, even those whose contents haven't
+ * changed, so that classes loaded from a snapshot pick up changes to their
+ * members' users and groups. Only classes that came out different replace the
+ * loaded ones, and the snapshot is refreshed. If there was an error, -1 is
+ * returned (and errno should be looked up). Otherwise, 0 is returned.
+ */
+int revalidate_classes(Context* context);
+
+/*
+ * Fills the given vector with the uids of the users logind knows about. If
+ * there was an error, -1 is returned (and errno should be looked up).
+ * Otherwise, 0 is returned.
+ */
+int list_active_uids(Vector* uids);
+
+/*
+ * Fills the given vector with the uids of the logged in users, as tracked by
+ * the context's membership, or by asking logind if they aren't tracked. If
+ * there was an error, -1 is returned (and errno should be looked up).
+ * Otherwise, 0 is returned.
+ */
+int list_active_users(Context* context, Vector* uids);
+
 #endif // CONTROLLER_H
@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: GPL-3.0
+#ifndef DISPATCHER_H
+#define DISPATCHER_H
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "controller.h"
+#include "vector.h"
+
+#define DEFAULT_MAX_DELAY_MSEC 100
+#define MAX_DISPATCH_BATCH 512
+#define RELOAD_CHUNK_SIZE 32
+
+/*
+ * The classes a reload pass enforces on. If all is true, the classpaths are
+ * ignored and every active user is enforced.
+ */
+typedef struct ReloadFilter {
+    bool all;
+    // Allocated char*'s of class filepaths
+    Vector classpaths;
+} ReloadFilter;
+
+/*
+ * A reload pass over the active users, tagged with the configuration
+ * generation it enforces.
+ */
+typedef struct ReloadPass {
+    uint64_t generation;
+    ReloadFilter filter;
+    // uid_t's of the active users when the pass started
+    Vector uids;
+    size_t next;
+    // Whether the pass was cut short by a newer generation
+    bool stale;
+    uint64_t start_usec;
+} ReloadPass;
+
+/*
+ * Schedules enforcement. New users are coalesced into batches and always
+ * preempt reload passes, which are worked through in chunks. A reload with a
+ * newer generation cancels the rest of an older pass and takes over its
+ * classes.
+ */
+typedef struct Dispatcher {
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    // uid_t's waiting to be dispatched
+    Vector pending;
+    // When the oldest pending uid was queued (CLOCK_MONOTONIC)
+    uint64_t oldest_usec;
+    uint64_t max_delay_usec;
+    // The newest reload asked for; newer than the pass if not picked up yet
+    uint64_t requested_generation;
+    ReloadFilter requested;
+    Context* context;
+} Dispatcher;
+
+/*
+ * Passes back a dispatcher that enforces on the given context and returns a
+ * 0 if the creation was successful, or -1 if not. A queued user waits at most
+ * max_delay_usec before their batch is dispatched. If a -1 is returned, the
+ * issue should be looked up via errno.
+ */
+int create_dispatcher(Dispatcher* dispatcher, Context* context,
+    uint64_t max_delay_usec);
+
+/*
+ * Destroys the given dispatcher. The dispatcher must not be running.
+ */
+void destroy_dispatcher(Dispatcher* dispatcher);
+
+/*
+ * Queues a user to have their class evaluated and enforced in the next
+ * batch. Returns -1 if there was an error (and errno should be looked up),
+ * otherwise 0.
+ */
+int queue_user(Dispatcher* dispatcher, uid_t uid);
+
+/*
+ * Queues a reload pass that enforces the given generation on the active
+ * users of the class at classpath, or on every active user if classpath is
+ * NULL. Any older pass that hasn't finished is cancelled and its classes are
+ * enforced by this one instead. Returns -1 if there was an error (and errno
+ * should be looked up), otherwise 0.
+ */
+int queue_reload(Dispatcher* dispatcher, const char* classpath,
+    uint64_t generation);
+
+/*
+ * Queues a reload pass like queue_reload, but over the active users of every
+ * class in classpaths at once, where a NULL classpath stands for every active
+ * user. Returns the same as queue_reload.
+ */
+int queue_reloads(Dispatcher* dispatcher, const char* const* classpaths,
+    size_t npaths, uint64_t generation);
+
+/*
+ * Drains the queued work forever. Meant to be the start routine of a thread,
+ * given the dispatcher.
+ */
+void* run_dispatcher(void* vargp);
+
+#endif // DISPATCHER_H
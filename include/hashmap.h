@@ -3,22 +3,62 @@
 #define HASHMAP_H
 #define _GNU_SOURCE
 
-#include "vector.h"
-#include <search.h>
+#include <stdbool.h>
+#include <stdint.h>
 
+#include "arena.h"
+
+/*
+ * An open addressing hashmap of zero-terminated string keys to values of a
+ * fixed size. The entries are kept densely in the order they were added, with
+ * the values stored inline, and a table of slots indexes into them. Both grow
+ * as needed.
+ */
 typedef struct HashMap {
-    struct hsearch_data data;
-    // Keep references to the entries
-    Vector keys;
+    // Each entry is a HashMapEntry followed by its value
+    char* entries;
+    size_t count;
+    size_t capacity;
+    size_t entry_size;
     size_t value_size;
+    // Index + 1 of the entry hashed into each slot; zero if empty
+    uint32_t* slots;
+    size_t nslots;
+    size_t iter_count;
+    // If not NULL, the keys are interned in here
+    Arena* arena;
+    // Whether the entries and slots are allocated from the arena too
+    bool arena_backed;
 } HashMap;
 
+typedef struct HashMapEntry {
+    char* key;
+    uint64_t hash;
+} HashMapEntry;
+
+/*
+ * Passes back a hashmap with room for size entries before it has to grow and
+ * returns a 0 if the creation was successful, or -1 is not. If a -1 is
+ * returned, the issue should be looked up via errno and the parameters are
+ * untouched.
+ */
+int create_hashmap(HashMap* map, size_t value_size, size_t size);
+
+/*
+ * Creates a hashmap like create_hashmap, but whose keys are interned in the
+ * given arena (which the hashmap takes a reference to).
+ */
+int create_hashmap_in_arena(HashMap* map, size_t value_size, size_t size,
+    Arena* arena);
+
 /*
- * Passes back a hashmap and returns a 0 if the creation was successful, or -1
- * is not. If a -1 is returned, the issue should be looked up via errno and
- * the parameters are untouched.
+ * Creates a hashmap like create_hashmap_in_arena, but whose entries and slots
+ * are allocated from the arena too, so that destroying it frees nothing but
+ * its reference. Growing leaves the old entries and slots in the arena, so
+ * this is for small hashmaps that are filled once and freed with the arena.
  */
-int create_hashmap(HashMap* map, size_t value_size, size_t max_size);
+int create_hashmap_from_arena(HashMap* map, size_t value_size, size_t size,
+    Arena* arena);
 
 /*
  * Destorys the given hashmap.
@@ -27,17 +67,35 @@ void destroy_hashmap(HashMap* map);
 
 /*
  * Adds a given entry to the hashmap, potentially replacing an existing entry.
- * If replaced, the value is freed. The value and key must be zero-terminated
- * strings of characters. Both values are duplcated when added to the hashmap.
+ * The key must be a zero-terminated string of characters. Both are copied
+ * into the hashmap. Adding may move every value in the hashmap, so pointers
+ * to values must not be held across it.
  */
 int add_hashmap_entry(HashMap* map, char* key, void* value);
 
+/*
+ * Removes the entry of the given key, copying its value into removed (if not
+ * NULL). The entries after it keep their order, but move down, so removing
+ * takes time linear in the size of the hashmap. Returns -1 with
+ * errno ENOENT if the key cannot be found, otherwise 0.
+ */
+int remove_hashmap_entry(HashMap* map, const char* key, void* removed);
+
 /*
  * Gets an entry out of the given hashmap. If the key cannot be found, NULL is
  * returned. The returned entry is owned by the hashmap.
  */
 void* get_hashmap_entry(HashMap* map, char* key);
 
+/*
+ * Gets the key and value of the entry at the given index (in the order they
+ * were added). Unlike iterating, this doesn't modify the hashmap, so readers
+ * may call it concurrently. Either key or value may be NULL. The hashmap owns
+ * the key and value returned.
+ */
+void get_hashmap_entry_at(HashMap* map, size_t index, char** key,
+    void** value);
+
 /*
  * Returns the number of entrs in the hashmap.
  */
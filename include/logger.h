@@ -0,0 +1,63 @@
+// SPDX-License-Identifier: GPL-3.0
+#ifndef LOGGER_H
+#define LOGGER_H
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Must be a power of two
+#define LOG_RING_SIZE 1024
+#define LOG_MSG_SIZE 256
+#define LOG_CLASS_SIZE 64
+// At most LOG_RATE_BURST messages are written per LOG_RATE_INTERVAL_USEC
+#define LOG_RATE_BURST 1000
+#define LOG_RATE_INTERVAL_USEC 1000000
+
+/*
+ * Counters of the messages that never made it to the journal.
+ */
+typedef struct LogStats {
+    // Messages dropped because the ring was full
+    uint64_t dropped;
+    // Messages suppressed by the rate limit or as repeats
+    uint64_t suppressed;
+} LogStats;
+
+/*
+ * Spawns off the writer that drains logged messages to the journal. If echo
+ * is true, messages are also written to stderr. Until the writer is started,
+ * messages are sent to syslog synchronously. Returns -1 if there was an error
+ * (and errno should be looked up), otherwise 0.
+ */
+int start_logger(bool echo);
+
+/*
+ * Sets the syslog log mask (see setlogmask), which logged messages are
+ * checked against without taking syslog's lock.
+ */
+void set_log_mask(int mask);
+
+/*
+ * Logs a message without blocking. If the ring is full, the message is
+ * dropped and counted. Messages outside the log mask are ignored.
+ */
+void log_message(int priority, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/*
+ * Logs a message about a specific user without blocking. The uid, the class
+ * and the duration (if not zero) are attached as structured journal fields.
+ * The classpath may be NULL.
+ */
+void log_user_event(int priority, uid_t uid, const char* classpath,
+    uint64_t duration_usec, const char* fmt, ...)
+    __attribute__((format(printf, 5, 6)));
+
+/*
+ * Passes back the counters of lost messages.
+ */
+void get_log_stats(LogStats* stats);
+
+#endif // LOGGER_H
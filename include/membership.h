@@ -0,0 +1,166 @@
+// SPDX-License-Identifier: GPL-3.0
+#ifndef MEMBERSHIP_H
+#define MEMBERSHIP_H
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "arena.h"
+#include "hashmap.h"
+#include "typedvector.h"
+#include "vector.h"
+
+/*
+ * The outcome of the last time a class was enforced on a user.
+ */
+typedef struct EnforceStatus {
+    // The filepath of the class enforced; interned in the membership when
+    // recorded
+    const char* classpath;
+    // The configuration generation the class was evaluated under
+    uint64_t generation;
+    // When the enforcement finished (CLOCK_REALTIME) and how long it took
+    uint64_t timestamp_usec;
+    uint64_t duration_usec;
+    bool succeeded;
+} EnforceStatus;
+
+/*
+ * A user and the class they were last evaluated into.
+ */
+typedef struct UserClass {
+    uid_t uid;
+    // Interned in the membership
+    const char* classpath;
+} UserClass;
+
+/*
+ * The logged in users and the class each of them was last evaluated into,
+ * kept up to date from logind's UserNew and UserRemoved signals rather than
+ * by asking logind for every user, so that who is in a class can be answered
+ * without evaluating everyone. Users are forgotten when they log out.
+ */
+typedef struct Membership {
+    pthread_mutex_t lock;
+    // The class filepath (interned in classpaths, or NULL if they're in no
+    // class or haven't been evaluated yet) of each active user, keyed by uid
+    HashMap users;
+    // The sorted uids (a UidVector) of the active members of each class
+    // with any, keyed by class filepath
+    HashMap classes;
+    // The last EnforceStatus of each active user enforced on, keyed by uid
+    HashMap enforcements;
+    // The sorted gids (a GidVector) each active user was last evaluated
+    // with, keyed by uid, to tell when their groups change
+    HashMap groups;
+    // Every class filepath seen, which there are only ever a few of
+    Arena* classpaths;
+    // Whether every active user has been tracked since startup; until then,
+    // logind is asked instead
+    bool complete;
+} Membership;
+
+/*
+ * Passes back an empty membership and returns a 0 if the creation was
+ * successful, or -1 if not. If a -1 is returned, the issue should be looked
+ * up via errno.
+ */
+int create_membership(Membership* membership);
+
+/*
+ * Destroys the given membership.
+ */
+void destroy_membership(Membership* membership);
+
+/*
+ * Starts tracking the given users, which are every user logind knows about,
+ * so that the membership is complete from here on. Returns -1 if there was an
+ * error (and errno should be looked up), otherwise 0.
+ */
+int track_active_users(Membership* membership, const uid_t* uids,
+    size_t nuids);
+
+/*
+ * Starts tracking a user who logged in, in no class until they're evaluated.
+ * Returns -1 if there was an error (and errno should be looked up), otherwise
+ * 0.
+ */
+int track_user(Membership* membership, uid_t uid);
+
+/*
+ * Stops tracking a user who logged out, removing them from their class.
+ * Returns the filepath of the class they were in, which stays valid as long
+ * as the membership, or NULL if they were in none.
+ */
+const char* forget_user(Membership* membership, uid_t uid);
+
+/*
+ * Moves a tracked user into the class at classpath, or out of every class if
+ * classpath is NULL. Users who aren't tracked (such as those who logged out
+ * before they were evaluated) are ignored. If previous isn't NULL and the user
+ * moved, the filepath of the class they were in (valid as long as the
+ * membership, or NULL if none) is passed back. Returns -1 if there was an
+ * error (and errno should be looked up), 1 if the user moved, otherwise 0.
+ */
+int set_user_class(Membership* membership, uid_t uid, const char* classpath,
+    const char** previous);
+
+/*
+ * Records the outcome of enforcing a class on a tracked user, replacing the
+ * last one. Users who aren't tracked are ignored. Returns -1 if there was an
+ * error (and errno should be looked up), otherwise 0.
+ */
+int record_enforcement(Membership* membership, uid_t uid,
+    const EnforceStatus* status);
+
+/*
+ * Records the groups a tracked user was just evaluated with, replacing the
+ * last ones. Users who aren't tracked are ignored. Returns -1 if there was an
+ * error (and errno should be looked up), otherwise 0.
+ */
+int record_user_groups(Membership* membership, uid_t uid, const gid_t* gids,
+    size_t ngids);
+
+/*
+ * Passes back a copy of the sorted groups the user was last evaluated with,
+ * which must be destroyed. Returns -1 with errno ENOENT if the user isn't
+ * tracked or hasn't been evaluated since they logged in, or -1 if there was
+ * another error (and errno should be looked up), otherwise 0.
+ */
+int get_user_groups(Membership* membership, uid_t uid, GidVector* gids);
+
+/*
+ * Passes back the outcome of the last enforcement on the user, whose classpath
+ * stays valid as long as the membership. Returns -1 with errno ENOENT if the
+ * user isn't tracked or hasn't been enforced on since they logged in,
+ * otherwise 0.
+ */
+int get_enforcement(Membership* membership, uid_t uid, EnforceStatus* status);
+
+/*
+ * Appends the uid_t's of the active users to the given vector. Returns -1
+ * with errno ENODATA if the membership isn't complete, or -1 if there was
+ * another error (and errno should be looked up), otherwise 0.
+ */
+int list_tracked_users(Membership* membership, Vector* uids);
+
+/*
+ * Appends a UserClass for each active user in a class to the given vector.
+ * Their classpaths stay valid as long as the membership. Returns -1 if there
+ * was an error (and errno should be looked up), otherwise 0.
+ */
+int list_user_classes(Membership* membership, Vector* users);
+
+/*
+ * Appends the uid_t's of the active members of the class at classpath to the
+ * given vector, in ascending order. Returns -1 with errno ENODATA if the
+ * membership isn't complete, or -1 if there was another error (and errno
+ * should be looked up), otherwise 0.
+ */
+int list_class_members(Membership* membership, const char* classpath,
+    Vector* uids);
+
+#endif // MEMBERSHIP_H
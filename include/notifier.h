@@ -0,0 +1,100 @@
+// SPDX-License-Identifier: GPL-3.0
+#ifndef NOTIFIER_H
+#define NOTIFIER_H
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+
+#include "membership.h"
+#include "vector.h"
+
+// Notifications past this many waiting to be sent are dropped
+#define MAX_PENDING_NOTIFICATIONS 65536
+
+/*
+ * Called from the event loop with its userdata once notifications that
+ * change the classes or who is in them have been sent.
+ */
+typedef void (*NotifierHook)(void* userdata);
+
+/*
+ * Sends the ClassesChanged, UserClassChanged and Enforced signals. Any thread
+ * can queue a notification; they're sent in order from the event loop of the
+ * bus the daemon's name is on, since a bus connection can only be used from
+ * one thread.
+ */
+typedef struct Notifier {
+    pthread_mutex_t lock;
+    // Notifications (private to the notifier) waiting to be sent
+    Vector pending;
+    // An eventfd that wakes up the event loop when notifications are queued
+    int fd;
+    sd_event_source* io;
+    sd_bus* bus;
+    const char* path;
+    const char* interface;
+    // Whether dropping notifications has been logged since the queue was full
+    bool overflowed;
+    NotifierHook changed;
+    void* changed_userdata;
+} Notifier;
+
+/*
+ * Passes back a notifier that queues notifications until it's attached, and
+ * returns a 0 if the creation was successful, or -1 if not. If a -1 is
+ * returned, the issue should be looked up via errno.
+ */
+int create_notifier(Notifier* notifier);
+
+/*
+ * Starts sending the notifications as signals from the given object path and
+ * interface on the bus, which must be attached to the event loop. Returns a 0
+ * if successful, or -1 if not. If a -1 is returned, the issue should be
+ * looked up via errno.
+ */
+int attach_notifier(Notifier* notifier, sd_event* event, sd_bus* bus,
+    const char* path, const char* interface);
+
+/*
+ * Sets the hook called after changes are sent, or clears it if NULL. Must be
+ * set before the notifier is attached.
+ */
+void set_notifier_hook(Notifier* notifier, NotifierHook changed,
+    void* userdata);
+
+/*
+ * Destroys the given notifier, dropping anything not yet sent.
+ */
+void destroy_notifier(Notifier* notifier);
+
+/*
+ * Queues a ClassesChanged signal for the classnames (char*'s) added, removed
+ * and modified, any of which may be NULL, as of the given configuration
+ * generation. Nothing is queued if no classnames are given. Returns -1 if
+ * there was an error (and errno should be looked up), otherwise 0.
+ */
+int notify_classes_changed(Notifier* notifier, Vector* added, Vector* removed,
+    Vector* modified, uint64_t generation);
+
+/*
+ * Queues a UserClassChanged signal for the user moving from the class at
+ * old_classpath into the class at new_classpath, either of which is NULL if
+ * they were or are in no class. Returns -1 if there was an error (and errno
+ * should be looked up), otherwise 0.
+ */
+int notify_user_class_changed(Notifier* notifier, uid_t uid,
+    const char* old_classpath, const char* new_classpath);
+
+/*
+ * Queues an Enforced signal for the outcome of enforcing a class on the user.
+ * Returns -1 if there was an error (and errno should be looked up), otherwise
+ * 0.
+ */
+int notify_enforced(Notifier* notifier, uid_t uid, const EnforceStatus* status);
+
+#endif // NOTIFIER_H
@@ -0,0 +1,100 @@
+// SPDX-License-Identifier: GPL-3.0
+#ifndef QUERYCLIENT_H
+#define QUERYCLIENT_H
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "queryprotocol.h"
+
+/*
+ * A connection to userctld's query socket. Queries are buffered and only
+ * written once a response is read (or flush_queries is called), so that many
+ * can be pipelined in a few writes.
+ */
+typedef struct QueryClient {
+    int fd;
+    // How long a read or write may wait; zero waits forever
+    uint64_t timeout_usec;
+    // If not zero, when (CLOCK_MONOTONIC) every wait ends, however long
+    // timeout_usec would allow
+    uint64_t deadline_usec;
+    uint32_t next_id;
+    // Requests not yet written
+    char* out;
+    size_t out_size;
+    size_t out_capacity;
+    // Bytes read from in_start up to in_end that haven't been consumed
+    char* in;
+    size_t in_start;
+    size_t in_end;
+    size_t in_capacity;
+} QueryClient;
+
+/*
+ * A response, whose data is owned by the client and valid until the next
+ * response is read or queries are flushed.
+ */
+typedef struct QueryResponse {
+    uint32_t id;
+    // 0 if the query succeeded, otherwise a negative errno
+    int32_t status;
+    const char* data;
+    size_t length;
+} QueryResponse;
+
+/*
+ * Connects to the query socket at path (or DEFAULT_QUERY_SOCKET if NULL),
+ * failing reads and writes that wait longer than timeout_usec (or never if
+ * zero) with ETIMEDOUT. Returns a 0 if successful, or -1 if not. If a -1 is
+ * returned, the issue should be looked up via errno.
+ */
+int connect_query_client(QueryClient* client, const char* path,
+    uint64_t timeout_usec);
+
+/*
+ * Connects like connect_query_client, but fails everything done with the
+ * client, from connecting on, with ETIMEDOUT once timeout_usec (which must
+ * not be zero) has passed in all, rather than once a single read or write
+ * waited that long. Connecting is retried until then if userctld has no room
+ * for another connection yet.
+ */
+int connect_query_client_within(QueryClient* client, const char* path,
+    uint64_t timeout_usec);
+
+/*
+ * Closes the connection and destroys the given client.
+ */
+void close_query_client(QueryClient* client);
+
+/*
+ * Queues a query (a QueryOp with its argument) and passes back its id (if
+ * not NULL). Returns -1 if there was an error (and errno should be looked
+ * up), otherwise 0.
+ */
+int queue_query(QueryClient* client, uint16_t op, uint32_t arg, uint32_t* id);
+
+/*
+ * Writes every queued query. Returns -1 if there was an error (and errno
+ * should be looked up), otherwise 0.
+ */
+int flush_queries(QueryClient* client);
+
+/*
+ * Writes any queued queries and reads the next response, which answers the
+ * oldest query not yet answered. Returns -1 if there was an error (and errno
+ * should be looked up), otherwise 0.
+ */
+int read_query_response(QueryClient* client, QueryResponse* response);
+
+/*
+ * Evaluates the uid and passes back the allocated filepath of their class.
+ * Any queries already queued must have been answered. Returns -1 with errno
+ * ENOENT if they're in no class, or -1 if there was another error (and errno
+ * should be looked up), otherwise 0.
+ */
+int query_evaluate(QueryClient* client, uid_t uid, char** classpath);
+
+#endif // QUERYCLIENT_H
@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: GPL-3.0
+#ifndef QUERYPROTOCOL_H
+#define QUERYPROTOCOL_H
+#define _GNU_SOURCE
+
+#include <stdint.h>
+
+/*
+ * The framing of the query socket, a fast path to userctld that skips the
+ * bus. Clients write requests back to back without waiting for
+ * replies; each is answered in order with a response carrying its id. Both
+ * ends are on the same host, so integers are in host byte order.
+ */
+
+#define DEFAULT_QUERY_SOCKET "/run/userctl/query.sock"
+// Bump whenever the framing changes
+#define QUERY_PROTOCOL_VERSION 1
+// The largest payload a response carries
+#define QUERY_MAX_PAYLOAD 4096
+
+typedef enum QueryOp {
+    // Evaluates the uid given as the argument; the payload is the filepath of
+    // their class, or the status is -ENOENT if they're in none, or
+    // -ETIMEDOUT if their groups couldn't be looked up quickly enough (the
+    // lookup goes on, so asking again soon is likely to be answered)
+    QUERY_EVALUATE = 1,
+    // The payload is the uint64_t generation of the loaded classes, which
+    // changes whenever they do (it is not aligned, so copy it out)
+    QUERY_GENERATION = 2,
+    // Evaluates the uid given as the argument and enforces their class,
+    // answering once it's done (with no payload) or with -EIO if it failed.
+    // Only root may ask (-EPERM otherwise); later queries on the same
+    // connection wait behind it
+    QUERY_ENFORCE = 3,
+} QueryOp;
+
+typedef struct QueryRequest {
+    // Echoed back in the response
+    uint32_t id;
+    uint16_t op;
+    uint16_t version;
+    uint32_t arg;
+} QueryRequest;
+
+typedef struct QueryResponseHeader {
+    uint32_t id;
+    // 0 if the query succeeded, otherwise a negative errno
+    int32_t status;
+    // The number of bytes of payload following the header
+    uint32_t length;
+} QueryResponseHeader;
+
+#endif // QUERYPROTOCOL_H
@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: GPL-3.0
+#ifndef QUERYSERVER_H
+#define QUERYSERVER_H
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <systemd/sd-event.h>
+
+#include "controller.h"
+
+// Connections past this many are closed as soon as they're accepted
+#define MAX_QUERY_CONNECTIONS 1024
+// A connection isn't read from while this many bytes of responses are unsent
+#define MAX_QUERY_BACKLOG (256 * 1024)
+// Enforcements past this many at once are answered with -EBUSY
+#define MAX_QUERY_ENFORCEMENTS 64
+// Requests answered per hold of the classes' lock, so that a long pipeline
+// doesn't hold up reloads
+#define MAX_QUERY_BATCH 64
+// How long a batch waits on the groups of the users it evaluates; those not
+// looked up by then are answered with -ETIMEDOUT, so one slow NSS source
+// can't stall every client of the socket
+#define QUERY_RESOLVE_TIMEOUT_MSEC 50
+
+/*
+ * Answers the query socket (see queryprotocol.h) from the loaded classes, on
+ * a thread of its own so that slow clients don't hold up the bus.
+ * Enforcements each get a thread while they wait on systemctl.
+ */
+typedef struct QueryServer {
+    int fd;
+    char* path;
+    sd_event* event;
+    sd_event_source* io;
+    size_t nconnections;
+    size_t nenforcements;
+    Context* context;
+} QueryServer;
+
+/*
+ * Listens on a unix socket at path, replacing any stale one, and passes back
+ * a server answering from the given context. Returns a 0 if successful, or -1
+ * if not. If a -1 is returned, the issue should be looked up via errno.
+ */
+int create_query_server(QueryServer* server, Context* context,
+    const char* path);
+
+/*
+ * Stops listening and destroys the given server. The server must not be
+ * running.
+ */
+void destroy_query_server(QueryServer* server);
+
+/*
+ * Answers queries forever. Meant to be the start routine of a thread, given
+ * the server.
+ */
+void* run_query_server(void* vargp);
+
+#endif // QUERYSERVER_H
@@ -0,0 +1,107 @@
+// SPDX-License-Identifier: GPL-3.0
+#ifndef RESOLVER_H
+#define RESOLVER_H
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define RESOLVER_THREADS 4
+// Lookups mostly wait on NSS, so more threads than this only sit idle
+#define MAX_RESOLVER_THREADS 16
+#define RESOLVER_CACHE_SIZE 65536
+#define DEFAULT_NSS_TIMEOUT_MSEC 2000
+#define RESOLVER_POSITIVE_TTL_USEC (300 * 1000000ULL)
+#define RESOLVER_NEGATIVE_TTL_USEC (30 * 1000000ULL)
+// Fewer uncached names than this are looked up one by one, not enumerated
+#define BULK_ENUMERATE_MIN 256
+
+/*
+ * Spawns off a pool of nthreads threads that do NSS lookups on behalf of the
+ * resolve_* functions, which wait at most timeout_usec on a lookup. Until the
+ * resolver is started, lookups are done synchronously and aren't cached.
+ * Returns -1 if there was an error (and errno should be looked up),
+ * otherwise 0.
+ */
+int start_resolver(size_t nthreads, uint64_t timeout_usec);
+
+/*
+ * Sets whether many names may be resolved by enumerating every user or group
+ * and whether numeric ids are looked up to make sure they exist. By default,
+ * names are enumerated and numeric ids are taken as is.
+ */
+void configure_resolver(bool enumerate, bool validate_ids);
+
+/*
+ * Converts the username string to a uid, if it wasn't already. If the user
+ * doesn't exist, returns -1 and errno is zero. If the lookup failed, returns
+ * -1 and errno is set; ETIMEDOUT means the lookup did not finish in time.
+ * Otherwise, 0 is returned.
+ */
+int resolve_uid(const char* username, uid_t* uid);
+
+/*
+ * Converts the groupname string to a gid, if it wasn't already. Returns the
+ * same as resolve_uid.
+ */
+int resolve_gid(const char* groupname, gid_t* gid);
+
+/*
+ * Converts many usernames to uids at once, passing back whether each was
+ * found. A name whose lookup failed isn't found, and has the errno it failed
+ * with in errors (ETIMEDOUT if it didn't finish in time), so it isn't
+ * mistaken for one that doesn't exist; the errors of the rest are zero. Every
+ * lookup, including an enumeration, is waited on under one timeout. Returns
+ * -1 if there was an error (and errno should be looked up), otherwise 0.
+ */
+int resolve_usernames(char** usernames, size_t nnames, uid_t* uids,
+    bool* found, int* errors);
+
+/*
+ * Converts many groupnames to gids at once. Returns the same as
+ * resolve_usernames.
+ */
+int resolve_groupnames(char** groupnames, size_t nnames, gid_t* gids,
+    bool* found, int* errors);
+
+/*
+ * Converts many uids to usernames at once, passing back an allocated copy of
+ * each name, or NULL for uids that don't exist or whose lookup failed or
+ * timed out. Names are cached like any other lookup. Returns -1 if there was
+ * an error (and errno should be looked up), otherwise 0.
+ */
+int resolve_uid_names(const uid_t* uids, size_t nuids, char** usernames);
+
+/*
+ * Converts many gids to groupnames at once. Returns the same as
+ * resolve_uid_names.
+ */
+int resolve_gid_names(const gid_t* gids, size_t ngids, char** groupnames);
+
+/*
+ * Passes back an allocated list of gids belonging to the user. Returns the
+ * same as resolve_uid.
+ */
+int resolve_groups(uid_t uid, gid_t** gids, int* ngids);
+
+/*
+ * Passes back an allocated list of gids for each of many users at once,
+ * waiting no longer than timeout_usec (or the resolver's timeout if that's
+ * shorter) on all of them together. A user whose gids aren't passed back has
+ * a NULL list and the errno of why in errors: ENOENT if they don't exist, or
+ * ETIMEDOUT if the lookup didn't finish in time (it still finishes in the
+ * background and is cached). Returns -1 if there was an error (and errno
+ * should be looked up), otherwise 0.
+ */
+int resolve_many_groups(const uid_t* uids, size_t nuids, uint64_t timeout_usec,
+    gid_t** gids, int* ngids, int* errors);
+
+/*
+ * Marks every cached lookup as expired, so that the next lookup of each goes
+ * through NSS again.
+ */
+void expire_resolver_cache();
+
+#endif // RESOLVER_H
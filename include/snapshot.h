@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: GPL-3.0
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hashmap.h"
+
+#define SNAPSHOT_MAGIC "UCTLSNAP"
+// Bump whenever the layout of a snapshot changes
+#define SNAPSHOT_VERSION 3
+#define DEFAULT_SNAPSHOT_PATH "/var/cache/userctl/classes.snapshot"
+
+/*
+ * Builds a snapshot of the fully resolved classes loaded from the class files
+ * in classdir, along with what's needed to tell whether the class files have
+ * changed since. Passes back the allocated snapshot and its size. If a class
+ * has transient controls, the snapshot isn't built and errno is EBUSY. If a
+ * class file changed since it was loaded, errno is ESTALE. Returns -1 if there
+ * was an error (and errno should be looked up), otherwise 0.
+ */
+int build_snapshot(const char* classdir, const char* classext,
+    HashMap* classes, char** data, size_t* size);
+
+/*
+ * Builds a snapshot of the classes and atomically replaces the snapshot at
+ * path with it, creating its directory if needed. Returns the same as
+ * build_snapshot.
+ */
+int write_snapshot(const char* path, const char* classdir,
+    const char* classext, HashMap* classes);
+
+/*
+ * Builds an export of the classes as they're loaded, transient controls and
+ * all, tagged with the given configuration generation. An export has the
+ * layout of a snapshot without the class files. Passes back the allocated
+ * export and its size. Returns -1 if there was an error (and errno should be
+ * looked up), otherwise 0.
+ */
+int build_export(const char* classdir, const char* classext,
+    HashMap* classes, uint64_t generation, char** data, size_t* size);
+
+/*
+ * Passes back the classes in the export of the given size in a new hashmap
+ * (keyed by class filename), along with its generation (if not NULL). If the
+ * export is corrupt or of another version, errno is EINVAL. Returns -1 if
+ * there was an error (and errno should be looked up), otherwise 0.
+ */
+int read_export(const char* data, size_t size, HashMap* classes,
+    uint64_t* generation);
+
+/*
+ * Maps the snapshot at path and passes back its classes in a new hashmap
+ * (keyed by class filename), as if they were loaded from classdir. If there
+ * is no snapshot, errno is ENOENT. If the snapshot is corrupt, of another
+ * version or not owned by us, errno is EINVAL. If it was built from another
+ * class directory or any class file was added, changed or removed since,
+ * errno is ESTALE. Returns -1 if there was an error (and errno should be
+ * looked up), otherwise 0.
+ */
+int read_snapshot(const char* path, const char* classdir,
+    const char* classext, HashMap* classes);
+
+#endif // SNAPSHOT_H
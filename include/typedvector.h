@@ -0,0 +1,181 @@
+// SPDX-License-Identifier: GPL-3.0
+#ifndef TYPEDVECTOR_H
+#define TYPEDVECTOR_H
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+// Sorted vectors up to this size are searched with a straight scan, which
+// the compiler can vectorize, rather than a binary search
+#define TYPED_VECTOR_SCAN_MAX 32
+// How many items a scan compares at once
+#define TYPED_VECTOR_BLOCK 8
+
+/*
+ * Defines the struct Type, a vector of item_t's stored by value, along with
+ * its functions named after name (create_<name>, append_<name>_item, ...).
+ * Since every function is inline and knows the item type, looking through
+ * the vector compiles down to a plain loop over an array. A vector doesn't
+ * allocate until its first item is added.
+ */
+#define DEFINE_TYPED_VECTOR(Type, name, item_t)                                 \
+    typedef struct Type {                                                       \
+        item_t* items;                                                          \
+        size_t count;                                                           \
+        size_t capacity;                                                        \
+    } Type;                                                                     \
+                                                                                \
+    static inline void create_##name(Type* vec)                                 \
+    {                                                                           \
+        assert(vec);                                                            \
+        vec->items = NULL;                                                      \
+        vec->count = 0;                                                         \
+        vec->capacity = 0;                                                      \
+    }                                                                           \
+                                                                                \
+    static inline void destroy_##name(Type* vec)                                \
+    {                                                                           \
+        assert(vec);                                                            \
+        free(vec->items);                                                       \
+        vec->items = NULL;                                                      \
+        vec->count = vec->capacity = 0;                                         \
+    }                                                                           \
+                                                                                \
+    /* Makes room for n more items. Returns -1 and sets errno on failure. */    \
+    static inline int ensure_##name##_capacity(Type* vec, size_t n)             \
+    {                                                                           \
+        assert(vec);                                                            \
+        if (vec->capacity - vec->count >= n)                                    \
+            return 0;                                                           \
+        size_t capacity = vec->capacity ? vec->capacity : 8;                    \
+        while (capacity - vec->count < n)                                       \
+            capacity *= 2;                                                      \
+        item_t* items = realloc(vec->items, sizeof *items * capacity);          \
+        if (!items)                                                             \
+            return -1;                                                          \
+        vec->items = items;                                                     \
+        vec->capacity = capacity;                                               \
+        return 0;                                                               \
+    }                                                                           \
+                                                                                \
+    static inline int append_##name##_item(Type* vec, item_t item)              \
+    {                                                                           \
+        if (ensure_##name##_capacity(vec, 1) < 0)                               \
+            return -1;                                                          \
+        vec->items[vec->count++] = item;                                        \
+        return 0;                                                               \
+    }                                                                           \
+                                                                                \
+    static inline void clear_##name(Type* vec)                                  \
+    {                                                                           \
+        assert(vec);                                                            \
+        vec->count = 0;                                                         \
+    }                                                                           \
+                                                                                \
+    static inline item_t get_##name##_item(const Type* vec, size_t index)       \
+    {                                                                           \
+        assert(vec);                                                            \
+        assert(index < vec->count);                                             \
+        return vec->items[index];                                               \
+    }                                                                           \
+                                                                                \
+    static inline size_t get_##name##_count(const Type* vec)                    \
+    {                                                                           \
+        assert(vec);                                                            \
+        return vec->count;                                                      \
+    }                                                                           \
+                                                                                \
+    /* Scans the whole vector without branching on each item. The fixed size  \
+     * blocks are what lets -O2 vectorize the scan. */                          \
+    static inline bool has_##name##_item(const Type* vec, item_t item)          \
+    {                                                                           \
+        assert(vec);                                                            \
+        unsigned int found = 0;                                                 \
+        size_t n = 0;                                                           \
+        for (; n + TYPED_VECTOR_BLOCK <= vec->count; n += TYPED_VECTOR_BLOCK)   \
+            for (size_t i = 0; i < TYPED_VECTOR_BLOCK; i++)                     \
+                found |= vec->items[n + i] == item;                             \
+        for (; n < vec->count; n++)                                             \
+            found |= vec->items[n] == item;                                     \
+        return found != 0;                                                      \
+    }
+
+/*
+ * Like DEFINE_TYPED_VECTOR, but for integer item_t's, and adds functions for
+ * keeping the vector sorted in ascending order without duplicates, so that
+ * membership can be checked with find_<name>_item.
+ */
+#define DEFINE_SORTED_TYPED_VECTOR(Type, name, item_t)                          \
+    DEFINE_TYPED_VECTOR(Type, name, item_t)                                     \
+                                                                                \
+    /* Returns the index of the first item that isn't less than item. */        \
+    static inline size_t lower_bound_##name(const Type* vec, item_t item)       \
+    {                                                                           \
+        assert(vec);                                                            \
+        size_t low = 0;                                                         \
+        size_t high = vec->count;                                               \
+        while (low < high) {                                                    \
+            size_t mid = low + (high - low) / 2;                                \
+            if (vec->items[mid] < item)                                         \
+                low = mid + 1;                                                  \
+            else                                                                \
+                high = mid;                                                     \
+        }                                                                       \
+        return low;                                                             \
+    }                                                                           \
+                                                                                \
+    /* Returns whether the sorted vector has the item. */                       \
+    static inline bool find_##name##_item(const Type* vec, item_t item)         \
+    {                                                                           \
+        if (vec->count <= TYPED_VECTOR_SCAN_MAX)                                \
+            return has_##name##_item(vec, item);                                \
+        size_t index = lower_bound_##name(vec, item);                           \
+        return index < vec->count && vec->items[index] == item;                 \
+    }                                                                           \
+                                                                                \
+    /* Inserts the item in order unless it's already there. */                  \
+    static inline int insert_##name##_item(Type* vec, item_t item)              \
+    {                                                                           \
+        size_t index = lower_bound_##name(vec, item);                           \
+        if (index < vec->count && vec->items[index] == item)                    \
+            return 0;                                                           \
+        if (ensure_##name##_capacity(vec, 1) < 0)                               \
+            return -1;                                                          \
+        memmove(vec->items + index + 1, vec->items + index,                     \
+            sizeof *vec->items * (vec->count - index));                         \
+        vec->items[index] = item;                                               \
+        vec->count++;                                                           \
+        return 0;                                                               \
+    }                                                                           \
+                                                                                \
+    static inline int _compare_##name##_items(const void* a, const void* b)     \
+    {                                                                           \
+        item_t x = *(const item_t*)a;                                           \
+        item_t y = *(const item_t*)b;                                           \
+        return (x > y) - (x < y);                                               \
+    }                                                                           \
+                                                                                \
+    /* Sorts the items appended so far and drops any duplicates. */             \
+    static inline void sort_##name(Type* vec)                                   \
+    {                                                                           \
+        assert(vec);                                                            \
+        if (vec->count < 2)                                                     \
+            return;                                                             \
+        qsort(vec->items, vec->count, sizeof *vec->items,                       \
+            _compare_##name##_items);                                           \
+        size_t last = 0;                                                        \
+        for (size_t n = 1; n < vec->count; n++)                                 \
+            if (vec->items[n] != vec->items[last])                              \
+                vec->items[++last] = vec->items[n];                             \
+        vec->count = last + 1;                                                  \
+    }
+
+DEFINE_SORTED_TYPED_VECTOR(UidVector, uid_vector, uid_t)
+DEFINE_SORTED_TYPED_VECTOR(GidVector, gid_vector, gid_t)
+DEFINE_TYPED_VECTOR(StringVector, string_vector, char*)
+
+#endif // TYPEDVECTOR_H
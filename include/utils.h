@@ -3,6 +3,7 @@
 #define UTILS_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 /*
@@ -53,6 +54,12 @@ int to_groupname(gid_t gid, const char** groupname);
  */
 int get_groups(uid_t uid, gid_t** gids, int* ngids);
 
+/*
+ * Returns whether the string is all digits. If the string is empty, returns
+ * false.
+ */
+bool all_digits(const char* string);
+
 /*
  * Moves the string pointer to after the leading whitespace and adds a NULL
  * terminator at the beginning of the trailing whitespace. Special care should
@@ -78,4 +85,44 @@ const char* get_filepath(const char* restrict dir,
 const char*
 add_ext(const char* restrict string, const char* restrict ext);
 
+#define FNV1A_OFFSET 14695981039346656037ULL
+
+/*
+ * Continues a 64 bit FNV-1a hash over the given data. Start with a hash of
+ * FNV1A_OFFSET.
+ */
+uint64_t fnv1a_hash(uint64_t hash, const void* data, size_t len);
+
+/*
+ * Passes back the FNV-1a hash of the contents of the file. Returns -1 if
+ * there was an error (and errno should be looked up), otherwise 0.
+ */
+int hash_file(const char* filepath, uint64_t* hash);
+
+/*
+ * Returns the current CLOCK_MONOTONIC time in microseconds.
+ */
+uint64_t monotonic_usec();
+
+/*
+ * Returns the current CLOCK_REALTIME time in microseconds.
+ */
+uint64_t realtime_usec();
+
+/*
+ * Passes back how many bytes of memory the process has resident. Returns -1
+ * if there was an error (and errno should be looked up), otherwise 0.
+ */
+int get_resident_bytes(uint64_t* bytes);
+
+/*
+ * Atomically replaces the file at path with size bytes of data, creating its
+ * directory if needed, so readers only ever see a whole file. If sync is
+ * true, the data is flushed to disk before it replaces the file, so a crash
+ * can't leave it empty. Returns -1 if there was an error (and errno should be
+ * looked up), otherwise 0.
+ */
+int write_file_atomically(const char* path, const char* data, size_t size,
+    bool sync);
+
 #endif // UTILS_H
@@ -2,8 +2,8 @@
 #ifndef VECTOR_H
 #define VECTOR_H
 
-#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 /*
  * Defines a non-nullable vector.
@@ -16,8 +16,6 @@ typedef struct Vector {
     size_t iter_count;
 } Vector;
 
-typedef bool (*finder_t)(const void*, va_list);
-
 /*
  * Passes back a vector and returns a 0 if the creation was successful, or -1
  * is not. If a -1 is returned, the issue should be looked up via errno and
@@ -42,6 +40,11 @@ int ensure_vector_capacity(Vector* vec, size_t capacity);
  */
 int append_vector_item(Vector* vec, const void* item);
 
+/*
+ * Removes every item from the vector, keeping its allocation.
+ */
+void clear_vector(Vector* vec);
+
 /*
  * Gets an item out of the given Vector.
  */
@@ -52,12 +55,6 @@ void* get_vector_item(Vector* vec, size_t index);
  */
 size_t get_vector_count(Vector* vec);
 
-/*
- * Finds a given item based on the finder function. If no such item exists,
- * NULL is returned.
- */
-void* find_vector_item(Vector* vec, finder_t finder, ...);
-
 /*
  * Iterates over the vector, returning each item within it. NULL is returned
  * for the last item.
@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: GPL-3.0
+#ifndef WATCHER_H
+#define WATCHER_H
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <systemd/sd-event.h>
+
+#include "controller.h"
+#include "vector.h"
+
+// How long the class directory has to be quiet before changes are reloaded
+#define RELOAD_DEBOUNCE_MSEC 200
+
+/*
+ * Watches the class directory with inotify and reloads the class files that
+ * changed once the directory settles down.
+ */
+typedef struct Watcher {
+    int fd;
+    // The extension of the class files watched
+    char* classext;
+    sd_event_source* io;
+    sd_event_source* debounce;
+    // Allocated char*'s of the class filenames that changed
+    Vector changed;
+    // Whether events were lost, so every class file must be checked
+    bool overflowed;
+    Context* context;
+} Watcher;
+
+/*
+ * Starts watching the context's class directory on the given event loop and
+ * returns a 0 if successful, or -1 if not. If a -1 is returned, the issue
+ * should be looked up via errno.
+ */
+int watch_classes(Watcher* watcher, sd_event* event, Context* context);
+
+/*
+ * Stops watching and destroys the given watcher.
+ */
+void destroy_watcher(Watcher* watcher);
+
+#endif // WATCHER_H
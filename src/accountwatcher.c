@@ -0,0 +1,523 @@
+// SPDX-License-Identifier: GPL-3.0
+#define _GNU_SOURCE
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <systemd/sd-event.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accountwatcher.h"
+#include "classparser.h"
+#include "controller.h"
+#include "dispatcher.h"
+#include "hashmap.h"
+#include "logger.h"
+#include "membership.h"
+#include "resolver.h"
+#include "typedvector.h"
+#include "utils.h"
+#include "vector.h"
+
+// sssd writes its databases in place, while the rest are replaced
+#define WATCH_ACCOUNT_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO | IN_CREATE | IN_DELETE)
+
+/*
+ * Files in one of the account_dirs that hold users or groups: the file named
+ * prefix, or every file starting with prefix and ending with suffix if there
+ * is a suffix.
+ */
+typedef struct AccountSource {
+    size_t dir;
+    const char* prefix;
+    const char* suffix;
+} AccountSource;
+
+static const char* account_dirs[ACCOUNT_DIRS] = {
+    "/etc",
+    "/var/lib/sss/mc",
+    "/var/lib/sss/db",
+};
+
+static const AccountSource account_sources[] = {
+    { 0, "passwd", NULL },
+    { 0, "group", NULL },
+    { 1, "passwd", NULL },
+    { 1, "group", NULL },
+    { 1, "initgroups", NULL },
+    { 2, "cache_", ".ldb" },
+};
+
+static int _on_account_inotify(sd_event_source* source, int fd,
+    uint32_t revents, void* userdata);
+static int _on_account_debounce(sd_event_source* source, uint64_t usec,
+    void* userdata);
+static int _on_account_poll(sd_event_source* source, uint64_t usec,
+    void* userdata);
+static void _schedule(sd_event_source* source, uint64_t delay_usec);
+static bool _is_account_file(size_t dir, const char* filename);
+static uint64_t _fingerprint_accounts(void);
+static void* _run_checker(void* vargp);
+static bool _is_stopping(AccountWatcher* watcher);
+static void _check_accounts(AccountWatcher* watcher);
+static int _lookup_groups(uid_t uid, GidVector* gids);
+static int _list_class_gids(Context* context, GidVector* gids);
+static bool _membership_changed(GidVector* before, GidVector* after,
+    GidVector* class_gids, GidVector* changed);
+
+int watch_accounts(AccountWatcher* watcher, sd_event* event, Context* context,
+    uint64_t poll_usec)
+{
+    assert(watcher && event && context);
+    memset(watcher, 0, sizeof *watcher);
+    pthread_mutex_init(&watcher->lock, NULL);
+    pthread_cond_init(&watcher->wakeup, NULL);
+    watcher->context = context;
+    watcher->poll_usec = poll_usec;
+    watcher->fd = -1;
+    for (size_t d = 0; d < ACCOUNT_DIRS; d++)
+        watcher->wds[d] = -1;
+
+    // Changes are found against the groups users were enforced with
+    if (!context->membership) {
+        errno = ENODATA;
+        return -1;
+    }
+    watcher->fingerprint = _fingerprint_accounts();
+
+    // Directories that don't exist (such as without sssd) are left to polling
+    int r = 0;
+    size_t nwatched = 0;
+    watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    for (size_t d = 0; watcher->fd >= 0 && d < ACCOUNT_DIRS; d++) {
+        watcher->wds[d] = inotify_add_watch(watcher->fd, account_dirs[d],
+            WATCH_ACCOUNT_EVENTS);
+        if (watcher->wds[d] < 0)
+            log_message(LOG_DEBUG, "Not watching %s: %s", account_dirs[d],
+                strerror(errno));
+        else
+            nwatched++;
+    }
+    if (nwatched > 0) {
+        r = sd_event_add_io(event, &watcher->io, watcher->fd, EPOLLIN,
+            _on_account_inotify, watcher);
+        if (r < 0)
+            goto sd_error;
+    } else if (poll_usec == 0) {
+        errno = ENOENT;
+        goto error;
+    }
+
+    // Armed whenever a change comes in
+    r = sd_event_add_time(event, &watcher->debounce, CLOCK_MONOTONIC, 0, 0,
+        _on_account_debounce, watcher);
+    if (r < 0)
+        goto sd_error;
+    r = sd_event_source_set_enabled(watcher->debounce, SD_EVENT_OFF);
+    if (r < 0)
+        goto sd_error;
+
+    if (poll_usec > 0) {
+        r = sd_event_add_time(event, &watcher->poll, CLOCK_MONOTONIC,
+            monotonic_usec() + poll_usec, 0, _on_account_poll, watcher);
+        if (r < 0)
+            goto sd_error;
+    }
+
+    r = pthread_create(&watcher->checker, NULL, _run_checker, watcher);
+    if (r != 0) {
+        errno = r;
+        goto error;
+    }
+    watcher->checker_started = true;
+    return 0;
+
+sd_error:
+    errno = -r;
+error:
+    r = errno;
+    destroy_account_watcher(watcher);
+    errno = r;
+    return -1;
+}
+
+void destroy_account_watcher(AccountWatcher* watcher)
+{
+    assert(watcher);
+
+    if (watcher->checker_started) {
+        pthread_mutex_lock(&watcher->lock);
+        watcher->stopping = true;
+        pthread_cond_signal(&watcher->wakeup);
+        pthread_mutex_unlock(&watcher->lock);
+        pthread_join(watcher->checker, NULL);
+    }
+    pthread_cond_destroy(&watcher->wakeup);
+    pthread_mutex_destroy(&watcher->lock);
+    sd_event_source_unref(watcher->poll);
+    sd_event_source_unref(watcher->debounce);
+    sd_event_source_unref(watcher->io);
+    if (watcher->fd >= 0)
+        close(watcher->fd);
+    memset(watcher, 0, sizeof *watcher);
+    watcher->fd = -1;
+}
+
+/*
+ * Pushes back the membership check until the user databases named in the
+ * inotify events have been quiet for ACCOUNT_DEBOUNCE_MSEC.
+ */
+static int
+_on_account_inotify(sd_event_source* source, int fd, uint32_t revents,
+    void* userdata)
+{
+    (void)source;
+    (void)revents;
+    AccountWatcher* watcher = userdata;
+
+    bool changed = false;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t len = read(fd, buf, sizeof buf);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                break;
+            log_message(LOG_ERR, "Failed to read user database events: %s",
+                strerror(errno));
+            return 0;
+        }
+
+        const struct inotify_event* event = NULL;
+        for (char* ptr = buf; ptr < buf + len;
+             ptr += sizeof *event + event->len) {
+            event = (const struct inotify_event*)ptr;
+            if (event->mask & IN_Q_OVERFLOW)
+                changed = true;
+            for (size_t d = 0; event->len > 0 && d < ACCOUNT_DIRS; d++)
+                if (event->wd == watcher->wds[d] && _is_account_file(d, event->name))
+                    changed = true;
+        }
+    }
+
+    if (changed)
+        _schedule(watcher->debounce, ACCOUNT_DEBOUNCE_MSEC * 1000);
+    return 0;
+}
+
+/*
+ * Asks the checker to check the memberships once the user databases settle
+ * down. A change that comes in during a check gets a check of its own after.
+ */
+static int
+_on_account_debounce(sd_event_source* source, uint64_t usec, void* userdata)
+{
+    (void)source;
+    (void)usec;
+    AccountWatcher* watcher = userdata;
+
+    watcher->fingerprint = _fingerprint_accounts();
+    pthread_mutex_lock(&watcher->lock);
+    watcher->check_requested = true;
+    pthread_cond_signal(&watcher->wakeup);
+    pthread_mutex_unlock(&watcher->lock);
+    return 0;
+}
+
+/*
+ * Checks the memberships if the user databases changed without inotify
+ * noticing.
+ */
+static int
+_on_account_poll(sd_event_source* source, uint64_t usec, void* userdata)
+{
+    (void)usec;
+    AccountWatcher* watcher = userdata;
+
+    if (_fingerprint_accounts() != watcher->fingerprint) {
+        log_message(LOG_DEBUG, "Found user database changes by polling");
+        _schedule(watcher->debounce, 0);
+    }
+
+    _schedule(source, watcher->poll_usec);
+    return 0;
+}
+
+/*
+ * Arms the time event source to go off once after delay_usec.
+ */
+static void
+_schedule(sd_event_source* source, uint64_t delay_usec)
+{
+    uint64_t now = 0;
+    int r = sd_event_now(sd_event_source_get_event(source), CLOCK_MONOTONIC, &now);
+    if (r < 0)
+        now = monotonic_usec();
+    r = sd_event_source_set_time(source, now + delay_usec);
+    if (r >= 0)
+        r = sd_event_source_set_enabled(source, SD_EVENT_ONESHOT);
+    if (r < 0)
+        log_message(LOG_ERR, "Failed to schedule membership check: %s",
+            strerror(-r));
+}
+
+/*
+ * Returns whether the file in the nth account directory holds users or
+ * groups.
+ */
+static bool
+_is_account_file(size_t dir, const char* filename)
+{
+    size_t nsources = sizeof account_sources / sizeof *account_sources;
+    for (size_t s = 0; s < nsources; s++) {
+        const AccountSource* source = &account_sources[s];
+        if (source->dir != dir)
+            continue;
+        if (!source->suffix) {
+            if (strcmp(filename, source->prefix) == 0)
+                return true;
+            continue;
+        }
+
+        size_t len = strlen(filename);
+        size_t prefix_len = strlen(source->prefix);
+        size_t suffix_len = strlen(source->suffix);
+        if (len >= prefix_len + suffix_len
+            && strncmp(filename, source->prefix, prefix_len) == 0
+            && strcmp(filename + len - suffix_len, source->suffix) == 0)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Returns a hash of the inode, size and mtime of every user database file,
+ * which changes whenever one of them is written to or replaced.
+ */
+static uint64_t
+_fingerprint_accounts(void)
+{
+    uint64_t hash = FNV1A_OFFSET;
+    for (size_t d = 0; d < ACCOUNT_DIRS; d++) {
+        DIR* dir = opendir(account_dirs[d]);
+        if (!dir)
+            continue;
+
+        struct dirent* entry = NULL;
+        while ((entry = readdir(dir))) {
+            struct stat st;
+            if (!_is_account_file(d, entry->d_name)
+                || fstatat(dirfd(dir), entry->d_name, &st, 0) < 0)
+                continue;
+            hash = fnv1a_hash(hash, entry->d_name, strlen(entry->d_name));
+            hash = fnv1a_hash(hash, &st.st_ino, sizeof st.st_ino);
+            hash = fnv1a_hash(hash, &st.st_size, sizeof st.st_size);
+            hash = fnv1a_hash(hash, &st.st_mtim, sizeof st.st_mtim);
+        }
+        closedir(dir);
+    }
+    return hash;
+}
+
+/*
+ * Checks the memberships whenever the event loop asks, until the watcher is
+ * stopped. Meant to be the start routine of a thread, given the watcher.
+ */
+static void*
+_run_checker(void* vargp)
+{
+    AccountWatcher* watcher = vargp;
+    pthread_mutex_lock(&watcher->lock);
+    for (;;) {
+        while (!watcher->check_requested && !watcher->stopping)
+            pthread_cond_wait(&watcher->wakeup, &watcher->lock);
+        if (watcher->stopping)
+            break;
+        watcher->check_requested = false;
+        pthread_mutex_unlock(&watcher->lock);
+
+        _check_accounts(watcher);
+
+        pthread_mutex_lock(&watcher->lock);
+    }
+    pthread_mutex_unlock(&watcher->lock);
+    return NULL;
+}
+
+/*
+ * Returns whether the watcher is being destroyed, so a check should give up.
+ */
+static bool
+_is_stopping(AccountWatcher* watcher)
+{
+    pthread_mutex_lock(&watcher->lock);
+    bool stopping = watcher->stopping;
+    pthread_mutex_unlock(&watcher->lock);
+    return stopping;
+}
+
+/*
+ * Works out which groups of the classes the active users joined or left
+ * since they were last enforced on and re-enforces on those users only. Users
+ * who weren't enforced on yet are left to the enforcement they're waiting on.
+ * Runs on the checker, since each user's groups may take an NSS lookup.
+ */
+static void
+_check_accounts(AccountWatcher* watcher)
+{
+    uint64_t start = monotonic_usec();
+
+    Vector uids;
+    GidVector class_gids;
+    GidVector changed_gids;
+    create_gid_vector(&class_gids);
+    create_gid_vector(&changed_gids);
+    if (create_vector(&uids, sizeof(uid_t)) < 0)
+        goto error;
+
+    if (list_active_users(watcher->context, &uids) < 0)
+        goto error;
+    expire_resolver_cache();
+    if (_list_class_gids(watcher->context, &class_gids) < 0)
+        goto error;
+
+    size_t nqueued = 0;
+    size_t nuids = get_vector_count(&uids);
+    for (size_t n = 0; n < nuids && !_is_stopping(watcher); n++) {
+        uid_t uid = *(uid_t*)get_vector_item(&uids, n);
+        GidVector before;
+        GidVector after;
+        if (get_user_groups(watcher->context->membership, uid, &before) < 0)
+            continue;
+        if (_lookup_groups(uid, &after) < 0) {
+            destroy_gid_vector(&before);
+            continue;
+        }
+
+        // The enforcement records the groups it was evaluated with
+        bool changed = _membership_changed(&before, &after, &class_gids,
+            &changed_gids);
+        destroy_gid_vector(&before);
+        destroy_gid_vector(&after);
+        if (!changed)
+            continue;
+
+        if (queue_user(watcher->context->dispatcher, uid) < 0)
+            log_user_event(LOG_ERR, uid, NULL, 0, "Failed to queue uid %u: %s",
+                uid, strerror(errno));
+        else
+            nqueued++;
+    }
+
+    if (get_gid_vector_count(&changed_gids) > 0)
+        log_message(LOG_NOTICE, "Membership of %zu class groups changed; "
+                                "re-enforcing %zu of %zu active users in %lu ms",
+            get_gid_vector_count(&changed_gids), nqueued, nuids,
+            (unsigned long)((monotonic_usec() - start) / 1000));
+    else
+        log_message(LOG_DEBUG, "User databases changed, but no class groups did");
+    goto cleanup;
+
+error:
+    log_message(LOG_ERR, "Failed to check for membership changes: %s",
+        strerror(errno));
+cleanup:
+    destroy_vector(&uids);
+    destroy_gid_vector(&class_gids);
+    destroy_gid_vector(&changed_gids);
+}
+
+/*
+ * Passes back the sorted gids of the user. Returns -1 if there was an error
+ * (and errno should be looked up), otherwise 0.
+ */
+static int
+_lookup_groups(uid_t uid, GidVector* gids)
+{
+    gid_t* groups = NULL;
+    int ngroups = 0;
+    if (resolve_groups(uid, &groups, &ngroups) < 0)
+        return -1;
+
+    create_gid_vector(gids);
+    int r = ensure_gid_vector_capacity(gids, ngroups);
+    for (int n = 0; r == 0 && n < ngroups; n++)
+        append_gid_vector_item(gids, groups[n]);
+    free(groups);
+    if (r < 0) {
+        destroy_gid_vector(gids);
+        return -1;
+    }
+    sort_gid_vector(gids);
+    return 0;
+}
+
+/*
+ * Passes back the sorted gids of the groups in every class. Returns -1 if
+ * there was an error (and errno should be looked up), otherwise 0.
+ */
+static int
+_list_class_gids(Context* context, GidVector* gids)
+{
+    int r = 0;
+    pthread_rwlock_rdlock(&context_lock);
+    size_t nclasses = get_hashmap_count(&context->classes);
+    for (size_t n = 0; r == 0 && n < nclasses; n++) {
+        ClassProperties* props = NULL;
+        get_hashmap_entry_at(&context->classes, n, NULL, (void**)&props);
+        size_t ngroups = get_gid_vector_count(&props->groups);
+        r = ensure_gid_vector_capacity(gids, ngroups);
+        for (size_t g = 0; r == 0 && g < ngroups; g++)
+            append_gid_vector_item(gids, get_gid_vector_item(&props->groups, g));
+    }
+    pthread_rwlock_unlock(&context_lock);
+    sort_gid_vector(gids);
+    return r;
+}
+
+/*
+ * Returns whether the user joined or left any of the class groups, going
+ * from the sorted gids before to after. The class groups they did are added
+ * to changed.
+ */
+static bool
+_membership_changed(GidVector* before, GidVector* after, GidVector* class_gids,
+    GidVector* changed)
+{
+    bool any = false;
+    size_t b = 0;
+    size_t a = 0;
+    while (b < before->count || a < after->count) {
+        gid_t gid;
+        if (a == after->count || (b < before->count && before->items[b] < after->items[a])) {
+            gid = before->items[b++];
+        } else if (b == before->count || after->items[a] < before->items[b]) {
+            gid = after->items[a++];
+        } else {
+            // In both
+            b++;
+            a++;
+            continue;
+        }
+
+        if (find_gid_vector_item(class_gids, gid)) {
+            any = true;
+            if (insert_gid_vector_item(changed, gid) < 0)
+                log_message(LOG_DEBUG, "Failed to note changed group %u: %s",
+                    gid, strerror(errno));
+        }
+    }
+    return any;
+}
@@ -0,0 +1,210 @@
+// SPDX-License-Identifier: GPL-3.0
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "utils.h"
+
+#define ARENA_INTERN_SLOTS 256
+
+static void* _alloc_locked(Arena* arena, size_t size);
+static int _grow_strings(Arena* arena);
+static size_t _find_string(const char** strings, size_t slots,
+    const char* string, size_t len);
+
+Arena* create_arena(void)
+{
+    return create_sized_arena(ARENA_CHUNK_SIZE);
+}
+
+Arena* create_sized_arena(size_t size)
+{
+    size = size < ARENA_ALIGN ? ARENA_ALIGN : size;
+    // The first chunk shares the arena's allocation, so a small arena is a
+    // single allocation
+    size_t header = (sizeof(Arena) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    Arena* arena = malloc(header + sizeof(ArenaChunk) + size);
+    if (!arena)
+        return NULL;
+    memset(arena, 0, sizeof *arena);
+
+    ArenaChunk* chunk = (ArenaChunk*)((char*)arena + header);
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    arena->chunks = chunk;
+    arena->reserved = header + sizeof(ArenaChunk) + size;
+    atomic_init(&arena->refs, 1);
+
+    int r = pthread_mutex_init(&arena->lock, NULL);
+    if (r != 0) {
+        free(arena);
+        errno = r;
+        return NULL;
+    }
+    return arena;
+}
+
+Arena* ref_arena(Arena* arena)
+{
+    assert(arena);
+    atomic_fetch_add(&arena->refs, 1);
+    return arena;
+}
+
+void unref_arena(Arena* arena)
+{
+    if (!arena || atomic_fetch_sub(&arena->refs, 1) != 1)
+        return;
+
+    // The last chunk is the one allocated along with the arena
+    ArenaChunk* chunk = arena->chunks;
+    while (chunk->next) {
+        ArenaChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(arena->strings);
+    pthread_mutex_destroy(&arena->lock);
+    free(arena);
+}
+
+void* arena_alloc(Arena* arena, size_t size)
+{
+    assert(arena);
+
+    pthread_mutex_lock(&arena->lock);
+    void* ptr = _alloc_locked(arena, size);
+    pthread_mutex_unlock(&arena->lock);
+    return ptr;
+}
+
+const char* arena_intern(Arena* arena, const char* string)
+{
+    assert(arena && string);
+    return arena_intern_len(arena, string, strlen(string));
+}
+
+const char* arena_intern_len(Arena* arena, const char* string, size_t len)
+{
+    assert(arena && (string || len == 0));
+
+    const char* interned = NULL;
+
+    pthread_mutex_lock(&arena->lock);
+    // Keep the set at most half full
+    if ((arena->nstrings + 1) * 2 > arena->string_slots
+        && _grow_strings(arena) < 0)
+        goto unlock;
+
+    size_t slot = _find_string(arena->strings, arena->string_slots, string, len);
+    if (arena->strings[slot]) {
+        interned = arena->strings[slot];
+        goto unlock;
+    }
+
+    char* copy = _alloc_locked(arena, len + 1);
+    if (!copy)
+        goto unlock;
+    memcpy(copy, string, len);
+    copy[len] = '\0';
+    arena->strings[slot] = copy;
+    arena->nstrings++;
+    interned = copy;
+
+unlock:
+    pthread_mutex_unlock(&arena->lock);
+    return interned;
+}
+
+void get_arena_size(Arena* arena, size_t* used, size_t* reserved)
+{
+    assert(arena);
+
+    pthread_mutex_lock(&arena->lock);
+    if (used)
+        *used = arena->used;
+    if (reserved)
+        *reserved = arena->reserved;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/*
+ * Allocates from the current chunk, or a new one twice as large if it is
+ * full. The arena must be locked. Returns NULL if there was an error (and
+ * errno should be looked up).
+ */
+static void*
+_alloc_locked(Arena* arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (size == 0)
+        size = ARENA_ALIGN;
+
+    ArenaChunk* chunk = arena->chunks;
+    if (chunk->size - chunk->used < size) {
+        size_t chunk_size = chunk->size * 2;
+        while (chunk_size < size)
+            chunk_size *= 2;
+        ArenaChunk* next = malloc(sizeof *next + chunk_size);
+        if (!next)
+            return NULL;
+        next->next = chunk;
+        next->size = chunk_size;
+        next->used = 0;
+        arena->chunks = next;
+        arena->reserved += sizeof *next + chunk_size;
+        chunk = next;
+    }
+
+    void* ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->used += size;
+    return ptr;
+}
+
+/*
+ * Doubles the slots of the interned strings. The arena must be locked.
+ * Returns -1 if there was an error (and errno should be looked up),
+ * otherwise 0.
+ */
+static int
+_grow_strings(Arena* arena)
+{
+    size_t slots = arena->string_slots ? arena->string_slots * 2 : ARENA_INTERN_SLOTS;
+    const char** strings = calloc(slots, sizeof *strings);
+    if (!strings)
+        return -1;
+
+    for (size_t n = 0; n < arena->string_slots; n++) {
+        const char* string = arena->strings[n];
+        if (string)
+            strings[_find_string(strings, slots, string, strlen(string))] = string;
+    }
+    free(arena->strings);
+    arena->strings = strings;
+    arena->string_slots = slots;
+    return 0;
+}
+
+/*
+ * Returns the slot holding the string of len bytes (which needn't be
+ * zero-terminated), or the empty slot it belongs in. Slots must be a power of
+ * two.
+ */
+static size_t
+_find_string(const char** strings, size_t slots, const char* string, size_t len)
+{
+    size_t mask = slots - 1;
+    size_t slot = fnv1a_hash(FNV1A_OFFSET, string, len) & mask;
+    while (strings[slot]
+        && (strncmp(strings[slot], string, len) != 0 || strings[slot][len] != '\0'))
+        slot = (slot + 1) & mask;
+    return slot;
+}
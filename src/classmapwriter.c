@@ -0,0 +1,133 @@
+// SPDX-License-Identifier: GPL-3.0
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "classmap.h"
+#include "classmapwriter.h"
+#include "hashmap.h"
+#include "membership.h"
+#include "utils.h"
+#include "vector.h"
+
+static int _build_classmap(Vector* users, uint64_t generation, char** data,
+    size_t* size);
+static int _compare_user_classes(const void* a, const void* b);
+
+int write_classmap(const char* path, Membership* membership,
+    uint64_t generation)
+{
+    assert(path && membership);
+
+    Vector users = { 0 };
+    if (create_vector(&users, sizeof(UserClass)) < 0)
+        return -1;
+
+    int ret = -1;
+    char* data = NULL;
+    size_t size = 0;
+    if (list_user_classes(membership, &users) < 0
+        || _build_classmap(&users, generation, &data, &size) < 0)
+        goto cleanup;
+    // It's on /run, so it doesn't outlive a crash and needn't be synced
+    ret = write_file_atomically(path, data, size, false);
+
+cleanup:
+    free(data);
+    destroy_vector(&users);
+    return ret;
+}
+
+/*
+ * Builds a classmap of the users (UserClass's), sorting them in place, and
+ * passes back the allocated classmap and its size. Returns -1 if there was an
+ * error (and errno should be looked up), otherwise 0.
+ */
+static int
+_build_classmap(Vector* users, uint64_t generation, char** data,
+    size_t* size)
+{
+    size_t nusers = get_vector_count(users);
+    UserClass* sorted = pretend_vector_is_array(users);
+    if (nusers > 0)
+        qsort(sorted, nusers, sizeof *sorted, _compare_user_classes);
+
+    // There are only ever a few classes, so each filepath is stored once
+    HashMap offsets;
+    if (create_hashmap(&offsets, sizeof(uint32_t), 0) < 0)
+        return -1;
+
+    int ret = -1;
+    size_t strings_size = 0;
+    ClassMapEntry* entries = calloc(nusers + 1, sizeof *entries);
+    if (!entries)
+        goto cleanup;
+    for (size_t n = 0; n < nusers; n++) {
+        uint32_t* offset = get_hashmap_entry(&offsets,
+            (char*)sorted[n].classpath);
+        uint32_t added = (uint32_t)strings_size;
+        if (!offset) {
+            if (add_hashmap_entry(&offsets, (char*)sorted[n].classpath, &added)
+                < 0)
+                goto cleanup;
+            strings_size += strlen(sorted[n].classpath) + 1;
+            offset = &added;
+        }
+        entries[n].uid = sorted[n].uid;
+        entries[n].classpath = *offset;
+    }
+
+    size_t strings = sizeof(ClassMapHeader) + nusers * sizeof *entries;
+    size_t total = strings + strings_size;
+    if (total > UINT32_MAX) {
+        errno = EOVERFLOW;
+        goto cleanup;
+    }
+    char* buf = calloc(1, total);
+    if (!buf)
+        goto cleanup;
+
+    ClassMapHeader header = {
+        .version = CLASSMAP_VERSION,
+        .header_size = sizeof header,
+        .size = total,
+        .generation = generation,
+        .nusers = (uint32_t)nusers,
+        .strings = (uint32_t)strings,
+        .strings_size = (uint32_t)strings_size,
+    };
+    memcpy(header.magic, CLASSMAP_MAGIC, sizeof header.magic);
+    memcpy(buf, &header, sizeof header);
+    if (nusers > 0)
+        memcpy(buf + sizeof header, entries, nusers * sizeof *entries);
+    // Each filepath is copied in where it's first pointed to
+    for (size_t n = 0; n < nusers; n++) {
+        char* classpath = buf + strings + entries[n].classpath;
+        if (*classpath == '\0')
+            strcpy(classpath, sorted[n].classpath);
+    }
+
+    *data = buf;
+    *size = total;
+    ret = 0;
+
+cleanup:
+    free(entries);
+    destroy_hashmap(&offsets);
+    return ret;
+}
+
+/*
+ * Orders UserClass's by uid.
+ */
+static int
+_compare_user_classes(const void* a, const void* b)
+{
+    uid_t x = ((const UserClass*)a)->uid;
+    uid_t y = ((const UserClass*)b)->uid;
+    return (x > y) - (x < y);
+}
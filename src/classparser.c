@@ -4,124 +4,511 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <grp.h>
 #include <limits.h>
 #include <math.h>
 #include <pwd.h>
-#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <syslog.h>
 #include <unistd.h>
 
 #include "classparser.h"
 #include "hashmap.h"
-#include "macros.h"
+#include "logger.h"
+#include "resolver.h"
 #include "utils.h"
 #include "vector.h"
 
-int _insert_class_prop(ClassProperties* prop, char* restrict key,
-    char* restrict value);
-void _parse_uids_or_gids(char* string, ClassProperties* props, bool uid_or_gid);
-void _print_line_error(unsigned int linenum, const char* restrict filepath,
-    const char* restrict desc);
+int _insert_class_prop(ClassProperties* prop, const char* restrict key,
+    const char* restrict value, size_t value_len);
+int _parse_uids_or_gids(const char* string, size_t len, ClassProperties* props,
+    bool uid_or_gid);
+int _parse_parents(const char* string, size_t len, ClassProperties* props);
+bool _next_token(const char** string, const char* end, const char** token,
+    size_t* token_len);
+void _trim_span(const char** start, size_t* len);
+bool _span_is(const char* span, size_t len, const char* word);
+int _flatten_class(ClassProperties* classes, char** classnames, size_t n,
+    HashMap* index, HashMap* flattened, unsigned char* states, int* errors);
+int _inherit_controls(ClassProperties* props, ClassProperties* parent);
+int _resolve_member_names(ClassProperties* classes, size_t nclasses,
+    bool uid_or_gid, int* errors);
+void _free_member_names(ClassProperties* props);
+int _compare_names(const void* a, const void* b);
+int _read_classfile(const char* filepath, char** data, size_t* size);
+bool _parse_class_line(ClassProperties* props, const char* line, size_t len,
+    unsigned int linenum, const char* restrict filepath);
+void _print_line_error(unsigned int linenum, unsigned int column,
+    const char* restrict filepath, const char* restrict desc);
 int _is_classfile(const struct dirent* dir);
 bool _in_class(uid_t uid, gid_t* groups, int ngroups, ClassProperties* props);
-bool _uid_finder(const void* void_uid, va_list args);
-bool _gids_finder(const void* void_gid, va_list args);
 
 void destroy_class(ClassProperties* props)
 {
-    free((char*)props->filepath);
-    destroy_vector(&props->users);
-    destroy_vector(&props->groups);
+    _free_member_names(props);
+    destroy_uid_vector(&props->users);
+    destroy_gid_vector(&props->groups);
+    destroy_string_vector(&props->usernames);
+    destroy_string_vector(&props->groupnames);
+    // The parents' names go along with the arena
+    destroy_string_vector(&props->parents);
+    // Only drops the controls' reference to the arena
     destroy_hashmap(&props->controls);
+    // The filepath and controls go along with the arena
+    unref_arena(props->arena);
 }
 
 int create_class(const char* dir, const char* filename, ClassProperties* props)
+{
+    int r = create_unresolved_class(dir, filename, props, NULL);
+    if (r < 0)
+        return r;
+    int error = 0;
+    r = resolve_class_members(props, 1, &error);
+    if (r == 0 && error != 0) {
+        errno = error;
+        r = -1;
+    }
+    if (r < 0) {
+        int saved = errno;
+        destroy_class(props);
+        errno = saved;
+    }
+    return r;
+}
+
+int create_unresolved_class(const char* dir, const char* filename,
+    ClassProperties* props, Arena* arena)
 {
     assert(dir);
     assert(filename);
     assert(props);
 
     const char* filepath = get_filepath(dir, filename);
-    int r = parse_classfile(filepath, props);
+    int r = parse_classfile(filepath, props, arena);
 
     free((char*)filepath);
     return r;
 }
 
-int parse_classfile(const char* filepath, ClassProperties* props)
+int resolve_class_members(ClassProperties* classes, size_t nclasses,
+    int* errors)
 {
-    assert(filepath);
-    assert(props);
-    memset(props, 0, sizeof *props);
-    props->filepath = strdup(filepath);
-    if (!props->filepath)
+    assert(classes && (errors || nclasses == 0));
+
+    for (size_t n = 0; n < nclasses; n++)
+        errors[n] = 0;
+    if (_resolve_member_names(classes, nclasses, true, errors) < 0
+        || _resolve_member_names(classes, nclasses, false, errors) < 0)
         return -1;
-    if ((create_vector(&props->users, sizeof(uid_t))) < 0)
+    for (size_t n = 0; n < nclasses; n++)
+        _free_member_names(&classes[n]);
+    return 0;
+}
+
+/*
+ * Resolves the usernames of every class if uid_or_gid is true, otherwise the
+ * groupnames, into their users or groups. Each distinct name is only looked
+ * up once, and all of them together. A class with a name whose lookup failed
+ * gets that errno in errors. Returns -1 if there was an error (and errno
+ * should be looked up), otherwise 0.
+ */
+int _resolve_member_names(ClassProperties* classes, size_t nclasses,
+    bool uid_or_gid, int* errors)
+{
+    size_t nnames = 0;
+    for (size_t n = 0; n < nclasses; n++) {
+        StringVector* names = uid_or_gid ? &classes[n].usernames : &classes[n].groupnames;
+        nnames += get_string_vector_count(names);
+    }
+    if (nnames == 0)
+        return 0;
+
+    int r = -1;
+    char** unique = malloc(sizeof *unique * nnames);
+    id_t* ids = malloc(sizeof *ids * nnames);
+    bool* found = malloc(sizeof *found * nnames);
+    int* lookup_errors = malloc(sizeof *lookup_errors * nnames);
+    if (!unique || !ids || !found || !lookup_errors)
+        goto cleanup;
+
+    size_t nunique = 0;
+    for (size_t n = 0; n < nclasses; n++) {
+        StringVector* names = uid_or_gid ? &classes[n].usernames : &classes[n].groupnames;
+        size_t count = get_string_vector_count(names);
+        if (count > 0)
+            memcpy(unique + nunique, names->items, sizeof *unique * count);
+        nunique += count;
+    }
+    qsort(unique, nunique, sizeof *unique, _compare_names);
+    size_t last = 0;
+    for (size_t n = 1; n < nunique; n++)
+        if (strcmp(unique[n], unique[last]) != 0)
+            unique[++last] = unique[n];
+    nunique = last + 1;
+
+    if (uid_or_gid)
+        r = resolve_usernames(unique, nunique, ids, found, lookup_errors);
+    else
+        r = resolve_groupnames(unique, nunique, ids, found, lookup_errors);
+    if (r < 0)
+        goto cleanup;
+
+    // Members are sorted once they're all in, rather than kept in order
+    for (size_t n = 0; n < nclasses; n++) {
+        StringVector* names = uid_or_gid ? &classes[n].usernames : &classes[n].groupnames;
+        size_t count = get_string_vector_count(names);
+        size_t nfailed = 0;
+        for (size_t i = 0; i < count; i++) {
+            char* name = get_string_vector_item(names, i);
+            char** match = bsearch(&name, unique, nunique, sizeof *unique,
+                _compare_names);
+            size_t index = match - unique;
+            if (lookup_errors[index] != 0) {
+                // Leaving the member out would unenforce them, so the class
+                // fails instead
+                if (nfailed++ == 0 && errors[n] == 0)
+                    errors[n] = lookup_errors[index];
+                continue;
+            }
+            if (!found[index]) {
+                log_message(LOG_DEBUG, "Skipping %s %s in %s",
+                    uid_or_gid ? "user" : "group", name, classes[n].filepath);
+                continue;
+            }
+            r = uid_or_gid ? append_uid_vector_item(&classes[n].users, ids[index])
+                           : append_gid_vector_item(&classes[n].groups, ids[index]);
+            if (r < 0)
+                goto cleanup;
+        }
+        if (nfailed > 0)
+            log_message(LOG_ERR, "Failed to resolve %zu %s in %s: %s", nfailed,
+                uid_or_gid ? "users" : "groups", classes[n].filepath,
+                strerror(errors[n]));
+        if (uid_or_gid)
+            sort_uid_vector(&classes[n].users);
+        else
+            sort_gid_vector(&classes[n].groups);
+    }
+    r = 0;
+
+cleanup:
+    free(unique);
+    free(ids);
+    free(found);
+    free(lookup_errors);
+    return r;
+}
+
+/*
+ * Frees the names of members that are left to be resolved.
+ */
+void _free_member_names(ClassProperties* props)
+{
+    StringVector* names[] = { &props->usernames, &props->groupnames };
+    for (size_t v = 0; v < sizeof names / sizeof *names; v++) {
+        size_t count = get_string_vector_count(names[v]);
+        for (size_t n = 0; n < count; n++)
+            free(get_string_vector_item(names[v], n));
+        clear_string_vector(names[v]);
+    }
+}
+
+/*
+ * Compares two char*'s for sorting.
+ */
+int _compare_names(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// How far along flattening a class is
+enum { UNFLATTENED, FLATTENING, FLATTENED };
+
+int flatten_classes(ClassProperties* classes, char** classnames,
+    size_t nclasses, HashMap* flattened, int* errors)
+{
+    assert(nclasses == 0 || (classes && classnames && errors));
+
+    // Parents among the classes are found by their index
+    HashMap index;
+    unsigned char* states = calloc(nclasses + 1, sizeof *states);
+    if (!states || create_hashmap(&index, sizeof(size_t), nclasses) < 0) {
+        free(states);
         return -1;
-    if ((create_vector(&props->groups, sizeof(gid_t))) < 0)
+    }
+
+    int r = 0;
+    for (size_t n = 0; r == 0 && n < nclasses; n++)
+        r = add_hashmap_entry(&index, classnames[n], &n);
+    for (size_t n = 0; r == 0 && n < nclasses; n++)
+        _flatten_class(classes, classnames, n, &index, flattened, states, errors);
+
+    destroy_hashmap(&index);
+    free(states);
+    return r;
+}
+
+/*
+ * Flattens the nth class after the classes it inherits from, as described by
+ * flatten_classes. A class that is seen again while it's being flattened
+ * inherits from itself. Returns -1 if the class failed (and errno should be
+ * looked up), otherwise 0.
+ */
+int _flatten_class(ClassProperties* classes, char** classnames, size_t n,
+    HashMap* index, HashMap* flattened, unsigned char* states, int* errors)
+{
+    if (errors[n] != 0 || states[n] == FLATTENED) {
+        errno = errors[n];
+        return errno ? -1 : 0;
+    }
+    if (states[n] == FLATTENING) {
+        log_message(LOG_ERR, "Class %s inherits from itself", classnames[n]);
+        errno = ELOOP;
         return -1;
-    if ((create_hashmap(&props->controls, sizeof(char*), MAX_CONTROLS)) < 0)
+    }
+    states[n] = FLATTENING;
+
+    // Later parents go first, so that their controls win over earlier ones
+    ClassProperties* props = &classes[n];
+    int r = 0;
+    for (size_t p = get_string_vector_count(&props->parents); r == 0 && p-- > 0;) {
+        char* name = get_string_vector_item(&props->parents, p);
+        ClassProperties* parent = NULL;
+        size_t* i = get_hashmap_entry(index, name);
+        if (i) {
+            bool missing = errors[*i] != 0;
+            r = _flatten_class(classes, classnames, *i, index, flattened,
+                states, errors);
+            parent = &classes[*i];
+            if (missing) {
+                log_message(LOG_ERR, "Class %s inherits from %s, which failed "
+                                     "to load",
+                    classnames[n], name);
+                errno = ENOENT;
+            }
+        } else if (flattened) {
+            parent = get_hashmap_entry(flattened, name);
+        }
+
+        if (r == 0 && !parent) {
+            log_message(LOG_ERR, "Class %s inherits from missing class %s",
+                classnames[n], name);
+            errno = ENOENT;
+            r = -1;
+        }
+        if (r == 0)
+            r = _inherit_controls(props, parent);
+    }
+
+    states[n] = FLATTENED;
+    errors[n] = r < 0 ? errno : 0;
+    return r;
+}
+
+/*
+ * Sets each control of the parent on the class that the class doesn't have
+ * yet. Returns -1 if there was an error (and errno should be looked up),
+ * otherwise 0.
+ */
+int _inherit_controls(ClassProperties* props, ClassProperties* parent)
+{
+    size_t ncontrols = get_hashmap_count(&parent->controls);
+    for (size_t n = 0; n < ncontrols; n++) {
+        char* key = NULL;
+        char** value = NULL;
+        get_hashmap_entry_at(&parent->controls, n, &key, (void**)&value);
+        if (get_hashmap_entry(&props->controls, key))
+            continue;
+        if (set_class_control(props, key, *value) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int init_class(const char* filepath, ClassProperties* props, Arena* arena)
+{
+    assert(filepath);
+    assert(props);
+    memset(props, 0, sizeof *props);
+    props->arena = arena ? ref_arena(arena) : create_arena();
+    if (!props->arena)
         return -1;
+    props->filepath = arena_intern(props->arena, filepath);
+    if (!props->filepath)
+        goto error;
+    create_uid_vector(&props->users);
+    create_gid_vector(&props->groups);
+    create_string_vector(&props->usernames);
+    create_string_vector(&props->groupnames);
+    create_string_vector(&props->parents);
+    // The controls live and die with the class's arena, so they're freed
+    // along with every other class in it
+    if ((create_hashmap_from_arena(&props->controls, sizeof(char*), DEFAULT_CONTROLS,
+            props->arena))
+        < 0)
+        goto error;
+    return 0;
+
+error:;
+    // A class that failed must not keep its arena around
+    int saved = errno;
+    destroy_class(props);
+    errno = saved;
+    return -1;
+}
 
-    FILE* classfile = fopen(filepath, "r");
-    if (!classfile) {
-        syslog(LOG_ERR, "Failed to read class file %s: %s", filepath, strerror(errno));
+int parse_classfile(const char* filepath, ClassProperties* props, Arena* arena)
+{
+    if (init_class(filepath, props, arena) < 0)
         return -1;
+
+    char* data = NULL;
+    size_t size = 0;
+    if (_read_classfile(filepath, &data, &size) < 0) {
+        log_message(LOG_ERR, "Failed to read class file %s: %s", filepath, strerror(errno));
+        goto error;
     }
+    props->hash = fnv1a_hash(FNV1A_OFFSET, data, size);
 
+    // Lines are parsed where they are in the buffer, so they can be any
+    // length and nothing but what the class keeps is copied
     unsigned int linenum = 0;
     bool errors = false;
-    char buf[LINE_BUFSIZE] = { 0 };
-    char* end = NULL;
-    char* key = NULL;
-    char* value = NULL;
-
-    while ((end = fgets(buf, sizeof buf / sizeof *buf, classfile))) {
+    const char* end = data + size;
+    for (const char* line = data; line < end;) {
         linenum++;
+        const char* newline = memchr(line, '\n', end - line);
+        const char* line_end = newline ? newline : end;
+        if (!_parse_class_line(props, line, line_end - line, linenum, filepath))
+            errors = true;
+        line = newline ? newline + 1 : end;
+    }
 
-        // Ignore blank lines
-        if (!strcmp(end, "\n"))
-            continue;
+    free(data);
+    if (!errors)
+        return 0;
+    errno = EINVAL;
 
-        // Ignore comments
-        if (strchr(end, '#') == end)
-            continue;
+error:;
+    int saved = errno;
+    destroy_class(props);
+    errno = saved;
+    return -1;
+}
 
-        // Ensure equal sign
-        if (strchr(end, '=') == NULL) {
-            _print_line_error(linenum, filepath, "No key=value found. Ignoring.");
-            errors = true;
-            continue;
-        }
-        if (parse_key_value(end, &key, &value) == -1) {
-            _print_line_error(linenum, filepath, "Failed to parse key=value");
-            errors = true;
-            continue;
+/*
+ * Reads the whole class file into an allocated buffer, so it can be parsed
+ * where it is, and passes back its contents and size. The file is read
+ * rather than mapped, since a mapping faults with SIGBUS if the file is
+ * truncated while it's being parsed, which an editor saving it in place
+ * does. The contents are NULL for an empty file. Returns -1 if there was an
+ * error (and errno should be looked up), otherwise 0.
+ */
+int _read_classfile(const char* filepath, char** data, size_t* size)
+{
+    *data = NULL;
+    *size = 0;
+    int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    char* buf = NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        goto error;
+
+    // The file may change size while it's read, so read until the end
+    // rather than trusting its size
+    size_t capacity = 0;
+    size_t len = 0;
+    for (;;) {
+        if (len == capacity) {
+            // One more than its size, so that the end is found in one read
+            if (capacity)
+                capacity *= 2;
+            else
+                capacity = st.st_size > 0 ? (size_t)st.st_size + 1 : 4096;
+            char* tmp = realloc(buf, capacity);
+            if (!tmp)
+                goto error;
+            buf = tmp;
         }
-        if (_insert_class_prop(props, key, value) == -1) {
-            _print_line_error(linenum, filepath, "Unknown key=value pair");
-            errors = true;
+        ssize_t r = pread(fd, buf + len, capacity - len, len);
+        if (r < 0 && errno == EINTR)
             continue;
-        }
+        if (r < 0)
+            goto error;
+        if (r == 0)
+            break;
+        len += r;
     }
+    close(fd);
 
-    if (feof(classfile)) {
-        // We are at the end of the file
-        if (errors)
-            errno = EINVAL;
-
-        return errors ? -1 : 0;
-    } else if (ferror(classfile)) {
-        // There is an error with the stream
-        syslog(LOG_ERR, "Failed to read class file %s: %s", filepath, strerror(errno));
+    if (len == 0) {
+        free(buf);
+        return 0;
     }
+    *data = buf;
+    *size = len;
     return 0;
+
+error:;
+    int saved = errno;
+    free(buf);
+    close(fd);
+    errno = saved;
+    return -1;
+}
+
+/*
+ * Parses a single line of a class file, len bytes long and not terminated,
+ * into the props. Errors are reported with the line and column they were
+ * found at. Returns whether the line was valid.
+ */
+bool _parse_class_line(ClassProperties* props, const char* line, size_t len,
+    unsigned int linenum, const char* restrict filepath)
+{
+    // Ignore blank lines and comments
+    if (len == 0 || line[0] == '#')
+        return true;
+
+    // Ensure equal sign
+    const char* equals = memchr(line, '=', len);
+    if (!equals) {
+        _print_line_error(linenum, 1, filepath, "No key=value found. Ignoring.");
+        return false;
+    }
+
+    // Like parse_key_value, but without terminating the key and value in
+    // place
+    const char* key = line;
+    size_t key_len = equals - line;
+    const char* value = equals + 1;
+    size_t value_len = line + len - value;
+    if (key_len == 0 || value_len == 0) {
+        _print_line_error(linenum, equals - line + 1, filepath,
+            "Failed to parse key=value");
+        return false;
+    }
+    _trim_span(&key, &key_len);
+    _trim_span(&value, &value_len);
+
+    // The controls intern their keys in the arena anyway, so terminating the
+    // key there costs nothing extra
+    const char* interned = arena_intern_len(props->arena, key, key_len);
+    if (!interned || _insert_class_prop(props, interned, value, value_len) == -1) {
+        _print_line_error(linenum, key - line + 1, filepath,
+            "Unknown key=value pair");
+        return false;
+    }
+    return true;
 }
 
 /*
@@ -143,21 +530,22 @@ int parse_key_value(char* line, char** restrict key, char** restrict value)
 }
 
 /*
- * Inserts a class property into the ClassProperties struct. If either the key
- * or value doesn't match any of the properties characteristics, a -1 is
- * returned and the properties is indeterminate.
+ * Inserts a class property into the ClassProperties struct. The value is
+ * value_len bytes and needn't be terminated. If either the key or value
+ * doesn't match any of the properties characteristics, a -1 is returned and
+ * the properties is indeterminate.
  */
-int _insert_class_prop(ClassProperties* props, char* restrict key,
-    char* restrict value)
+int _insert_class_prop(ClassProperties* props, const char* restrict key,
+    const char* restrict value, size_t value_len)
 {
     assert(props && key && value);
 
     if (strcasecmp(key, "shared") == 0) {
-        if (strcasecmp(value, "true") == 0 || strcasecmp(value, "yes") == 0) {
+        if (_span_is(value, value_len, "true") || _span_is(value, value_len, "yes")) {
             props->shared = true;
             return 0;
         }
-        if (strcasecmp(value, "false") == 0 || strcasecmp(value, "no") == 0) {
+        if (_span_is(value, value_len, "false") || _span_is(value, value_len, "no")) {
             props->shared = false;
             return 0;
         }
@@ -165,63 +553,182 @@ int _insert_class_prop(ClassProperties* props, char* restrict key,
     }
 
     if (strcasecmp(key, "priority") == 0) {
-        double priority = strtod(value, NULL);
-        if (strcmp(value, "0") != 0 && priority == 0)
+        // strtod needs a terminated number, and no number is this long
+        char number[64];
+        if (value_len >= sizeof number)
+            return -1;
+        memcpy(number, value, value_len);
+        number[value_len] = '\0';
+
+        double priority = strtod(number, NULL);
+        if (strcmp(number, "0") != 0 && priority == 0)
             return -1;
 
         props->priority = priority;
         return 0;
     }
 
-    if (strcasecmp(key, "groups") == 0) {
-        _parse_uids_or_gids(value, props, false);
-        return 0;
-    }
+    if (strcasecmp(key, "groups") == 0)
+        return _parse_uids_or_gids(value, value_len, props, false);
+
+    if (strcasecmp(key, "users") == 0)
+        return _parse_uids_or_gids(value, value_len, props, true);
+
+    if (strcasecmp(key, "inherit") == 0)
+        return _parse_parents(value, value_len, props);
+
+    const char* interned = arena_intern_len(props->arena, value, value_len);
+    if (!interned)
+        return -1;
+    return set_class_control(props, (char*)key, interned);
+}
+
+int set_class_control(ClassProperties* props, char* key, const char* value)
+{
+    assert(props && key && value);
+
+    // The controls hold pointers, since values can be any length. The same
+    // values tend to show up across classes, so they're only stored once
+    char* interned = (char*)arena_intern(props->arena, value);
+    if (!interned)
+        return -1;
 
-    if (strcasecmp(key, "users") == 0) {
-        _parse_uids_or_gids(value, props, true);
+    char** existing = get_hashmap_entry(&props->controls, key);
+    if (existing) {
+        *existing = interned;
         return 0;
     }
+    return add_hashmap_entry(&props->controls, key, &interned);
+}
+
+int remove_class_control(ClassProperties* props, const char* key)
+{
+    assert(props && key);
 
-    return add_hashmap_entry(&props->controls, key, value);
+    char** existing = get_hashmap_entry(&props->controls, (char*)key);
+    if (!existing || (*existing)[0] == '\0') {
+        errno = ENOENT;
+        return -1;
+    }
+    // systemctl set-property takes KEY= as resetting the control, which
+    // dropping it from the controls wouldn't do. The old value stays in the
+    // arena, since other classes may share it
+    char* empty = (char*)arena_intern(props->arena, "");
+    if (!empty)
+        return -1;
+    *existing = empty;
+    return 0;
 }
 
 /*
- * Parses uids or usernames out of the string if uid_or_gid is true, otherwise
- * parses gids or groups out of the string. The ids should be separated by
- * commas. Extra whitespace will be stripped and usernames or groupnames will
- * be converted to uids or gids. If a username or groupname doesn't have a
- * corresponding uid or gid, or if the uid or gid is not valid, it will be
- * skipped.
+ * Parses usernames out of the len bytes of string if uid_or_gid is true,
+ * otherwise groupnames. The names should be separated by commas. Extra
+ * whitespace will be stripped. Copies of the names are kept to be converted
+ * to uids or gids by resolve_class_members.
  */
-void _parse_uids_or_gids(char* string, ClassProperties* props, bool uid_or_gid)
+int _parse_uids_or_gids(const char* string, size_t len, ClassProperties* props,
+    bool uid_or_gid)
 {
-    id_t id = 0;
-    char* token = "";
+    StringVector* names = uid_or_gid ? &props->usernames : &props->groupnames;
+    const char* end = string + len;
+    const char* token = NULL;
+    size_t token_len = 0;
+
+    while (_next_token(&string, end, &token, &token_len)) {
+        char* name = strndup(token, token_len);
+        if (!name || append_string_vector_item(names, name) < 0) {
+            free(name);
+            return -1;
+        }
+    }
+    return 0;
+}
 
-    while ((token = strsep(&string, ","))) {
-        trim_whitespace(&token);
-        if (uid_or_gid) {
-            if (to_uid(token, &id) == -1)
-                continue;
+/*
+ * Parses the classnames of the classes to inherit controls from out of the
+ * len bytes of string. The names should be separated by commas and may leave
+ * out the class file's extension.
+ */
+int _parse_parents(const char* string, size_t len, ClassProperties* props)
+{
+    const char* ext = strrchr(basename(props->filepath), '.');
+    const char* end = string + len;
+    const char* token = NULL;
+    size_t token_len = 0;
+
+    while (_next_token(&string, end, &token, &token_len)) {
+        char* name = strndup(token, token_len);
+        if (!name)
+            return -1;
+        const char* classname = name;
+        if (ext && !has_ext(name, ext)) {
+            classname = add_ext(name, ext);
+            if (!classname) {
+                free(name);
+                return -1;
+            }
+        }
+        const char* interned = arena_intern(props->arena, classname);
+        if (classname != name)
+            free((char*)classname);
+        free(name);
+        if (!interned || append_string_vector_item(&props->parents, (char*)interned) < 0)
+            return -1;
+    }
+    return 0;
+}
 
-            append_vector_item(&props->users, (uid_t*)&id);
-        } else {
-            if (to_gid(token, &id) == -1)
-                continue;
+/*
+ * Passes back the next non-empty, trimmed comma separated token of the string
+ * that ends at end, and moves the string past it. Returns whether there was
+ * one.
+ */
+bool _next_token(const char** string, const char* end, const char** token,
+    size_t* token_len)
+{
+    while (*string < end) {
+        const char* comma = memchr(*string, ',', end - *string);
+        const char* token_end = comma ? comma : end;
+        *token = *string;
+        *token_len = token_end - *string;
+        *string = comma ? comma + 1 : end;
+
+        _trim_span(token, token_len);
+        if (*token_len > 0)
+            return true;
+    }
+    return false;
+}
 
-            append_vector_item(&props->groups, (gid_t*)&id);
-        }
+/*
+ * Strips the whitespace around the span of len bytes at start.
+ */
+void _trim_span(const char** start, size_t* len)
+{
+    while (*len > 0 && isspace((unsigned char)**start)) {
+        (*start)++;
+        (*len)--;
     }
+    while (*len > 0 && isspace((unsigned char)(*start)[*len - 1]))
+        (*len)--;
 }
 
 /*
- * Reports on a error on a specific line in the given file.
+ * Returns whether the span of len bytes is the word, ignoring case.
  */
-void _print_line_error(unsigned int linenum, const char* restrict filepath,
-    const char* restrict desc)
+bool _span_is(const char* span, size_t len, const char* word)
 {
-    syslog(LOG_ERR, "Syntax error in %s:%u %s", filepath, linenum, desc);
+    return strlen(word) == len && strncasecmp(span, word, len) == 0;
+}
+
+/*
+ * Reports on a error on a specific line and column in the given file.
+ */
+void _print_line_error(unsigned int linenum, unsigned int column,
+    const char* restrict filepath, const char* restrict desc)
+{
+    log_message(LOG_ERR, "Syntax error in %s:%u:%u %s", filepath, linenum,
+        column, desc);
 }
 
 static const char* curr_ext = "";
@@ -234,7 +741,7 @@ int list_class_files(const char* dir, const char* ext, struct dirent*** class_fi
     curr_ext = ext;
     int filecount = scandir(dir, class_files, _is_classfile, alphasort);
     if (filecount == -1) {
-        syslog(LOG_ERR, "Failed to read dir %s: %s", dir, strerror(errno));
+        log_message(LOG_ERR, "Failed to read dir %s: %s", dir, strerror(errno));
         *num_files = 0;
         class_files = NULL;
         return -1;
@@ -258,19 +765,37 @@ int evaluate(uid_t uid, HashMap* classes, ClassProperties* props)
     assert(classes);
     assert(props);
 
-    ClassProperties* choosen_class = NULL;
     gid_t* groups = NULL;
     int ngroups = 0;
-    int props_match_count = 0;
-    double highest_priority = -INFINITY;
-
-    if (get_groups(uid, &groups, &ngroups) < 0) {
-        syslog(LOG_ERR, "Failed to get group list for %u", uid);
+    if (resolve_groups(uid, &groups, &ngroups) < 0) {
+        // A user that doesn't exist has no groups to look up
+        if (errno == 0)
+            errno = ENOENT;
+        log_message(LOG_ERR, "Failed to get group list for %u: %s", uid,
+            strerror(errno));
         return -1;
     }
 
+    int r = evaluate_with_groups(uid, groups, ngroups, classes, props);
+    free(groups);
+    return r;
+}
+
+int evaluate_with_groups(uid_t uid, gid_t* groups, int ngroups,
+    HashMap* classes, ClassProperties* props)
+{
+    assert(classes);
+    assert(props);
+
+    ClassProperties* choosen_class = NULL;
+    int props_match_count = 0;
+    double highest_priority = -INFINITY;
+
+    // Concurrent evaluations share the classes, so don't use the iterator
     ClassProperties* tmp_props = NULL;
-    while ((tmp_props = iter_hashmap_values(classes))) {
+    size_t nclasses = get_hashmap_count(classes);
+    for (size_t n = 0; n < nclasses; n++) {
+        get_hashmap_entry_at(classes, n, NULL, (void**)&tmp_props);
         // Select first if same priority
         if (tmp_props->priority > highest_priority && _in_class(uid, groups, ngroups, tmp_props)) {
             highest_priority = tmp_props->priority;
@@ -278,8 +803,6 @@ int evaluate(uid_t uid, HashMap* classes, ClassProperties* props)
             props_match_count++;
         }
     }
-    iter_hashmap_end(classes);
-    free(groups);
 
     if (choosen_class)
         *props = *choosen_class;
@@ -293,42 +816,10 @@ bool _in_class(uid_t uid, gid_t* groups, int ngroups, ClassProperties* props)
 {
     assert(props);
 
-    if (find_vector_item(&props->users, _uid_finder, uid))
-        return true;
-    if (find_vector_item(&props->groups, _gids_finder, groups, ngroups))
+    if (find_uid_vector_item(&props->users, uid))
         return true;
-    return false;
-}
-
-/*
- * Implements the vector finder interface for finding a uid, given as the
- * second argument, in a vector of uids.
- */
-inline bool
-_uid_finder(const void* void_uid, va_list args)
-{
-    assert(void_uid);
-
-    const uid_t* uid = void_uid;
-    uid_t our_uid = va_arg(args, uid_t);
-    return our_uid == *uid;
-}
-
-/*
- * Implements the vector finder interface for finding whether any of a list of
- * gids, given as the second argument and the length as the third argument,
- * are in a vector of gids.
- */
-inline bool
-_gids_finder(const void* void_gid, va_list args)
-{
-    assert(void_gid);
-
-    gid_t gid = *((gid_t*)void_gid);
-    gid_t* our_gids = va_arg(args, gid_t*);
-    int our_gid_count = va_arg(args, int);
-    for (int i = 0; i < our_gid_count; i++)
-        if (our_gids[i] == gid)
+    for (int n = 0; n < ngroups; n++)
+        if (find_gid_vector_item(&props->groups, groups[n]))
             return true;
     return false;
 }
@@ -6,12 +6,14 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <grp.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <pwd.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -20,28 +22,106 @@
 
 #include "classparser.h"
 #include "commands.h"
+#include "controller.h"
+#include "hashmap.h"
 #include "macros.h"
+#include "queryclient.h"
+#include "snapshot.h"
 #include "utils.h"
 
 #define STATUS_INDENT 10
+// How many batch calls can be waiting on replies at once
+#define DEFAULT_BATCH_WINDOW 64
+// How long to wait on the query socket before asking over the bus instead
+#define QUERY_TIMEOUT_USEC 1000000
 
 typedef struct Class {
+    const char* classname;
     const char* filepath;
-    bool shared;
+    int shared;
     double priority;
     const uid_t* uids;
     size_t uids_size;
     const gid_t* gids;
     size_t gids_size;
+    // Allocated names lining up with the uids and gids (empty for those that
+    // don't exist), or empty if the names weren't asked for
+    char** usernames;
+    char** groupnames;
+    // The logged in members; NULL if the daemon couldn't tell
+    const uid_t* active;
+    size_t active_size;
 } Class;
 
+typedef enum BatchOp {
+    BATCH_EVAL,
+    BATCH_STATUS,
+    BATCH_SET_PROPERTY,
+    BATCH_RELOAD,
+    BATCH_DAEMON_RELOAD,
+    BATCH_INVALID,
+} BatchOp;
+
+static const char* batch_ops[] = {
+    [BATCH_EVAL] = "eval",
+    [BATCH_STATUS] = "status",
+    [BATCH_SET_PROPERTY] = "set-property",
+    [BATCH_RELOAD] = "reload",
+    [BATCH_DAEMON_RELOAD] = "daemon-reload",
+    [BATCH_INVALID] = "invalid",
+};
+
+typedef struct BatchCall {
+    size_t lineno;
+    BatchOp op;
+    // The class the call reads or changes, or NULL if it involves every class
+    char* classname;
+    bool done;
+    bool failed;
+    // What's printed after the call once it's done, or NULL for nothing
+    char* result;
+} BatchCall;
+
+typedef struct Batch {
+    sd_bus* bus;
+    // A ring of the calls that haven't been printed yet, which are those from
+    // head up to tail
+    BatchCall* calls;
+    size_t window;
+    size_t head;
+    size_t tail;
+    size_t nfailed;
+} Batch;
+
 void _parse_no_args(int argc, char* argv[]);
 void _print_class(const char* filepath);
+int _read_class(sd_bus_message* msg, Class* class);
+void _free_class_names(Class* class);
 void _print_class_status(Class* class, bool print_uids, bool print_gids);
-void _print_status_user_line(const uid_t* users, int nusers, bool print_uids);
-void _print_status_group_line(const gid_t* groups, int ngroups,
-    bool print_gids);
+void _print_status_user_line(const char* label, const uid_t* users,
+    char** usernames, int nusers, bool print_uids);
+void _print_status_group_line(const gid_t* groups, char** groupnames,
+    int ngroups, bool print_gids);
+size_t _count_names(char** names);
 int _reload_class(const char* classname);
+void _print_export(const char* data, size_t size);
+int _parse_control(char* resource_control, char** key, char** value);
+BatchCall* _reserve_batch_call(Batch* batch, size_t lineno, BatchOp op,
+    const char* classname);
+bool _batch_calls_depend(const BatchCall* call, BatchOp op,
+    const char* classname);
+int _wait_batch(Batch* batch);
+void _print_batch_calls(Batch* batch);
+void _run_batch_line(Batch* batch, size_t lineno, char* line);
+int _send_batch_call(Batch* batch, BatchCall* call, char** args, int nargs);
+int _batch_reply(sd_bus_message* reply, void* userdata, sd_bus_error* ret_error);
+void _fail_batch_call(BatchCall* call, const char* message);
+int _on_classes_changed(sd_bus_message* m, void* userdata,
+    sd_bus_error* ret_error);
+int _on_user_class_changed(sd_bus_message* m, void* userdata,
+    sd_bus_error* ret_error);
+int _on_enforced(sd_bus_message* m, void* userdata, sd_bus_error* ret_error);
+void _print_classnames(const char* label, char** classnames);
 
 static const char* service_path = "/org/dylangardner/userctl";
 static const char* service_name = "org.dylangardner.userctl";
@@ -204,6 +284,25 @@ void eval(int argc, char* argv[])
             errno_die("Failed to get passwd record of effective uid\n");
     }
 
+    // The query socket answers without a round trip through the bus, but
+    // the bus is still asked if userctld isn't answering on it
+    QueryClient client;
+    if (connect_query_client(&client, NULL, QUERY_TIMEOUT_USEC) == 0) {
+        char* queried = NULL;
+        int queried_r = query_evaluate(&client, uid, &queried);
+        int queried_errno = errno;
+        close_query_client(&client);
+        if (queried_r == 0) {
+            _print_class(queried);
+            free(queried);
+            return;
+        }
+        if (queried_errno == ENOENT) {
+            fprintf(stderr, "No class found for the user.\n");
+            return;
+        }
+    }
+
     int r = sd_bus_open_system(&bus);
     if (r < 0) {
         fprintf(stderr, "Failed to connect to system bus: %s\n", strerror(-r));
@@ -303,40 +402,44 @@ void status(int argc, char* argv[])
         goto cleanup;
     }
 
+    // The daemon looks the names up, so they come out of its cache
     r = sd_bus_call_method(bus, service_name, service_path, service_name,
-        "GetClass", &error, &msg, "s", classname);
+        "GetClasses", &error, &msg, "ast", 1, classname,
+        (uint64_t)CLASS_INFO_NAMES);
     if (r < 0) {
         fprintf(stderr, "%s\n", error.message);
         goto cleanup;
     }
 
+    r = sd_bus_message_enter_container(msg, SD_BUS_TYPE_ARRAY,
+        "(ssbdauauasasa{ss})");
     Class class = { 0 };
-    r = sd_bus_message_read(msg, "sbd", &class.filepath, &class.shared,
-        &class.priority);
+    if (r >= 0)
+        r = _read_class(msg, &class);
     if (r < 0) {
-        fprintf(stderr, "Internal error: Failed to class status from userctl %s\n",
-            strerror(-r));
-        goto cleanup;
-    }
-
-    r = sd_bus_message_read_array(msg, 'u', (const void**)&class.uids,
-        &class.uids_size);
-    if (r < 0) {
-        fprintf(stderr, "Internal error: Failed to parse uids in class status from "
+        fprintf(stderr, "Internal error: Failed to parse class status from "
                         "userctl %s\n",
             strerror(-r));
         goto cleanup;
     }
-
-    r = sd_bus_message_read_array(msg, 'u', (const void**)&class.gids,
-        &class.gids_size);
-    if (r < 0) {
-        fprintf(stderr, "Internal error: Failed to parse gids in class status from "
-                        "userctl %s\n",
-            strerror(-r));
+    if (r == 0) {
+        fprintf(stderr, "No such class found (may need to daemon-reload).\n");
         goto cleanup;
     }
+
+    // Older daemons don't track who is logged in, so that's left out
+    sd_bus_message* members = NULL;
+    sd_bus_error members_error = SD_BUS_ERROR_NULL;
+    r = sd_bus_call_method(bus, service_name, service_path, service_name,
+        "ListClassMembers", &members_error, &members, "s", classname);
+    if (r >= 0
+        && sd_bus_message_read_array(members, 'u', (const void**)&class.active,
+               &class.active_size)
+            < 0)
+        class.active = NULL;
+    sd_bus_error_free(&members_error);
     _print_class_status(&class, print_uids, print_gids);
+    _free_class_names(&class);
 
 cleanup:
     if (alloc_classname)
@@ -346,38 +449,114 @@ cleanup:
     sd_bus_unref(bus);
 }
 
+/*
+ * Reads the next class out of a GetClasses reply, which must already be
+ * entered. The class points into the message, apart from its names, which
+ * are freed with _free_class_names. Returns a negative errno if there was an
+ * error, 0 if there are no classes left, otherwise 1.
+ */
+int _read_class(sd_bus_message* msg, Class* class)
+{
+    assert(msg && class);
+
+    int r = sd_bus_message_enter_container(msg, SD_BUS_TYPE_STRUCT,
+        "ssbdauauasasa{ss}");
+    if (r <= 0)
+        return r;
+
+    r = sd_bus_message_read(msg, "ssbd", &class->classname, &class->filepath,
+        &class->shared, &class->priority);
+    if (r < 0)
+        return r;
+    r = sd_bus_message_read_array(msg, 'u', (const void**)&class->uids,
+        &class->uids_size);
+    if (r < 0)
+        return r;
+    r = sd_bus_message_read_array(msg, 'u', (const void**)&class->gids,
+        &class->gids_size);
+    if (r < 0)
+        return r;
+    r = sd_bus_message_read_strv(msg, &class->usernames);
+    if (r < 0)
+        return r;
+    r = sd_bus_message_read_strv(msg, &class->groupnames);
+    if (r < 0)
+        return r;
+    r = sd_bus_message_skip(msg, "a{ss}");
+    if (r < 0)
+        return r;
+    r = sd_bus_message_exit_container(msg);
+    return r < 0 ? r : 1;
+}
+
+/*
+ * Frees the names read along with the class.
+ */
+void _free_class_names(Class* class)
+{
+    char** names[] = { class->usernames, class->groupnames };
+    for (size_t n = 0; n < sizeof names / sizeof *names; n++) {
+        for (size_t i = 0; names[n] && names[n][i]; i++)
+            free(names[n][i]);
+        free(names[n]);
+    }
+    class->usernames = NULL;
+    class->groupnames = NULL;
+}
+
 /*
  * Prints the properties of the class. The users and groups fields contain
  * only those who exist.
  */
 void _print_class_status(Class* class, bool print_uids, bool print_gids)
 {
+    int nusers = class->uids_size / sizeof *class->uids;
+    int ngroups = class->gids_size / sizeof *class->gids;
+    char** usernames = _count_names(class->usernames) == (size_t)nusers
+        ? class->usernames
+        : NULL;
+    char** groupnames = _count_names(class->groupnames) == (size_t)ngroups
+        ? class->groupnames
+        : NULL;
+
     _print_class(class->filepath);
-    _print_status_user_line(class->uids, class->uids_size / sizeof *class->uids,
-        print_uids);
-    _print_status_group_line(class->gids, class->gids_size / sizeof *class->gids,
-        print_gids);
+    _print_status_user_line("Users", class->uids, usernames, nusers, print_uids);
+    _print_status_group_line(class->gids, groupnames, ngroups, print_gids);
 
     const char* shared_str = (class->shared) ? "true" : "false";
     printf("%*s: %s\n", STATUS_INDENT, "Shared", shared_str);
     printf("%*s: %lf\n", STATUS_INDENT, "Priority", class->priority);
+    if (class->active)
+        _print_status_user_line("Active", class->active, NULL,
+            class->active_size / sizeof *class->active, print_uids);
 }
 
 /*
  * Prints the given users onto a line. If print_uids is true, the uids are not
- * converted to usernames. If a user isn't valid, they are ignored.
+ * converted to usernames. If a user isn't valid, they are ignored. The
+ * usernames of the uids may be given, so that they don't have to be looked
+ * up, or NULL.
  */
-void _print_status_user_line(const uid_t* users, int nusers, bool print_uids)
+void _print_status_user_line(const char* label, const uid_t* users,
+    char** usernames, int nusers, bool print_uids)
 {
-    assert(users);
+    assert(users || nusers == 0);
 
-    printf("%*s: ", STATUS_INDENT, "Users");
+    printf("%*s: ", STATUS_INDENT, label);
 
     const char* username = NULL;
     for (int i = 0; i < nusers; i++) {
         uid_t uid = (uid_t)users[i];
 
-        if (print_uids) {
+        if (usernames) {
+            // The daemon already found which users exist
+            if (usernames[i][0] == '\0')
+                continue;
+            if (print_uids)
+                printf("%lu", (unsigned long)uid);
+            else
+                printf("%s", usernames[i]);
+        } else if (print_uids) {
             if (!getpwuid(uid))
                 continue;
             printf("%lu", (unsigned long)uid);
@@ -395,18 +574,28 @@ void _print_status_user_line(const uid_t* users, int nusers, bool print_uids)
 
 /*
  * Prints the given groups onto a line. If print_gids is true, the gids are
- * not converted to groupnames. If a group isn't valid, they are ignored.
+ * not converted to groupnames. If a group isn't valid, they are ignored. The
+ * groupnames of the gids may be given, or NULL.
  */
-void _print_status_group_line(const uid_t* groups, int ngroups, bool print_gids)
+void _print_status_group_line(const gid_t* groups, char** groupnames,
+    int ngroups, bool print_gids)
 {
-    assert(groups);
+    assert(groups || ngroups == 0);
     printf("%*s: ", STATUS_INDENT, "Groups");
 
     const char* groupname = NULL;
     for (int i = 0; i < ngroups; i++) {
         gid_t gid = (gid_t)groups[i];
 
-        if (print_gids) {
+        if (groupnames) {
+            // The daemon already found which groups exist
+            if (groupnames[i][0] == '\0')
+                continue;
+            if (print_gids)
+                printf("%lu", (unsigned long)gid);
+            else
+                printf("%s", groupnames[i]);
+        } else if (print_gids) {
             // Ignore invalid users
             if (!getgrgid(gid))
                 continue;
@@ -424,12 +613,24 @@ void _print_status_group_line(const uid_t* groups, int ngroups, bool print_gids)
     puts("");
 }
 
+/*
+ * Returns the number of names in the NULL terminated array, which may be
+ * NULL.
+ */
+size_t _count_names(char** names)
+{
+    size_t count = 0;
+    while (names && names[count])
+        count++;
+    return count;
+}
+
 void show_status_help()
 {
     printf("userctl status [OPTIONS...] [TARGET]\n\n"
            "Prints the properties of the class. The users and groups fields "
            "contain only\n"
-           "those who exist.\n\n"
+           "those who exist, and the active field those logged in.\n\n"
            "  -u --uids\t\tShow uids rather than usernames\n"
            "  -g --gids\t\tShow gids rather than groupnames\n"
            "  -h --help\t\tShow this help\n");
@@ -491,6 +692,47 @@ cleanup:
     return r < 0 ? -1 : 0;
 }
 
+/*
+ * Prints the classes in the export in class file syntax, with their members
+ * as ids and any inherited or transient controls in place.
+ */
+void _print_export(const char* data, size_t size)
+{
+    HashMap classes;
+    uint64_t generation = 0;
+    if (read_export(data, size, &classes, &generation) < 0)
+        errno_die("Failed to read export");
+
+    printf("# generation %" PRIu64 "\n", generation);
+    size_t nclasses = get_hashmap_count(&classes);
+    for (size_t n = 0; n < nclasses; n++) {
+        char* classname = NULL;
+        ClassProperties* props = NULL;
+        get_hashmap_entry_at(&classes, n, &classname, (void**)&props);
+
+        printf("\n# %s (%s)\n", classname, props->filepath);
+        printf("shared=%s\n", props->shared ? "yes" : "no");
+        printf("priority=%g\n", props->priority);
+        printf("users=");
+        for (size_t i = 0; i < props->users.count; i++)
+            printf("%s%u", i > 0 ? "," : "", props->users.items[i]);
+        printf("\ngroups=");
+        for (size_t i = 0; i < props->groups.count; i++)
+            printf("%s%u", i > 0 ? "," : "", props->groups.items[i]);
+        printf("\n");
+
+        size_t ncontrols = get_hashmap_count(&props->controls);
+        for (size_t i = 0; i < ncontrols; i++) {
+            char* key = NULL;
+            char** value = NULL;
+            get_hashmap_entry_at(&props->controls, i, &key, (void**)&value);
+            printf("%s=%s\n", key, *value);
+        }
+        destroy_class(props);
+    }
+    destroy_hashmap(&classes);
+}
+
 void show_reload_help()
 {
     printf("userctl reload [OPTIONS...] [TARGET]\n\n"
@@ -532,6 +774,7 @@ void set_property(int argc, char* argv[])
 
     sd_bus_error error = SD_BUS_ERROR_NULL;
     sd_bus_message* msg = NULL;
+    sd_bus_message* reply = NULL;
     sd_bus* bus = NULL;
 
     _parse_no_args(argc, argv);
@@ -560,17 +803,14 @@ void set_property(int argc, char* argv[])
             errno_die("Failed to add .class to the end of the given classname");
     }
 
-    char* resource_control = argv[optind + 1];
-
-    // Soft error checking just to be nice
-
-    if (strchr(resource_control, '=') == NULL)
-        die("Resource control given does not contain an '='\n");
-
-    char* key = NULL;
-    char* value = NULL;
-    if (parse_key_value(resource_control, &key, &value) < 0)
-        die("Failed to parse key=value pair\n");
+    int ncontrols = leftover_argc - 1;
+    char** keys = calloc(ncontrols, sizeof *keys);
+    char** values = calloc(ncontrols, sizeof *values);
+    if (!keys || !values)
+        errno_die("Failed to allocate the resource controls");
+    for (int n = 0; n < ncontrols; n++)
+        if (_parse_control(argv[optind + 1 + n], &keys[n], &values[n]) < 0)
+            die("Failed to parse key=value pair\n");
 
     /* Connect to the system bus */
     int r = sd_bus_open_system(&bus);
@@ -579,18 +819,44 @@ void set_property(int argc, char* argv[])
         goto cleanup;
     }
 
-    r = sd_bus_call_method(bus, service_name, service_path, service_name,
-        "SetProperty", &error, &msg, "sss", classname, key,
-        value);
-    if (r < 0) {
-        fprintf(stderr, "%s\n", error.message);
-        goto cleanup;
+    r = sd_bus_message_new_method_call(bus, &msg, service_name, service_path,
+        service_name, "SetProperties");
+    if (r < 0)
+        goto append_error;
+    r = sd_bus_message_append(msg, "s", classname);
+    if (r < 0)
+        goto append_error;
+    r = sd_bus_message_open_container(msg, SD_BUS_TYPE_ARRAY, "(ss)");
+    if (r < 0)
+        goto append_error;
+
+    // Every control goes in one call, so the class is only enforced once
+    for (int n = 0; n < ncontrols; n++) {
+        r = sd_bus_message_append(msg, "(ss)", keys[n], values[n]);
+        if (r < 0)
+            goto append_error;
     }
 
+    r = sd_bus_message_close_container(msg);
+    if (r < 0)
+        goto append_error;
+
+    r = sd_bus_call(bus, msg, 0, &error, &reply);
+    if (r < 0)
+        fprintf(stderr, "%s\n", error.message);
+    goto cleanup;
+
+append_error:
+    fprintf(stderr, "Internal error: Failed to build call to userctl: %s\n",
+        strerror(-r));
+
 cleanup:
     if (alloc_classname)
         free((char*)classname);
-
+    free(keys);
+    free(values);
+    sd_bus_message_unref(msg);
+    sd_bus_message_unref(reply);
     sd_bus_error_free(&error);
     sd_bus_unref(bus);
 }
@@ -598,11 +864,38 @@ cleanup:
 void show_set_property_help()
 {
     printf("userctl set-property [OPTIONS...] [TARGET] [CONTROLS...]\n\n"
-           "Sets a transient resource control on a class. For permanent "
-           "controls you edit the class file.\n"
+           "Sets transient resource controls on a class, or removes those "
+           "given as KEY=,\nresetting them on its users. Either every control "
+           "is set or none are.\nFor permanent controls you edit the class "
+           "file.\n"
            "  -h --help\t\tShow this help\n");
 }
 
+/*
+ * Parses the KEY=VALUE resource control in place, passing back the key and
+ * value. An empty value (KEY=) means the control is to be removed. Returns -1
+ * if the control couldn't be parsed, otherwise 0.
+ */
+int _parse_control(char* resource_control, char** key, char** value)
+{
+    assert(resource_control && key && value);
+
+    // Soft error checking just to be nice
+    char* equals = strchr(resource_control, '=');
+    if (!equals)
+        return -1;
+
+    // KEY= removes the control
+    if (equals[1] == '\0') {
+        *equals = '\0';
+        *key = resource_control;
+        *value = equals;
+        trim_whitespace(key);
+        return (*key)[0] == '\0' ? -1 : 0;
+    }
+    return parse_key_value(resource_control, key, value);
+}
+
 void cat(int argc, char* argv[])
 {
     assert(argc >= 0); // No negative args
@@ -610,7 +903,11 @@ void cat(int argc, char* argv[])
 
     sd_bus_error error = SD_BUS_ERROR_NULL;
     sd_bus_message* msg = NULL;
+    sd_bus_message* reply = NULL;
     sd_bus* bus = NULL;
+    char** classnames = NULL;
+    const char** filepaths = NULL;
+    int nclasses = 0;
 
     _parse_no_args(argc, argv);
 
@@ -633,34 +930,61 @@ void cat(int argc, char* argv[])
         goto cleanup;
     }
 
-    const char* filepath;
-    for (int i = optind; i < argc; i++) {
-        const char* classname = argv[i];
-        bool alloc_classname = false;
-        if (!has_ext(classname, ".class")) {
-            alloc_classname = true;
-            classname = add_ext(classname, ".class");
-            if (!classname)
-                errno_die("Failed to add .class to the end of the given classname");
-        }
-        r = sd_bus_call_method(bus, service_name, service_path, service_name,
-            "GetClass", &error, &msg, "s", classname);
-        if (alloc_classname)
-            free((char*)classname);
-        if (r < 0) {
-            fprintf(stderr, "%s\n", error.message);
-            continue;
-        }
+    nclasses = argc - optind;
+    classnames = calloc(nclasses + 1, sizeof *classnames);
+    filepaths = calloc(nclasses, sizeof *filepaths);
+    if (!classnames || !filepaths)
+        errno_die("Failed to allocate the classnames");
+    for (int i = 0; i < nclasses; i++) {
+        if (has_ext(argv[optind + i], ".class"))
+            classnames[i] = strdup(argv[optind + i]);
+        else
+            classnames[i] = (char*)add_ext(argv[optind + i], ".class");
+        if (!classnames[i])
+            errno_die("Failed to add .class to the end of the given classname");
+    }
 
-        r = sd_bus_message_read(msg, "s", &filepath);
-        if (r < 0) {
-            fprintf(stderr,
-                "Internal error: Failed to parse class from userctld %s\n",
-                strerror(-r));
+    // Every class comes back in one reply, rather than one call per class
+    r = sd_bus_message_new_method_call(bus, &msg, service_name, service_path,
+        service_name, "GetClasses");
+    if (r >= 0)
+        r = sd_bus_message_append_strv(msg, classnames);
+    if (r >= 0)
+        r = sd_bus_message_append(msg, "t", (uint64_t)0);
+    if (r < 0) {
+        fprintf(stderr, "Internal error: Failed to create message: %s\n",
+            strerror(-r));
+        goto cleanup;
+    }
+    r = sd_bus_call(bus, msg, 0, &error, &reply);
+    if (r < 0) {
+        fprintf(stderr, "%s\n", error.message);
+        goto cleanup;
+    }
+
+    r = sd_bus_message_enter_container(reply, SD_BUS_TYPE_ARRAY,
+        "(ssbdauauasasa{ss})");
+    Class class = { 0 };
+    while (r >= 0 && (r = _read_class(reply, &class)) > 0) {
+        for (int i = 0; i < nclasses; i++)
+            if (strcmp(classnames[i], class.classname) == 0)
+                filepaths[i] = class.filepath;
+        _free_class_names(&class);
+    }
+    if (r < 0) {
+        fprintf(stderr, "Internal error: Failed to parse class from userctld %s\n",
+            strerror(-r));
+        goto cleanup;
+    }
+
+    // Classes that don't exist are left out of the reply
+    for (int i = 0; i < nclasses; i++) {
+        if (!filepaths[i]) {
+            fprintf(stderr, "No such class found (may need to daemon-reload).\n");
             continue;
         }
 
-        int fd = open(filepath, O_RDONLY);
+        int fd = open(filepaths[i], O_RDONLY);
         if (fd < 0) {
             perror("Failed to open class file");
             continue;
@@ -668,21 +992,22 @@ void cat(int argc, char* argv[])
 
         size_t bufsize = 8096;
         char buf[bufsize];
-        for (;;) {
-            r = read(fd, &buf, bufsize);
-            if (r < 0) {
-                perror("Failed to open class file");
-                break;
-            }
-            if (r == 0)
-                break;
-
-            fputs(buf, stdout);
-        }
+        ssize_t size;
+        while ((size = read(fd, &buf, bufsize)) > 0)
+            fwrite(buf, 1, size, stdout);
+        if (size < 0)
+            perror("Failed to read class file");
         close(fd);
     }
 
 cleanup:
+    if (classnames)
+        for (int i = 0; i < nclasses; i++)
+            free(classnames[i]);
+    free(classnames);
+    free(filepaths);
+    sd_bus_message_unref(msg);
+    sd_bus_message_unref(reply);
     sd_bus_error_free(&error);
     sd_bus_unref(bus);
 }
@@ -815,3 +1140,862 @@ void show_edit_help()
            "Opens up an editor and reloads the class upon exit.\n"
            "  -h --help\t\tShow this help\n");
 }
+
+void compile(int argc, char* argv[])
+{
+    assert(argc >= 0); // No negative args
+    assert(argv); // At least empty
+
+    const char* output = DEFAULT_SNAPSHOT_PATH;
+    while (true) {
+        static struct option long_options[] = {
+            { "help", no_argument, &help, 1 },
+            { "output", required_argument, NULL, 'o' },
+            { 0 }
+        };
+
+        int option_index = 0;
+        int c = getopt_long(argc, argv, "ho:", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 'h':
+            help = 1;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case '?':
+            stop = 1;
+            break;
+        default:
+            continue;
+        }
+    }
+
+    // Abort, missing/wrong args (getopt will print errors out)
+    if (stop)
+        exit(1);
+
+    if (help) {
+        show_compile_help();
+        exit(0);
+    }
+
+    struct dirent** class_files = NULL;
+    int num_files = 0;
+    if (list_class_files(DEFAULT_CLASSDIR, DEFAULT_CLASSEXT, &class_files,
+            &num_files)
+        < 0)
+        errno_die("Failed to list class files");
+
+    size_t nclasses = 0;
+    ClassProperties* classes = calloc(num_files + 1, sizeof *classes);
+    Arena* arena = create_arena();
+    if (!classes || !arena)
+        errno_die("Failed to compile classes");
+    for (int i = 0; i < num_files; i++) {
+        const char* classname = class_files[i]->d_name;
+        if (create_unresolved_class(DEFAULT_CLASSDIR, classname,
+                &classes[nclasses], arena)
+            < 0) {
+            // The daemon skips classes that fail to parse too
+            fprintf(stderr, "Skipping %s: %s\n", classname, strerror(errno));
+            continue;
+        }
+        nclasses++;
+    }
+
+    char** classnames = calloc(nclasses + 1, sizeof *classnames);
+    int* errors = calloc(nclasses + 1, sizeof *errors);
+    if (!classnames || !errors)
+        errno_die("Failed to compile classes");
+    for (size_t n = 0; n < nclasses; n++)
+        classnames[n] = basename(classes[n].filepath);
+
+    // The daemon trusts a snapshot's members, so one missing a member that
+    // couldn't be looked up mustn't be written
+    if (resolve_class_members(classes, nclasses, errors) < 0)
+        errno_die("Failed to resolve class members");
+    for (size_t n = 0; n < nclasses; n++) {
+        if (errors[n] != 0) {
+            errno = errors[n];
+            fprintf(stderr, "Failed to resolve the members of %s: %s\n",
+                classnames[n], strerror(errno));
+            exit(1);
+        }
+    }
+    if (flatten_classes(classes, classnames, nclasses, NULL, errors) < 0)
+        errno_die("Failed to flatten classes");
+
+    HashMap map;
+    if (create_hashmap(&map, sizeof(ClassProperties), nclasses) < 0)
+        errno_die("Failed to compile classes");
+    for (size_t n = 0; n < nclasses; n++) {
+        if (errors[n] != 0) {
+            fprintf(stderr, "Skipping %s: %s\n", classnames[n],
+                strerror(errors[n]));
+            continue;
+        }
+        if (add_hashmap_entry(&map, classnames[n], &classes[n]) < 0)
+            errno_die("Failed to compile classes");
+    }
+
+    if (write_snapshot(output, DEFAULT_CLASSDIR, DEFAULT_CLASSEXT, &map) < 0) {
+        fprintf(stderr, "Failed to write %s: %s\n", output, strerror(errno));
+        exit(1);
+    }
+    printf("Compiled %zu classes into %s\n", get_hashmap_count(&map), output);
+
+    for (size_t n = 0; n < nclasses; n++)
+        destroy_class(&classes[n]);
+    free(classes);
+    free(classnames);
+    free(errors);
+    unref_arena(arena);
+    destroy_hashmap(&map);
+    for (int i = 0; i < num_files; i++)
+        free(class_files[i]);
+    free(class_files);
+}
+
+void show_compile_help()
+{
+    printf("userctl compile [OPTIONS...]\n\n"
+           "Compiles the class files into a snapshot userctld starts from.\n"
+           "  -h --help\t\tShow this help\n"
+           "  -o --output=PATH\tWhere to write the snapshot (default %s)\n",
+        DEFAULT_SNAPSHOT_PATH);
+}
+
+void export(int argc, char* argv[])
+{
+    assert(argc >= 0); // No negative args
+    assert(argv); // At least empty
+
+    const char* output = NULL;
+    int text = 0;
+    while (true) {
+        static struct option long_options[] = {
+            { "help", no_argument, &help, 1 },
+            { "output", required_argument, NULL, 'o' },
+            { "text", no_argument, NULL, 't' },
+            { 0 }
+        };
+
+        int option_index = 0;
+        int c = getopt_long(argc, argv, "ho:t", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 'h':
+            help = 1;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 't':
+            text = 1;
+            break;
+        case '?':
+            stop = 1;
+            break;
+        default:
+            continue;
+        }
+    }
+
+    // Abort, missing/wrong args (getopt will print errors out)
+    if (stop)
+        exit(1);
+
+    if (help) {
+        show_export_help();
+        exit(0);
+    }
+    if (!output && !text && isatty(STDOUT_FILENO))
+        die("Refusing to write an export to a terminal; use --output or "
+            "--text\n");
+
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message* msg = NULL;
+    sd_bus* bus = NULL;
+    int r = sd_bus_open_system(&bus);
+    if (r < 0) {
+        fprintf(stderr, "Failed to connect to system bus: %s\n", strerror(-r));
+        exit(1);
+    }
+
+    // The whole configuration comes back as a sealed file, however big
+    r = sd_bus_call_method(bus, service_name, service_path, service_name,
+        "ExportConfiguration", &error, &msg, "");
+    if (r < 0) {
+        fprintf(stderr, "%s\n", error.message);
+        exit(1);
+    }
+    int fd = -1;
+    r = sd_bus_message_read_basic(msg, 'h', &fd);
+    if (r < 0) {
+        fprintf(stderr, "Failed to parse export from userctld: %s\n",
+            strerror(-r));
+        exit(1);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        errno_die("Failed to read export");
+    size_t size = st.st_size;
+    char* data = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                          : NULL;
+    if (data == MAP_FAILED)
+        errno_die("Failed to read export");
+
+    if (text) {
+        _print_export(data, size);
+    } else {
+        int out = STDOUT_FILENO;
+        if (output) {
+            out = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (out < 0) {
+                fprintf(stderr, "Failed to open %s: %s\n", output,
+                    strerror(errno));
+                exit(1);
+            }
+        }
+        size_t written = 0;
+        while (written < size) {
+            ssize_t len = write(out, data + written, size - written);
+            if (len < 0 && errno == EINTR)
+                continue;
+            if (len < 0)
+                errno_die("Failed to write export");
+            written += len;
+        }
+        if (output && close(out) < 0)
+            errno_die("Failed to write export");
+    }
+
+    if (data)
+        munmap(data, size);
+    sd_bus_error_free(&error);
+    sd_bus_message_unref(msg);
+    sd_bus_unref(bus);
+}
+
+void show_export_help()
+{
+    printf("userctl export [OPTIONS...]\n\n"
+           "Writes out every class the daemon has loaded with its members and "
+           "controls.\n"
+           "  -h --help\t\tShow this help\n"
+           "  -o --output=PATH\tWhere to write the export (default stdout)\n"
+           "  -t --text\t\tPrint the classes in class file syntax instead\n");
+}
+
+void batch(int argc, char* argv[])
+{
+    assert(argc >= 0); // No negative args
+    assert(argv); // At least empty
+
+    Batch batch = { .window = DEFAULT_BATCH_WINDOW };
+    while (true) {
+        static struct option long_options[] = {
+            { "help", no_argument, &help, 1 },
+            { "window", required_argument, NULL, 'w' },
+            { 0 }
+        };
+
+        int option_index = 0;
+        int c = getopt_long(argc, argv, "hw:", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 'h':
+            help = 1;
+            break;
+        case 'w':
+            batch.window = strtoul(optarg, NULL, 10);
+            if (!all_digits(optarg) || batch.window == 0) {
+                fprintf(stderr, "Invalid window: %s\n", optarg);
+                stop = 1;
+            }
+            break;
+        case '?':
+            stop = 1;
+            break;
+        default:
+            continue;
+        }
+    }
+
+    // Abort, missing/wrong args (getopt will print errors out)
+    if (stop)
+        exit(1);
+
+    if (help) {
+        show_batch_help();
+        exit(0);
+    }
+
+    FILE* file = stdin;
+    if (optind < argc && strcmp(argv[optind], "-") != 0) {
+        file = fopen(argv[optind], "r");
+        if (!file)
+            errno_die("Failed to open the batch file");
+    }
+
+    batch.calls = calloc(batch.window, sizeof *batch.calls);
+    if (!batch.calls)
+        errno_die("Failed to allocate the batch");
+
+    /* Connect to the system bus once for every command */
+    int r = sd_bus_open_system(&batch.bus);
+    if (r < 0) {
+        fprintf(stderr, "Failed to connect to system bus: %s\n", strerror(-r));
+        exit(1);
+    }
+
+    uint64_t start = monotonic_usec();
+    char* line = NULL;
+    size_t linesize = 0;
+    size_t lineno = 0;
+    while (getline(&line, &linesize, file) != -1)
+        _run_batch_line(&batch, ++lineno, line);
+    if (ferror(file))
+        perror("Failed to read the batch file");
+
+    while (batch.head < batch.tail)
+        if (_wait_batch(&batch) < 0)
+            break;
+    double seconds = (monotonic_usec() - start) / 1e6;
+
+    size_t ncalls = batch.tail;
+    fprintf(stderr, "%zu commands (%zu failed) in %.3fs, %.1f commands/s\n",
+        ncalls, batch.nfailed, seconds, seconds > 0 ? ncalls / seconds : 0.0);
+
+    free(line);
+    if (file != stdin)
+        fclose(file);
+    free(batch.calls);
+    sd_bus_flush_close_unref(batch.bus);
+    if (batch.nfailed > 0 || batch.head < batch.tail)
+        exit(1);
+}
+
+void show_batch_help()
+{
+    printf("userctl batch [OPTIONS...] [FILE]\n\n"
+           "Runs the commands in the file (or stdin) over one connection to "
+           "userctld,\none per line:\n"
+           "  eval USER\n"
+           "  status CLASS\n"
+           "  set-property CLASS KEY=VALUE...\n"
+           "  reload CLASS\n"
+           "  daemon-reload\n\n"
+           "Commands that don't depend on each other are sent without "
+           "waiting for the\nreplies. The result of each is printed in order "
+           "as a tab separated line:\nLINE COMMAND ok|error [RESULT...]\n"
+           "  -h --help\t\tShow this help\n"
+           "  -w --window=N\t\tHow many commands can wait on replies "
+           "(default %d)\n",
+        DEFAULT_BATCH_WINDOW);
+}
+
+/*
+ * Parses and sends the command on the line, printing any calls that finished
+ * in the meantime.
+ */
+void _run_batch_line(Batch* batch, size_t lineno, char* line)
+{
+    size_t nargs = 0;
+    char* args[strlen(line) / 2 + 1];
+    char* saveptr = NULL;
+    for (char* arg = strtok_r(line, " \t\n", &saveptr); arg;
+         arg = strtok_r(NULL, " \t\n", &saveptr))
+        args[nargs++] = arg;
+
+    // Skip blank lines and comments
+    if (nargs == 0 || args[0][0] == '#')
+        return;
+
+    BatchOp op = 0;
+    while (op < BATCH_INVALID && strcmp(args[0], batch_ops[op]) != 0)
+        op++;
+
+    // Every command but eval and daemon-reload is on a class
+    const char* classname = NULL;
+    bool alloc_classname = false;
+    if (op != BATCH_EVAL && op != BATCH_DAEMON_RELOAD && op != BATCH_INVALID
+        && nargs >= 2) {
+        classname = args[1];
+        if (!has_ext(classname, ".class")) {
+            alloc_classname = true;
+            classname = add_ext(classname, ".class");
+            if (!classname)
+                errno_die("Failed to add .class to the end of the given classname");
+        }
+    }
+
+    BatchCall* call = _reserve_batch_call(batch, lineno, op, classname);
+    if (alloc_classname)
+        free((char*)classname);
+    if (op == BATCH_INVALID) {
+        _fail_batch_call(call, "Unknown command");
+        return;
+    }
+
+    int r = _send_batch_call(batch, call, args + 1, nargs - 1);
+    if (r < 0 && !call->done)
+        _fail_batch_call(call, strerror(-r));
+}
+
+/*
+ * Waits until a call can be sent without getting ahead of those it depends on
+ * and there's room for it in the window, then passes back the call. Returns
+ * NULL if the connection failed.
+ */
+BatchCall* _reserve_batch_call(Batch* batch, size_t lineno, BatchOp op,
+    const char* classname)
+{
+    for (;;) {
+        bool blocked = batch->tail - batch->head >= batch->window;
+        for (size_t n = batch->head; !blocked && n < batch->tail; n++) {
+            BatchCall* call = &batch->calls[n % batch->window];
+            blocked = !call->done && _batch_calls_depend(call, op, classname);
+        }
+        if (!blocked)
+            break;
+        if (_wait_batch(batch) < 0)
+            die("Lost the connection to userctld\n");
+    }
+
+    BatchCall* call = &batch->calls[batch->tail++ % batch->window];
+    *call = (BatchCall) { .lineno = lineno, .op = op };
+    if (classname) {
+        call->classname = strdup(classname);
+        if (!call->classname)
+            errno_die("Failed to allocate the batch command");
+    }
+    return call;
+}
+
+/*
+ * Returns whether the op on the class (or every class if NULL) has to wait for
+ * the call to finish. Calls that change a class wait for the calls on it
+ * before them, and calls on it wait for those changes, so that what each
+ * command sees doesn't depend on how far ahead the others were sent.
+ */
+bool _batch_calls_depend(const BatchCall* call, BatchOp op,
+    const char* classname)
+{
+    if (op == BATCH_INVALID)
+        return false;
+
+    bool writes = op >= BATCH_SET_PROPERTY;
+    bool call_writes = call->op >= BATCH_SET_PROPERTY;
+    if (!writes && !call_writes)
+        return false;
+    if (!classname || !call->classname)
+        return true;
+    return strcmp(classname, call->classname) == 0;
+}
+
+/*
+ * Processes the replies that arrived, waiting for one if there were none,
+ * and prints the calls that are done in order. Returns a negative errno if
+ * the connection failed, otherwise 0.
+ */
+int _wait_batch(Batch* batch)
+{
+    int r = sd_bus_process(batch->bus, NULL);
+    if (r == 0)
+        r = sd_bus_wait(batch->bus, UINT64_MAX);
+    if (r < 0) {
+        fprintf(stderr, "Failed to process replies from userctld: %s\n",
+            strerror(-r));
+        return r;
+    }
+    _print_batch_calls(batch);
+    return 0;
+}
+
+/*
+ * Prints the oldest calls for as long as they're done, making room for more.
+ */
+void _print_batch_calls(Batch* batch)
+{
+    while (batch->head < batch->tail) {
+        BatchCall* call = &batch->calls[batch->head % batch->window];
+        if (!call->done)
+            break;
+
+        printf("%zu\t%s\t%s", call->lineno, batch_ops[call->op],
+            call->failed ? "error" : "ok");
+        if (call->result)
+            printf("\t%s", call->result);
+        puts("");
+        if (call->failed)
+            batch->nfailed++;
+
+        free(call->classname);
+        free(call->result);
+        batch->head++;
+    }
+}
+
+/*
+ * Sends the call for the command with the given arguments (without the
+ * command itself), without waiting for the reply. Returns a negative errno if
+ * the call couldn't be sent, otherwise 0. Bad arguments fail the call rather
+ * than returning an error.
+ */
+int _send_batch_call(Batch* batch, BatchCall* call, char** args, int nargs)
+{
+    sd_bus_message* msg = NULL;
+    int r = 0;
+
+    const char* method = NULL;
+    switch (call->op) {
+    case BATCH_EVAL:
+        method = "Evaluate";
+        break;
+    case BATCH_STATUS:
+        method = "GetClasses";
+        break;
+    case BATCH_SET_PROPERTY:
+        method = "SetProperties";
+        break;
+    case BATCH_RELOAD:
+        method = "Reload";
+        break;
+    case BATCH_DAEMON_RELOAD:
+        method = "DaemonReload";
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    int expected_nargs = call->op == BATCH_DAEMON_RELOAD ? 0 : 1;
+    if ((call->op == BATCH_SET_PROPERTY && nargs < 2)
+        || (call->op != BATCH_SET_PROPERTY && nargs != expected_nargs)) {
+        _fail_batch_call(call, "Wrong number of arguments");
+        return 0;
+    }
+
+    r = sd_bus_message_new_method_call(batch->bus, &msg, service_name,
+        service_path, service_name, method);
+    if (r < 0)
+        goto cleanup;
+
+    uid_t uid = 0;
+    char* key = NULL;
+    char* value = NULL;
+    switch (call->op) {
+    case BATCH_EVAL:
+        if (to_uid(args[0], &uid) == -1) {
+            _fail_batch_call(call, errno != 0 ? strerror(errno) : "No such user");
+            goto cleanup;
+        }
+        r = sd_bus_message_append(msg, "u", uid);
+        break;
+    case BATCH_STATUS:
+        r = sd_bus_message_append(msg, "ast", 1, call->classname, (uint64_t)0);
+        break;
+    case BATCH_SET_PROPERTY:
+        r = sd_bus_message_append(msg, "s", call->classname);
+        if (r >= 0)
+            r = sd_bus_message_open_container(msg, SD_BUS_TYPE_ARRAY, "(ss)");
+        for (int n = 1; r >= 0 && n < nargs; n++) {
+            if (_parse_control(args[n], &key, &value) < 0) {
+                _fail_batch_call(call, "Failed to parse key=value pair");
+                goto cleanup;
+            }
+            r = sd_bus_message_append(msg, "(ss)", key, value);
+        }
+        if (r >= 0)
+            r = sd_bus_message_close_container(msg);
+        break;
+    case BATCH_RELOAD:
+        r = sd_bus_message_append(msg, "s", call->classname);
+        break;
+    default:
+        break;
+    }
+    if (r < 0)
+        goto cleanup;
+
+    // The slot is left floating, so it goes away along with the reply
+    r = sd_bus_call_async(batch->bus, NULL, msg, _batch_reply, call, 0);
+
+cleanup:
+    sd_bus_message_unref(msg);
+    return r < 0 ? r : 0;
+}
+
+/*
+ * Marks the call whose reply this is as done, keeping its result.
+ */
+int _batch_reply(sd_bus_message* reply, void* userdata,
+    sd_bus_error* ret_error)
+{
+    (void)ret_error;
+    BatchCall* call = userdata;
+
+    const sd_bus_error* error = sd_bus_message_get_error(reply);
+    if (error) {
+        _fail_batch_call(call, error->message ? error->message : error->name);
+        return 0;
+    }
+
+    const char* filepath = NULL;
+    size_t size = 0;
+    FILE* result = NULL;
+    Class class = { 0 };
+    int r = 0;
+    switch (call->op) {
+    case BATCH_EVAL:
+        r = sd_bus_message_read_basic(reply, 's', &filepath);
+        if (r >= 0 && !(call->result = strdup(filepath)))
+            r = -errno;
+        break;
+    case BATCH_STATUS:
+        r = sd_bus_message_enter_container(reply, SD_BUS_TYPE_ARRAY,
+            "(ssbdauauasasa{ss})");
+        if (r >= 0)
+            r = _read_class(reply, &class);
+        if (r == 0) {
+            _fail_batch_call(call, "No such class found (may need to "
+                                   "daemon-reload).");
+            return 0;
+        }
+        if (r < 0)
+            break;
+
+        result = open_memstream(&call->result, &size);
+        if (!result) {
+            r = -errno;
+            break;
+        }
+        fprintf(result, "%s\tshared=%s\tpriority=%lf\tusers=", class.filepath,
+            class.shared ? "true" : "false", class.priority);
+        for (size_t n = 0; n < class.uids_size / sizeof *class.uids; n++)
+            fprintf(result, "%s%lu", n ? "," : "", (unsigned long)class.uids[n]);
+        fprintf(result, "\tgroups=");
+        for (size_t n = 0; n < class.gids_size / sizeof *class.gids; n++)
+            fprintf(result, "%s%lu", n ? "," : "", (unsigned long)class.gids[n]);
+        if (fclose(result) != 0)
+            r = -errno;
+        _free_class_names(&class);
+        break;
+    default:
+        break;
+    }
+    if (r < 0) {
+        free(call->result);
+        call->result = NULL;
+        _fail_batch_call(call, strerror(-r));
+        return 0;
+    }
+
+    call->done = true;
+    return 0;
+}
+
+/*
+ * Marks the call as done and failed with the given message.
+ */
+void _fail_batch_call(BatchCall* call, const char* message)
+{
+    free(call->result);
+    call->result = strdup(message);
+    call->failed = true;
+    call->done = true;
+}
+
+void monitor(int argc, char* argv[])
+{
+    assert(argc >= 0); // No negative args
+    assert(argv); // At least empty
+
+    sd_bus* bus = NULL;
+
+    _parse_no_args(argc, argv);
+
+    // Abort, missing/wrong args (getopt will print errors out)
+    if (stop)
+        exit(1);
+
+    if (help) {
+        show_monitor_help();
+        exit(0);
+    }
+
+    /* Connect to the system bus */
+    int r = sd_bus_open_system(&bus);
+    if (r < 0) {
+        fprintf(stderr, "Failed to connect to system bus: %s\n", strerror(-r));
+        exit(1);
+    }
+
+    // sd_bus_add_match rather than sd_bus_match_signal, for older systemds
+    char match[256];
+    snprintf(match, sizeof match,
+        "type='signal',sender='%s',path='%s',interface='%s',"
+        "member='ClassesChanged'",
+        service_name, service_path, service_name);
+    r = sd_bus_add_match(bus, NULL, match, _on_classes_changed, NULL);
+    if (r >= 0) {
+        snprintf(match, sizeof match,
+            "type='signal',sender='%s',path='%s',interface='%s',"
+            "member='UserClassChanged'",
+            service_name, service_path, service_name);
+        r = sd_bus_add_match(bus, NULL, match, _on_user_class_changed, NULL);
+    }
+    if (r >= 0) {
+        snprintf(match, sizeof match,
+            "type='signal',sender='%s',path='%s',interface='%s',"
+            "member='Enforced'",
+            service_name, service_path, service_name);
+        r = sd_bus_add_match(bus, NULL, match, _on_enforced, NULL);
+    }
+    if (r < 0) {
+        fprintf(stderr, "Failed to watch for changes: %s\n", strerror(-r));
+        goto cleanup;
+    }
+
+    // Whoever is following along sees each change as it comes
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    for (;;) {
+        r = sd_bus_process(bus, NULL);
+        if (r < 0) {
+            fprintf(stderr, "Failed to process bus: %s\n", strerror(-r));
+            goto cleanup;
+        }
+        if (r > 0)
+            continue;
+
+        r = sd_bus_wait(bus, (uint64_t)-1);
+        if (r < 0) {
+            fprintf(stderr, "Failed to wait on bus: %s\n", strerror(-r));
+            goto cleanup;
+        }
+    }
+
+cleanup:
+    sd_bus_unref(bus);
+    exit(1);
+}
+
+void show_monitor_help()
+{
+    printf("userctl monitor [OPTIONS...]\n\n"
+           "Follows changes to the classes, to which class each logged in "
+           "user is in and\nthe classes enforced on them, printing a line for "
+           "each:\n"
+           "  ClassesChanged generation=N added=... removed=... modified=...\n"
+           "  UserClassChanged uid=UID old=CLASS new=CLASS\n"
+           "  Enforced uid=UID class=CLASS generation=N result=ok|failed "
+           "usec=USEC\n"
+           "A user in no class has an empty class.\n"
+           "  -h --help\t\tShow this help\n");
+}
+
+/*
+ * Prints the ClassesChanged signal.
+ */
+int _on_classes_changed(sd_bus_message* m, void* userdata,
+    sd_bus_error* ret_error)
+{
+    (void)userdata;
+    (void)ret_error;
+
+    char** added = NULL;
+    char** removed = NULL;
+    char** modified = NULL;
+    uint64_t generation = 0;
+    int r = sd_bus_message_read_strv(m, &added);
+    if (r >= 0)
+        r = sd_bus_message_read_strv(m, &removed);
+    if (r >= 0)
+        r = sd_bus_message_read_strv(m, &modified);
+    if (r >= 0)
+        r = sd_bus_message_read(m, "t", &generation);
+    if (r < 0) {
+        fprintf(stderr, "Failed to parse ClassesChanged: %s\n", strerror(-r));
+    } else {
+        printf("ClassesChanged generation=%lu", (unsigned long)generation);
+        _print_classnames("added", added);
+        _print_classnames("removed", removed);
+        _print_classnames("modified", modified);
+        puts("");
+    }
+
+    char** lists[] = { added, removed, modified };
+    for (size_t n = 0; n < sizeof lists / sizeof *lists; n++) {
+        for (size_t i = 0; lists[n] && lists[n][i]; i++)
+            free(lists[n][i]);
+        free(lists[n]);
+    }
+    return 0;
+}
+
+/*
+ * Prints the UserClassChanged signal.
+ */
+int _on_user_class_changed(sd_bus_message* m, void* userdata,
+    sd_bus_error* ret_error)
+{
+    (void)userdata;
+    (void)ret_error;
+
+    uid_t uid = 0;
+    const char* old_classpath = NULL;
+    const char* new_classpath = NULL;
+    int r = sd_bus_message_read(m, "uss", &uid, &old_classpath, &new_classpath);
+    if (r < 0) {
+        fprintf(stderr, "Failed to parse UserClassChanged: %s\n", strerror(-r));
+        return 0;
+    }
+    printf("UserClassChanged uid=%lu old=%s new=%s\n", (unsigned long)uid,
+        old_classpath, new_classpath);
+    return 0;
+}
+
+/*
+ * Prints the Enforced signal.
+ */
+int _on_enforced(sd_bus_message* m, void* userdata, sd_bus_error* ret_error)
+{
+    (void)userdata;
+    (void)ret_error;
+
+    uid_t uid = 0;
+    const char* classpath = NULL;
+    uint64_t generation = 0;
+    uint64_t timestamp_usec = 0;
+    uint64_t duration_usec = 0;
+    int succeeded = 0;
+    int r = sd_bus_message_read(m, "ustttb", &uid, &classpath, &generation,
+        &timestamp_usec, &duration_usec, &succeeded);
+    if (r < 0) {
+        fprintf(stderr, "Failed to parse Enforced: %s\n", strerror(-r));
+        return 0;
+    }
+    printf("Enforced uid=%lu class=%s generation=%lu result=%s usec=%lu\n",
+        (unsigned long)uid, classpath, (unsigned long)generation,
+        succeeded ? "ok" : "failed", (unsigned long)duration_usec);
+    return 0;
+}
+
+/*
+ * Prints the classnames as a comma separated label=... field.
+ */
+void _print_classnames(const char* label, char** classnames)
+{
+    printf(" %s=", label);
+    for (size_t n = 0; classnames && classnames[n]; n++)
+        printf("%s%s", n ? "," : "", classnames[n]);
+}
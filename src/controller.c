@@ -2,13 +2,16 @@
 #define _GNU_SOURCE // (basename)
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <syslog.h>
@@ -17,24 +20,260 @@
 
 #include "classparser.h"
 #include "controller.h"
+#include "dispatcher.h"
 #include "hashmap.h"
+#include "logger.h"
+#include "membership.h"
+#include "notifier.h"
+#include "resolver.h"
+#include "snapshot.h"
 #include "utils.h"
 #include "vector.h"
 
-static int _load_class_properties(char* dir, char* ext, HashMap* classes);
-static int _enforce_controls(uid_t uid, HashMap* controls);
-static int _enforce_controls_on_class(const char* classpath, HashMap* classes);
-static int _active_uids_and_class(Vector* uids, Vector* classes, HashMap* all_classes);
+// systemctl + set-property + unit_name
+#define ENFORCEMENT_ARGC_PREFIX 3
+#define MAX_INFLIGHT_ENFORCEMENTS 16
+// Batches smaller than this are evaluated on the calling thread
+#define PARALLEL_EVALUATE_MIN 64
+#define MAX_EVALUATE_THREADS 8
+// Parsing mostly waits on NSS, so it may use more threads than evaluating
+#define MAX_PARSE_THREADS 16
+// Transient controls are staged in an arena of their own, starting this big
+#define CONTROLS_ARENA_SIZE 1024
+
+/*
+ * A systemctl process enforcing a class on a user.
+ */
+typedef struct EnforceSlot {
+    pid_t pid;
+    uid_t uid;
+    // Owned by the job the process was spawned for
+    const char* classpath;
+    uint64_t start_usec;
+} EnforceSlot;
+
+/*
+ * A systemctl invocation built while the classes were locked, to be spawned
+ * once they aren't.
+ */
+typedef struct EnforceJob {
+    uid_t uid;
+    char* classpath;
+    char** argv;
+} EnforceJob;
+
+/*
+ * A pipelined enforcement pass: up to MAX_INFLIGHT_ENFORCEMENTS systemctl
+ * processes run at once and are waited on in the order they were spawned.
+ */
+typedef struct EnforcePass {
+    EnforceSlot slots[MAX_INFLIGHT_ENFORCEMENTS];
+    size_t head;
+    size_t count;
+    int failures;
+    // Where the outcomes are recorded, and the generation they were
+    // evaluated under
+    Context* context;
+    uint64_t generation;
+} EnforcePass;
+
+/*
+ * A slice of users evaluated by one thread.
+ */
+typedef struct EvaluateSlice {
+    HashMap* classes;
+    const uid_t* uids;
+    ClassProperties* results;
+    int* matches;
+    size_t start;
+    size_t end;
+} EvaluateSlice;
+
+/*
+ * Class files parsed by a pool of threads, each taking the next file not yet
+ * taken.
+ */
+typedef struct ParseJobs {
+    const char* dir;
+    struct dirent** class_files;
+    size_t nfiles;
+    ClassProperties* results;
+    // errno of each file that failed to parse; zero if it parsed
+    int* errors;
+    Arena* arena;
+    atomic_size_t next;
+} ParseJobs;
+
+/*
+ * What GetClasses replies with for a class, copied out so that names can be
+ * looked up without holding the classes locked.
+ */
+typedef struct ClassInfo {
+    char* classname;
+    // References to the class's arena, which holds the filepath, and the
+    // arena of its controls, which differs once transient ones are set
+    Arena* arena;
+    Arena* controls_arena;
+    const char* filepath;
+    bool shared;
+    double priority;
+    UidVector users;
+    GidVector groups;
+    // Pairs of const char* keys and values, if asked for
+    Vector controls;
+} ClassInfo;
+
+/*
+ * A class file that changed on disk, parsed before the classes are locked.
+ */
+typedef struct ClassChange {
+    char* classname;
+    // If not removed, the class has been parsed into props
+    bool removed;
+    ClassProperties props;
+} ClassChange;
+
+pthread_rwlock_t context_lock;
+
+static int _init_context(Context* context, bool strict);
+static int _load_class_properties(char* dir, char* ext, HashMap* classes,
+    bool strict);
+static void* _parse_class_files(void* vargp);
+static void _parse_classes(const char* dir, struct dirent** class_files,
+    size_t nfiles, ClassProperties* results, int* errors, Arena* arena);
+static void _update_memory_stats(Context* context);
+static bool _in_classpaths(const char* filepath, Vector* classpaths);
+static void* _evaluate_slice(void* vargp);
+static void _evaluate_users(HashMap* classes, const uid_t* uids, size_t nuids,
+    ClassProperties* results, int* matches);
+static int _reload_classes(Context* context, Vector* filenames, bool force);
+static void _regroup_users(Context* context);
+static int _move_user(Context* context, uid_t uid, const char* classpath);
+static void _notify_classes_changed(Context* context, Vector* added,
+    Vector* removed, Vector* modified);
+static void _notify_class_modified(Context* context, char* classname);
+static void _notify_reloaded_classes(Context* context, HashMap* before);
+static int _set_class_controls(Context* context, char* classname,
+    char** keys, char** values, size_t ncontrols, sd_bus_error* ret_error);
+static int _copy_controls(HashMap* from, HashMap* to, Arena* arena);
+static int _collect_class_info(char* classname, ClassProperties* props,
+    uint64_t flags, Vector* infos);
+static int _append_class_info(sd_bus_message* reply, ClassInfo* info,
+    uint64_t flags);
+static int _append_names(sd_bus_message* reply, char** names, size_t nnames);
+static void _destroy_class_info(ClassInfo* info);
+static int _list_all_classnames(Context* context, Vector* classnames);
+static int _parse_class_change(Context* context, const char* classdir,
+    char* classname, Vector* changes, bool force, Arena* arena);
+static int _parse_dependent_changes(Context* context, const char* classdir,
+    Vector* classnames, Vector* changes, Arena* arena);
+static int _list_dependents(Context* context, const char* parent,
+    Vector* changes, Vector* classnames);
+static int _resolve_class_changes(Vector* changes);
+static int _flatten_class_changes(Context* context, Vector* changes);
+static int _drop_unchanged_classes(Context* context, Vector* changes);
+static bool _same_class(ClassProperties* a, ClassProperties* b);
+static bool _same_members(ClassProperties* a, ClassProperties* b);
+static bool _same_controls(HashMap* a, HashMap* b);
+static int _apply_class_change(HashMap* classes, ClassChange* change,
+    Vector* replaced);
+static bool _in_class_changes(const char* filepath, Vector* changes);
+static char** _build_enforcement_argv(uid_t uid, HashMap* controls);
+static void _free_enforcement_argv(char** argv);
+static void _record_groups(Context* context, uid_t uid);
+static int _queue_enforcement(Vector* jobs, uid_t uid, ClassProperties* props);
+static int _spawn_enforcement(EnforcePass* pass, EnforceJob* job);
+static int _reap_enforcement(EnforcePass* pass, EnforceSlot* slot);
+static void _record_enforcement(EnforcePass* pass, uid_t uid,
+    const char* classpath, uint64_t start_usec, bool succeeded);
+static int _finish_enforcement_pass(EnforcePass* pass);
 
 int init_context(Context* context)
 {
-    context->classdir = strdup("/etc/userctl");
-    context->classext = strdup(".class");
+    return _init_context(context, false);
+}
+
+/*
+ * Initializes the context like init_context. If strict is true, the classes
+ * fail to load altogether if any class's members couldn't be resolved, rather
+ * than leaving that class out.
+ */
+static int
+_init_context(Context* context, bool strict)
+{
+    context->classdir = strdup(DEFAULT_CLASSDIR);
+    context->classext = strdup(DEFAULT_CLASSEXT);
     if (!context->classdir || !context->classext)
         return -1;
     // FIXME: What if no /etc/userctl?
-    return _load_class_properties(context->classdir, context->classext,
-        &context->classes);
+    if (_load_class_properties(context->classdir, context->classext,
+            &context->classes, strict)
+        < 0) {
+        int saved = errno;
+        free(context->classdir);
+        free(context->classext);
+        context->classdir = NULL;
+        context->classext = NULL;
+        errno = saved;
+        return -1;
+    }
+    _update_memory_stats(context);
+    return 0;
+}
+
+int init_context_from_snapshot(Context* context)
+{
+    assert(context);
+
+    if (!context->snapshot_path) {
+        errno = ENOENT;
+        return -1;
+    }
+    context->classdir = strdup(DEFAULT_CLASSDIR);
+    context->classext = strdup(DEFAULT_CLASSEXT);
+    if (!context->classdir || !context->classext
+        || read_snapshot(context->snapshot_path, context->classdir,
+               context->classext, &context->classes)
+            < 0) {
+        int saved = errno;
+        free(context->classdir);
+        free(context->classext);
+        context->classdir = NULL;
+        context->classext = NULL;
+        errno = saved;
+        return -1;
+    }
+    log_message(LOG_NOTICE, "Loaded %zu classes from snapshot %s",
+        get_hashmap_count(&context->classes), context->snapshot_path);
+    _update_memory_stats(context);
+    return 0;
+}
+
+int save_snapshot(Context* context)
+{
+    assert(context);
+
+    if (!context->snapshot_path)
+        return 0;
+
+    pthread_rwlock_rdlock(&context_lock);
+    int r = write_snapshot(context->snapshot_path, context->classdir,
+        context->classext, &context->classes);
+    int saved = errno;
+    pthread_rwlock_unlock(&context_lock);
+
+    if (r < 0 && (saved == EBUSY || saved == ESTALE)) {
+        // Taken again once the classes settle down
+        log_message(LOG_DEBUG, "Not snapshotting classes: %s", strerror(saved));
+    } else if (r < 0) {
+        log_message(LOG_ERR, "Failed to snapshot classes to %s: %s",
+            context->snapshot_path, strerror(saved));
+    } else {
+        log_message(LOG_DEBUG, "Snapshotted classes to %s",
+            context->snapshot_path);
+    }
+    errno = saved;
+    return r;
 }
 
 void destroy_context(Context* context)
@@ -51,50 +290,226 @@ void destroy_context(Context* context)
 }
 
 /*
- * Loads and initializes the classes based on the found class files. Only
- * valid class files are returned. If there is a issue with getting the class
- * files, a -1 is returned (and errno should be looked up), otherwise zero is
- * returned.
+ * Loads and initializes the classes based on the found class files. The files
+ * are parsed in parallel and then added in order. Only valid class files are
+ * returned. A class with members that couldn't be resolved is left out, or if
+ * strict is true, fails the whole load. If there is a issue with getting the
+ * class files, resolving their members or flattening them, a -1 is returned
+ * (and errno should be looked up) and no classes are passed back, otherwise
+ * zero is returned.
  */
 static int
-_load_class_properties(char* dir, char* ext, HashMap* classes)
+_load_class_properties(char* dir, char* ext, HashMap* classes, bool strict)
 {
     assert(dir && ext && classes);
     struct dirent** class_files = NULL;
     int num_files = 0;
 
-    // FIXME: Limit classes in list_class_files, rather than here
     if (list_class_files(dir, ext, &class_files, &num_files) < 0)
         return -1;
 
     assert(class_files);
     assert(*class_files); // FIXME: What if no class files!
 
-    int r = create_hashmap(classes, sizeof(ClassProperties), MAX_CLASSES);
+    size_t nfiles = num_files;
+    int r = create_hashmap(classes, sizeof(ClassProperties), nfiles);
     if (r < 0)
-        return -1;
+        goto cleanup;
 
-    for (int i = 0; i < num_files; i++) {
-        if (i >= MAX_CLASSES) {
-            syslog(LOG_WARNING, "Skipping class %s because the max class "
-                                "count has been hit (%d)",
-                class_files[i]->d_name, MAX_CLASSES);
-            free(class_files[i]);
+    // Every class loaded together lives and dies in the same arena
+    ClassProperties* results = calloc(nfiles + 1, sizeof *results);
+    int* errors = calloc(nfiles + 1, sizeof *errors);
+    Arena* arena = create_arena();
+    if (!results || !errors || !arena) {
+        free(results);
+        free(errors);
+        unref_arena(arena);
+        destroy_hashmap(classes);
+        r = -1;
+        goto cleanup;
+    }
+
+    _parse_classes(dir, class_files, nfiles, results, errors, arena);
+
+    // Move the classes that parsed to the front, keeping the order of the
+    // files, so their members can all be resolved together
+    size_t nparsed = 0;
+    for (size_t n = 0; n < nfiles; n++) {
+        if (errors[n] != 0) {
+            log_message(LOG_DEBUG, "Failed to create class from %s: %s",
+                class_files[n]->d_name, strerror(errors[n]));
             continue;
         }
+        struct dirent* class_file = class_files[n];
+        class_files[n] = class_files[nparsed];
+        class_files[nparsed] = class_file;
+        results[nparsed++] = results[n];
+    }
+    // Loading a class without its members would unenforce them, so a class
+    // whose members couldn't all be resolved is left out, or when strict,
+    // fails the load so that whatever was loaded before is kept
+    r = resolve_class_members(results, nparsed, errors);
+    for (size_t n = 0; r == 0 && strict && n < nparsed; n++) {
+        if (errors[n] != 0) {
+            errno = errors[n];
+            r = -1;
+        }
+    }
+    int saved = 0;
+    if (r < 0) {
+        saved = errno;
+        log_message(LOG_ERR, "Failed to resolve class members: %s",
+            strerror(saved));
+        goto error;
+    }
 
-        ClassProperties props;
-        if (create_class(dir, class_files[i]->d_name, &props) < 0) {
-            syslog(LOG_DEBUG, "Failed to create class from %s: %s",
-                class_files[i]->d_name, strerror(errno));
-        } else {
-            char* classname = basename(class_files[i]->d_name);
-            add_hashmap_entry(classes, classname, &props);
+    // Classes that inherit from one that failed to parse or resolve fail
+    // too. If flattening fails, loading them without their inherited controls
+    // would be wrong, so none are loaded
+    char** classnames = calloc(nparsed + 1, sizeof *classnames);
+    for (size_t n = 0; classnames && n < nparsed; n++)
+        classnames[n] = basename(class_files[n]->d_name);
+    if (!classnames || flatten_classes(results, classnames, nparsed, NULL, errors) < 0) {
+        saved = errno;
+        free(classnames);
+        log_message(LOG_ERR, "Failed to flatten classes: %s", strerror(saved));
+        goto error;
+    }
+    free(classnames);
+
+    for (size_t n = 0; n < nparsed; n++) {
+        char* classname = basename(class_files[n]->d_name);
+        if (errors[n] != 0) {
+            log_message(LOG_DEBUG, "Not loading class %s: %s", classname,
+                strerror(errors[n]));
+            destroy_class(&results[n]);
+            continue;
         }
-        free(class_files[i]);
+        add_hashmap_entry(classes, classname, &results[n]);
     }
+    free(results);
+    free(errors);
+    unref_arena(arena);
+    goto cleanup;
+
+error:
+    for (size_t n = 0; n < nparsed; n++)
+        destroy_class(&results[n]);
+    free(results);
+    free(errors);
+    unref_arena(arena);
+    destroy_hashmap(classes);
+    errno = saved;
+    r = -1;
+
+cleanup:
+    for (int i = 0; i < num_files; i++)
+        free(class_files[i]);
     free(class_files);
-    return 0;
+    return r;
+}
+
+/*
+ * Records how much memory the classes take up across their arenas and how
+ * much the daemon has resident. The context must not be changing under us.
+ */
+static void
+_update_memory_stats(Context* context)
+{
+    // Classes loaded together share an arena, so there are only a few, plus
+    // one for the controls of each class with transient ones
+    Vector arenas;
+    if (create_vector(&arenas, sizeof(Arena*)) < 0)
+        return;
+
+    uint64_t arena_bytes = 0;
+    size_t nclasses = get_hashmap_count(&context->classes);
+    for (size_t n = 0; n < nclasses * 2; n++) {
+        ClassProperties* props = NULL;
+        get_hashmap_entry_at(&context->classes, n / 2, NULL, (void**)&props);
+        Arena* arena = n % 2 ? props->controls.arena : props->arena;
+        if (!arena)
+            continue;
+
+        bool seen = false;
+        size_t narenas = get_vector_count(&arenas);
+        for (size_t a = 0; !seen && a < narenas; a++)
+            seen = *(Arena**)get_vector_item(&arenas, a) == arena;
+        if (seen || append_vector_item(&arenas, &arena) < 0)
+            continue;
+
+        size_t reserved = 0;
+        get_arena_size(arena, NULL, &reserved);
+        arena_bytes += reserved;
+    }
+
+    uint64_t resident_bytes = 0;
+    if (get_resident_bytes(&resident_bytes) < 0)
+        log_message(LOG_DEBUG, "Failed to read resident memory: %s",
+            strerror(errno));
+
+    context->stats.arena_bytes = arena_bytes;
+    context->stats.resident_bytes = resident_bytes;
+    log_message(LOG_INFO, "%zu classes take %lu KiB in %zu arenas; %lu KiB "
+                          "resident",
+        nclasses, (unsigned long)(arena_bytes / 1024),
+        get_vector_count(&arenas), (unsigned long)(resident_bytes / 1024));
+    destroy_vector(&arenas);
+}
+
+/*
+ * Parses class files until there are none left to take.
+ */
+static void*
+_parse_class_files(void* vargp)
+{
+    ParseJobs* jobs = vargp;
+    size_t n = 0;
+    while ((n = atomic_fetch_add(&jobs->next, 1)) < jobs->nfiles) {
+        errno = 0;
+        if (create_unresolved_class(jobs->dir, jobs->class_files[n]->d_name,
+                &jobs->results[n], jobs->arena)
+            < 0)
+            jobs->errors[n] = errno ? errno : EINVAL;
+    }
+    return NULL;
+}
+
+/*
+ * Parses each class file into results, with the errno of the files that
+ * failed to parse in errors. The files are spread across a thread per core.
+ */
+static void
+_parse_classes(const char* dir, struct dirent** class_files, size_t nfiles,
+    ClassProperties* results, int* errors, Arena* arena)
+{
+    ParseJobs jobs = {
+        .dir = dir,
+        .class_files = class_files,
+        .nfiles = nfiles,
+        .results = results,
+        .errors = errors,
+        .arena = arena,
+    };
+    atomic_init(&jobs.next, 0);
+
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = ncpus > 1 ? (size_t)ncpus : 1;
+    if (nthreads > MAX_PARSE_THREADS)
+        nthreads = MAX_PARSE_THREADS;
+    if (nthreads > nfiles)
+        nthreads = nfiles;
+
+    // This thread parses too
+    pthread_t tids[MAX_PARSE_THREADS];
+    size_t nspawned = 0;
+    for (; nspawned + 1 < nthreads; nspawned++)
+        if (pthread_create(&tids[nspawned], NULL, _parse_class_files, &jobs) != 0)
+            break;
+
+    _parse_class_files(&jobs);
+    for (size_t t = 0; t < nspawned; t++)
+        pthread_join(tids[t], NULL);
 }
 
 int method_list_classes(sd_bus_message* m, void* userdata, sd_bus_error* ret_error)
@@ -108,13 +523,17 @@ int method_list_classes(sd_bus_message* m, void* userdata, sd_bus_error* ret_err
 
     pthread_rwlock_rdlock(&context_lock);
 
-    const char* classnames[MAX_CLASSES] = { 0 };
-    int i = 0;
+    size_t nclasses = get_hashmap_count(&context->classes);
+    const char** classnames = calloc(nclasses + 1, sizeof *classnames);
+    if (!classnames) {
+        r = -errno;
+        goto cleanup;
+    }
     ClassProperties* props;
-    while ((props = iter_hashmap_values(&context->classes)))
-        classnames[i++] = props->filepath;
-
-    iter_hashmap_end(&context->classes);
+    for (size_t n = 0; n < nclasses; n++) {
+        get_hashmap_entry_at(&context->classes, n, NULL, (void**)&props);
+        classnames[n] = props->filepath;
+    }
 
     // systemd docs says the string array is a const char array but doesn't
     // make the function signature reflect that...
@@ -126,6 +545,69 @@ int method_list_classes(sd_bus_message* m, void* userdata, sd_bus_error* ret_err
 
 cleanup:
     pthread_rwlock_unlock(&context_lock);
+    free(classnames);
+    sd_bus_error_set_errno(ret_error, r);
+    sd_bus_message_unrefp(&reply);
+    return r;
+}
+
+int method_export_configuration(sd_bus_message* m, void* userdata,
+    sd_bus_error* ret_error)
+{
+    Context* context = userdata;
+    sd_bus_message* reply = NULL;
+    char* data = NULL;
+    size_t size = 0;
+    int fd = -1;
+
+    int r = sd_bus_message_new_method_return(m, &reply);
+    if (r < 0)
+        return r;
+
+    pthread_rwlock_rdlock(&context_lock);
+    r = build_export(context->classdir, context->classext, &context->classes,
+        context->generation, &data, &size);
+    pthread_rwlock_unlock(&context_lock);
+    if (r < 0) {
+        r = -errno;
+        goto cleanup;
+    }
+
+    // Sealed, so the caller can map it without us changing it underneath
+    fd = memfd_create("userctl-export", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        r = -errno;
+        goto cleanup;
+    }
+    size_t written = 0;
+    while (written < size) {
+        ssize_t len = write(fd, data + written, size - written);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0) {
+            r = -errno;
+            goto cleanup;
+        }
+        written += len;
+    }
+    if (fcntl(fd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+            < 0
+        || lseek(fd, 0, SEEK_SET) < 0) {
+        r = -errno;
+        goto cleanup;
+    }
+
+    // The fd is duplicated into the message, so ours is still ours to close
+    r = sd_bus_message_append_basic(reply, 'h', &fd);
+    if (r < 0)
+        goto cleanup;
+    r = sd_bus_send(NULL, reply, NULL);
+
+cleanup:
+    if (fd >= 0)
+        close(fd);
+    free(data);
     sd_bus_error_set_errno(ret_error, r);
     sd_bus_message_unrefp(&reply);
     return r;
@@ -160,15 +642,13 @@ int method_get_class(sd_bus_message* m, void* userdata, sd_bus_error* ret_error)
     if (r < 0)
         goto unlock_cleanup;
 
-    uid_t* users = pretend_vector_is_array(&props->users);
-    size_t users_size = get_vector_count(&props->users) * sizeof *users;
-    r = sd_bus_message_append_array(reply, 'u', users, users_size);
+    r = sd_bus_message_append_array(reply, 'u', props->users.items,
+        get_uid_vector_count(&props->users) * sizeof(uid_t));
     if (r < 0)
         goto unlock_cleanup;
 
-    gid_t* groups = pretend_vector_is_array(&props->groups);
-    size_t groups_size = get_vector_count(&props->groups) * sizeof *groups;
-    r = sd_bus_message_append_array(reply, 'u', groups, groups_size);
+    r = sd_bus_message_append_array(reply, 'u', props->groups.items,
+        get_gid_vector_count(&props->groups) * sizeof(gid_t));
     if (r < 0)
         goto unlock_cleanup;
 
@@ -183,10 +663,13 @@ cleanup:
     return r;
 }
 
-int method_reload_class(sd_bus_message* m, void* userdata, sd_bus_error* ret_error)
+int method_list_class_members(sd_bus_message* m, void* userdata,
+    sd_bus_error* ret_error)
 {
     Context* context = userdata;
     sd_bus_message* reply = NULL;
+    char* classpath = NULL;
+    Vector uids = { 0 };
 
     int r = sd_bus_message_new_method_return(m, &reply);
     if (r < 0)
@@ -197,124 +680,121 @@ int method_reload_class(sd_bus_message* m, void* userdata, sd_bus_error* ret_err
     if (r < 0)
         goto cleanup;
 
-    syslog(LOG_NOTICE, "Reloading class %s", classname);
-
-    pthread_rwlock_wrlock(&context_lock);
-
+    pthread_rwlock_rdlock(&context_lock);
     ClassProperties* props = get_hashmap_entry(&context->classes, classname);
+    if (props)
+        classpath = strdup(props->filepath);
+    pthread_rwlock_unlock(&context_lock);
     if (!props) {
         sd_bus_error_set_const(ret_error, "org.dylangardner.NoSuchClass",
             "No such class found (may need to daemon-reload).");
         r = -EINVAL;
-        goto unlock_cleanup;
+        goto cleanup;
     }
-
-    // Backup onto the stack just in case of failure
-    ClassProperties backup;
-    memcpy(&backup, props, sizeof backup);
-
-    // Now try and modify that class
-    r = create_class(context->classdir, classname, props);
-    if (r < 0) {
-        syslog(LOG_ERR, "Failed to reload class %s: %s", classname,
-            strerror(errno));
+    if (!classpath || create_vector(&uids, sizeof(uid_t)) < 0) {
         r = -errno;
-        memcpy(props, &backup, sizeof backup);
-        sd_bus_error_set_const(ret_error, "org.dylangardner.ClassFailure",
-            "Class could not be loaded.");
-        goto unlock_cleanup;
+        goto cleanup;
     }
 
-    destroy_class(&backup);
-    _enforce_controls_on_class(props->filepath, &context->classes);
-    r = sd_bus_send(NULL, reply, NULL);
+    if (!context->membership
+        || list_class_members(context->membership, classpath, &uids) < 0) {
+        sd_bus_error_set_const(ret_error, "org.dylangardner.MembersUnknown",
+            "The logged in users aren't known yet.");
+        r = -ENODATA;
+        goto cleanup;
+    }
 
-unlock_cleanup:
-    pthread_rwlock_unlock(&context_lock);
+    r = sd_bus_message_append_array(reply, 'u', pretend_vector_is_array(&uids),
+        get_vector_count(&uids) * sizeof(uid_t));
+    if (r < 0)
+        goto cleanup;
+
+    r = sd_bus_send(NULL, reply, NULL);
 
 cleanup:
+    destroy_vector(&uids);
+    free(classpath);
     sd_bus_error_set_errno(ret_error, r);
     sd_bus_message_unrefp(&reply);
     return r;
 }
 
-int method_daemon_reload(sd_bus_message* m, void* userdata, sd_bus_error* ret_error)
+int method_get_classes(sd_bus_message* m, void* userdata, sd_bus_error* ret_error)
 {
     Context* context = userdata;
     sd_bus_message* reply = NULL;
+    char** classnames = NULL;
+    Vector infos = { 0 };
 
     int r = sd_bus_message_new_method_return(m, &reply);
     if (r < 0)
         return r;
 
-    syslog(LOG_NOTICE, "Reloading daemon");
-
-    pthread_rwlock_wrlock(&context_lock);
-
-    Context backup;
-    memcpy(&backup, context, sizeof backup);
-
-    if ((init_context(context)) < 0) {
-        syslog(LOG_ERR, "Failed to reload daemon: %s", strerror(errno));
+    uint64_t flags = 0;
+    r = sd_bus_message_read_strv(m, &classnames);
+    if (r < 0)
+        goto cleanup;
+    r = sd_bus_message_read(m, "t", &flags);
+    if (r < 0)
+        goto cleanup;
+    if (create_vector(&infos, sizeof(ClassInfo)) < 0) {
         r = -errno;
-        memcpy(context, &backup, sizeof backup);
-        sd_bus_error_set_const(ret_error, "org.dylangardner.DaemonFailure",
-            "Daemon could not be loaded.");
-        goto unlock_cleanup;
+        goto cleanup;
     }
 
-    destroy_context(&backup);
-    _enforce_controls_on_class(NULL, &context->classes);
-    r = sd_bus_send(NULL, reply, NULL);
-
-unlock_cleanup:
+    // Only the ids are copied under the lock; names may wait on NSS
+    pthread_rwlock_rdlock(&context_lock);
+    if (!classnames || !classnames[0]) {
+        size_t nclasses = get_hashmap_count(&context->classes);
+        for (size_t n = 0; r >= 0 && n < nclasses; n++) {
+            char* classname = NULL;
+            ClassProperties* props = NULL;
+            get_hashmap_entry_at(&context->classes, n, &classname, (void**)&props);
+            r = _collect_class_info(classname, props, flags, &infos);
+        }
+    } else {
+        // Classes that aren't loaded are left out of the reply
+        for (size_t n = 0; r >= 0 && classnames[n]; n++) {
+            ClassProperties* props = get_hashmap_entry(&context->classes,
+                classnames[n]);
+            if (props)
+                r = _collect_class_info(classnames[n], props, flags, &infos);
+        }
+    }
     pthread_rwlock_unlock(&context_lock);
-    sd_bus_error_set_errno(ret_error, r);
-    sd_bus_message_unrefp(&reply);
-    return r;
-}
-
-int method_evaluate(sd_bus_message* m, void* userdata, sd_bus_error* ret_error)
-{
-    Context* context = userdata;
-    sd_bus_message* reply = NULL;
+    if (r < 0) {
+        r = -errno;
+        goto cleanup;
+    }
 
-    int r = sd_bus_message_new_method_return(m, &reply);
+    r = sd_bus_message_open_container(reply, SD_BUS_TYPE_ARRAY,
+        "(ssbdauauasasa{ss})");
     if (r < 0)
-        return r;
-
-    uid_t uid = 0;
-    r = sd_bus_message_read(m, "u", &uid);
+        goto cleanup;
+    size_t ninfos = get_vector_count(&infos);
+    for (size_t n = 0; r >= 0 && n < ninfos; n++)
+        r = _append_class_info(reply, get_vector_item(&infos, n), flags);
     if (r < 0)
         goto cleanup;
-
-    pthread_rwlock_rdlock(&context_lock);
-    ClassProperties props = { 0 };
-    r = evaluate(uid, &context->classes, &props);
+    r = sd_bus_message_close_container(reply);
     if (r < 0)
-        goto unlock_cleanup;
-    if (r == 0) {
-        sd_bus_error_setf(ret_error, "org.dylangardner.NoClassForUser",
-            "No class found for the user.");
-        r = -EINVAL;
-        goto unlock_cleanup;
-    }
+        goto cleanup;
 
-    r = sd_bus_message_append_basic(reply, 's', props.filepath);
-    if (r < 0)
-        goto unlock_cleanup;
     r = sd_bus_send(NULL, reply, NULL);
 
-unlock_cleanup:
-    pthread_rwlock_unlock(&context_lock);
-
 cleanup:
+    for (size_t n = 0; n < get_vector_count(&infos); n++)
+        _destroy_class_info(get_vector_item(&infos, n));
+    destroy_vector(&infos);
+    for (size_t n = 0; classnames && classnames[n]; n++)
+        free(classnames[n]);
+    free(classnames);
     sd_bus_error_set_errno(ret_error, r);
     sd_bus_message_unrefp(&reply);
     return r;
 }
 
-int method_set_property(sd_bus_message* m, void* userdata, sd_bus_error* ret_error)
+int method_reload_class(sd_bus_message* m, void* userdata, sd_bus_error* ret_error)
 {
     Context* context = userdata;
     sd_bus_message* reply = NULL;
@@ -324,30 +804,104 @@ int method_set_property(sd_bus_message* m, void* userdata, sd_bus_error* ret_err
         return r;
 
     char* classname = NULL;
-    char* key = NULL;
-    char* value = NULL;
-    r = sd_bus_message_read(m, "sss", &classname, &key, &value);
+    r = sd_bus_message_read(m, "s", &classname);
     if (r < 0)
         goto cleanup;
 
-    syslog(LOG_INFO, "Setting transient property for %s: %s=%s", classname, key, value);
+    log_message(LOG_NOTICE, "Reloading class %s", classname);
+
+    pthread_rwlock_rdlock(&context_lock);
+    bool exists = get_hashmap_entry(&context->classes, classname);
+    char* classdir = strdup(context->classdir);
+    pthread_rwlock_unlock(&context_lock);
+    if (!exists) {
+        free(classdir);
+        sd_bus_error_set_const(ret_error, "org.dylangardner.NoSuchClass",
+            "No such class found (may need to daemon-reload).");
+        r = -EINVAL;
+        goto cleanup;
+    }
+
+    // Parsing and resolving may wait on NSS, so it's done before the classes
+    // are locked. A class whose members couldn't all be resolved fails, and
+    // the loaded one is kept
+    ClassProperties loaded;
+    r = classdir ? create_class(classdir, classname, &loaded) : -1;
+    free(classdir);
+    if (r < 0) {
+        log_message(LOG_ERR, "Failed to reload class %s: %s", classname,
+            strerror(errno));
+        r = -errno;
+        sd_bus_error_set_const(ret_error, "org.dylangardner.ClassFailure",
+            "Class could not be loaded.");
+        goto cleanup;
+    }
 
     pthread_rwlock_wrlock(&context_lock);
 
     ClassProperties* props = get_hashmap_entry(&context->classes, classname);
     if (!props) {
+        destroy_class(&loaded);
         sd_bus_error_set_const(ret_error, "org.dylangardner.NoSuchClass",
             "No such class found (may need to daemon-reload).");
         r = -EINVAL;
         goto unlock_cleanup;
     }
 
-    add_hashmap_entry(&props->controls, key, value);
+    // Inherit from the loaded classes
+    int error = 0;
+    if (flatten_classes(&loaded, &classname, 1, &context->classes, &error) < 0
+        || error != 0) {
+        errno = error ? error : errno;
+        log_message(LOG_ERR, "Failed to reload class %s: %s", classname,
+            strerror(errno));
+        r = -errno;
+        destroy_class(&loaded);
+        sd_bus_error_set_const(ret_error, "org.dylangardner.ClassFailure",
+            "Class could not be loaded.");
+        goto unlock_cleanup;
+    }
 
-    syslog(LOG_DEBUG, "Enforcing resource controls on all users in %s",
-        classname);
-    _enforce_controls_on_class(props->filepath, &context->classes);
+    ClassProperties backup;
+    memcpy(&backup, props, sizeof backup);
+    memcpy(props, &loaded, sizeof loaded);
+
+    // The reload pass only goes over the class's members, so if who is in it
+    // changed, find its new members first
+    bool regroup = !_same_members(&backup, props);
+    destroy_class(&backup);
+    context->generation++;
+    _update_memory_stats(context);
+    _notify_class_modified(context, classname);
+    if (regroup)
+        _regroup_users(context);
+    r = queue_reload(context->dispatcher, props->filepath, context->generation);
+    if (r < 0) {
+        r = -errno;
+        goto unlock_cleanup;
+    }
+
+    // The classes inheriting from it have to be flattened again
+    Vector dependents = { 0 };
+    if (create_vector(&dependents, sizeof(char*)) < 0
+        || _list_dependents(context, classname, NULL, &dependents) < 0)
+        log_message(LOG_ERR, "Failed to find the classes inheriting from %s: "
+                             "%s",
+            classname, strerror(errno));
     r = sd_bus_send(NULL, reply, NULL);
+    pthread_rwlock_unlock(&context_lock);
+
+    if (get_vector_count(&dependents) > 0
+        && _reload_classes(context, &dependents, true) < 0)
+        log_message(LOG_ERR, "Failed to reload the classes inheriting from "
+                             "%s: %s",
+            classname, strerror(errno));
+    for (size_t n = 0; n < get_vector_count(&dependents); n++)
+        free(*(char**)get_vector_item(&dependents, n));
+    destroy_vector(&dependents);
+
+    save_snapshot(context);
+    goto cleanup;
 
 unlock_cleanup:
     pthread_rwlock_unlock(&context_lock);
@@ -358,14 +912,241 @@ cleanup:
     return r;
 }
 
-/*
- * Fills the given vector with uids and a vector of to their corresponding
- * class. If there was an error, -1 is returned (and errno should be looked
- * up). Otherwise, 0 is returned.
- */
-static int
-_active_uids_and_class(Vector* uids, Vector* classes, HashMap* all_classes)
+int method_daemon_reload(sd_bus_message* m, void* userdata, sd_bus_error* ret_error)
+{
+    Context* context = userdata;
+    sd_bus_message* reply = NULL;
+
+    int r = sd_bus_message_new_method_return(m, &reply);
+    if (r < 0)
+        return r;
+
+    log_message(LOG_NOTICE, "Reloading daemon");
+
+    // Every class file is parsed and resolved before the classes are locked,
+    // so evaluations go on against the old classes in the meantime. A class
+    // whose members couldn't be resolved fails the reload, since leaving it
+    // out would unenforce its members
+    Context loaded = { 0 };
+    if (_init_context(&loaded, true) < 0) {
+        log_message(LOG_ERR, "Failed to reload daemon: %s", strerror(errno));
+        r = -errno;
+        sd_bus_error_set_const(ret_error, "org.dylangardner.DaemonFailure",
+            "Daemon could not be loaded.");
+        goto cleanup;
+    }
+
+    // Only swapping the new classes in happens under the lock
+    pthread_rwlock_wrlock(&context_lock);
+    Context old = { 0 };
+    old.classes = context->classes;
+    old.classdir = context->classdir;
+    old.classext = context->classext;
+    context->classes = loaded.classes;
+    context->classdir = loaded.classdir;
+    context->classext = loaded.classext;
+    context->stats.arena_bytes = loaded.stats.arena_bytes;
+    context->stats.resident_bytes = loaded.stats.resident_bytes;
+
+    context->generation++;
+    _notify_reloaded_classes(context, &old.classes);
+    r = queue_reload(context->dispatcher, NULL, context->generation);
+    if (r < 0) {
+        r = -errno;
+        pthread_rwlock_unlock(&context_lock);
+        destroy_context(&old);
+        goto cleanup;
+    }
+    r = sd_bus_send(NULL, reply, NULL);
+    pthread_rwlock_unlock(&context_lock);
+
+    // Nothing refers to the old classes once they're swapped out
+    destroy_context(&old);
+    save_snapshot(context);
+
+cleanup:
+    sd_bus_error_set_errno(ret_error, r);
+    sd_bus_message_unrefp(&reply);
+    return r;
+}
+
+int method_evaluate(sd_bus_message* m, void* userdata, sd_bus_error* ret_error)
+{
+    Context* context = userdata;
+    sd_bus_message* reply = NULL;
+
+    int r = sd_bus_message_new_method_return(m, &reply);
+    if (r < 0)
+        return r;
+
+    uid_t uid = 0;
+    r = sd_bus_message_read(m, "u", &uid);
+    if (r < 0)
+        goto cleanup;
+
+    pthread_rwlock_rdlock(&context_lock);
+    ClassProperties props = { 0 };
+    r = evaluate(uid, &context->classes, &props);
+    if (r < 0)
+        goto unlock_cleanup;
+    if (r == 0) {
+        sd_bus_error_setf(ret_error, "org.dylangardner.NoClassForUser",
+            "No class found for the user.");
+        r = -EINVAL;
+        goto unlock_cleanup;
+    }
+
+    r = sd_bus_message_append_basic(reply, 's', props.filepath);
+    if (r < 0)
+        goto unlock_cleanup;
+    r = sd_bus_send(NULL, reply, NULL);
+
+unlock_cleanup:
+    pthread_rwlock_unlock(&context_lock);
+
+cleanup:
+    sd_bus_error_set_errno(ret_error, r);
+    sd_bus_message_unrefp(&reply);
+    return r;
+}
+
+int method_get_user_status(sd_bus_message* m, void* userdata,
+    sd_bus_error* ret_error)
+{
+    Context* context = userdata;
+    sd_bus_message* reply = NULL;
+
+    int r = sd_bus_message_new_method_return(m, &reply);
+    if (r < 0)
+        return r;
+
+    uid_t uid = 0;
+    r = sd_bus_message_read(m, "u", &uid);
+    if (r < 0)
+        goto cleanup;
+
+    EnforceStatus status = { 0 };
+    if (!context->membership
+        || get_enforcement(context->membership, uid, &status) < 0) {
+        sd_bus_error_set_const(ret_error, "org.dylangardner.NotEnforced",
+            "No class has been enforced on the user since they logged in.");
+        r = -ENOENT;
+        goto cleanup;
+    }
+
+    r = sd_bus_message_append(reply, "stttb", status.classpath,
+        status.generation, status.timestamp_usec, status.duration_usec,
+        (int)status.succeeded);
+    if (r < 0)
+        goto cleanup;
+    r = sd_bus_send(NULL, reply, NULL);
+
+cleanup:
+    sd_bus_error_set_errno(ret_error, r);
+    sd_bus_message_unrefp(&reply);
+    return r;
+}
+
+int method_set_property(sd_bus_message* m, void* userdata, sd_bus_error* ret_error)
+{
+    Context* context = userdata;
+    sd_bus_message* reply = NULL;
+
+    int r = sd_bus_message_new_method_return(m, &reply);
+    if (r < 0)
+        return r;
+
+    char* classname = NULL;
+    char* key = NULL;
+    char* value = NULL;
+    r = sd_bus_message_read(m, "sss", &classname, &key, &value);
+    if (r < 0)
+        goto cleanup;
+
+    log_message(LOG_INFO, "Setting transient property for %s: %s=%s", classname, key, value);
+
+    r = _set_class_controls(context, classname, &key, &value, 1, ret_error);
+    if (r < 0)
+        goto cleanup;
+    r = sd_bus_send(NULL, reply, NULL);
+
+cleanup:
+    sd_bus_error_set_errno(ret_error, r);
+    sd_bus_message_unrefp(&reply);
+    return r;
+}
+
+int method_set_properties(sd_bus_message* m, void* userdata,
+    sd_bus_error* ret_error)
+{
+    Context* context = userdata;
+    sd_bus_message* reply = NULL;
+    Vector keys = { 0 };
+    Vector values = { 0 };
+
+    int r = sd_bus_message_new_method_return(m, &reply);
+    if (r < 0)
+        return r;
+
+    char* classname = NULL;
+    r = sd_bus_message_read(m, "s", &classname);
+    if (r < 0)
+        goto cleanup;
+
+    if (create_vector(&keys, sizeof(char*)) < 0
+        || create_vector(&values, sizeof(char*)) < 0) {
+        r = -errno;
+        goto cleanup;
+    }
+
+    // The strings belong to the message, which outlives setting them
+    r = sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, "(ss)");
+    if (r < 0)
+        goto cleanup;
+    char* key = NULL;
+    char* value = NULL;
+    while ((r = sd_bus_message_read(m, "(ss)", &key, &value)) > 0) {
+        if (append_vector_item(&keys, &key) < 0
+            || append_vector_item(&values, &value) < 0) {
+            r = -errno;
+            goto cleanup;
+        }
+    }
+    if (r < 0)
+        goto cleanup;
+    r = sd_bus_message_exit_container(m);
+    if (r < 0)
+        goto cleanup;
+
+    size_t ncontrols = get_vector_count(&keys);
+    if (ncontrols == 0) {
+        sd_bus_error_set_const(ret_error, SD_BUS_ERROR_INVALID_ARGS,
+            "No resource controls given.");
+        r = -EINVAL;
+        goto cleanup;
+    }
+
+    log_message(LOG_INFO, "Setting %zu transient properties for %s",
+        ncontrols, classname);
+
+    r = _set_class_controls(context, classname, pretend_vector_is_array(&keys),
+        pretend_vector_is_array(&values), ncontrols, ret_error);
+    if (r < 0)
+        goto cleanup;
+    r = sd_bus_send(NULL, reply, NULL);
+
+cleanup:
+    destroy_vector(&keys);
+    destroy_vector(&values);
+    sd_bus_error_set_errno(ret_error, r);
+    sd_bus_message_unrefp(&reply);
+    return r;
+}
+
+int list_active_uids(Vector* uids)
 {
+    assert(uids);
+
     sd_bus_error error = SD_BUS_ERROR_NULL;
     sd_bus_message* msg = NULL;
     sd_bus* bus = NULL;
@@ -373,7 +1154,7 @@ _active_uids_and_class(Vector* uids, Vector* classes, HashMap* all_classes)
     /* Connect to the system bus */
     int r = sd_bus_open_system(&bus);
     if (r < 0) {
-        syslog(LOG_ERR, "Failed to connect to system bus to get active uids: "
+        log_message(LOG_ERR, "Failed to connect to system bus to get active uids: "
                         "%s",
             strerror(-r));
         goto cleanup;
@@ -383,42 +1164,43 @@ _active_uids_and_class(Vector* uids, Vector* classes, HashMap* all_classes)
         bus, "org.freedesktop.login1", "/org/freedesktop/login1",
         "org.freedesktop.login1.Manager", "ListUsers", &error, &msg, NULL);
     if (r < 0) {
-        syslog(LOG_ERR, "Failed to get active uids from logind: %s", error.message);
+        log_message(LOG_ERR, "Failed to get active uids from logind: %s", error.message);
         goto cleanup;
     }
 
     r = sd_bus_message_enter_container(msg, SD_BUS_TYPE_ARRAY, "(uso)");
     if (r < 0) {
-        syslog(LOG_DEBUG, "Failed to parse active uids: %s", strerror(-r));
+        log_message(LOG_DEBUG, "Failed to parse active uids: %s", strerror(-r));
         goto cleanup;
     }
 
     uid_t uid = 0;
-    ClassProperties props = { 0 };
     while ((r = sd_bus_message_read(msg, "(uso)", &uid, NULL, NULL)) > 0) {
-        if (evaluate(uid, all_classes, &props) < 1) {
-            syslog(LOG_DEBUG, "Could not evaluate uid %u: %s", uid, strerror(-r));
-            continue;
+        if (append_vector_item(uids, &uid) < 0) {
+            r = -errno;
+            goto cleanup;
         }
-
-        append_vector_item(uids, &uid);
-        append_vector_item(classes, &props);
     }
     if (r < 0) {
-        syslog(LOG_DEBUG, "Failed to parse active uids: %s", strerror(-r));
+        log_message(LOG_DEBUG, "Failed to parse active uids: %s", strerror(-r));
         goto cleanup;
     }
 
     r = sd_bus_message_exit_container(msg);
     if (r < 0) {
-        syslog(LOG_DEBUG, "Failed to parse active uids: %s", strerror(-r));
+        log_message(LOG_DEBUG, "Failed to parse active uids: %s", strerror(-r));
         goto cleanup;
     }
 
 cleanup:
+    sd_bus_message_unrefp(&msg);
     sd_bus_error_free(&error);
     sd_bus_unref(bus);
-    return r;
+    if (r < 0) {
+        errno = -r;
+        return -1;
+    }
+    return 0;
 }
 
 int match_user_new(sd_bus_message* m, void* userdata, sd_bus_error* ret_error)
@@ -430,141 +1212,1586 @@ int match_user_new(sd_bus_message* m, void* userdata, sd_bus_error* ret_error)
     if (r < 0)
         return r;
 
-    syslog(LOG_INFO, "Setting resource controls on uid %u", uid);
+    log_message(LOG_INFO, "Queueing resource controls on uid %u", uid);
 
-    pthread_rwlock_rdlock(&context_lock);
-    ClassProperties props = { 0 };
-    r = evaluate(uid, &context->classes, &props);
-    if (r < 0)
-        goto cleanup;
+    // They join their class once they're evaluated
+    if (context->membership && track_user(context->membership, uid) < 0)
+        log_message(LOG_ERR, "Failed to track uid %u: %s", uid, strerror(errno));
 
-    // User has no class; ignore
-    if (r == 0) {
-        syslog(LOG_INFO, "uid %u belongs to no class. Ignoring.", uid);
-        r = 0;
-        goto cleanup;
+    // The dispatcher evaluates and enforces in batches, so that login storms
+    // don't serialize behind one another here
+    r = queue_user(context->dispatcher, uid);
+    if (r < 0) {
+        r = -errno;
+        log_message(LOG_ERR, "Failed to queue uid %u: %s", uid, strerror(errno));
     }
-    r = _enforce_controls(uid, &props.controls);
-
-cleanup:
-    pthread_rwlock_unlock(&context_lock);
     sd_bus_error_set_errno(ret_error, r);
     return r;
 }
 
-/*
- * Enforces the given resource controls on the active users of the given
- * class. If the given class is NULL, every user's evaluated resource controls
- * are enforced. If there was an error, -1 is returned (and errno should be
- * looked up). Otherwise, 0 is returned.
- */
-static int
-_enforce_controls_on_class(const char* filepath, HashMap* classes)
+int match_user_removed(sd_bus_message* m, void* userdata,
+    sd_bus_error* ret_error)
 {
-    ClassProperties* evaluated_props = NULL;
+    (void)ret_error;
+    Context* context = userdata;
 
-    Vector active_uids = { 0 };
-    Vector corresponding_classes = { 0 };
-    create_vector(&active_uids, sizeof(uid_t));
-    create_vector(&corresponding_classes, sizeof(ClassProperties));
-    int r = _active_uids_and_class(&active_uids, &corresponding_classes, classes);
+    uid_t uid = 0;
+    int r = sd_bus_message_read(m, "uo", &uid, NULL);
     if (r < 0)
-        return -1;
-
-    size_t nuids = get_vector_count(&active_uids);
-    for (size_t n = 0; n < nuids; n++) {
-        uid_t uid = *((uid_t*)get_vector_item(&active_uids, n));
-        evaluated_props = get_vector_item(&corresponding_classes, n);
-        if (filepath && strcmp(filepath, evaluated_props->filepath) != 0)
-            continue;
+        return r;
 
-        _enforce_controls(uid, &evaluated_props->controls);
-    }
-    destroy_vector(&active_uids);
-    destroy_vector(&corresponding_classes);
+    log_message(LOG_DEBUG, "uid %u logged out", uid);
+    const char* classpath = context->membership
+        ? forget_user(context->membership, uid)
+        : NULL;
+    if (classpath && context->notifier
+        && notify_user_class_changed(context->notifier, uid, classpath, NULL) < 0)
+        log_message(LOG_ERR, "Failed to notify that uid %u left %s: %s", uid,
+            classpath, strerror(errno));
     return 0;
 }
 
-/*
- * Enforces the given resource controls on a specific user. If there was an
- * error, -1 is returned (and errno should be looked up). Otherwise, 0 is
- * returned.
- */
-static int
-_enforce_controls(uid_t uid, HashMap* controls)
+int list_active_users(Context* context, Vector* uids)
 {
-    int r = 0;
-    syslog(LOG_DEBUG, "Enforcing resource controls on uid %u", uid);
+    assert(context && uids);
 
-    size_t ncontrols = get_hashmap_count(controls);
-    if (ncontrols < 1)
+    if (context->membership && list_tracked_users(context->membership, uids) == 0)
         return 0;
+    clear_vector(uids);
+    return list_active_uids(uids);
+}
 
-    size_t argc_prefix = 3; // systemctl + set-property + unit_name
-    size_t argc = argc_prefix + ncontrols; // + controls ...
-    char** argv = malloc(sizeof *argv * (argc + 1)); // + NULL
-    if (!argv)
+int enforce_users(Context* context, const uid_t* uids, size_t nuids,
+    Vector* classpaths, uint64_t generation)
+{
+    assert(context && uids);
+
+    EnforcePass pass = { 0 };
+    Vector jobs = { 0 };
+    ClassProperties* results = calloc(nuids, sizeof *results);
+    int* matches = calloc(nuids, sizeof *matches);
+    if (!results || !matches || create_vector(&jobs, sizeof(EnforceJob)) < 0) {
+        free(results);
+        free(matches);
         return -1;
+    }
 
-    argv[0] = "systemctl";
-    argv[1] = "set-property";
-    char unit_name[24]; // 32 bit uid can only be at most 11 chars long
-    snprintf(unit_name, 24, "user-%u.slice", uid);
-    argv[2] = unit_name;
+    pthread_rwlock_rdlock(&context_lock);
+    if (generation && generation != context->generation) {
+        // The configuration moved on; whoever changed it has queued new work
+        pthread_rwlock_unlock(&context_lock);
+        free(results);
+        free(matches);
+        destroy_vector(&jobs);
+        errno = ECANCELED;
+        return -1;
+    }
+    pass.context = context;
+    pass.generation = context->generation;
 
-    char* key = NULL;
-    char* value = NULL;
-    size_t n = 0;
-    for (; n < ncontrols; n++) {
-        iter_hashmap(controls, &key, (void**)&value);
-        int arglen = strlen(key) + strlen(value) + 2;
-        char* arg = malloc(sizeof *arg * arglen);
-        if (!arg) {
-            r = -1;
-            iter_hashmap_end(controls);
-            goto cleanup;
+    _evaluate_users(&context->classes, uids, nuids, results, matches);
+    for (size_t n = 0; n < nuids; n++) {
+        if (matches[n] < 0) {
+            log_user_event(LOG_ERR, uids[n], NULL, 0,
+                "Could not evaluate uid %u: %s", uids[n], strerror(-matches[n]));
+            pass.failures++;
+            continue;
         }
 
-        snprintf(arg, arglen, "%s=%s", key, value);
-        argv[argc_prefix + n] = arg;
-    }
-    iter_hashmap_end(controls);
-    argv[argc] = NULL;
+        const char* classpath = matches[n] > 0 ? results[n].filepath : NULL;
+        if (_move_user(context, uids[n], classpath) < 0)
+            log_message(LOG_ERR, "Failed to track the class of uid %u: %s",
+                uids[n], strerror(errno));
+        _record_groups(context, uids[n]);
 
-    pid_t pid = fork();
-    if (pid == -1) {
-        syslog(LOG_ERR, "Failed to fork and set property");
-        r = -1;
-        goto exec_cleanup;
+        // User has no class; ignore
+        if (matches[n] == 0) {
+            log_user_event(LOG_INFO, uids[n], NULL, 0,
+                "uid %u belongs to no class. Ignoring.", uids[n]);
+            continue;
+        }
+        if (classpaths && !_in_classpaths(results[n].filepath, classpaths))
+            continue;
+
+        if (_queue_enforcement(&jobs, uids[n], &results[n]) < 0) {
+            _record_enforcement(&pass, uids[n], results[n].filepath,
+                monotonic_usec(), false);
+            pass.failures++;
+        }
     }
-    if (pid == 0) {
-        // FIXME: Print out the entire command
-        const char* systemctl = "/bin/systemctl";
-        syslog(LOG_DEBUG, "Exec: %s %s %s %s %s ...", systemctl, argv[0], argv[1], argv[2], argv[3]);
-        if (execv(systemctl, argv) == -1)
-            syslog(LOG_ERR, "Failed to exec and set property");
+    pthread_rwlock_unlock(&context_lock);
+    free(results);
+    free(matches);
+
+    // The argvs are already built, so the processes are spawned and waited on
+    // without holding up reloads
+    size_t njobs = get_vector_count(&jobs);
+    for (size_t n = 0; n < njobs; n++) {
+        EnforceJob* job = get_vector_item(&jobs, n);
+        if (_spawn_enforcement(&pass, job) < 0) {
+            _record_enforcement(&pass, job->uid, job->classpath,
+                monotonic_usec(), false);
+            pass.failures++;
+        }
     }
+    int failures = _finish_enforcement_pass(&pass);
+    for (size_t n = 0; n < njobs; n++) {
+        EnforceJob* job = get_vector_item(&jobs, n);
+        free(job->classpath);
+        _free_enforcement_argv(job->argv);
+    }
+    destroy_vector(&jobs);
+    return failures;
+}
 
-    int status = 0;
-    waitpid(pid, &status, 0);
-    if (WIFEXITED(status)) {
-        if (WEXITSTATUS(status) == 0)
-            goto exec_cleanup;
-
-        syslog(LOG_ERR, "systemctl exited with non-zero status code: %d",
-            WEXITSTATUS(status));
-    } else if (WIFSIGNALED(status)) {
-        if (WTERMSIG(status) == 0)
-            goto exec_cleanup;
+int reconcile_active_users(Context* context)
+{
+    assert(context);
+
+    uint64_t start = monotonic_usec();
+    Vector uids = { 0 };
+    if (create_vector(&uids, sizeof(uid_t)) < 0)
+        return -1;
+    if (list_active_uids(&uids) < 0) {
+        destroy_vector(&uids);
+        return -1;
+    }
+
+    // From here on, logins and logouts keep track of who is active
+    size_t nuids = get_vector_count(&uids);
+    if (context->membership
+        && track_active_users(context->membership,
+               pretend_vector_is_array(&uids), nuids)
+            < 0)
+        log_message(LOG_ERR, "Failed to track logged in users: %s",
+            strerror(errno));
+    int failures = enforce_users(context, pretend_vector_is_array(&uids), nuids,
+        NULL, 0);
+    destroy_vector(&uids);
+    if (failures < 0)
+        return -1;
+
+    context->stats.reconcile_usec = monotonic_usec() - start;
+    context->stats.reconciled_users = nuids;
+    log_message(LOG_NOTICE, "Reconciled %zu logged in users in %lu ms (%d failed)",
+        nuids, (unsigned long)(context->stats.reconcile_usec / 1000), failures);
+    return 0;
+}
+
+int reload_changed_classes(Context* context, Vector* filenames)
+{
+    assert(context);
+
+    int r = _reload_classes(context, filenames, false);
+    if (r > 0)
+        save_snapshot(context);
+    return r < 0 ? -1 : 0;
+}
+
+int revalidate_classes(Context* context)
+{
+    assert(context);
+
+    uint64_t start = monotonic_usec();
+    int r = _reload_classes(context, NULL, true);
+    if (r < 0)
+        return -1;
+
+    log_message(LOG_NOTICE, "Revalidated classes in %lu ms (%d changed)",
+        (unsigned long)((monotonic_usec() - start) / 1000), r);
+    save_snapshot(context);
+    return 0;
+}
+
+/*
+ * Reloads the given class filenames, or every class file if filenames is NULL,
+ * as described by reload_changed_classes. If force is true, class files are
+ * reparsed even if their contents haven't changed, but only replace the loaded
+ * class if they came out different. If there was an error, -1 is returned (and
+ * errno should be looked up). Otherwise, the number of classes changed is
+ * returned.
+ */
+static int
+_reload_classes(Context* context, Vector* filenames, bool force)
+{
+    int ret = -1;
+    bool applied = false;
+    char* classdir = NULL;
+    Arena* arena = NULL;
+    ClassProperties* before = NULL;
+    ClassProperties* after = NULL;
+    int* before_matches = NULL;
+    int* after_matches = NULL;
+    Vector classnames = { 0 };
+    Vector changes = { 0 };
+    Vector replaced = { 0 };
+    Vector uids = { 0 };
+    Vector changed_uids = { 0 };
+    // The classnames (char*'s of the changes) by how they changed
+    Vector added = { 0 };
+    Vector removed = { 0 };
+    Vector modified = { 0 };
+    if (create_vector(&classnames, sizeof(char*)) < 0
+        || create_vector(&changes, sizeof(ClassChange)) < 0
+        || create_vector(&replaced, sizeof(ClassProperties)) < 0
+        || create_vector(&uids, sizeof(uid_t)) < 0
+        || create_vector(&changed_uids, sizeof(uid_t)) < 0
+        || create_vector(&added, sizeof(char*)) < 0
+        || create_vector(&removed, sizeof(char*)) < 0
+        || create_vector(&modified, sizeof(char*)) < 0)
+        goto cleanup;
+
+    if (filenames) {
+        size_t nfiles = get_vector_count(filenames);
+        for (size_t n = 0; n < nfiles; n++) {
+            char* classname = strdup(*(char**)get_vector_item(filenames, n));
+            if (!classname || append_vector_item(&classnames, &classname) < 0) {
+                free(classname);
+                goto cleanup;
+            }
+        }
+    } else if (_list_all_classnames(context, &classnames) < 0) {
+        goto cleanup;
+    }
+
+    pthread_rwlock_rdlock(&context_lock);
+    classdir = strdup(context->classdir);
+    pthread_rwlock_unlock(&context_lock);
+    if (!classdir)
+        goto cleanup;
+
+    // The classes that change together share an arena
+    arena = create_arena();
+    if (!arena)
+        goto cleanup;
+
+    // Parsing may wait on NSS, so do it before taking the write lock
+    size_t nclassnames = get_vector_count(&classnames);
+    for (size_t n = 0; n < nclassnames; n++) {
+        char* classname = *(char**)get_vector_item(&classnames, n);
+        if (_parse_class_change(context, classdir, classname, &changes, force,
+                arena)
+            < 0)
+            goto cleanup;
+    }
+
+    if (_parse_dependent_changes(context, classdir, &classnames, &changes,
+            arena)
+        < 0)
+        goto cleanup;
+
+    if (_resolve_class_changes(&changes) < 0
+        || _flatten_class_changes(context, &changes) < 0)
+        goto cleanup;
+    // Dependents are reparsed whether or not they come out different
+    if (_drop_unchanged_classes(context, &changes) < 0)
+        goto cleanup;
+    size_t nchanges = get_vector_count(&changes);
+    if (nchanges == 0) {
+        log_message(LOG_DEBUG, "No class files changed");
+        ret = 0;
+        goto cleanup;
+    }
 
-        syslog(LOG_ERR, "systemctl recieved a signal: %s", strsignal(WTERMSIG(status)));
+    // Warm the group cache too, so the write lock isn't held on NSS
+    if (list_active_users(context, &uids) < 0)
+        log_message(LOG_WARNING, "Reloading changed classes without active "
+                                 "users: %s",
+            strerror(errno));
+    size_t nuids = get_vector_count(&uids);
+    uid_t* active = pretend_vector_is_array(&uids);
+    for (size_t n = 0; n < nuids; n++) {
+        gid_t* gids = NULL;
+        int ngids = 0;
+        if (resolve_groups(active[n], &gids, &ngids) == 0)
+            free(gids);
     }
 
-exec_cleanup:
-    for (size_t m = 0; m < n; m++)
-        free(argv[argc_prefix + m]);
+    before = calloc(nuids + 1, sizeof *before);
+    after = calloc(nuids + 1, sizeof *after);
+    before_matches = calloc(nuids + 1, sizeof *before_matches);
+    after_matches = calloc(nuids + 1, sizeof *after_matches);
+    if (!before || !after || !before_matches || !after_matches)
+        goto cleanup;
+
+    pthread_rwlock_wrlock(&context_lock);
+    _evaluate_users(&context->classes, active, nuids, before, before_matches);
+    for (size_t n = 0; n < nchanges; n++) {
+        ClassChange* change = get_vector_item(&changes, n);
+        bool loaded = get_hashmap_entry(&context->classes, change->classname);
+        if (_apply_class_change(&context->classes, change, &replaced) < 0) {
+            log_message(LOG_ERR, "Failed to reload class %s: %s",
+                change->classname, strerror(errno));
+            if (!change->removed)
+                destroy_class(&change->props);
+            // Don't mistake the class for one that changed
+            change->removed = true;
+            continue;
+        }
+        if (change->removed && !loaded)
+            continue;
+        Vector* kind = change->removed ? &removed : loaded ? &modified : &added;
+        append_vector_item(kind, &change->classname);
+    }
+    applied = true;
+    _update_memory_stats(context);
+    _notify_classes_changed(context, &added, &removed, &modified);
+
+    // The replaced classes are still around, so the users' old classes can
+    // be compared against
+    _evaluate_users(&context->classes, active, nuids, after, after_matches);
+    for (size_t n = 0; n < nuids; n++) {
+        if (after_matches[n] >= 0)
+            _move_user(context, active[n],
+                after_matches[n] > 0 ? after[n].filepath : NULL);
+        if (after_matches[n] <= 0)
+            continue;
+        // The members of the changed classes are left to the reload pass
+        if ((before_matches[n] > 0
+                && strcmp(before[n].filepath, after[n].filepath) == 0)
+            || _in_class_changes(after[n].filepath, &changes))
+            continue;
+        append_vector_item(&changed_uids, &active[n]);
+    }
+
+    // A pass still enforcing the last generation is cancelled by this one,
+    // so the reload takes over its classes too
+    size_t nreplaced = get_vector_count(&replaced);
+    if (get_vector_count(&added) + get_vector_count(&removed)
+            + get_vector_count(&modified)
+        > 0)
+        context->generation++;
+    // The classes are queued together, since the dispatcher may pick up the
+    // generation as soon as any of them is
+    const char** classpaths = calloc(nchanges + nreplaced + 1, sizeof *classpaths);
+    size_t npaths = 0;
+    for (size_t n = 0; classpaths && n < nchanges + nreplaced; n++) {
+        const char* classpath = NULL;
+        if (n < nchanges) {
+            ClassChange* change = get_vector_item(&changes, n);
+            classpath = change->removed ? NULL : change->props.filepath;
+        } else {
+            classpath = ((ClassProperties*)get_vector_item(&replaced,
+                             n - nchanges))
+                            ->filepath;
+        }
+        if (classpath)
+            classpaths[npaths++] = classpath;
+    }
+    if (!classpaths
+        || queue_reloads(context->dispatcher, classpaths, npaths,
+               context->generation)
+            < 0)
+        log_message(LOG_ERR, "Failed to queue reload of %zu classes: %s",
+            nchanges + nreplaced, strerror(errno));
+    free(classpaths);
+    pthread_rwlock_unlock(&context_lock);
+
+    size_t nchanged = get_vector_count(&changed_uids);
+    log_message(LOG_NOTICE, "Reloaded %zu changed class files; enforcing on "
+                            "their members and %zu other moved users",
+        nchanges, nchanged);
+
+    uid_t* changed = pretend_vector_is_array(&changed_uids);
+    for (size_t n = 0; n < nchanged; n++) {
+        if (queue_user(context->dispatcher, changed[n]) < 0)
+            log_user_event(LOG_ERR, changed[n], NULL, 0,
+                "Failed to queue uid %u: %s", changed[n], strerror(errno));
+    }
+    ret = nchanges;
+
+cleanup:
+    for (size_t n = 0; !applied && n < get_vector_count(&changes); n++) {
+        ClassChange* change = get_vector_item(&changes, n);
+        if (!change->removed)
+            destroy_class(&change->props);
+    }
+    for (size_t n = 0; n < get_vector_count(&replaced); n++)
+        destroy_class(get_vector_item(&replaced, n));
+    for (size_t n = 0; n < get_vector_count(&classnames); n++)
+        free(*(char**)get_vector_item(&classnames, n));
+    destroy_vector(&classnames);
+    destroy_vector(&changes);
+    destroy_vector(&replaced);
+    destroy_vector(&uids);
+    destroy_vector(&changed_uids);
+    destroy_vector(&added);
+    destroy_vector(&removed);
+    destroy_vector(&modified);
+    free(before);
+    free(after);
+    free(before_matches);
+    free(after_matches);
+    free(classdir);
+    unref_arena(arena);
+    return ret;
+}
+
+/*
+ * Evaluates the active users again and moves them into the classes they now
+ * evaluate into, queueing those who moved for enforcement.
+ * Must be called with the context locked for writing.
+ */
+static void
+_regroup_users(Context* context)
+{
+    if (!context->membership)
+        return;
+
+    Vector uids = { 0 };
+    if (create_vector(&uids, sizeof(uid_t)) < 0
+        || list_tracked_users(context->membership, &uids) < 0) {
+        // Without the membership, reload passes go over everyone anyway
+        destroy_vector(&uids);
+        return;
+    }
+
+    size_t nuids = get_vector_count(&uids);
+    uid_t* active = pretend_vector_is_array(&uids);
+    ClassProperties* results = calloc(nuids + 1, sizeof *results);
+    int* matches = calloc(nuids + 1, sizeof *matches);
+    if (!results || !matches)
+        goto cleanup;
+
+    _evaluate_users(&context->classes, active, nuids, results, matches);
+    for (size_t n = 0; n < nuids; n++) {
+        if (matches[n] < 0)
+            continue;
+        const char* classpath = matches[n] > 0 ? results[n].filepath : NULL;
+        if (_move_user(context, active[n], classpath) > 0
+            && queue_user(context->dispatcher, active[n]) < 0)
+            log_user_event(LOG_ERR, active[n], NULL, 0,
+                "Failed to queue uid %u: %s", active[n], strerror(errno));
+    }
 
 cleanup:
+    free(results);
+    free(matches);
+    destroy_vector(&uids);
+}
+
+/*
+ * Moves the user into the class at classpath (or out of every class if NULL)
+ * in the context's membership, notifying of it if they moved. Returns what
+ * set_user_class does, or 0 if the membership isn't tracked.
+ */
+static int
+_move_user(Context* context, uid_t uid, const char* classpath)
+{
+    if (!context->membership)
+        return 0;
+
+    const char* previous = NULL;
+    int r = set_user_class(context->membership, uid, classpath, &previous);
+    if (r > 0 && context->notifier
+        && notify_user_class_changed(context->notifier, uid, previous,
+               classpath)
+            < 0)
+        log_message(LOG_ERR, "Failed to notify that uid %u moved: %s", uid,
+            strerror(errno));
+    return r;
+}
+
+/*
+ * Notifies of the classnames (char*'s) added, removed and modified as of the
+ * context's generation. Must be called with the context locked for writing,
+ * so that notifications go out in the order the changes were made.
+ */
+static void
+_notify_classes_changed(Context* context, Vector* added, Vector* removed,
+    Vector* modified)
+{
+    if (context->notifier
+        && notify_classes_changed(context->notifier, added, removed, modified,
+               context->generation)
+            < 0)
+        log_message(LOG_ERR, "Failed to notify of changed classes: %s",
+            strerror(errno));
+}
+
+/*
+ * Notifies that the class was modified. Must be called with the context
+ * locked for writing.
+ */
+static void
+_notify_class_modified(Context* context, char* classname)
+{
+    Vector modified = { 0 };
+    if (create_vector(&modified, sizeof(char*)) < 0
+        || append_vector_item(&modified, &classname) < 0) {
+        log_message(LOG_ERR, "Failed to notify of changed classes: %s",
+            strerror(errno));
+        destroy_vector(&modified);
+        return;
+    }
+    _notify_classes_changed(context, NULL, NULL, &modified);
+    destroy_vector(&modified);
+}
+
+/*
+ * Notifies of how the context's classes differ from the classes loaded
+ * before. Must be called with the context locked for writing.
+ */
+static void
+_notify_reloaded_classes(Context* context, HashMap* before)
+{
+    if (!context->notifier)
+        return;
+
+    Vector added = { 0 };
+    Vector removed = { 0 };
+    Vector modified = { 0 };
+    if (create_vector(&added, sizeof(char*)) < 0
+        || create_vector(&removed, sizeof(char*)) < 0
+        || create_vector(&modified, sizeof(char*)) < 0)
+        goto error;
+
+    int r = 0;
+    char* classname = NULL;
+    ClassProperties* props = NULL;
+    size_t nclasses = get_hashmap_count(&context->classes);
+    for (size_t n = 0; r == 0 && n < nclasses; n++) {
+        get_hashmap_entry_at(&context->classes, n, &classname, (void**)&props);
+        ClassProperties* old = get_hashmap_entry(before, classname);
+        if (!old)
+            r = append_vector_item(&added, &classname);
+        else if (!_same_class(old, props))
+            r = append_vector_item(&modified, &classname);
+    }
+    nclasses = get_hashmap_count(before);
+    for (size_t n = 0; r == 0 && n < nclasses; n++) {
+        get_hashmap_entry_at(before, n, &classname, NULL);
+        if (!get_hashmap_entry(&context->classes, classname))
+            r = append_vector_item(&removed, &classname);
+    }
+    if (r < 0)
+        goto error;
+
+    _notify_classes_changed(context, &added, &removed, &modified);
+    goto cleanup;
+
+error:
+    log_message(LOG_ERR, "Failed to notify of changed classes: %s",
+        strerror(errno));
+cleanup:
+    destroy_vector(&added);
+    destroy_vector(&removed);
+    destroy_vector(&modified);
+}
+
+/*
+ * Sets the resource controls of the class to the given values, or removes
+ * those whose value is empty so the pass resets them, and queues one reload
+ * pass over the class's members. Either every control is changed or none
+ * are. Returns a negative errno if there was an error (with ret_error set if
+ * it's the caller's fault), otherwise 0.
+ */
+static int
+_set_class_controls(Context* context, char* classname, char** keys,
+    char** values, size_t ncontrols, sd_bus_error* ret_error)
+{
+    int r = 0;
+    pthread_rwlock_wrlock(&context_lock);
+
+    ClassProperties* props = get_hashmap_entry(&context->classes, classname);
+    if (!props) {
+        sd_bus_error_set_const(ret_error, "org.dylangardner.NoSuchClass",
+            "No such class found (may need to daemon-reload).");
+        r = -EINVAL;
+        goto cleanup;
+    }
+
+    // The changes go to a copy of the controls, which only replaces the
+    // class's once all of them went through. The copy gets an arena of its
+    // own, so values set and replaced over and over don't pile up in the
+    // class's arena; the last copy's arena goes along with its controls
+    ClassProperties staged = *props;
+    staged.arena = create_sized_arena(CONTROLS_ARENA_SIZE);
+    if (!staged.arena) {
+        r = -errno;
+        goto cleanup;
+    }
+    if (_copy_controls(&props->controls, &staged.controls, staged.arena) < 0) {
+        r = -errno;
+        unref_arena(staged.arena);
+        goto cleanup;
+    }
+    // The controls hold their own reference
+    unref_arena(staged.arena);
+    for (size_t n = 0; r == 0 && n < ncontrols; n++) {
+        // An empty value removes the control, which is reset from then on
+        int changed = values[n][0] == '\0'
+            ? remove_class_control(&staged, keys[n])
+            : set_class_control(&staged, keys[n], values[n]);
+        if (changed < 0 && errno == ENOENT) {
+            sd_bus_error_setf(ret_error, "org.dylangardner.NoSuchControl",
+                "No such resource control set on the class: %s", keys[n]);
+            r = -ENOENT;
+        } else if (changed < 0) {
+            r = -errno;
+        }
+    }
+    if (r < 0) {
+        destroy_hashmap(&staged.controls);
+        goto cleanup;
+    }
+    destroy_hashmap(&props->controls);
+    props->controls = staged.controls;
+    props->transient = true;
+
+    log_message(LOG_DEBUG, "Enforcing resource controls on all users in %s",
+        classname);
+    context->generation++;
+    _notify_class_modified(context, classname);
+    if (queue_reload(context->dispatcher, props->filepath, context->generation) < 0)
+        r = -errno;
+
+cleanup:
+    pthread_rwlock_unlock(&context_lock);
+    return r;
+}
+
+/*
+ * Copies the controls into a new hashmap allocated from the given arena, with
+ * its keys and values interned there. Returns -1 if there was an error (and
+ * errno should be looked up), otherwise 0.
+ */
+static int
+_copy_controls(HashMap* from, HashMap* to, Arena* arena)
+{
+    size_t ncontrols = get_hashmap_count(from);
+    if (create_hashmap_from_arena(to, sizeof(char*), ncontrols, arena) < 0)
+        return -1;
+    for (size_t n = 0; n < ncontrols; n++) {
+        char* key = NULL;
+        char** value = NULL;
+        get_hashmap_entry_at(from, n, &key, (void**)&value);
+        const char* interned = arena_intern(arena, *value);
+        if (!interned || add_hashmap_entry(to, key, &interned) < 0) {
+            destroy_hashmap(to);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Copies what GetClasses replies with for the class onto infos. Must be
+ * called with the context locked. Returns -1 if there was an error (and errno
+ * should be looked up), otherwise 0.
+ */
+static int
+_collect_class_info(char* classname, ClassProperties* props, uint64_t flags,
+    Vector* infos)
+{
+    ClassInfo info = {
+        .filepath = props->filepath,
+        .shared = props->shared,
+        .priority = props->priority,
+    };
+    create_uid_vector(&info.users);
+    create_gid_vector(&info.groups);
+    info.classname = strdup(classname);
+    if (!info.classname || create_vector(&info.controls, sizeof(const char*)) < 0)
+        goto error;
+
+    size_t nusers = get_uid_vector_count(&props->users);
+    size_t ngroups = get_gid_vector_count(&props->groups);
+    if (ensure_uid_vector_capacity(&info.users, nusers) < 0
+        || ensure_gid_vector_capacity(&info.groups, ngroups) < 0)
+        goto error;
+    for (size_t n = 0; n < nusers; n++)
+        append_uid_vector_item(&info.users, get_uid_vector_item(&props->users, n));
+    for (size_t n = 0; n < ngroups; n++)
+        append_gid_vector_item(&info.groups, get_gid_vector_item(&props->groups, n));
+
+    // The controls live in the arena, which outlives the class with this
+    size_t ncontrols = (flags & CLASS_INFO_CONTROLS) ? get_hashmap_count(&props->controls) : 0;
+    for (size_t n = 0; n < ncontrols; n++) {
+        char* key = NULL;
+        char** value = NULL;
+        get_hashmap_entry_at(&props->controls, n, &key, (void**)&value);
+        if (append_vector_item(&info.controls, &key) < 0
+            || append_vector_item(&info.controls, value) < 0)
+            goto error;
+    }
+
+    info.arena = ref_arena(props->arena);
+    info.controls_arena = props->controls.arena ? ref_arena(props->controls.arena) : NULL;
+    if (append_vector_item(infos, &info) < 0)
+        goto error;
+    return 0;
+
+error:
+    _destroy_class_info(&info);
+    return -1;
+}
+
+/*
+ * Appends the class to the GetClasses reply, looking up the names of its
+ * users and groups if asked for. Returns a negative errno if there was an
+ * error, otherwise 0.
+ */
+static int
+_append_class_info(sd_bus_message* reply, ClassInfo* info, uint64_t flags)
+{
+    size_t nusers = get_uid_vector_count(&info->users);
+    size_t ngroups = get_gid_vector_count(&info->groups);
+    size_t nnames = (flags & CLASS_INFO_NAMES) ? nusers + ngroups : 0;
+    char** names = calloc(nnames + 1, sizeof *names);
+    if (!names)
+        return -errno;
+
+    int r = 0;
+    if (nnames > 0
+        && (resolve_uid_names(info->users.items, nusers, names) < 0
+            || resolve_gid_names(info->groups.items, ngroups, names + nusers) < 0)) {
+        r = -errno;
+        goto cleanup;
+    }
+
+    r = sd_bus_message_open_container(reply, SD_BUS_TYPE_STRUCT,
+        "ssbdauauasasa{ss}");
+    if (r < 0)
+        goto cleanup;
+    r = sd_bus_message_append(reply, "ssbd", info->classname, info->filepath,
+        info->shared, info->priority);
+    if (r < 0)
+        goto cleanup;
+    r = sd_bus_message_append_array(reply, 'u', info->users.items,
+        nusers * sizeof(uid_t));
+    if (r < 0)
+        goto cleanup;
+    r = sd_bus_message_append_array(reply, 'u', info->groups.items,
+        ngroups * sizeof(gid_t));
+    if (r < 0)
+        goto cleanup;
+
+    // The names line up with the ids, and are empty for those that don't exist
+    r = _append_names(reply, names, nnames > 0 ? nusers : 0);
+    if (r < 0)
+        goto cleanup;
+    r = _append_names(reply, names + nusers, nnames > 0 ? ngroups : 0);
+    if (r < 0)
+        goto cleanup;
+
+    r = sd_bus_message_open_container(reply, SD_BUS_TYPE_ARRAY, "{ss}");
+    if (r < 0)
+        goto cleanup;
+    size_t ncontrols = get_vector_count(&info->controls) / 2;
+    for (size_t n = 0; r >= 0 && n < ncontrols; n++)
+        r = sd_bus_message_append(reply, "{ss}",
+            *(const char**)get_vector_item(&info->controls, 2 * n),
+            *(const char**)get_vector_item(&info->controls, 2 * n + 1));
+    if (r < 0)
+        goto cleanup;
+    r = sd_bus_message_close_container(reply);
+    if (r < 0)
+        goto cleanup;
+    r = sd_bus_message_close_container(reply);
+
+cleanup:
+    for (size_t n = 0; n < nnames; n++)
+        free(names[n]);
+    free(names);
+    return r;
+}
+
+/*
+ * Appends the names as a string array, with NULL names as empty strings.
+ * Returns a negative errno if there was an error, otherwise 0.
+ */
+static int
+_append_names(sd_bus_message* reply, char** names, size_t nnames)
+{
+    int r = sd_bus_message_open_container(reply, SD_BUS_TYPE_ARRAY, "s");
+    for (size_t n = 0; r >= 0 && n < nnames; n++)
+        r = sd_bus_message_append_basic(reply, 's', names[n] ? names[n] : "");
+    if (r < 0)
+        return r;
+    return sd_bus_message_close_container(reply);
+}
+
+/*
+ * Destroys the copied class, dropping its reference to the class's arena.
+ */
+static void
+_destroy_class_info(ClassInfo* info)
+{
+    free(info->classname);
+    destroy_uid_vector(&info->users);
+    destroy_gid_vector(&info->groups);
+    destroy_vector(&info->controls);
+    unref_arena(info->arena);
+    unref_arena(info->controls_arena);
+}
+
+/*
+ * Fills classnames with allocated copies of the names of every class file on
+ * disk and every class loaded. If there was an error, -1 is returned (and
+ * errno should be looked up). Otherwise, 0 is returned.
+ */
+static int
+_list_all_classnames(Context* context, Vector* classnames)
+{
+    struct dirent** class_files = NULL;
+    int num_files = 0;
+
+    pthread_rwlock_rdlock(&context_lock);
+    int r = list_class_files(context->classdir, context->classext,
+        &class_files, &num_files);
+    if (r < 0)
+        goto unlock;
+
+    for (int i = 0; i < num_files; i++) {
+        char* classname = strdup(class_files[i]->d_name);
+        if (!classname || append_vector_item(classnames, &classname) < 0) {
+            free(classname);
+            r = -1;
+        }
+        free(class_files[i]);
+    }
+    free(class_files);
+
+    // Loaded classes that are no longer on disk need to be removed
+    size_t nclasses = get_hashmap_count(&context->classes);
+    for (size_t n = 0; r == 0 && n < nclasses; n++) {
+        char* key = NULL;
+        get_hashmap_entry_at(&context->classes, n, &key, NULL);
+        if (_in_classpaths(key, classnames))
+            continue;
+
+        char* classname = strdup(key);
+        if (!classname || append_vector_item(classnames, &classname) < 0) {
+            free(classname);
+            r = -1;
+        }
+    }
+
+unlock:
+    pthread_rwlock_unlock(&context_lock);
+    return r;
+}
+
+/*
+ * Compares the class file against the loaded class of the same name and, if
+ * it was added, changed or removed, appends a ClassChange to changes. If force
+ * is true, the class file is parsed even if its contents are the same. The
+ * class is allocated from the given arena. Files that fail to parse keep
+ * their loaded class. If there was an error, -1 is returned (and errno should
+ * be looked up). Otherwise, 0 is returned.
+ */
+static int
+_parse_class_change(Context* context, const char* classdir, char* classname,
+    Vector* changes, bool force, Arena* arena)
+{
+    pthread_rwlock_rdlock(&context_lock);
+    ClassProperties* loaded = get_hashmap_entry(&context->classes, classname);
+    bool known = loaded != NULL;
+    uint64_t loaded_hash = known ? loaded->hash : 0;
+    pthread_rwlock_unlock(&context_lock);
+
+    const char* filepath = get_filepath(classdir, classname);
+    if (!filepath)
+        return -1;
+
+    ClassChange change = { .classname = classname };
+    uint64_t hash = 0;
+    int r = hash_file(filepath, &hash);
+    free((char*)filepath);
+    if (r < 0) {
+        if (errno != ENOENT || !known) {
+            log_message(LOG_DEBUG, "Skipping class file %s: %s", classname,
+                strerror(errno));
+            return 0;
+        }
+        change.removed = true;
+    } else if (!force && known && hash == loaded_hash) {
+        // Touched or rewritten, but the same
+        return 0;
+    } else if (create_unresolved_class(classdir, classname, &change.props,
+                   arena)
+        < 0) {
+        log_message(LOG_ERR, "Failed to reload class %s, keeping the loaded "
+                             "one: %s",
+            classname, strerror(errno));
+        return 0;
+    }
+
+    if (append_vector_item(changes, &change) < 0) {
+        if (!change.removed)
+            destroy_class(&change.props);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Parses the class files of the loaded classes that inherit from a class that
+ * changed, directly or through other classes, into changes, so that they're
+ * flattened again. Their names are appended to classnames. If there was an
+ * error, -1 is returned (and errno should be looked up). Otherwise, 0 is
+ * returned.
+ */
+static int
+_parse_dependent_changes(Context* context, const char* classdir,
+    Vector* classnames, Vector* changes, Arena* arena)
+{
+    // The dependents' changes are checked for dependents of their own
+    for (size_t n = 0; n < get_vector_count(changes); n++) {
+        ClassChange* change = get_vector_item(changes, n);
+        size_t first = get_vector_count(classnames);
+
+        pthread_rwlock_rdlock(&context_lock);
+        int r = _list_dependents(context, change->classname, changes,
+            classnames);
+        pthread_rwlock_unlock(&context_lock);
+        if (r < 0)
+            return -1;
+
+        for (size_t i = first; i < get_vector_count(classnames); i++) {
+            char* classname = *(char**)get_vector_item(classnames, i);
+            log_message(LOG_DEBUG, "Reloading class %s, since it inherits "
+                                   "from a class that changed",
+                classname);
+            if (_parse_class_change(context, classdir, classname, changes,
+                    true, arena)
+                < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Appends allocated copies of the names of the loaded classes that inherit
+ * directly from the parent to classnames, unless they're in changes (if not
+ * NULL). The context must be locked. If there was an error, -1 is returned
+ * (and errno should be looked up). Otherwise, 0 is returned.
+ */
+static int
+_list_dependents(Context* context, const char* parent, Vector* changes,
+    Vector* classnames)
+{
+    size_t nclasses = get_hashmap_count(&context->classes);
+    for (size_t n = 0; n < nclasses; n++) {
+        char* key = NULL;
+        ClassProperties* props = NULL;
+        get_hashmap_entry_at(&context->classes, n, &key, (void**)&props);
+
+        bool inherits = false;
+        size_t nparents = get_string_vector_count(&props->parents);
+        for (size_t p = 0; !inherits && p < nparents; p++)
+            inherits = strcmp(get_string_vector_item(&props->parents, p), parent) == 0;
+        if (!inherits)
+            continue;
+
+        bool changed = false;
+        size_t nchanges = changes ? get_vector_count(changes) : 0;
+        for (size_t c = 0; !changed && c < nchanges; c++) {
+            ClassChange* change = get_vector_item(changes, c);
+            changed = strcmp(change->classname, key) == 0;
+        }
+        if (changed)
+            continue;
+
+        char* classname = strdup(key);
+        if (!classname || append_vector_item(classnames, &classname) < 0) {
+            free(classname);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Resolves the members of every class that changed together. Classes with
+ * members that couldn't be resolved are dropped from the changes, keeping
+ * their loaded class, since leaving the members out would unenforce them. If
+ * there was an error, -1 is returned (and errno should be looked up) and the
+ * changes are untouched. Otherwise, 0 is returned.
+ */
+static int
+_resolve_class_changes(Vector* changes)
+{
+    size_t nchanges = get_vector_count(changes);
+    ClassProperties* parsed = calloc(nchanges + 1, sizeof *parsed);
+    int* errors = calloc(nchanges + 1, sizeof *errors);
+    Vector kept = { 0 };
+    int r = -1;
+    if (!parsed || !errors || create_vector(&kept, sizeof(ClassChange)) < 0
+        || ensure_vector_capacity(&kept, nchanges + 1) < 0)
+        goto cleanup;
+
+    size_t nparsed = 0;
+    for (size_t n = 0; n < nchanges; n++) {
+        ClassChange* change = get_vector_item(changes, n);
+        if (!change->removed)
+            parsed[nparsed++] = change->props;
+    }
+    r = resolve_class_members(parsed, nparsed, errors);
+    if (r < 0)
+        goto cleanup;
+
+    // The members were added to copies of the classes. Room was made for
+    // every change, so this can't fail midway
+    nparsed = 0;
+    for (size_t n = 0; n < nchanges; n++) {
+        ClassChange* change = get_vector_item(changes, n);
+        if (!change->removed) {
+            int error = errors[nparsed];
+            change->props = parsed[nparsed++];
+            if (error != 0) {
+                log_message(LOG_ERR, "Failed to reload class %s, keeping the "
+                                     "loaded one: %s",
+                    change->classname, strerror(error));
+                destroy_class(&change->props);
+                continue;
+            }
+        }
+        append_vector_item(&kept, change);
+    }
+    destroy_vector(changes);
+    memcpy(changes, &kept, sizeof kept);
+    memset(&kept, 0, sizeof kept);
+
+cleanup:
+    destroy_vector(&kept);
+    free(parsed);
+    free(errors);
+    return r;
+}
+
+/*
+ * Flattens the controls that the changed classes inherit, from each other or
+ * from the loaded classes. Classes that fail to flatten are dropped from the
+ * changes, keeping their loaded class, as are classes that inherit from a
+ * removed class. If there was an error, -1 is returned (and errno should be
+ * looked up) and the changes are untouched. Otherwise, 0 is returned.
+ */
+static int
+_flatten_class_changes(Context* context, Vector* changes)
+{
+    size_t nchanges = get_vector_count(changes);
+    ClassProperties* classes = calloc(nchanges + 1, sizeof *classes);
+    char** classnames = calloc(nchanges + 1, sizeof *classnames);
+    int* errors = calloc(nchanges + 1, sizeof *errors);
+    Vector kept = { 0 };
+    int r = -1;
+    if (!classes || !classnames || !errors
+        || create_vector(&kept, sizeof(ClassChange)) < 0
+        || ensure_vector_capacity(&kept, nchanges + 1) < 0)
+        goto cleanup;
+
+    for (size_t n = 0; n < nchanges; n++) {
+        ClassChange* change = get_vector_item(changes, n);
+        classnames[n] = change->classname;
+        if (change->removed)
+            errors[n] = ENOENT;
+        else
+            classes[n] = change->props;
+    }
+
+    pthread_rwlock_rdlock(&context_lock);
+    r = flatten_classes(classes, classnames, nchanges, &context->classes,
+        errors);
+    pthread_rwlock_unlock(&context_lock);
+    if (r < 0)
+        goto cleanup;
+
+    // The controls were added to copies of the classes. Room was made for
+    // every change, so this can't fail midway
+    for (size_t n = 0; n < nchanges; n++) {
+        ClassChange* change = get_vector_item(changes, n);
+        if (!change->removed)
+            change->props = classes[n];
+        if (!change->removed && errors[n] != 0) {
+            log_message(LOG_ERR, "Failed to reload class %s, keeping the "
+                                 "loaded one: %s",
+                change->classname, strerror(errors[n]));
+            destroy_class(&change->props);
+            continue;
+        }
+        append_vector_item(&kept, change);
+    }
+    destroy_vector(changes);
+    memcpy(changes, &kept, sizeof kept);
+    memset(&kept, 0, sizeof kept);
+
+cleanup:
+    destroy_vector(&kept);
+    free(classes);
+    free(classnames);
+    free(errors);
+    return r;
+}
+
+/*
+ * Drops the changes whose resolved class is the same as the loaded one, so
+ * that their users aren't enforced on again. If there was an error, -1 is
+ * returned (and errno should be looked up) and the changes are untouched.
+ * Otherwise, 0 is returned.
+ */
+static int
+_drop_unchanged_classes(Context* context, Vector* changes)
+{
+    size_t nchanges = get_vector_count(changes);
+    bool* same = calloc(nchanges + 1, sizeof *same);
+    Vector kept = { 0 };
+    if (!same || create_vector(&kept, sizeof(ClassChange)) < 0
+        || ensure_vector_capacity(&kept, nchanges + 1) < 0) {
+        free(same);
+        destroy_vector(&kept);
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&context_lock);
+    for (size_t n = 0; n < nchanges; n++) {
+        ClassChange* change = get_vector_item(changes, n);
+        ClassProperties* loaded = get_hashmap_entry(&context->classes,
+            change->classname);
+        same[n] = !change->removed && loaded
+            && _same_class(loaded, &change->props);
+    }
+    pthread_rwlock_unlock(&context_lock);
+
+    // Room was made for every change, so this can't fail midway
+    for (size_t n = 0; n < nchanges; n++) {
+        ClassChange* change = get_vector_item(changes, n);
+        if (same[n])
+            destroy_class(&change->props);
+        else
+            append_vector_item(&kept, change);
+    }
+    destroy_vector(changes);
+    memcpy(changes, &kept, sizeof kept);
+    free(same);
+    return 0;
+}
+
+/*
+ * Returns whether both classes came from the same class file contents and
+ * resolved to the same members.
+ */
+static bool
+_same_class(ClassProperties* a, ClassProperties* b)
+{
+    if (a->hash != b->hash || !_same_members(a, b))
+        return false;
+    // A class's inherited controls can change without its class file
+    return _same_controls(&a->controls, &b->controls);
+}
+
+/*
+ * Returns whether both classes would have the same users evaluated into them,
+ * all else being equal.
+ */
+static bool
+_same_members(ClassProperties* a, ClassProperties* b)
+{
+    size_t nusers = get_uid_vector_count(&a->users);
+    size_t ngroups = get_gid_vector_count(&a->groups);
+    if (a->priority != b->priority || nusers != get_uid_vector_count(&b->users)
+        || ngroups != get_gid_vector_count(&b->groups))
+        return false;
+    // Members are sorted, so the same members means the same arrays
+    if (nusers > 0
+        && memcmp(a->users.items, b->users.items, nusers * sizeof(uid_t)) != 0)
+        return false;
+    return ngroups == 0
+        || memcmp(a->groups.items, b->groups.items, ngroups * sizeof(gid_t)) == 0;
+}
+
+/*
+ * Returns whether both classes have the same controls set to the same
+ * values.
+ */
+static bool
+_same_controls(HashMap* a, HashMap* b)
+{
+    size_t ncontrols = get_hashmap_count(a);
+    if (ncontrols != get_hashmap_count(b))
+        return false;
+    for (size_t n = 0; n < ncontrols; n++) {
+        char* key = NULL;
+        char** value = NULL;
+        get_hashmap_entry_at(a, n, &key, (void**)&value);
+        char** other = get_hashmap_entry(b, key);
+        // The values may be interned in different arenas
+        if (!other || strcmp(*value, *other) != 0)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Applies the change to the classes. Any class that was replaced or removed
+ * is appended to replaced rather than destroyed. If there was an error, -1 is
+ * returned (and errno should be looked up) and the classes are untouched.
+ * Otherwise, 0 is returned.
+ */
+static int
+_apply_class_change(HashMap* classes, ClassChange* change, Vector* replaced)
+{
+    assert(classes && change && replaced);
+
+    ClassProperties* loaded = get_hashmap_entry(classes, change->classname);
+    if (change->removed) {
+        if (!loaded)
+            return 0;
+        ClassProperties removed;
+        if (remove_hashmap_entry(classes, change->classname, &removed) < 0)
+            return -1;
+        if (append_vector_item(replaced, &removed) < 0) {
+            // Leak the class rather than free it from under a user
+            return 0;
+        }
+        log_message(LOG_INFO, "Removed class %s", change->classname);
+        return 0;
+    }
+
+    if (loaded) {
+        if (append_vector_item(replaced, loaded) < 0)
+            return -1;
+        memcpy(loaded, &change->props, sizeof *loaded);
+        log_message(LOG_INFO, "Reloaded class %s", change->classname);
+        return 0;
+    }
+
+    if (add_hashmap_entry(classes, change->classname, &change->props) < 0)
+        return -1;
+    log_message(LOG_INFO, "Added class %s", change->classname);
+    return 0;
+}
+
+/*
+ * Returns whether the filepath is the class of one of the changes applied.
+ */
+static bool
+_in_class_changes(const char* filepath, Vector* changes)
+{
+    size_t nchanges = get_vector_count(changes);
+    for (size_t n = 0; n < nchanges; n++) {
+        ClassChange* change = get_vector_item(changes, n);
+        if (!change->removed && strcmp(filepath, change->props.filepath) == 0)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Evaluates the users in the slice.
+ */
+static void*
+_evaluate_slice(void* vargp)
+{
+    EvaluateSlice* slice = vargp;
+    for (size_t n = slice->start; n < slice->end; n++) {
+        int r = evaluate(slice->uids[n], slice->classes, &slice->results[n]);
+        slice->matches[n] = r < 0 ? -errno : r;
+    }
+    return NULL;
+}
+
+/*
+ * Evaluates each user into results, with what evaluate() returned (or a
+ * negative errno) in matches. Large batches are split across threads. Must be
+ * called with the context locked.
+ */
+static void
+_evaluate_users(HashMap* classes, const uid_t* uids, size_t nuids,
+    ClassProperties* results, int* matches)
+{
+    size_t nthreads = 1;
+    if (nuids >= PARALLEL_EVALUATE_MIN) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpus > 1 ? (size_t)ncpus : 1;
+        if (nthreads > MAX_EVALUATE_THREADS)
+            nthreads = MAX_EVALUATE_THREADS;
+    }
+
+    EvaluateSlice slices[MAX_EVALUATE_THREADS];
+    pthread_t tids[MAX_EVALUATE_THREADS];
+    bool threaded[MAX_EVALUATE_THREADS] = { 0 };
+    size_t per_slice = (nuids + nthreads - 1) / nthreads;
+    for (size_t t = 0; t < nthreads; t++) {
+        size_t start = t * per_slice;
+        size_t end = start + per_slice;
+        slices[t] = (EvaluateSlice) {
+            .classes = classes,
+            .uids = uids,
+            .results = results,
+            .matches = matches,
+            .start = start < nuids ? start : nuids,
+            .end = end < nuids ? end : nuids,
+        };
+
+        // This thread takes the first slice
+        if (t > 0)
+            threaded[t] = pthread_create(&tids[t], NULL, _evaluate_slice, &slices[t]) == 0;
+    }
+
+    _evaluate_slice(&slices[0]);
+    for (size_t t = 1; t < nthreads; t++) {
+        if (threaded[t])
+            pthread_join(tids[t], NULL);
+        else
+            _evaluate_slice(&slices[t]);
+    }
+}
+
+/*
+ * Returns whether the filepath is one of the given class filepaths.
+ */
+static bool
+_in_classpaths(const char* filepath, Vector* classpaths)
+{
+    assert(filepath && classpaths);
+
+    size_t npaths = get_vector_count(classpaths);
+    for (size_t n = 0; n < npaths; n++)
+        if (strcmp(filepath, *(char**)get_vector_item(classpaths, n)) == 0)
+            return true;
+    return false;
+}
+
+/*
+ * Builds the systemctl argv that sets the given resource controls on the
+ * user's slice. The argv must be freed with _free_enforcement_argv. If there
+ * are no controls to set, NULL is returned and errno is zero. If there was an
+ * error, NULL is returned (and errno should be looked up).
+ */
+static char**
+_build_enforcement_argv(uid_t uid, HashMap* controls)
+{
+    errno = 0;
+    size_t ncontrols = get_hashmap_count(controls);
+    if (ncontrols < 1)
+        return NULL;
+
+    size_t argc = ENFORCEMENT_ARGC_PREFIX + ncontrols; // + controls ...
+    char** argv = calloc(argc + 1, sizeof *argv); // + NULL
+    if (!argv)
+        return NULL;
+
+    argv[0] = "systemctl";
+    argv[1] = "set-property";
+    // 32 bit uid can only be at most 11 chars long
+    argv[2] = malloc(24);
+    if (!argv[2])
+        goto error;
+    snprintf(argv[2], 24, "user-%u.slice", uid);
+
+    char* key = NULL;
+    char** entry = NULL;
+    for (size_t n = 0; n < ncontrols; n++) {
+        get_hashmap_entry_at(controls, n, &key, (void**)&entry);
+        char* value = *entry;
+        int arglen = strlen(key) + strlen(value) + 2;
+        char* arg = malloc(sizeof *arg * arglen);
+        if (!arg)
+            goto error;
+
+        snprintf(arg, arglen, "%s=%s", key, value);
+        argv[ENFORCEMENT_ARGC_PREFIX + n] = arg;
+    }
+    return argv;
+
+error:
+    _free_enforcement_argv(argv);
+    return NULL;
+}
+
+/*
+ * Frees the argv built by _build_enforcement_argv.
+ */
+static void
+_free_enforcement_argv(char** argv)
+{
+    if (!argv)
+        return;
+
+    // The first two arguments are static strings
+    for (char** arg = argv + 2; *arg; arg++)
+        free(*arg);
     free(argv);
+}
+
+/*
+ * Records the groups the user was just evaluated with in the context's
+ * membership, which the account watcher compares their groups against later.
+ * Evaluating the user just cached them, so this doesn't wait on NSS.
+ */
+static void
+_record_groups(Context* context, uid_t uid)
+{
+    if (!context->membership)
+        return;
+
+    gid_t* gids = NULL;
+    int ngids = 0;
+    int r = resolve_groups(uid, &gids, &ngids);
+    if (r == 0)
+        r = record_user_groups(context->membership, uid, gids, ngids);
+    // Users that don't exist have no groups to record
+    if (r < 0 && errno != 0)
+        log_message(LOG_DEBUG, "Failed to record the groups of uid %u: %s",
+            uid, strerror(errno));
+    free(gids);
+}
+
+/*
+ * Builds the systemctl argv that enforces the class's resource controls on a
+ * specific user and adds it to the jobs, copying what's needed out of the
+ * class. Classes without controls add nothing. If there was an error, -1 is
+ * returned (and errno should be looked up). Otherwise, 0 is returned.
+ */
+static int
+_queue_enforcement(Vector* jobs, uid_t uid, ClassProperties* props)
+{
+    assert(jobs && props);
+
+    EnforceJob job = { .uid = uid };
+    job.argv = _build_enforcement_argv(uid, &props->controls);
+    if (!job.argv)
+        return errno ? -1 : 0;
+    job.classpath = strdup(props->filepath);
+    if (!job.classpath || append_vector_item(jobs, &job) < 0) {
+        free(job.classpath);
+        _free_enforcement_argv(job.argv);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Forks off a systemctl process running the job and adds it to the pass. If
+ * the pass is already full, the oldest process is waited on first. The job
+ * must outlive the pass. If there was an error, -1 is returned (and errno
+ * should be looked up). Otherwise, 0 is returned.
+ */
+static int
+_spawn_enforcement(EnforcePass* pass, EnforceJob* job)
+{
+    assert(pass && job);
+    log_user_event(LOG_DEBUG, job->uid, job->classpath, 0,
+        "Enforcing resource controls on uid %u", job->uid);
+
+    if (pass->count == MAX_INFLIGHT_ENFORCEMENTS) {
+        if (_reap_enforcement(pass, &pass->slots[pass->head]) < 0)
+            pass->failures++;
+        pass->head = (pass->head + 1) % MAX_INFLIGHT_ENFORCEMENTS;
+        pass->count--;
+    }
+
+    EnforceSlot* slot = &pass->slots[(pass->head + pass->count) % MAX_INFLIGHT_ENFORCEMENTS];
+    slot->uid = job->uid;
+    slot->start_usec = monotonic_usec();
+    slot->classpath = job->classpath;
+
+    // FIXME: Print out the entire command
+    const char* systemctl = "/bin/systemctl";
+    char** argv = job->argv;
+    log_message(LOG_DEBUG, "Exec: %s %s %s %s %s ...", systemctl, argv[0],
+        argv[1], argv[2], argv[3]);
+
+    slot->pid = fork();
+    if (slot->pid == -1) {
+        log_message(LOG_ERR, "Failed to fork and set property");
+        return -1;
+    }
+    if (slot->pid == 0) {
+        // Other threads may have held locks (such as syslog's) when we forked,
+        // so only async-signal-safe calls are made until the exec
+        execv(systemctl, argv);
+        static const char failed[] = "Failed to exec and set property\n";
+        ssize_t r = write(STDERR_FILENO, failed, sizeof failed - 1);
+        (void)r;
+        _exit(1);
+    }
+    pass->count++;
+    return 0;
+}
+
+/*
+ * Waits on a systemctl process spawned by _spawn_enforcement, records how it
+ * went and releases its slot. If systemctl failed, -1 is returned. Otherwise,
+ * 0 is returned.
+ */
+static int
+_reap_enforcement(EnforcePass* pass, EnforceSlot* slot)
+{
+    int r = -1;
+    int status = 0;
+    if (waitpid(slot->pid, &status, 0) < 0) {
+        log_user_event(LOG_ERR, slot->uid, slot->classpath, 0,
+            "Failed to wait on systemctl for uid %u: %s", slot->uid,
+            strerror(errno));
+        goto cleanup;
+    }
+
+    uint64_t duration = monotonic_usec() - slot->start_usec;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        log_user_event(LOG_DEBUG, slot->uid, slot->classpath, duration,
+            "Enforced resource controls on uid %u", slot->uid);
+        r = 0;
+    } else if (WIFEXITED(status)) {
+        log_user_event(LOG_ERR, slot->uid, slot->classpath, duration,
+            "systemctl exited with non-zero status code for uid %u: %d",
+            slot->uid, WEXITSTATUS(status));
+    } else if (WIFSIGNALED(status)) {
+        log_user_event(LOG_ERR, slot->uid, slot->classpath, duration,
+            "systemctl recieved a signal for uid %u: %s", slot->uid,
+            strsignal(WTERMSIG(status)));
+    }
+
+cleanup:
+    _record_enforcement(pass, slot->uid, slot->classpath, slot->start_usec,
+        r == 0);
     return r;
 }
+
+/*
+ * Records the outcome of enforcing the class at classpath on the user, which
+ * started at start_usec (CLOCK_MONOTONIC), and notifies of it.
+ */
+static void
+_record_enforcement(EnforcePass* pass, uid_t uid, const char* classpath,
+    uint64_t start_usec, bool succeeded)
+{
+    Context* context = pass->context;
+    if (!context)
+        return;
+
+    EnforceStatus status = {
+        .classpath = classpath,
+        .generation = pass->generation,
+        .timestamp_usec = realtime_usec(),
+        .duration_usec = monotonic_usec() - start_usec,
+        .succeeded = succeeded,
+    };
+    if (context->membership
+        && record_enforcement(context->membership, uid, &status) < 0)
+        log_message(LOG_ERR, "Failed to record enforcement on uid %u: %s", uid,
+            strerror(errno));
+    if (context->notifier && notify_enforced(context->notifier, uid, &status) < 0)
+        log_message(LOG_ERR, "Failed to notify of enforcement on uid %u: %s",
+            uid, strerror(errno));
+}
+
+/*
+ * Waits on every process remaining in the pass. Returns the number of
+ * enforcements in the pass that failed.
+ */
+static int
+_finish_enforcement_pass(EnforcePass* pass)
+{
+    assert(pass);
+
+    for (; pass->count > 0; pass->count--) {
+        if (_reap_enforcement(pass, &pass->slots[pass->head]) < 0)
+            pass->failures++;
+        pass->head = (pass->head + 1) % MAX_INFLIGHT_ENFORCEMENTS;
+    }
+    return pass->failures;
+}
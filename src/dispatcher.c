@@ -0,0 +1,446 @@
+// SPDX-License-Identifier: GPL-3.0
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "controller.h"
+#include "dispatcher.h"
+#include "logger.h"
+#include "membership.h"
+#include "utils.h"
+#include "vector.h"
+
+static bool _has_work(Dispatcher* dispatcher, ReloadPass* pass);
+static bool _has_request(Dispatcher* dispatcher, ReloadPass* pass);
+static void _start_reload_pass(Dispatcher* dispatcher, ReloadPass* pass);
+static int _list_pass_users(Dispatcher* dispatcher, ReloadPass* pass);
+static void _run_reload_chunk(Dispatcher* dispatcher, ReloadPass* pass);
+static void _run_login_batch(Dispatcher* dispatcher, Vector* batch);
+static int _create_filter(ReloadFilter* filter);
+static void _destroy_filter(ReloadFilter* filter);
+static void _clear_filter(ReloadFilter* filter);
+static int _add_to_filter(ReloadFilter* filter, const char* classpath);
+static int _merge_filter(ReloadFilter* into, ReloadFilter* from);
+static size_t _dedup_uids(uid_t* uids, size_t nuids);
+static int _uid_cmp(const void* a, const void* b);
+
+int create_dispatcher(Dispatcher* dispatcher, Context* context,
+    uint64_t max_delay_usec)
+{
+    assert(dispatcher && context);
+
+    dispatcher->context = context;
+    dispatcher->max_delay_usec = max_delay_usec;
+    dispatcher->oldest_usec = 0;
+    dispatcher->requested_generation = 0;
+    if (create_vector(&dispatcher->pending, sizeof(uid_t)) < 0)
+        return -1;
+    if (_create_filter(&dispatcher->requested) < 0) {
+        destroy_vector(&dispatcher->pending);
+        return -1;
+    }
+
+    // Deadlines are computed from the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    int r = pthread_cond_init(&dispatcher->wakeup, &attr);
+    pthread_condattr_destroy(&attr);
+    if (r != 0) {
+        _destroy_filter(&dispatcher->requested);
+        destroy_vector(&dispatcher->pending);
+        errno = r;
+        return -1;
+    }
+    pthread_mutex_init(&dispatcher->lock, NULL);
+    return 0;
+}
+
+void destroy_dispatcher(Dispatcher* dispatcher)
+{
+    assert(dispatcher);
+
+    pthread_cond_destroy(&dispatcher->wakeup);
+    pthread_mutex_destroy(&dispatcher->lock);
+    _destroy_filter(&dispatcher->requested);
+    destroy_vector(&dispatcher->pending);
+}
+
+int queue_user(Dispatcher* dispatcher, uid_t uid)
+{
+    assert(dispatcher);
+
+    pthread_mutex_lock(&dispatcher->lock);
+    size_t count = get_vector_count(&dispatcher->pending);
+    if (count == 0)
+        dispatcher->oldest_usec = monotonic_usec();
+
+    int r = append_vector_item(&dispatcher->pending, &uid);
+
+    // Only wake the dispatcher when it has a new deadline or a full batch
+    if (r == 0 && (count == 0 || count + 1 >= MAX_DISPATCH_BATCH))
+        pthread_cond_signal(&dispatcher->wakeup);
+    pthread_mutex_unlock(&dispatcher->lock);
+    return r;
+}
+
+int queue_reload(Dispatcher* dispatcher, const char* classpath,
+    uint64_t generation)
+{
+    return queue_reloads(dispatcher, &classpath, 1, generation);
+}
+
+int queue_reloads(Dispatcher* dispatcher, const char* const* classpaths,
+    size_t npaths, uint64_t generation)
+{
+    assert(dispatcher && (classpaths || npaths == 0));
+
+    // All of them go in under the one lock, so the dispatcher can't start a
+    // pass on the generation with only some of them
+    pthread_mutex_lock(&dispatcher->lock);
+    int r = 0;
+    for (size_t n = 0; r == 0 && n < npaths; n++)
+        r = _add_to_filter(&dispatcher->requested, classpaths[n]);
+    if (r == 0 && npaths > 0) {
+        if (generation > dispatcher->requested_generation)
+            dispatcher->requested_generation = generation;
+        pthread_cond_signal(&dispatcher->wakeup);
+    }
+    pthread_mutex_unlock(&dispatcher->lock);
+    return r;
+}
+
+void* run_dispatcher(void* vargp)
+{
+    assert(vargp);
+    Dispatcher* dispatcher = vargp;
+
+    Vector batch = { 0 };
+    ReloadPass pass = { 0 };
+    if (create_vector(&batch, sizeof(uid_t)) < 0
+        || create_vector(&pass.uids, sizeof(uid_t)) < 0
+        || _create_filter(&pass.filter) < 0) {
+        log_message(LOG_ERR, "Failed to create dispatcher queues: %s", strerror(errno));
+        return NULL;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&dispatcher->lock);
+        while (!_has_work(dispatcher, &pass))
+            pthread_cond_wait(&dispatcher->wakeup, &dispatcher->lock);
+
+        // A newer reload supersedes whatever is left of the current pass
+        bool start_pass = _has_request(dispatcher, &pass);
+        if (start_pass) {
+            // The classes of an unfinished pass are carried over
+            if (pass.next < get_vector_count(&pass.uids)) {
+                log_message(LOG_NOTICE, "Cancelling %zu remaining users of reload "
+                                   "generation %lu",
+                    get_vector_count(&pass.uids) - pass.next,
+                    (unsigned long)pass.generation);
+            } else if (!pass.stale) {
+                _clear_filter(&pass.filter);
+            }
+            pass.stale = false;
+
+            if (_merge_filter(&pass.filter, &dispatcher->requested) < 0)
+                log_message(LOG_ERR, "Failed to merge reload passes: %s",
+                    strerror(errno));
+            _clear_filter(&dispatcher->requested);
+            pass.generation = dispatcher->requested_generation;
+        }
+
+        size_t npending = get_vector_count(&dispatcher->pending);
+        uint64_t deadline = dispatcher->oldest_usec + dispatcher->max_delay_usec;
+        bool logins_due = npending >= MAX_DISPATCH_BATCH
+            || (npending > 0 && monotonic_usec() >= deadline);
+        bool reloading = start_pass || pass.next < get_vector_count(&pass.uids);
+
+        // Let the batch fill up until the oldest user has waited long enough,
+        // unless there is reload work to get on with in the meantime
+        if (npending > 0 && !logins_due && !reloading) {
+            struct timespec ts = {
+                .tv_sec = deadline / 1000000,
+                .tv_nsec = (deadline % 1000000) * 1000,
+            };
+            pthread_cond_timedwait(&dispatcher->wakeup, &dispatcher->lock, &ts);
+            pthread_mutex_unlock(&dispatcher->lock);
+            continue;
+        }
+
+        if (logins_due) {
+            // Take the pending users and leave our empty vector in their place
+            Vector tmp = dispatcher->pending;
+            dispatcher->pending = batch;
+            batch = tmp;
+        }
+        pthread_mutex_unlock(&dispatcher->lock);
+
+        if (start_pass)
+            _start_reload_pass(dispatcher, &pass);
+
+        // New users always go before reload work
+        if (logins_due)
+            _run_login_batch(dispatcher, &batch);
+        else
+            _run_reload_chunk(dispatcher, &pass);
+    }
+
+    _destroy_filter(&pass.filter);
+    destroy_vector(&pass.uids);
+    destroy_vector(&batch);
+    return NULL;
+}
+
+/*
+ * Returns whether the dispatcher has anything to do. Must be called with the
+ * dispatcher locked.
+ */
+static bool
+_has_work(Dispatcher* dispatcher, ReloadPass* pass)
+{
+    return get_vector_count(&dispatcher->pending) > 0
+        || _has_request(dispatcher, pass)
+        || pass->next < get_vector_count(&pass->uids);
+}
+
+/*
+ * Returns whether a reload was queued that the pass hasn't taken over. One
+ * queued at the generation the pass already has still counts, so its classes
+ * aren't left behind. Must be called with the dispatcher locked.
+ */
+static bool
+_has_request(Dispatcher* dispatcher, ReloadPass* pass)
+{
+    return dispatcher->requested_generation > pass->generation
+        || dispatcher->requested.all
+        || get_vector_count(&dispatcher->requested.classpaths) > 0;
+}
+
+/*
+ * Fills the pass with the currently active users of its classes.
+ */
+static void
+_start_reload_pass(Dispatcher* dispatcher, ReloadPass* pass)
+{
+    clear_vector(&pass->uids);
+    pass->next = 0;
+    pass->start_usec = monotonic_usec();
+    if (_list_pass_users(dispatcher, pass) < 0) {
+        log_message(LOG_ERR, "Failed to start reload generation %lu: %s",
+            (unsigned long)pass->generation, strerror(errno));
+        clear_vector(&pass->uids);
+        return;
+    }
+
+    log_message(LOG_INFO, "Starting reload generation %lu over %zu active users",
+        (unsigned long)pass->generation, get_vector_count(&pass->uids));
+}
+
+/*
+ * Fills the pass with the active members of its classes, or with every active
+ * user if it reloads every class or the members aren't known. Returns -1 if
+ * there was an error (and errno should be looked up), otherwise 0.
+ */
+static int
+_list_pass_users(Dispatcher* dispatcher, ReloadPass* pass)
+{
+    Context* context = dispatcher->context;
+    if (pass->filter.all || !context->membership)
+        return list_active_users(context, &pass->uids);
+
+    size_t npaths = get_vector_count(&pass->filter.classpaths);
+    for (size_t n = 0; n < npaths; n++) {
+        char* classpath = *(char**)get_vector_item(&pass->filter.classpaths, n);
+        if (list_class_members(context->membership, classpath, &pass->uids) < 0) {
+            clear_vector(&pass->uids);
+            return list_active_users(context, &pass->uids);
+        }
+    }
+
+    // A user is only ever in one class, so there are no duplicates
+    return 0;
+}
+
+/*
+ * Enforces the next chunk of users in the reload pass.
+ */
+static void
+_run_reload_chunk(Dispatcher* dispatcher, ReloadPass* pass)
+{
+    size_t nuids = get_vector_count(&pass->uids);
+    if (pass->next >= nuids)
+        return;
+
+    size_t chunk = nuids - pass->next;
+    if (chunk > RELOAD_CHUNK_SIZE)
+        chunk = RELOAD_CHUNK_SIZE;
+
+    uid_t* uids = get_vector_item(&pass->uids, pass->next);
+    Vector* classpaths = pass->filter.all ? NULL : &pass->filter.classpaths;
+    int failures = enforce_users(dispatcher->context, uids, chunk, classpaths,
+        pass->generation);
+    if (failures < 0 && errno != ECANCELED) {
+        log_message(LOG_ERR, "Failed to enforce reload generation %lu: %s",
+            (unsigned long)pass->generation, strerror(errno));
+    } else if (failures < 0) {
+        // A newer reload is queued and will pick up the rest of our classes
+        log_message(LOG_INFO, "Reload generation %lu is stale; dropping %zu users",
+            (unsigned long)pass->generation, nuids - pass->next);
+        pass->next = nuids;
+        pass->stale = true;
+        return;
+    }
+    if (failures > 0)
+        log_message(LOG_WARNING, "Failed to enforce classes on %d of %zu users",
+            failures, chunk);
+
+    pass->next += chunk;
+    if (pass->next == nuids)
+        log_message(LOG_INFO, "Finished reload generation %lu in %lu ms",
+            (unsigned long)pass->generation,
+            (unsigned long)((monotonic_usec() - pass->start_usec) / 1000));
+}
+
+/*
+ * Enforces the batch of new users and empties it.
+ */
+static void
+_run_login_batch(Dispatcher* dispatcher, Vector* batch)
+{
+    size_t queued = get_vector_count(batch);
+    size_t nuids = _dedup_uids(pretend_vector_is_array(batch), queued);
+    log_message(LOG_INFO, "Dispatching %zu users (%zu queued)", nuids, queued);
+
+    int failures = enforce_users(dispatcher->context,
+        pretend_vector_is_array(batch), nuids, NULL, 0);
+    if (failures < 0)
+        log_message(LOG_ERR, "Failed to dispatch users: %s", strerror(errno));
+    else if (failures > 0)
+        log_message(LOG_WARNING, "Failed to enforce classes on %d of %zu users",
+            failures, nuids);
+
+    clear_vector(batch);
+}
+
+/*
+ * Creates an empty filter. Returns -1 if there was an error (and errno
+ * should be looked up), otherwise 0.
+ */
+static int
+_create_filter(ReloadFilter* filter)
+{
+    filter->all = false;
+    return create_vector(&filter->classpaths, sizeof(char*));
+}
+
+/*
+ * Destroys the filter and its classpaths.
+ */
+static void
+_destroy_filter(ReloadFilter* filter)
+{
+    _clear_filter(filter);
+    destroy_vector(&filter->classpaths);
+}
+
+/*
+ * Empties the filter so that it matches no classes.
+ */
+static void
+_clear_filter(ReloadFilter* filter)
+{
+    char** classpath = NULL;
+    while ((classpath = iter_vector(&filter->classpaths)))
+        free(*classpath);
+    clear_vector(&filter->classpaths);
+    filter->all = false;
+}
+
+/*
+ * Adds the classpath to the filter, or every class if classpath is NULL.
+ * Returns -1 if there was an error (and errno should be looked up),
+ * otherwise 0.
+ */
+static int
+_add_to_filter(ReloadFilter* filter, const char* classpath)
+{
+    if (!classpath) {
+        _clear_filter(filter);
+        filter->all = true;
+        return 0;
+    }
+    if (filter->all)
+        return 0;
+
+    char** existing = NULL;
+    while ((existing = iter_vector(&filter->classpaths))) {
+        if (strcmp(*existing, classpath) == 0) {
+            iter_vector_end(&filter->classpaths);
+            return 0;
+        }
+    }
+
+    char* copy = strdup(classpath);
+    if (!copy)
+        return -1;
+    if (append_vector_item(&filter->classpaths, &copy) < 0) {
+        free(copy);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Adds the classes of one filter to another. Returns -1 if there was an
+ * error (and errno should be looked up), otherwise 0.
+ */
+static int
+_merge_filter(ReloadFilter* into, ReloadFilter* from)
+{
+    if (from->all)
+        return _add_to_filter(into, NULL);
+
+    size_t npaths = get_vector_count(&from->classpaths);
+    for (size_t n = 0; n < npaths; n++)
+        if (_add_to_filter(into, *(char**)get_vector_item(&from->classpaths, n)) < 0)
+            return -1;
+    return 0;
+}
+
+/*
+ * Sorts the uids and moves the unique ones to the front. Returns the number
+ * of unique uids.
+ */
+static size_t
+_dedup_uids(uid_t* uids, size_t nuids)
+{
+    if (nuids < 2)
+        return nuids;
+
+    qsort(uids, nuids, sizeof *uids, _uid_cmp);
+    size_t unique = 1;
+    for (size_t n = 1; n < nuids; n++)
+        if (uids[n] != uids[unique - 1])
+            uids[unique++] = uids[n];
+    return unique;
+}
+
+/*
+ * Compares two uids for qsort.
+ */
+static int
+_uid_cmp(const void* a, const void* b)
+{
+    uid_t left = *(const uid_t*)a;
+    uid_t right = *(const uid_t*)b;
+    return (left > right) - (left < right);
+}
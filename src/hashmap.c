@@ -1,126 +1,173 @@
-#define _GNU_SOURCE // (search.h)
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
-#include <search.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "hashmap.h"
+#include "utils.h"
 
-int create_hashmap(HashMap* map, size_t value_size, size_t max_size)
+#define HASHMAP_MIN_SLOTS 8
+// Entries are aligned like malloc'd memory, since values may hold anything
+#define HASHMAP_ALIGN 16
+
+int _create_hashmap(HashMap* map, size_t value_size, size_t size,
+    Arena* arena);
+HashMapEntry* _get_entry(HashMap* map, size_t index);
+size_t _find_slot(HashMap* map, const char* key, uint64_t hash);
+int _grow_entries(HashMap* map);
+int _rehash(HashMap* map, size_t nslots);
+void _remove_slot(HashMap* map, size_t hole);
+
+int create_hashmap(HashMap* map, size_t value_size, size_t size)
 {
     assert(map);
-    map->value_size = value_size;
+    return _create_hashmap(map, value_size, size, NULL);
+}
 
-    memset(&map->data, 0, sizeof map->data);
-    int r = hcreate_r(max_size, &map->data);
-    if (!r)
-        return -1;
+int create_hashmap_in_arena(HashMap* map, size_t value_size, size_t size,
+    Arena* arena)
+{
+    assert(arena);
 
-    r = create_vector(&map->keys, sizeof(char*));
+    int r = create_hashmap(map, value_size, size);
     if (r < 0)
-        return -1;
-
+        return r;
+    map->arena = ref_arena(arena);
     return 0;
 }
 
+int create_hashmap_from_arena(HashMap* map, size_t value_size, size_t size,
+    Arena* arena)
+{
+    assert(map && arena);
+    return _create_hashmap(map, value_size, size, arena);
+}
+
 void destroy_hashmap(HashMap* map)
 {
     assert(map);
 
-    char** key;
-    while ((key = iter_vector(&map->keys))) {
-        // Safe to modify things because hashmap owns things
-        free(get_hashmap_entry(map, *key));
-        free(*key);
+    for (size_t n = 0; !map->arena && n < map->count; n++)
+        free(_get_entry(map, n)->key);
+    if (!map->arena_backed) {
+        free(map->entries);
+        free(map->slots);
     }
-    iter_vector_end(&map->keys);
-
-    destroy_vector(&map->keys);
-    hdestroy_r(&map->data);
-}
-
-/*
- * Returns the entry as a allocated null terminated char array.
- */
-char* _mangle_value(const void* value, size_t value_size)
-{
-    char* mangled = malloc(value_size + 1); // value + '\0'
-    memcpy(mangled, value, value_size);
-    mangled[value_size] = '\0';
-    return mangled;
+    unref_arena(map->arena);
+    memset(map, 0, sizeof *map);
 }
 
 int add_hashmap_entry(HashMap* map, char* key, void* value)
 {
-    assert(map);
-    ENTRY* entry_ptr = NULL;
-    ENTRY entry = { key, NULL };
+    assert(map && key && value);
 
-    // hsearch never replaces entries so we must check if the key is in there
-    int r = hsearch_r(entry, FIND, &entry_ptr, &map->data);
-    if (!r) {
-        if (errno != ESRCH)
-            return -1;
+    uint64_t hash = fnv1a_hash(FNV1A_OFFSET, key, strlen(key));
+    size_t slot = _find_slot(map, key, hash);
+    if (map->slots[slot]) {
+        // Found; replace
+        HashMapEntry* entry = _get_entry(map, map->slots[slot] - 1);
+        memcpy(entry + 1, value, map->value_size);
+        return 0;
+    }
 
-        // Not found; insert
-        entry.key = strdup(key);
-        entry.data = _mangle_value(value, map->value_size);
-        if (!entry.key || !entry.data)
+    if (map->count >= UINT32_MAX - 1) {
+        errno = ENOSPC;
+        return -1;
+    }
+    if ((map->count + 1) * 4 > map->nslots * 3) {
+        if (_rehash(map, map->nslots * 2) < 0)
             return -1;
+        slot = _find_slot(map, key, hash);
+    }
+    if (map->count == map->capacity && _grow_entries(map) < 0)
+        return -1;
 
-        r = hsearch_r(entry, ENTER, &entry_ptr, &map->data);
-        if (!r)
-            return -1;
+    char* copy = map->arena ? (char*)arena_intern(map->arena, key) : strdup(key);
+    if (!copy)
+        return -1;
 
-        append_vector_item(&map->keys, &entry.key);
-    } else {
-        // found; replace
-        char* mangled = _mangle_value(value, map->value_size);
-        if (!mangled)
-            return -1;
+    HashMapEntry* entry = _get_entry(map, map->count);
+    entry->key = copy;
+    entry->hash = hash;
+    memcpy(entry + 1, value, map->value_size);
+    map->slots[slot] = ++map->count;
+    return 0;
+}
 
-        free(entry_ptr->data);
-        entry_ptr->data = mangled;
+int remove_hashmap_entry(HashMap* map, const char* key, void* removed)
+{
+    assert(map && key);
+
+    uint64_t hash = fnv1a_hash(FNV1A_OFFSET, key, strlen(key));
+    size_t slot = _find_slot(map, key, hash);
+    if (!map->slots[slot]) {
+        errno = ENOENT;
+        return -1;
     }
+
+    size_t index = map->slots[slot] - 1;
+    HashMapEntry* entry = _get_entry(map, index);
+    if (removed)
+        memcpy(removed, entry + 1, map->value_size);
+    if (!map->arena)
+        free(entry->key);
+    _remove_slot(map, slot);
+
+    // Keep the order by shifting the later entries down, then point the
+    // slots at where they moved to
+    memmove(entry, (char*)entry + map->entry_size,
+        (map->count - index - 1) * map->entry_size);
+    map->count--;
+    for (size_t n = 0; n < map->nslots; n++)
+        if (map->slots[n] > index + 1)
+            map->slots[n]--;
     return 0;
 }
 
 void* get_hashmap_entry(HashMap* map, char* key)
 {
-    assert(map);
-    ENTRY* entry_ptr = NULL;
-    ENTRY entry = { key, NULL };
+    assert(map && key);
 
-    hsearch_r(entry, FIND, &entry_ptr, &map->data);
-    if (!entry_ptr)
+    uint64_t hash = fnv1a_hash(FNV1A_OFFSET, key, strlen(key));
+    size_t slot = _find_slot(map, key, hash);
+    if (!map->slots[slot])
         return NULL;
-    return entry_ptr->data;
+    return _get_entry(map, map->slots[slot] - 1) + 1;
+}
+
+void get_hashmap_entry_at(HashMap* map, size_t index, char** key, void** value)
+{
+    assert(map);
+    assert(index < map->count);
+
+    HashMapEntry* entry = _get_entry(map, index);
+    if (key)
+        *key = entry->key;
+    if (value)
+        *value = entry + 1;
 }
 
 size_t
 get_hashmap_count(HashMap* map)
 {
     assert(map);
-    return get_vector_count(&map->keys);
+    return map->count;
 }
 
 void iter_hashmap(HashMap* map, char** key, void** value)
 {
     assert(map);
 
-    char** map_key = iter_vector(&map->keys);
-    if (!map_key) {
+    if (map->iter_count >= map->count) {
         if (key)
             *key = NULL;
         if (value)
             *value = NULL;
-    } else {
-        if (key)
-            *key = *map_key;
-        if (value)
-            *value = get_hashmap_entry(map, *map_key);
+        return;
     }
+    get_hashmap_entry_at(map, map->iter_count++, key, value);
 }
 
 void* iter_hashmap_values(HashMap* map)
@@ -133,5 +180,126 @@ void* iter_hashmap_values(HashMap* map)
 void iter_hashmap_end(HashMap* map)
 {
     assert(map);
-    iter_vector_end(&map->keys);
+    map->iter_count = 0;
+}
+
+/*
+ * Creates a hashmap as described by create_hashmap, with its entries and
+ * slots allocated from the arena if it isn't NULL.
+ */
+int _create_hashmap(HashMap* map, size_t value_size, size_t size, Arena* arena)
+{
+    HashMap created = { 0 };
+    created.arena = arena;
+    created.arena_backed = arena != NULL;
+    created.value_size = value_size;
+    created.entry_size = (sizeof(HashMapEntry) + value_size + HASHMAP_ALIGN - 1)
+        & ~(size_t)(HASHMAP_ALIGN - 1);
+
+    // Slots are kept at most three quarters full
+    size_t nslots = HASHMAP_MIN_SLOTS;
+    while (nslots / 4 * 3 < size)
+        nslots *= 2;
+    if (_rehash(&created, nslots) < 0)
+        return -1;
+
+    if (arena)
+        ref_arena(arena);
+    memcpy(map, &created, sizeof created);
+    return 0;
+}
+
+/*
+ * Returns the entry at the given index.
+ */
+HashMapEntry* _get_entry(HashMap* map, size_t index)
+{
+    return (HashMapEntry*)(map->entries + index * map->entry_size);
+}
+
+/*
+ * Returns the slot of the key, or the empty slot it would go in.
+ */
+size_t _find_slot(HashMap* map, const char* key, uint64_t hash)
+{
+    size_t mask = map->nslots - 1;
+    size_t slot = hash & mask;
+    while (map->slots[slot]) {
+        HashMapEntry* entry = _get_entry(map, map->slots[slot] - 1);
+        if (entry->hash == hash && strcmp(entry->key, key) == 0)
+            break;
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/*
+ * Empties the slot, moving back the slots after it whose probe sequence
+ * passed through it, so they can still be found.
+ */
+void _remove_slot(HashMap* map, size_t hole)
+{
+    size_t mask = map->nslots - 1;
+    for (size_t next = (hole + 1) & mask; map->slots[next]; next = (next + 1) & mask) {
+        size_t home = _get_entry(map, map->slots[next] - 1)->hash & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            map->slots[hole] = map->slots[next];
+            hole = next;
+        }
+    }
+    map->slots[hole] = 0;
+}
+
+/*
+ * Doubles the room for entries. Returns -1 if there was an error (and errno
+ * should be looked up), otherwise 0.
+ */
+int _grow_entries(HashMap* map)
+{
+    size_t capacity = map->capacity ? map->capacity * 2 : HASHMAP_MIN_SLOTS;
+    char* entries = NULL;
+    if (map->arena_backed) {
+        // The old entries stay behind in the arena
+        entries = arena_alloc(map->arena, capacity * map->entry_size);
+        if (entries && map->count > 0)
+            memcpy(entries, map->entries, map->count * map->entry_size);
+    } else {
+        entries = realloc(map->entries, capacity * map->entry_size);
+    }
+    if (!entries)
+        return -1;
+    map->entries = entries;
+    map->capacity = capacity;
+    return 0;
+}
+
+/*
+ * Rebuilds the slots with the given number of them (a power of two). Returns
+ * -1 if there was an error (and errno should be looked up), otherwise 0.
+ */
+int _rehash(HashMap* map, size_t nslots)
+{
+    uint32_t* slots = NULL;
+    if (map->arena_backed) {
+        slots = arena_alloc(map->arena, nslots * sizeof *slots);
+        if (slots)
+            memset(slots, 0, nslots * sizeof *slots);
+    } else {
+        slots = calloc(nslots, sizeof *slots);
+    }
+    if (!slots)
+        return -1;
+    if (!map->arena_backed)
+        free(map->slots);
+    map->slots = slots;
+    map->nslots = nslots;
+
+    size_t mask = nslots - 1;
+    for (size_t n = 0; n < map->count; n++) {
+        size_t slot = _get_entry(map, n)->hash & mask;
+        while (slots[slot])
+            slot = (slot + 1) & mask;
+        slots[slot] = n + 1;
+    }
+    return 0;
 }
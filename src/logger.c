@@ -0,0 +1,344 @@
+// SPDX-License-Identifier: GPL-3.0
+#define _GNU_SOURCE // (program_invocation_short_name)
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <syslog.h>
+#include <systemd/sd-journal.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "utils.h"
+
+/*
+ * A slot in the ring. The sequence tells producers and the writer whose turn
+ * it is to touch the rest of the slot.
+ */
+typedef struct LogEntry {
+    atomic_size_t sequence;
+    int priority;
+    bool has_uid;
+    uid_t uid;
+    uint64_t duration_usec;
+    char classname[LOG_CLASS_SIZE];
+    char message[LOG_MSG_SIZE];
+} LogEntry;
+
+/*
+ * The writer's bookkeeping for rate limiting.
+ */
+typedef struct LogLimiter {
+    char last[LOG_MSG_SIZE];
+    int last_priority;
+    uint64_t repeats;
+    uint64_t window_start_usec;
+    unsigned int window_count;
+    uint64_t window_suppressed;
+    uint64_t reported_dropped;
+} LogLimiter;
+
+static void _vlog(int priority, bool has_uid, uid_t uid,
+    const char* classpath, uint64_t duration_usec, const char* fmt,
+    va_list args);
+static void* _log_writer(void* vargp);
+static void _limit_entry(LogLimiter* limiter, LogEntry* entry);
+static void _flush_limiter(LogLimiter* limiter);
+static void _send_entry(LogEntry* entry);
+static void _send_notice(int priority, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static LogEntry ring[LOG_RING_SIZE];
+static atomic_size_t enqueue_pos;
+static size_t dequeue_pos; // Only touched by the writer
+static atomic_bool running;
+static bool echo_stderr;
+static atomic_uint_fast64_t dropped;
+static atomic_uint_fast64_t suppressed;
+// Mirrors the syslog mask, since setlogmask takes syslog's lock to read it
+static atomic_int log_mask = LOG_UPTO(LOG_DEBUG);
+// The writer blocks on wakeup_fd once the ring is empty, and says so in
+// writer_sleeping so that producers know to wake it
+static int wakeup_fd = -1;
+static atomic_bool writer_sleeping;
+
+int start_logger(bool echo)
+{
+    if (atomic_load(&running))
+        return 0;
+
+    for (size_t n = 0; n < LOG_RING_SIZE; n++)
+        atomic_init(&ring[n].sequence, n);
+    atomic_init(&enqueue_pos, 0);
+    dequeue_pos = 0;
+    echo_stderr = echo;
+    atomic_init(&writer_sleeping, false);
+    wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (wakeup_fd < 0)
+        return -1;
+
+    pthread_t tid = 0;
+    int r = pthread_create(&tid, NULL, _log_writer, NULL);
+    if (r != 0) {
+        close(wakeup_fd);
+        wakeup_fd = -1;
+        errno = r;
+        return -1;
+    }
+    pthread_detach(tid);
+
+    atomic_store_explicit(&running, true, memory_order_release);
+    return 0;
+}
+
+void set_log_mask(int mask)
+{
+    setlogmask(mask);
+    atomic_store_explicit(&log_mask, mask, memory_order_relaxed);
+}
+
+void log_message(int priority, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    _vlog(priority, false, 0, NULL, 0, fmt, args);
+    va_end(args);
+}
+
+void log_user_event(int priority, uid_t uid, const char* classpath,
+    uint64_t duration_usec, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    _vlog(priority, true, uid, classpath, duration_usec, fmt, args);
+    va_end(args);
+}
+
+void get_log_stats(LogStats* stats)
+{
+    assert(stats);
+    stats->dropped = atomic_load(&dropped);
+    stats->suppressed = atomic_load(&suppressed);
+}
+
+/*
+ * Claims a slot in the ring and formats the message into it. Falls back to
+ * syslog if the writer hasn't been started.
+ */
+static void
+_vlog(int priority, bool has_uid, uid_t uid, const char* classpath,
+    uint64_t duration_usec, const char* fmt, va_list args)
+{
+    // Respect the mask set with set_log_mask before doing any work
+    if (!(atomic_load_explicit(&log_mask, memory_order_relaxed)
+            & LOG_MASK(LOG_PRI(priority))))
+        return;
+
+    if (!atomic_load_explicit(&running, memory_order_acquire)) {
+        vsyslog(priority, fmt, args);
+        return;
+    }
+
+    LogEntry* entry = NULL;
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        entry = &ring[pos & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&entry->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos,
+                    pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // The writer is a full lap behind; never block the caller
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    entry->priority = priority;
+    entry->has_uid = has_uid;
+    entry->uid = uid;
+    entry->duration_usec = duration_usec;
+    entry->classname[0] = '\0';
+    if (classpath)
+        snprintf(entry->classname, sizeof entry->classname, "%s",
+            basename(classpath));
+    vsnprintf(entry->message, sizeof entry->message, fmt, args);
+
+    atomic_store(&entry->sequence, pos + 1);
+    // Only the producer that finds the writer asleep pays for the wakeup
+    if (atomic_load(&writer_sleeping) && atomic_exchange(&writer_sleeping, false)) {
+        uint64_t one = 1;
+        ssize_t r = write(wakeup_fd, &one, sizeof one);
+        (void)r;
+    }
+}
+
+/*
+ * Drains the ring into the journal forever, sleeping whenever it's empty.
+ */
+static void*
+_log_writer(void* vargp)
+{
+    (void)vargp;
+    LogLimiter limiter = { 0 };
+
+    for (;;) {
+        LogEntry* entry = &ring[dequeue_pos & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load(&entry->sequence);
+        if (seq != dequeue_pos + 1) {
+            // Nothing ready; catch up on the bookkeeping and wait. Whatever
+            // was published before we said we're asleep is seen by the
+            // recheck, and whatever after wakes us
+            _flush_limiter(&limiter);
+            atomic_store(&writer_sleeping, true);
+            if (atomic_load(&entry->sequence) == dequeue_pos + 1) {
+                atomic_store(&writer_sleeping, false);
+                continue;
+            }
+            uint64_t wakeups = 0;
+            while (read(wakeup_fd, &wakeups, sizeof wakeups) < 0
+                && errno == EINTR)
+                ;
+            continue;
+        }
+
+        _limit_entry(&limiter, entry);
+        atomic_store_explicit(&entry->sequence, dequeue_pos + LOG_RING_SIZE,
+            memory_order_release);
+        dequeue_pos++;
+    }
+    return NULL;
+}
+
+/*
+ * Sends the entry unless it repeats the last message or the burst limit has
+ * been hit in this interval.
+ */
+static void
+_limit_entry(LogLimiter* limiter, LogEntry* entry)
+{
+    if (entry->priority == limiter->last_priority
+        && strcmp(entry->message, limiter->last) == 0) {
+        limiter->repeats++;
+        atomic_fetch_add_explicit(&suppressed, 1, memory_order_relaxed);
+        return;
+    }
+    if (limiter->repeats > 0) {
+        _send_notice(limiter->last_priority, "Last message repeated %lu times",
+            (unsigned long)limiter->repeats);
+        limiter->repeats = 0;
+    }
+
+    uint64_t now = monotonic_usec();
+    if (now - limiter->window_start_usec >= LOG_RATE_INTERVAL_USEC) {
+        if (limiter->window_suppressed > 0)
+            _send_notice(LOG_WARNING, "Suppressed %lu log messages",
+                (unsigned long)limiter->window_suppressed);
+        limiter->window_start_usec = now;
+        limiter->window_count = 0;
+        limiter->window_suppressed = 0;
+    }
+    if (limiter->window_count >= LOG_RATE_BURST) {
+        limiter->window_suppressed++;
+        atomic_fetch_add_explicit(&suppressed, 1, memory_order_relaxed);
+        return;
+    }
+    limiter->window_count++;
+
+    _send_entry(entry);
+    limiter->last_priority = entry->priority;
+    memcpy(limiter->last, entry->message, sizeof limiter->last);
+}
+
+/*
+ * Reports on repeats and drops that haven't been reported yet.
+ */
+static void
+_flush_limiter(LogLimiter* limiter)
+{
+    if (limiter->repeats > 0) {
+        _send_notice(limiter->last_priority, "Last message repeated %lu times",
+            (unsigned long)limiter->repeats);
+        limiter->repeats = 0;
+    }
+    // Only back to back messages count as repeats
+    limiter->last[0] = '\0';
+
+    uint64_t total_dropped = atomic_load_explicit(&dropped, memory_order_relaxed);
+    if (total_dropped > limiter->reported_dropped) {
+        _send_notice(LOG_WARNING, "Dropped %lu log messages (log ring full)",
+            (unsigned long)(total_dropped - limiter->reported_dropped));
+        limiter->reported_dropped = total_dropped;
+    }
+}
+
+/*
+ * Writes the entry into the journal with its structured fields.
+ */
+static void
+_send_entry(LogEntry* entry)
+{
+    char message[LOG_MSG_SIZE + 8];
+    char priority[16];
+    char identifier[64];
+    char uid[32];
+    char classname[LOG_CLASS_SIZE + 16];
+    char duration[48];
+
+    struct iovec iov[6];
+    int n = 0;
+    iov[n].iov_base = message;
+    iov[n++].iov_len = snprintf(message, sizeof message, "MESSAGE=%s",
+        entry->message);
+    iov[n].iov_base = priority;
+    iov[n++].iov_len = snprintf(priority, sizeof priority, "PRIORITY=%d",
+        LOG_PRI(entry->priority));
+    iov[n].iov_base = identifier;
+    iov[n++].iov_len = snprintf(identifier, sizeof identifier,
+        "SYSLOG_IDENTIFIER=%s", program_invocation_short_name);
+    if (entry->has_uid) {
+        iov[n].iov_base = uid;
+        iov[n++].iov_len = snprintf(uid, sizeof uid, "USERCTL_UID=%u",
+            entry->uid);
+    }
+    if (entry->classname[0] != '\0') {
+        iov[n].iov_base = classname;
+        iov[n++].iov_len = snprintf(classname, sizeof classname,
+            "USERCTL_CLASS=%s", entry->classname);
+    }
+    if (entry->duration_usec > 0) {
+        iov[n].iov_base = duration;
+        iov[n++].iov_len = snprintf(duration, sizeof duration,
+            "USERCTL_DURATION_USEC=%lu", (unsigned long)entry->duration_usec);
+    }
+
+    sd_journal_sendv(iov, n);
+    if (echo_stderr)
+        fprintf(stderr, "%s\n", entry->message);
+}
+
+/*
+ * Sends a message of the writer's own straight to the journal.
+ */
+static void
+_send_notice(int priority, const char* fmt, ...)
+{
+    LogEntry entry = { .priority = priority };
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(entry.message, sizeof entry.message, fmt, args);
+    va_end(args);
+    _send_entry(&entry);
+}
@@ -0,0 +1,404 @@
+// SPDX-License-Identifier: GPL-3.0
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "arena.h"
+#include "hashmap.h"
+#include "membership.h"
+#include "typedvector.h"
+#include "vector.h"
+
+static int _track_user(Membership* membership, uid_t uid);
+static int _join_class(Membership* membership, uid_t uid,
+    const char* classpath);
+static void _leave_class(Membership* membership, uid_t uid,
+    const char* classpath);
+
+int create_membership(Membership* membership)
+{
+    assert(membership);
+
+    membership->classpaths = create_arena();
+    if (!membership->classpaths)
+        return -1;
+    if (create_hashmap(&membership->users, sizeof(const char*), 0) < 0)
+        goto error;
+    if (create_hashmap_in_arena(&membership->classes, sizeof(UidVector), 0,
+            membership->classpaths)
+        < 0) {
+        destroy_hashmap(&membership->users);
+        goto error;
+    }
+    if (create_hashmap(&membership->enforcements, sizeof(EnforceStatus), 0)
+        < 0) {
+        destroy_hashmap(&membership->classes);
+        destroy_hashmap(&membership->users);
+        goto error;
+    }
+    if (create_hashmap(&membership->groups, sizeof(GidVector), 0) < 0) {
+        destroy_hashmap(&membership->enforcements);
+        destroy_hashmap(&membership->classes);
+        destroy_hashmap(&membership->users);
+        goto error;
+    }
+    membership->complete = false;
+    pthread_mutex_init(&membership->lock, NULL);
+    return 0;
+
+error:
+    unref_arena(membership->classpaths);
+    return -1;
+}
+
+void destroy_membership(Membership* membership)
+{
+    assert(membership);
+
+    UidVector* members = NULL;
+    while ((members = iter_hashmap_values(&membership->classes)))
+        destroy_uid_vector(members);
+    destroy_hashmap(&membership->classes);
+    GidVector* gids = NULL;
+    while ((gids = iter_hashmap_values(&membership->groups)))
+        destroy_gid_vector(gids);
+    destroy_hashmap(&membership->groups);
+    destroy_hashmap(&membership->users);
+    destroy_hashmap(&membership->enforcements);
+    unref_arena(membership->classpaths);
+    pthread_mutex_destroy(&membership->lock);
+}
+
+int track_active_users(Membership* membership, const uid_t* uids,
+    size_t nuids)
+{
+    assert(membership && (uids || nuids == 0));
+
+    int r = 0;
+    pthread_mutex_lock(&membership->lock);
+    for (size_t n = 0; r == 0 && n < nuids; n++)
+        r = _track_user(membership, uids[n]);
+    if (r == 0)
+        membership->complete = true;
+    pthread_mutex_unlock(&membership->lock);
+    return r;
+}
+
+int track_user(Membership* membership, uid_t uid)
+{
+    assert(membership);
+
+    pthread_mutex_lock(&membership->lock);
+    int r = _track_user(membership, uid);
+    pthread_mutex_unlock(&membership->lock);
+    return r;
+}
+
+const char* forget_user(Membership* membership, uid_t uid)
+{
+    assert(membership);
+
+    char key[16];
+    snprintf(key, sizeof key, "%u", uid);
+
+    const char* left = NULL;
+    pthread_mutex_lock(&membership->lock);
+    const char** classpath = get_hashmap_entry(&membership->users, key);
+    if (classpath) {
+        left = *classpath;
+        if (left)
+            _leave_class(membership, uid, left);
+        remove_hashmap_entry(&membership->users, key, NULL);
+    }
+    remove_hashmap_entry(&membership->enforcements, key, NULL);
+    GidVector gids;
+    if (remove_hashmap_entry(&membership->groups, key, &gids) == 0)
+        destroy_gid_vector(&gids);
+    pthread_mutex_unlock(&membership->lock);
+    return left;
+}
+
+int set_user_class(Membership* membership, uid_t uid, const char* classpath,
+    const char** previous)
+{
+    assert(membership);
+
+    char key[16];
+    snprintf(key, sizeof key, "%u", uid);
+
+    int r = 0;
+    pthread_mutex_lock(&membership->lock);
+    const char** current = get_hashmap_entry(&membership->users, key);
+    if (!current)
+        goto cleanup;
+    // Users in no class stay in no class
+    if (!*current && !classpath)
+        goto cleanup;
+    if (*current && classpath && strcmp(*current, classpath) == 0)
+        goto cleanup;
+
+    const char* joined = NULL;
+    if (classpath) {
+        joined = arena_intern(membership->classpaths, classpath);
+        if (!joined || _join_class(membership, uid, joined) < 0) {
+            r = -1;
+            goto cleanup;
+        }
+    }
+    if (*current)
+        _leave_class(membership, uid, *current);
+    if (previous)
+        *previous = *current;
+    *current = joined;
+    r = 1;
+
+cleanup:
+    pthread_mutex_unlock(&membership->lock);
+    return r;
+}
+
+int record_enforcement(Membership* membership, uid_t uid,
+    const EnforceStatus* status)
+{
+    assert(membership && status && status->classpath);
+
+    char key[16];
+    snprintf(key, sizeof key, "%u", uid);
+
+    int r = 0;
+    pthread_mutex_lock(&membership->lock);
+    if (!get_hashmap_entry(&membership->users, key))
+        goto cleanup;
+
+    EnforceStatus recorded = *status;
+    recorded.classpath = arena_intern(membership->classpaths, status->classpath);
+    if (!recorded.classpath) {
+        r = -1;
+        goto cleanup;
+    }
+    EnforceStatus* last = get_hashmap_entry(&membership->enforcements, key);
+    if (last)
+        *last = recorded;
+    else
+        r = add_hashmap_entry(&membership->enforcements, key, &recorded);
+
+cleanup:
+    pthread_mutex_unlock(&membership->lock);
+    return r;
+}
+
+int record_user_groups(Membership* membership, uid_t uid, const gid_t* gids,
+    size_t ngids)
+{
+    assert(membership && (gids || ngids == 0));
+
+    char key[16];
+    snprintf(key, sizeof key, "%u", uid);
+
+    // Copied and sorted before locking, since most users' groups don't change
+    GidVector recorded;
+    create_gid_vector(&recorded);
+    if (ensure_gid_vector_capacity(&recorded, ngids) < 0)
+        return -1;
+    for (size_t n = 0; n < ngids; n++)
+        append_gid_vector_item(&recorded, gids[n]);
+    sort_gid_vector(&recorded);
+
+    int r = 0;
+    pthread_mutex_lock(&membership->lock);
+    if (!get_hashmap_entry(&membership->users, key)) {
+        destroy_gid_vector(&recorded);
+        goto cleanup;
+    }
+    GidVector* last = get_hashmap_entry(&membership->groups, key);
+    if (last) {
+        destroy_gid_vector(last);
+        *last = recorded;
+    } else if ((r = add_hashmap_entry(&membership->groups, key, &recorded)) < 0) {
+        destroy_gid_vector(&recorded);
+    }
+
+cleanup:
+    pthread_mutex_unlock(&membership->lock);
+    return r;
+}
+
+int get_user_groups(Membership* membership, uid_t uid, GidVector* gids)
+{
+    assert(membership && gids);
+
+    char key[16];
+    snprintf(key, sizeof key, "%u", uid);
+
+    create_gid_vector(gids);
+    int r = 0;
+    pthread_mutex_lock(&membership->lock);
+    GidVector* last = get_hashmap_entry(&membership->groups, key);
+    if (!last) {
+        errno = ENOENT;
+        r = -1;
+    } else if ((r = ensure_gid_vector_capacity(gids, last->count)) == 0) {
+        for (size_t n = 0; n < last->count; n++)
+            append_gid_vector_item(gids, last->items[n]);
+    }
+    pthread_mutex_unlock(&membership->lock);
+    return r;
+}
+
+int get_enforcement(Membership* membership, uid_t uid, EnforceStatus* status)
+{
+    assert(membership && status);
+
+    char key[16];
+    snprintf(key, sizeof key, "%u", uid);
+
+    pthread_mutex_lock(&membership->lock);
+    EnforceStatus* last = get_hashmap_entry(&membership->enforcements, key);
+    if (last)
+        *status = *last;
+    pthread_mutex_unlock(&membership->lock);
+    if (!last) {
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
+}
+
+int list_tracked_users(Membership* membership, Vector* uids)
+{
+    assert(membership && uids);
+
+    int r = 0;
+    pthread_mutex_lock(&membership->lock);
+    if (!membership->complete) {
+        errno = ENODATA;
+        r = -1;
+        goto cleanup;
+    }
+
+    size_t nusers = get_hashmap_count(&membership->users);
+    for (size_t n = 0; r == 0 && n < nusers; n++) {
+        char* key = NULL;
+        get_hashmap_entry_at(&membership->users, n, &key, NULL);
+        uid_t uid = (uid_t)strtoul(key, NULL, 10);
+        r = append_vector_item(uids, &uid);
+    }
+
+cleanup:
+    pthread_mutex_unlock(&membership->lock);
+    return r;
+}
+
+int list_user_classes(Membership* membership, Vector* users)
+{
+    assert(membership && users);
+
+    int r = 0;
+    pthread_mutex_lock(&membership->lock);
+    size_t nusers = get_hashmap_count(&membership->users);
+    for (size_t n = 0; r == 0 && n < nusers; n++) {
+        char* key = NULL;
+        const char** classpath = NULL;
+        get_hashmap_entry_at(&membership->users, n, &key, (void**)&classpath);
+        if (!*classpath)
+            continue;
+        UserClass user = { (uid_t)strtoul(key, NULL, 10), *classpath };
+        r = append_vector_item(users, &user);
+    }
+    pthread_mutex_unlock(&membership->lock);
+    return r;
+}
+
+int list_class_members(Membership* membership, const char* classpath,
+    Vector* uids)
+{
+    assert(membership && classpath && uids);
+
+    int r = 0;
+    pthread_mutex_lock(&membership->lock);
+    if (!membership->complete) {
+        errno = ENODATA;
+        r = -1;
+        goto cleanup;
+    }
+
+    UidVector* members = get_hashmap_entry(&membership->classes,
+        (char*)classpath);
+    size_t nmembers = members ? get_uid_vector_count(members) : 0;
+    for (size_t n = 0; r == 0 && n < nmembers; n++)
+        r = append_vector_item(uids, &members->items[n]);
+
+cleanup:
+    pthread_mutex_unlock(&membership->lock);
+    return r;
+}
+
+/*
+ * Tracks the user in no class, unless they're already tracked. Must be called
+ * with the membership locked. Returns -1 if there was an error (and errno
+ * should be looked up), otherwise 0.
+ */
+static int
+_track_user(Membership* membership, uid_t uid)
+{
+    char key[16];
+    snprintf(key, sizeof key, "%u", uid);
+    if (get_hashmap_entry(&membership->users, key))
+        return 0;
+
+    const char* classpath = NULL;
+    return add_hashmap_entry(&membership->users, key, &classpath);
+}
+
+/*
+ * Adds the user to the members of the class at classpath. Must be called with
+ * the membership locked. Returns -1 if there was an error (and errno should be
+ * looked up), otherwise 0.
+ */
+static int
+_join_class(Membership* membership, uid_t uid, const char* classpath)
+{
+    UidVector* members = get_hashmap_entry(&membership->classes,
+        (char*)classpath);
+    if (!members) {
+        UidVector empty;
+        create_uid_vector(&empty);
+        if (add_hashmap_entry(&membership->classes, (char*)classpath, &empty) < 0)
+            return -1;
+        members = get_hashmap_entry(&membership->classes, (char*)classpath);
+    }
+    return insert_uid_vector_item(members, uid);
+}
+
+/*
+ * Removes the user from the members of the class at classpath, dropping the
+ * class once it has no members left. Must be called with the membership
+ * locked.
+ */
+static void
+_leave_class(Membership* membership, uid_t uid, const char* classpath)
+{
+    UidVector* members = get_hashmap_entry(&membership->classes,
+        (char*)classpath);
+    if (!members)
+        return;
+
+    size_t index = lower_bound_uid_vector(members, uid);
+    if (index < members->count && members->items[index] == uid) {
+        memmove(members->items + index, members->items + index + 1,
+            sizeof *members->items * (members->count - index - 1));
+        members->count--;
+    }
+    if (members->count > 0)
+        return;
+
+    UidVector removed;
+    if (remove_hashmap_entry(&membership->classes, classpath, &removed) == 0)
+        destroy_uid_vector(&removed);
+}
@@ -0,0 +1,342 @@
+// SPDX-License-Identifier: GPL-3.0
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <syslog.h>
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "notifier.h"
+#include "vector.h"
+
+typedef enum NotificationKind {
+    NOTIFY_CLASSES_CHANGED,
+    NOTIFY_USER_CLASS_CHANGED,
+    NOTIFY_ENFORCED,
+} NotificationKind;
+
+/*
+ * A signal waiting to be sent. Everything in it is allocated.
+ */
+typedef struct Notification {
+    NotificationKind kind;
+    // ClassesChanged: NULL terminated lists of classnames
+    char** added;
+    char** removed;
+    char** modified;
+    uint64_t generation;
+    // UserClassChanged: the class filepaths, or NULL for no class
+    uid_t uid;
+    char* old_classpath;
+    char* new_classpath;
+    // Enforced: the outcome, whose classpath is new_classpath
+    EnforceStatus status;
+} Notification;
+
+static int _queue_notification(Notifier* notifier,
+    Notification* notification);
+static int _on_wakeup(sd_event_source* source, int fd, uint32_t revents,
+    void* userdata);
+static int _send_notification(Notifier* notifier,
+    Notification* notification);
+static char** _copy_classnames(Vector* classnames);
+static void _free_notification(Notification* notification);
+
+int create_notifier(Notifier* notifier)
+{
+    assert(notifier);
+    memset(notifier, 0, sizeof *notifier);
+
+    if (create_vector(&notifier->pending, sizeof(Notification)) < 0)
+        return -1;
+    notifier->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (notifier->fd < 0) {
+        int saved = errno;
+        destroy_vector(&notifier->pending);
+        errno = saved;
+        return -1;
+    }
+    pthread_mutex_init(&notifier->lock, NULL);
+    return 0;
+}
+
+int attach_notifier(Notifier* notifier, sd_event* event, sd_bus* bus,
+    const char* path, const char* interface)
+{
+    assert(notifier && event && bus && path && interface);
+
+    pthread_mutex_lock(&notifier->lock);
+    notifier->bus = sd_bus_ref(bus);
+    notifier->path = path;
+    notifier->interface = interface;
+    pthread_mutex_unlock(&notifier->lock);
+
+    // Anything queued before now is sent as soon as the loop runs
+    int r = sd_event_add_io(event, &notifier->io, notifier->fd, EPOLLIN,
+        _on_wakeup, notifier);
+    if (r < 0) {
+        errno = -r;
+        return -1;
+    }
+    return 0;
+}
+
+void set_notifier_hook(Notifier* notifier, NotifierHook changed,
+    void* userdata)
+{
+    assert(notifier);
+
+    notifier->changed = changed;
+    notifier->changed_userdata = userdata;
+}
+
+void destroy_notifier(Notifier* notifier)
+{
+    assert(notifier);
+
+    sd_event_source_unref(notifier->io);
+    sd_bus_unref(notifier->bus);
+    close(notifier->fd);
+    Notification* notification = NULL;
+    while ((notification = iter_vector(&notifier->pending)))
+        _free_notification(notification);
+    destroy_vector(&notifier->pending);
+    pthread_mutex_destroy(&notifier->lock);
+}
+
+int notify_classes_changed(Notifier* notifier, Vector* added, Vector* removed,
+    Vector* modified, uint64_t generation)
+{
+    assert(notifier);
+
+    if ((!added || get_vector_count(added) == 0)
+        && (!removed || get_vector_count(removed) == 0)
+        && (!modified || get_vector_count(modified) == 0))
+        return 0;
+
+    Notification notification = {
+        .kind = NOTIFY_CLASSES_CHANGED,
+        .added = _copy_classnames(added),
+        .removed = _copy_classnames(removed),
+        .modified = _copy_classnames(modified),
+        .generation = generation,
+    };
+    if (!notification.added || !notification.removed
+        || !notification.modified) {
+        _free_notification(&notification);
+        return -1;
+    }
+    return _queue_notification(notifier, &notification);
+}
+
+int notify_user_class_changed(Notifier* notifier, uid_t uid,
+    const char* old_classpath, const char* new_classpath)
+{
+    assert(notifier);
+
+    Notification notification = {
+        .kind = NOTIFY_USER_CLASS_CHANGED,
+        .uid = uid,
+        .old_classpath = old_classpath ? strdup(old_classpath) : NULL,
+        .new_classpath = new_classpath ? strdup(new_classpath) : NULL,
+    };
+    if ((old_classpath && !notification.old_classpath)
+        || (new_classpath && !notification.new_classpath)) {
+        _free_notification(&notification);
+        return -1;
+    }
+    return _queue_notification(notifier, &notification);
+}
+
+int notify_enforced(Notifier* notifier, uid_t uid, const EnforceStatus* status)
+{
+    assert(notifier && status && status->classpath);
+
+    Notification notification = {
+        .kind = NOTIFY_ENFORCED,
+        .uid = uid,
+        .new_classpath = strdup(status->classpath),
+        .status = *status,
+    };
+    if (!notification.new_classpath)
+        return -1;
+    return _queue_notification(notifier, &notification);
+}
+
+/*
+ * Queues the notification, which the notifier takes ownership of even if it
+ * can't be queued, and wakes up the event loop. Returns -1 if there was an
+ * error (and errno should be looked up), otherwise 0.
+ */
+static int
+_queue_notification(Notifier* notifier, Notification* notification)
+{
+    int r = 0;
+    pthread_mutex_lock(&notifier->lock);
+    if (get_vector_count(&notifier->pending) >= MAX_PENDING_NOTIFICATIONS) {
+        // Nobody is sending them, so there's no point holding on to more
+        if (!notifier->overflowed)
+            log_message(LOG_WARNING, "Dropping change notifications; %d are "
+                                     "already waiting to be sent",
+                MAX_PENDING_NOTIFICATIONS);
+        notifier->overflowed = true;
+        _free_notification(notification);
+        errno = ENOBUFS;
+        r = -1;
+        goto cleanup;
+    }
+    r = append_vector_item(&notifier->pending, notification);
+    if (r < 0) {
+        _free_notification(notification);
+        goto cleanup;
+    }
+
+    uint64_t one = 1;
+    if (write(notifier->fd, &one, sizeof one) < 0 && errno != EAGAIN)
+        log_message(LOG_ERR, "Failed to wake up the notifier: %s",
+            strerror(errno));
+
+cleanup:
+    pthread_mutex_unlock(&notifier->lock);
+    return r;
+}
+
+/*
+ * Sends every notification queued so far, in the order they were queued.
+ */
+static int
+_on_wakeup(sd_event_source* source, int fd, uint32_t revents, void* userdata)
+{
+    (void)source;
+    (void)revents;
+    Notifier* notifier = userdata;
+
+    uint64_t count = 0;
+    if (read(fd, &count, sizeof count) < 0 && errno != EAGAIN)
+        log_message(LOG_ERR, "Failed to read notifier wakeup: %s",
+            strerror(errno));
+
+    // Take the queue as it is, so that nobody waits on the bus to queue more
+    Vector sending = { 0 };
+    if (create_vector(&sending, sizeof(Notification)) < 0) {
+        log_message(LOG_ERR, "Failed to send change notifications: %s",
+            strerror(errno));
+        return 0;
+    }
+    pthread_mutex_lock(&notifier->lock);
+    Vector swap = notifier->pending;
+    notifier->pending = sending;
+    sending = swap;
+    notifier->overflowed = false;
+    pthread_mutex_unlock(&notifier->lock);
+
+    bool changed = false;
+    size_t nnotifications = get_vector_count(&sending);
+    for (size_t n = 0; n < nnotifications; n++) {
+        Notification* notification = get_vector_item(&sending, n);
+        int r = _send_notification(notifier, notification);
+        if (r < 0)
+            log_message(LOG_ERR, "Failed to send change notification: %s",
+                strerror(-r));
+        changed |= notification->kind != NOTIFY_ENFORCED;
+        _free_notification(notification);
+    }
+    destroy_vector(&sending);
+
+    // However many changes there were, the hook only needs to see them once
+    if (changed && notifier->changed)
+        notifier->changed(notifier->changed_userdata);
+    return 0;
+}
+
+/*
+ * Sends the notification as a signal. Returns a negative errno if there was
+ * an error, otherwise 0.
+ */
+static int
+_send_notification(Notifier* notifier, Notification* notification)
+{
+    if (notification->kind == NOTIFY_USER_CLASS_CHANGED) {
+        const char* old_classpath = notification->old_classpath;
+        const char* new_classpath = notification->new_classpath;
+        return sd_bus_emit_signal(notifier->bus, notifier->path,
+            notifier->interface, "UserClassChanged", "uss", notification->uid,
+            old_classpath ? old_classpath : "",
+            new_classpath ? new_classpath : "");
+    }
+    if (notification->kind == NOTIFY_ENFORCED) {
+        EnforceStatus* status = &notification->status;
+        return sd_bus_emit_signal(notifier->bus, notifier->path,
+            notifier->interface, "Enforced", "ustttb", notification->uid,
+            notification->new_classpath, status->generation,
+            status->timestamp_usec, status->duration_usec,
+            (int)status->succeeded);
+    }
+
+    sd_bus_message* signal = NULL;
+    int r = sd_bus_message_new_signal(notifier->bus, &signal, notifier->path,
+        notifier->interface, "ClassesChanged");
+    if (r < 0)
+        return r;
+    r = sd_bus_message_append_strv(signal, notification->added);
+    if (r >= 0)
+        r = sd_bus_message_append_strv(signal, notification->removed);
+    if (r >= 0)
+        r = sd_bus_message_append_strv(signal, notification->modified);
+    if (r >= 0)
+        r = sd_bus_message_append(signal, "t", notification->generation);
+    if (r >= 0)
+        r = sd_bus_send(notifier->bus, signal, NULL);
+    sd_bus_message_unref(signal);
+    return r < 0 ? r : 0;
+}
+
+/*
+ * Returns an allocated NULL terminated copy of the classnames (char*'s),
+ * which may be NULL, or NULL if there was an error (and errno should be
+ * looked up).
+ */
+static char**
+_copy_classnames(Vector* classnames)
+{
+    size_t nclassnames = classnames ? get_vector_count(classnames) : 0;
+    char** copy = calloc(nclassnames + 1, sizeof *copy);
+    if (!copy)
+        return NULL;
+    for (size_t n = 0; n < nclassnames; n++) {
+        copy[n] = strdup(*(char**)get_vector_item(classnames, n));
+        if (!copy[n]) {
+            for (size_t i = 0; i < n; i++)
+                free(copy[i]);
+            free(copy);
+            return NULL;
+        }
+    }
+    return copy;
+}
+
+/*
+ * Frees what the notification holds.
+ */
+static void
+_free_notification(Notification* notification)
+{
+    char** lists[] = { notification->added, notification->removed,
+        notification->modified };
+    for (size_t n = 0; n < sizeof lists / sizeof *lists; n++) {
+        for (size_t i = 0; lists[n] && lists[n][i]; i++)
+            free(lists[n][i]);
+        free(lists[n]);
+    }
+    free(notification->old_classpath);
+    free(notification->new_classpath);
+}
@@ -0,0 +1,209 @@
+// SPDX-License-Identifier: GPL-3.0
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pwd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#define PAM_SM_SESSION
+#include <security/pam_ext.h>
+#include <security/pam_modules.h>
+
+#include "queryclient.h"
+#include "queryprotocol.h"
+
+// How long to wait on userctld before giving up on the login's class
+#define DEFAULT_PAM_TIMEOUT_MSEC 1000
+// Where the passwd buffer starts if the system has no suggestion
+#define DEFAULT_PASSWD_BUFSIZE 4096
+// The passwd buffer isn't grown past this, however long the record
+#define MAX_PASSWD_BUFSIZE (1024 * 1024)
+
+/*
+ * The module arguments from the PAM configuration.
+ */
+typedef struct PamOptions {
+    const char* socket;
+    uint64_t timeout_usec;
+    // Whether logins are refused if their class can't be enforced
+    bool fail_closed;
+    bool debug;
+} PamOptions;
+
+static int _parse_options(pam_handle_t* pamh, int argc, const char** argv,
+    PamOptions* options);
+static int _lookup_uid(const char* user, uid_t* uid);
+static int _enforce(const PamOptions* options, uid_t uid);
+
+/*
+ * Enforces the class of the user logging in before their session starts, so
+ * that their first processes don't run before the limits are in place. Meant
+ * to come after pam_systemd, which creates the user's slice.
+ */
+PAM_EXTERN int pam_sm_open_session(pam_handle_t* pamh, int flags, int argc,
+    const char** argv)
+{
+    (void)flags;
+
+    PamOptions options = { 0 };
+    if (_parse_options(pamh, argc, argv, &options) < 0)
+        return PAM_SESSION_ERR;
+
+    const char* user = NULL;
+    if (pam_get_user(pamh, &user, NULL) != PAM_SUCCESS || !user) {
+        pam_syslog(pamh, LOG_ERR, "Failed to get user");
+        return PAM_USER_UNKNOWN;
+    }
+
+    // Without a uid there's no class to enforce, which is as much a failure
+    // to enforce as userctld not answering
+    uid_t uid = 0;
+    if (_lookup_uid(user, &uid) < 0) {
+        const char* reason = errno ? strerror(errno) : "No such user";
+        pam_syslog(pamh, options.fail_closed ? LOG_ERR : LOG_WARNING,
+            "Failed to get passwd record of %s: %s%s", user, reason,
+            options.fail_closed ? "" : " (allowing login anyway)");
+        return options.fail_closed ? PAM_SESSION_ERR : PAM_SUCCESS;
+    }
+
+    if (_enforce(&options, uid) < 0) {
+        pam_syslog(pamh, options.fail_closed ? LOG_ERR : LOG_WARNING,
+            "Failed to enforce class of %s: %s%s", user, strerror(errno),
+            options.fail_closed ? "" : " (allowing login anyway)");
+        return options.fail_closed ? PAM_SESSION_ERR : PAM_SUCCESS;
+    }
+    if (options.debug)
+        pam_syslog(pamh, LOG_DEBUG, "Enforced class of %s", user);
+    return PAM_SUCCESS;
+}
+
+/*
+ * Nothing to undo; userctld forgets users once logind says they're gone.
+ */
+PAM_EXTERN int pam_sm_close_session(pam_handle_t* pamh, int flags, int argc,
+    const char** argv)
+{
+    (void)pamh;
+    (void)flags;
+    (void)argc;
+    (void)argv;
+    return PAM_SUCCESS;
+}
+
+/*
+ * Parses the module arguments (socket=PATH, timeout=MSEC, fail=open|closed
+ * and debug) into options. Returns -1 if an argument is invalid, otherwise 0.
+ */
+static int
+_parse_options(pam_handle_t* pamh, int argc, const char** argv,
+    PamOptions* options)
+{
+    options->socket = DEFAULT_QUERY_SOCKET;
+    options->timeout_usec = DEFAULT_PAM_TIMEOUT_MSEC * 1000;
+    options->fail_closed = false;
+    options->debug = false;
+
+    for (int n = 0; n < argc; n++) {
+        const char* arg = argv[n];
+        if (strncmp(arg, "socket=", 7) == 0) {
+            options->socket = arg + 7;
+        } else if (strncmp(arg, "timeout=", 8) == 0) {
+            char* end = NULL;
+            errno = 0;
+            unsigned long long msec = strtoull(arg + 8, &end, 10);
+            // Zero would wait forever, which a login never should
+            if (errno != 0 || *end != '\0' || end == arg + 8 || msec == 0) {
+                pam_syslog(pamh, LOG_ERR, "Invalid timeout: %s", arg + 8);
+                return -1;
+            }
+            options->timeout_usec = msec * 1000;
+        } else if (strcmp(arg, "fail=open") == 0) {
+            options->fail_closed = false;
+        } else if (strcmp(arg, "fail=closed") == 0) {
+            options->fail_closed = true;
+        } else if (strcmp(arg, "debug") == 0) {
+            options->debug = true;
+        } else {
+            pam_syslog(pamh, LOG_ERR, "Unknown option: %s", arg);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Passes back the uid of the user, growing the buffer for their passwd record
+ * for as long as it's too small. Returns -1 with errno zero if there's no
+ * such user, or -1 if there was another error (and errno should be looked
+ * up), otherwise 0.
+ */
+static int
+_lookup_uid(const char* user, uid_t* uid)
+{
+    long suggested = sysconf(_SC_GETPW_R_SIZE_MAX);
+    size_t size = suggested > 0 ? (size_t)suggested : DEFAULT_PASSWD_BUFSIZE;
+    for (;;) {
+        char* buf = malloc(size);
+        if (!buf)
+            return -1;
+
+        struct passwd pwd;
+        struct passwd* pw = NULL;
+        int r = getpwnam_r(user, &pwd, buf, size, &pw);
+        if (r == 0 && pw)
+            *uid = pw->pw_uid;
+        free(buf);
+        if (r == ERANGE && size < MAX_PASSWD_BUFSIZE) {
+            size *= 2;
+            continue;
+        }
+        if (r != 0 || !pw) {
+            errno = r;
+            return -1;
+        }
+        return 0;
+    }
+}
+
+/*
+ * Asks userctld to evaluate and enforce the class of the uid, waiting until
+ * it's done. Connecting, asking and waiting on the answer all together take
+ * no longer than the timeout. Returns -1 if it couldn't be (and errno should
+ * be looked up), otherwise 0.
+ */
+static int
+_enforce(const PamOptions* options, uid_t uid)
+{
+    QueryClient client;
+    if (connect_query_client_within(&client, options->socket,
+            options->timeout_usec)
+        < 0)
+        return -1;
+
+    int r = 0;
+    int saved = 0;
+    uint32_t id = 0;
+    QueryResponse response = { 0 };
+    if (queue_query(&client, QUERY_ENFORCE, (uint32_t)uid, &id) < 0
+        || read_query_response(&client, &response) < 0) {
+        r = -1;
+        goto cleanup;
+    }
+    if (response.id != id) {
+        errno = EBADMSG;
+        r = -1;
+    } else if (response.status < 0) {
+        errno = -response.status;
+        r = -1;
+    }
+
+cleanup:
+    saved = errno;
+    close_query_client(&client);
+    errno = saved;
+    return r;
+}
@@ -0,0 +1,313 @@
+// SPDX-License-Identifier: GPL-3.0
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "queryclient.h"
+#include "queryprotocol.h"
+
+// How long to back off before connecting again while userctld's backlog is
+// full
+#define QUERY_CONNECT_RETRY_USEC 1000
+
+static int _connect(QueryClient* client, const char* path,
+    uint64_t timeout_usec, uint64_t deadline_usec);
+static int _wait_for(QueryClient* client, short events);
+static int _receive(QueryClient* client, size_t needed);
+static uint64_t _now_usec();
+static int _reserve(char** buf, size_t* capacity, size_t needed);
+
+int connect_query_client(QueryClient* client, const char* path,
+    uint64_t timeout_usec)
+{
+    assert(client);
+    return _connect(client, path, timeout_usec, 0);
+}
+
+int connect_query_client_within(QueryClient* client, const char* path,
+    uint64_t timeout_usec)
+{
+    assert(client && timeout_usec > 0);
+    return _connect(client, path, timeout_usec, _now_usec() + timeout_usec);
+}
+
+/*
+ * Connects the client to the query socket at path (or DEFAULT_QUERY_SOCKET if
+ * NULL). If there's a deadline, connecting is retried until it passes while
+ * the socket's backlog is full. Returns -1 if there was an error (and errno
+ * should be looked up), otherwise 0.
+ */
+static int
+_connect(QueryClient* client, const char* path, uint64_t timeout_usec,
+    uint64_t deadline_usec)
+{
+    memset(client, 0, sizeof *client);
+    client->timeout_usec = timeout_usec;
+    client->deadline_usec = deadline_usec;
+
+    if (!path)
+        path = DEFAULT_QUERY_SOCKET;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof addr.sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    // Non-blocking, so that every wait can be bounded by the timeout
+    client->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (client->fd < 0)
+        return -1;
+    int r = 0;
+    while ((r = connect(client->fd, (struct sockaddr*)&addr, sizeof addr)) < 0
+        && errno == EAGAIN && deadline_usec > _now_usec()) {
+        // A unix socket can't be polled for room in its backlog, so back off
+        struct timespec backoff = { .tv_nsec = QUERY_CONNECT_RETRY_USEC * 1000 };
+        nanosleep(&backoff, NULL);
+    }
+    if (r < 0 && errno == EAGAIN && deadline_usec)
+        errno = ETIMEDOUT;
+    if (r < 0) {
+        int saved = errno;
+        close(client->fd);
+        client->fd = -1;
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+void close_query_client(QueryClient* client)
+{
+    assert(client);
+
+    if (client->fd >= 0)
+        close(client->fd);
+    free(client->out);
+    free(client->in);
+    memset(client, 0, sizeof *client);
+    client->fd = -1;
+}
+
+int queue_query(QueryClient* client, uint16_t op, uint32_t arg, uint32_t* id)
+{
+    assert(client);
+
+    QueryRequest request = {
+        .id = client->next_id++,
+        .op = op,
+        .version = QUERY_PROTOCOL_VERSION,
+        .arg = arg,
+    };
+    if (_reserve(&client->out, &client->out_capacity,
+            client->out_size + sizeof request)
+        < 0)
+        return -1;
+    memcpy(client->out + client->out_size, &request, sizeof request);
+    client->out_size += sizeof request;
+    if (id)
+        *id = request.id;
+    return 0;
+}
+
+int flush_queries(QueryClient* client)
+{
+    assert(client);
+
+    size_t sent = 0;
+    while (sent < client->out_size) {
+        ssize_t len = send(client->fd, client->out + sent,
+            client->out_size - sent, MSG_NOSIGNAL);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0 && errno == EAGAIN) {
+            // userctld stops reading once enough responses are waiting, so
+            // they're taken in while waiting to write more
+            int ready = _wait_for(client, POLLIN | POLLOUT);
+            if (ready < 0 || ((ready & POLLIN) && _receive(client, 0) < 0))
+                return -1;
+            continue;
+        }
+        if (len < 0)
+            return -1;
+        sent += len;
+    }
+    client->out_size = 0;
+    return 0;
+}
+
+int read_query_response(QueryClient* client, QueryResponse* response)
+{
+    assert(client && response);
+
+    if (client->out_size > 0 && flush_queries(client) < 0)
+        return -1;
+
+    size_t needed = sizeof(QueryResponseHeader);
+    for (;;) {
+        const char* start = client->in + client->in_start;
+        size_t size = client->in_end - client->in_start;
+        if (size >= sizeof(QueryResponseHeader)) {
+            QueryResponseHeader header;
+            memcpy(&header, start, sizeof header);
+            if (header.length > QUERY_MAX_PAYLOAD) {
+                errno = EBADMSG;
+                return -1;
+            }
+            needed = sizeof header + header.length;
+            if (size >= needed) {
+                response->id = header.id;
+                response->status = header.status;
+                response->data = start + sizeof header;
+                response->length = header.length;
+                client->in_start += needed;
+                return 0;
+            }
+        }
+
+        int r = _receive(client, needed);
+        if (r < 0)
+            return -1;
+        if (r == 0 && _wait_for(client, POLLIN) < 0)
+            return -1;
+    }
+}
+
+int query_evaluate(QueryClient* client, uid_t uid, char** classpath)
+{
+    assert(client && classpath);
+
+    uint32_t id = 0;
+    QueryResponse response = { 0 };
+    if (queue_query(client, QUERY_EVALUATE, (uint32_t)uid, &id) < 0
+        || read_query_response(client, &response) < 0)
+        return -1;
+    if (response.id != id) {
+        errno = EBADMSG;
+        return -1;
+    }
+    if (response.status < 0) {
+        errno = -response.status;
+        return -1;
+    }
+
+    *classpath = strndup(response.data, response.length);
+    return *classpath ? 0 : -1;
+}
+
+/*
+ * Waits until the client's socket is ready for the events, for no longer than
+ * the client's timeout or past its deadline. Returns -1 with errno ETIMEDOUT
+ * if it passed, or -1 if there was another error (and errno should be looked
+ * up), otherwise the events that are ready.
+ */
+static int
+_wait_for(QueryClient* client, short events)
+{
+    uint64_t deadline = client->timeout_usec
+        ? _now_usec() + client->timeout_usec
+        : 0;
+    if (client->deadline_usec && (!deadline || client->deadline_usec < deadline))
+        deadline = client->deadline_usec;
+    struct pollfd pfd = { .fd = client->fd, .events = events };
+    for (;;) {
+        int timeout = -1;
+        if (deadline) {
+            uint64_t now = _now_usec();
+            if (now >= deadline) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            timeout = (int)((deadline - now + 999) / 1000);
+        }
+        int r = poll(&pfd, 1, timeout);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return -1;
+        if (r > 0)
+            return pfd.revents;
+    }
+}
+
+/*
+ * Reads as much as has arrived, making room for at least needed unconsumed
+ * bytes, since more responses are likely behind the one being waited on.
+ * Returns -1 if there was an error (and errno should be looked up), 0 if
+ * nothing had arrived, otherwise 1.
+ */
+static int
+_receive(QueryClient* client, size_t needed)
+{
+    // Whatever was consumed is done with
+    if (client->in_start > 0) {
+        memmove(client->in, client->in + client->in_start,
+            client->in_end - client->in_start);
+        client->in_end -= client->in_start;
+        client->in_start = 0;
+    }
+
+    size_t size = client->in_end;
+    if (_reserve(&client->in, &client->in_capacity,
+            needed > size + 4096 ? needed : size + 4096)
+        < 0)
+        return -1;
+
+    for (;;) {
+        ssize_t len = recv(client->fd, client->in + size,
+            client->in_capacity - size, 0);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0 && errno == EAGAIN)
+            return 0;
+        if (len < 0)
+            return -1;
+        if (len == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        client->in_end += len;
+        return 1;
+    }
+}
+
+/*
+ * Returns the current CLOCK_MONOTONIC time in microseconds. The client is
+ * linked into other programs, so it doesn't pull in utils.
+ */
+static uint64_t
+_now_usec()
+{
+    struct timespec ts = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Grows the buffer to hold at least needed bytes. Returns -1 if there was an
+ * error (and errno should be looked up), otherwise 0.
+ */
+static int
+_reserve(char** buf, size_t* capacity, size_t needed)
+{
+    if (needed <= *capacity)
+        return 0;
+    size_t grown = *capacity ? *capacity : 4096;
+    while (grown < needed)
+        grown *= 2;
+    char* resized = realloc(*buf, grown);
+    if (!resized)
+        return -1;
+    *buf = resized;
+    *capacity = grown;
+    return 0;
+}
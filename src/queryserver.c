@@ -0,0 +1,632 @@
+// SPDX-License-Identifier: GPL-3.0
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <systemd/sd-event.h>
+#include <unistd.h>
+
+#include "classparser.h"
+#include "controller.h"
+#include "logger.h"
+#include "membership.h"
+#include "queryprotocol.h"
+#include "queryserver.h"
+#include "resolver.h"
+#include "vector.h"
+
+struct QueryEnforcement;
+
+/*
+ * A client of the query socket.
+ */
+typedef struct QueryConnection {
+    int fd;
+    sd_event_source* io;
+    QueryServer* server;
+    // Who connected, which decides whether they may enforce
+    uid_t peer_uid;
+    // The enforcement being waited on, and the QueryRequests read since,
+    // which are answered once it's done
+    struct QueryEnforcement* enforcing;
+    Vector stalled;
+    // Whether the client hung up while an enforcement was being waited on
+    bool closed;
+    // The start of a request that hasn't been read in whole yet
+    char partial[sizeof(QueryRequest)];
+    size_t partial_size;
+    // Responses from out_sent up to out_size haven't been written yet
+    char* out;
+    size_t out_size;
+    size_t out_sent;
+    size_t out_capacity;
+} QueryConnection;
+
+/*
+ * An enforcement asked for by a client, run on a thread of its own.
+ */
+typedef struct QueryEnforcement {
+    QueryConnection* connection;
+    uint32_t id;
+    uid_t uid;
+    // Written by the thread once it's done
+    int fd;
+    sd_event_source* io;
+    int32_t status;
+} QueryEnforcement;
+
+static int _on_accept(sd_event_source* source, int fd, uint32_t revents,
+    void* userdata);
+static int _on_connection(sd_event_source* source, int fd, uint32_t revents,
+    void* userdata);
+static int _read_requests(QueryConnection* connection);
+static int _answer_requests(QueryConnection* connection,
+    const QueryRequest* requests, size_t nrequests);
+static int _answer_batch(QueryConnection* connection,
+    const QueryRequest* requests, size_t nrequests);
+static int _start_enforcement(QueryConnection* connection,
+    const QueryRequest* request);
+static void* _run_enforcement(void* vargp);
+static int _on_enforced(sd_event_source* source, int fd, uint32_t revents,
+    void* userdata);
+static void _destroy_enforcement(QueryEnforcement* enforcement);
+static int _append_response(QueryConnection* connection, uint32_t id,
+    int32_t status, const void* payload, size_t length);
+static int _write_responses(QueryConnection* connection);
+static int _update_events(QueryConnection* connection);
+static void _close_connection(QueryConnection* connection);
+static void _free_connection(QueryConnection* connection);
+
+int create_query_server(QueryServer* server, Context* context,
+    const char* path)
+{
+    assert(server && context && path);
+    memset(server, 0, sizeof *server);
+    server->context = context;
+    server->fd = -1;
+
+    int r = 0;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof addr.sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    server->path = strdup(path);
+    char* dir = strdup(path);
+    if (!server->path || !dir)
+        goto error;
+    if (mkdir(dirname(dir), 0755) < 0 && errno != EEXIST)
+        goto error;
+
+    server->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->fd < 0)
+        goto error;
+    // A socket left behind by a previous run would fail the bind
+    if (unlink(path) < 0 && errno != ENOENT)
+        goto error;
+    if (bind(server->fd, (struct sockaddr*)&addr, sizeof addr) < 0)
+        goto error;
+    // Only reads are answered, so anyone may ask, like Evaluate on the bus
+    if (chmod(path, 0666) < 0 || listen(server->fd, SOMAXCONN) < 0)
+        goto error;
+
+    r = sd_event_new(&server->event);
+    if (r >= 0)
+        r = sd_event_add_io(server->event, &server->io, server->fd, EPOLLIN,
+            _on_accept, server);
+    if (r < 0) {
+        errno = -r;
+        goto error;
+    }
+    free(dir);
+    return 0;
+
+error:
+    r = errno;
+    free(dir);
+    destroy_query_server(server);
+    errno = r;
+    return -1;
+}
+
+void destroy_query_server(QueryServer* server)
+{
+    assert(server);
+
+    sd_event_source_unref(server->io);
+    sd_event_unref(server->event);
+    if (server->fd >= 0) {
+        close(server->fd);
+        unlink(server->path);
+    }
+    free(server->path);
+    memset(server, 0, sizeof *server);
+    server->fd = -1;
+}
+
+void* run_query_server(void* vargp)
+{
+    assert(vargp);
+    QueryServer* server = vargp;
+
+    log_message(LOG_INFO, "Answering queries on %s", server->path);
+    int r = sd_event_loop(server->event);
+    if (r < 0)
+        log_message(LOG_ERR, "Failed to run query server: %s", strerror(-r));
+    return NULL;
+}
+
+/*
+ * Accepts every waiting client.
+ */
+static int
+_on_accept(sd_event_source* source, int fd, uint32_t revents, void* userdata)
+{
+    (void)source;
+    (void)revents;
+    QueryServer* server = userdata;
+
+    for (;;) {
+        int client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                log_message(LOG_ERR, "Failed to accept query client: %s",
+                    strerror(errno));
+            return 0;
+        }
+        if (server->nconnections >= MAX_QUERY_CONNECTIONS) {
+            log_message(LOG_WARNING, "Refusing query client; %d are already "
+                                     "connected",
+                MAX_QUERY_CONNECTIONS);
+            close(client);
+            continue;
+        }
+
+        struct ucred cred = { 0 };
+        socklen_t cred_size = sizeof cred;
+        if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &cred_size) < 0) {
+            close(client);
+            continue;
+        }
+
+        QueryConnection* connection = calloc(1, sizeof *connection);
+        if (!connection || create_vector(&connection->stalled,
+                               sizeof(QueryRequest))
+                < 0) {
+            free(connection);
+            close(client);
+            continue;
+        }
+        connection->fd = client;
+        connection->server = server;
+        connection->peer_uid = cred.uid;
+        int r = sd_event_add_io(server->event, &connection->io, client,
+            EPOLLIN, _on_connection, connection);
+        if (r < 0) {
+            log_message(LOG_ERR, "Failed to watch query client: %s",
+                strerror(-r));
+            close(client);
+            destroy_vector(&connection->stalled);
+            free(connection);
+            continue;
+        }
+        server->nconnections++;
+    }
+}
+
+/*
+ * Answers what the client sent and writes what it has room for.
+ */
+static int
+_on_connection(sd_event_source* source, int fd, uint32_t revents,
+    void* userdata)
+{
+    (void)source;
+    (void)fd;
+    QueryConnection* connection = userdata;
+
+    if ((revents & EPOLLIN) && _read_requests(connection) < 0) {
+        // What was answered before the client hung up goes out if it fits
+        _write_responses(connection);
+        goto close;
+    }
+    if (_write_responses(connection) < 0)
+        goto close;
+    if ((revents & (EPOLLHUP | EPOLLERR)) && !(revents & EPOLLIN))
+        goto close;
+    if (_update_events(connection) < 0)
+        goto close;
+    return 0;
+
+close:
+    _close_connection(connection);
+    return 0;
+}
+
+/*
+ * Reads and answers whole requests until the client has nothing more to say,
+ * too many responses are waiting to be written or an enforcement is being
+ * waited on. Returns -1 if the connection should be closed, otherwise 0.
+ */
+static int
+_read_requests(QueryConnection* connection)
+{
+    char buf[8192] __attribute__((aligned(__alignof__(QueryRequest))));
+    while (!connection->enforcing
+        && connection->out_size - connection->out_sent < MAX_QUERY_BACKLOG) {
+        // The partial request goes first, so the rest read lines up behind it
+        size_t size = connection->partial_size;
+        memcpy(buf, connection->partial, size);
+        ssize_t len = read(connection->fd, buf + size, sizeof buf - size);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0 && errno == EAGAIN)
+            return 0;
+        if (len <= 0)
+            return -1;
+        size += len;
+
+        size_t nrequests = size / sizeof(QueryRequest);
+        connection->partial_size = size % sizeof(QueryRequest);
+        memcpy(connection->partial, buf + nrequests * sizeof(QueryRequest),
+            connection->partial_size);
+        if (_answer_requests(connection, (QueryRequest*)buf, nrequests) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Answers the requests, taking the classes' lock once for every
+ * MAX_QUERY_BATCH of them. Those behind an enforcement are stalled until it's
+ * done. Returns -1 if there was an error (and errno should be looked up),
+ * otherwise 0.
+ */
+static int
+_answer_requests(QueryConnection* connection, const QueryRequest* requests,
+    size_t nrequests)
+{
+    int r = 0;
+    for (size_t n = 0; r == 0 && n < nrequests; n += MAX_QUERY_BATCH) {
+        size_t nbatch = nrequests - n;
+        if (nbatch > MAX_QUERY_BATCH)
+            nbatch = MAX_QUERY_BATCH;
+        r = _answer_batch(connection, requests + n, nbatch);
+    }
+    return r;
+}
+
+/*
+ * Answers up to MAX_QUERY_BATCH requests under one hold of the classes' lock.
+ * Returns -1 if there was an error (and errno should be looked up),
+ * otherwise 0.
+ */
+static int
+_answer_batch(QueryConnection* connection, const QueryRequest* requests,
+    size_t nrequests)
+{
+    Context* context = connection->server->context;
+
+    // Evaluating looks up the users' groups, so look them all up together on
+    // the resolver first, rather than wait on NSS with the classes locked or
+    // for longer than QUERY_RESOLVE_TIMEOUT_MSEC on the event loop
+    uid_t uids[MAX_QUERY_BATCH] = { 0 };
+    gid_t* gids[MAX_QUERY_BATCH] = { 0 };
+    int ngids[MAX_QUERY_BATCH] = { 0 };
+    int errors[MAX_QUERY_BATCH] = { 0 };
+    size_t nuids = 0;
+    for (size_t n = 0; !connection->enforcing && n < nrequests; n++)
+        if (requests[n].version == QUERY_PROTOCOL_VERSION
+            && requests[n].op == QUERY_EVALUATE)
+            uids[nuids++] = (uid_t)requests[n].arg;
+    if (resolve_many_groups(uids, nuids, QUERY_RESOLVE_TIMEOUT_MSEC * 1000ULL,
+            gids, ngids, errors)
+        < 0) {
+        for (size_t u = 0; u < nuids; u++)
+            errors[u] = errno;
+    }
+
+    int r = 0;
+    size_t u = 0;
+    pthread_rwlock_rdlock(&context_lock);
+    for (size_t n = 0; r == 0 && n < nrequests; n++) {
+        const QueryRequest* request = &requests[n];
+        if (connection->enforcing) {
+            r = append_vector_item(&connection->stalled, request);
+            continue;
+        }
+        if (request->version != QUERY_PROTOCOL_VERSION) {
+            r = _append_response(connection, request->id, -EPROTONOSUPPORT,
+                NULL, 0);
+            continue;
+        }
+
+        ClassProperties props = { 0 };
+        int matches = 0;
+        switch (request->op) {
+        case QUERY_EVALUATE:
+            // The requests are answered in the order they were looked up
+            if (errors[u] != 0) {
+                r = _append_response(connection, request->id, -errors[u++],
+                    NULL, 0);
+                break;
+            }
+            matches = evaluate_with_groups((uid_t)request->arg, gids[u],
+                ngids[u], &context->classes, &props);
+            u++;
+            if (matches < 0)
+                r = _append_response(connection, request->id, -errno, NULL, 0);
+            else if (matches == 0)
+                r = _append_response(connection, request->id, -ENOENT, NULL, 0);
+            else
+                r = _append_response(connection, request->id, 0,
+                    props.filepath, strlen(props.filepath));
+            break;
+        case QUERY_GENERATION:
+            r = _append_response(connection, request->id, 0,
+                &context->generation, sizeof context->generation);
+            break;
+        case QUERY_ENFORCE:
+            r = _start_enforcement(connection, request);
+            break;
+        default:
+            r = _append_response(connection, request->id, -EOPNOTSUPP, NULL,
+                0);
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&context_lock);
+    for (u = 0; u < nuids; u++)
+        free(gids[u]);
+    return r;
+}
+
+/*
+ * Starts enforcing on the uid asked for, if the client may and there's room
+ * for another enforcement, otherwise answers why not. Returns -1 if there was
+ * an error (and errno should be looked up), otherwise 0.
+ */
+static int
+_start_enforcement(QueryConnection* connection, const QueryRequest* request)
+{
+    QueryServer* server = connection->server;
+    uid_t uid = (uid_t)request->arg;
+
+    // Enforcing spawns systemctl, so only root (such as pam_userctl) may
+    // have it done; users could otherwise have it done over and over
+    if (connection->peer_uid != 0)
+        return _append_response(connection, request->id, -EPERM, NULL, 0);
+    if (server->nenforcements >= MAX_QUERY_ENFORCEMENTS)
+        return _append_response(connection, request->id, -EBUSY, NULL, 0);
+
+    QueryEnforcement* enforcement = calloc(1, sizeof *enforcement);
+    if (!enforcement)
+        return _append_response(connection, request->id, -errno, NULL, 0);
+    enforcement->connection = connection;
+    enforcement->id = request->id;
+    enforcement->uid = uid;
+    enforcement->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (enforcement->fd < 0) {
+        int r = -errno;
+        free(enforcement);
+        return _append_response(connection, request->id, r, NULL, 0);
+    }
+
+    int r = sd_event_add_io(server->event, &enforcement->io, enforcement->fd,
+        EPOLLIN, _on_enforced, enforcement);
+    if (r >= 0) {
+        pthread_t tid = 0;
+        r = -pthread_create(&tid, NULL, _run_enforcement, enforcement);
+        if (r == 0)
+            pthread_detach(tid);
+    }
+    if (r < 0) {
+        _destroy_enforcement(enforcement);
+        return _append_response(connection, request->id, r, NULL, 0);
+    }
+
+    connection->enforcing = enforcement;
+    server->nenforcements++;
+    return 0;
+}
+
+/*
+ * Evaluates and enforces on the user of the enforcement, then wakes up the
+ * server. Meant to be the start routine of a thread, given the enforcement.
+ */
+static void*
+_run_enforcement(void* vargp)
+{
+    QueryEnforcement* enforcement = vargp;
+    Context* context = enforcement->connection->server->context;
+    uid_t uid = enforcement->uid;
+
+    // They may be asked about before logind says they're new
+    if (context->membership && track_user(context->membership, uid) < 0)
+        log_message(LOG_ERR, "Failed to track uid %u: %s", uid, strerror(errno));
+
+    log_message(LOG_INFO, "Enforcing on uid %u for query client", uid);
+    int failures = enforce_users(context, &uid, 1, NULL, 0);
+    if (failures < 0)
+        enforcement->status = -errno;
+    else if (failures > 0)
+        enforcement->status = -EIO;
+
+    if (eventfd_write(enforcement->fd, 1) < 0)
+        log_message(LOG_ERR, "Failed to wake query server: %s", strerror(errno));
+    return NULL;
+}
+
+/*
+ * Answers a finished enforcement and the requests stalled behind it, or frees
+ * the connection if the client already hung up.
+ */
+static int
+_on_enforced(sd_event_source* source, int fd, uint32_t revents,
+    void* userdata)
+{
+    (void)source;
+    (void)fd;
+    (void)revents;
+    QueryEnforcement* enforcement = userdata;
+    QueryConnection* connection = enforcement->connection;
+
+    connection->server->nenforcements--;
+    connection->enforcing = NULL;
+    int r = 0;
+    if (!connection->closed)
+        r = _append_response(connection, enforcement->id, enforcement->status,
+            NULL, 0);
+    _destroy_enforcement(enforcement);
+    if (connection->closed) {
+        _free_connection(connection);
+        return 0;
+    }
+
+    // Anything stalled behind another enforcement is stalled again
+    if (r == 0 && get_vector_count(&connection->stalled) > 0) {
+        Vector stalled = connection->stalled;
+        r = create_vector(&connection->stalled, sizeof(QueryRequest));
+        if (r < 0) {
+            connection->stalled = stalled;
+        } else {
+            r = _answer_requests(connection, pretend_vector_is_array(&stalled),
+                get_vector_count(&stalled));
+            destroy_vector(&stalled);
+        }
+    }
+
+    if (r < 0 || _write_responses(connection) < 0
+        || _update_events(connection) < 0)
+        _close_connection(connection);
+    return 0;
+}
+
+/*
+ * Destroys the given enforcement, which must not be running.
+ */
+static void
+_destroy_enforcement(QueryEnforcement* enforcement)
+{
+    sd_event_source_unref(enforcement->io);
+    close(enforcement->fd);
+    free(enforcement);
+}
+
+/*
+ * Appends a response to those waiting to be written. Returns -1 if there was
+ * an error (and errno should be looked up), otherwise 0.
+ */
+static int
+_append_response(QueryConnection* connection, uint32_t id, int32_t status,
+    const void* payload, size_t length)
+{
+    if (length > QUERY_MAX_PAYLOAD) {
+        status = -ENAMETOOLONG;
+        length = 0;
+    }
+    QueryResponseHeader header = { .id = id, .status = status,
+        .length = (uint32_t)length };
+
+    size_t needed = connection->out_size + sizeof header + length;
+    if (needed > connection->out_capacity) {
+        size_t capacity = connection->out_capacity ? connection->out_capacity
+                                                   : 4096;
+        while (capacity < needed)
+            capacity *= 2;
+        char* out = realloc(connection->out, capacity);
+        if (!out)
+            return -1;
+        connection->out = out;
+        connection->out_capacity = capacity;
+    }
+
+    memcpy(connection->out + connection->out_size, &header, sizeof header);
+    connection->out_size += sizeof header;
+    if (length > 0)
+        memcpy(connection->out + connection->out_size, payload, length);
+    connection->out_size += length;
+    return 0;
+}
+
+/*
+ * Writes as many of the waiting responses as the client has room for.
+ * Returns -1 if the connection should be closed, otherwise 0.
+ */
+static int
+_write_responses(QueryConnection* connection)
+{
+    while (connection->out_sent < connection->out_size) {
+        ssize_t len = send(connection->fd,
+            connection->out + connection->out_sent,
+            connection->out_size - connection->out_sent, MSG_NOSIGNAL);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0 && errno == EAGAIN)
+            return 0;
+        if (len < 0)
+            return -1;
+        connection->out_sent += len;
+    }
+    connection->out_size = connection->out_sent = 0;
+    return 0;
+}
+
+/*
+ * Waits for the client to have room for responses if any are left, and for
+ * more requests unless too many responses are waiting. Returns -1 if there
+ * was an error, otherwise 0.
+ */
+static int
+_update_events(QueryConnection* connection)
+{
+    size_t backlog = connection->out_size - connection->out_sent;
+    uint32_t events = 0;
+    if (backlog < MAX_QUERY_BACKLOG && !connection->enforcing)
+        events |= EPOLLIN;
+    if (backlog > 0)
+        events |= EPOLLOUT;
+    return sd_event_source_set_io_events(connection->io, events) < 0 ? -1 : 0;
+}
+
+/*
+ * Closes the connection, dropping any responses not yet written. If an
+ * enforcement is being waited on, the connection is freed once it's done.
+ */
+static void
+_close_connection(QueryConnection* connection)
+{
+    connection->server->nconnections--;
+    connection->io = sd_event_source_unref(connection->io);
+    close(connection->fd);
+    connection->fd = -1;
+    connection->closed = true;
+    if (!connection->enforcing)
+        _free_connection(connection);
+}
+
+/*
+ * Frees the closed connection.
+ */
+static void
+_free_connection(QueryConnection* connection)
+{
+    destroy_vector(&connection->stalled);
+    free(connection->out);
+    free(connection);
+}
@@ -0,0 +1,1221 @@
+// SPDX-License-Identifier: GPL-3.0
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <grp.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hashmap.h"
+#include "logger.h"
+#include "resolver.h"
+#include "utils.h"
+#include "vector.h"
+
+#define LOOKUP_USER 'u'
+#define LOOKUP_GROUP 'g'
+#define LOOKUP_GROUPLIST 'G'
+#define LOOKUP_USERNAME 'n'
+#define LOOKUP_GROUPNAME 'N'
+
+/*
+ * A cached NSS lookup. While pending, a resolver thread owns the result
+ * fields.
+ */
+typedef struct ResolverEntry {
+    char kind;
+    char* name;
+    bool pending;
+    // How many callers are using the entry; it isn't evicted while they are
+    int refs;
+    bool found;
+    // errno of a failed lookup; zero if the lookup went through
+    int error;
+    id_t id;
+    gid_t* gids;
+    int ngids;
+    // The name found by a lookup by id
+    char* found_name;
+    uint64_t expires_usec;
+} ResolverEntry;
+
+/*
+ * An enumeration of every user or group, done by a resolver thread on behalf
+ * of a caller that may stop waiting on it. Whichever of the two lets go of it
+ * last frees it.
+ */
+typedef struct Enumeration {
+    char kind;
+    // Allocated copies of the names to find
+    char** names;
+    size_t nnames;
+    id_t* ids;
+    bool* found;
+    bool pending;
+    // errno of a failed enumeration; zero if it went through
+    int error;
+    int refs;
+} Enumeration;
+
+static void _resolve(char kind, const char* name, ResolverEntry* result);
+static int _resolve_many(char kind, char** names, size_t nnames, id_t* ids,
+    bool* found, int* errors);
+static int _resolve_ids(char kind, const id_t* ids, size_t nids,
+    char** names);
+static ResolverEntry* _get_entry(char kind, const char* name);
+static void _put_entry(ResolverEntry* entry);
+static void _put_entries(ResolverEntry** entries, size_t nentries);
+static void _evict_entries(uint64_t now);
+static int _compare_expiries(const void* a, const void* b);
+static void _free_entry(ResolverEntry* entry);
+static int _queue_entry(ResolverEntry* entry, uint64_t now);
+static void _wait_on_entry(ResolverEntry* entry, uint64_t deadline);
+static int _enumerate_on_pool(char kind, char** names, size_t nnames,
+    id_t* ids, bool* found, uint64_t deadline);
+static Enumeration* _create_enumeration(char kind, char** names,
+    size_t nnames);
+static void _put_enumeration(Enumeration* enumeration);
+static void _run_enumeration(Enumeration* enumeration);
+static int _enumerate(char kind, char** names, size_t nnames, id_t* ids,
+    bool* found);
+static bool _parse_numeric_id(const char* name, id_t* id);
+static int _compare_names(const void* a, const void* b, void* names);
+static void* _resolver_thread(void* vargp);
+static void _nss_lookup(char kind, const char* name, ResolverEntry* result);
+static int _nss_lookup_with(char kind, const char* name, char* buf,
+    size_t bufsize, ResolverEntry* result);
+static int _nss_grouplist(const char* username, gid_t gid,
+    ResolverEntry* result);
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t done;
+    // ResolverEntry*'s keyed by kind:name
+    HashMap cache;
+    // How many entries the cache may hold before some are evicted
+    size_t evict_at;
+    // ResolverEntry*'s waiting on a resolver thread
+    Vector jobs;
+    size_t next_job;
+    // Enumeration*'s waiting on a resolver thread
+    Vector enumerations;
+    size_t next_enumeration;
+    uint64_t timeout_usec;
+    bool running;
+    bool enumerate;
+    bool validate_ids;
+    // getpwent and getgrent share a position per process
+    pthread_mutex_t enumerate_lock;
+} resolver = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .enumerate = true,
+    .enumerate_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+void configure_resolver(bool enumerate, bool validate_ids)
+{
+    pthread_mutex_lock(&resolver.lock);
+    resolver.enumerate = enumerate;
+    resolver.validate_ids = validate_ids;
+    pthread_mutex_unlock(&resolver.lock);
+}
+
+int start_resolver(size_t nthreads, uint64_t timeout_usec)
+{
+    assert(nthreads > 0);
+
+    pthread_mutex_lock(&resolver.lock);
+    if (resolver.running) {
+        pthread_mutex_unlock(&resolver.lock);
+        return 0;
+    }
+
+    resolver.timeout_usec = timeout_usec;
+    resolver.next_job = 0;
+    resolver.next_enumeration = 0;
+    resolver.evict_at = RESOLVER_CACHE_SIZE;
+    if (create_hashmap(&resolver.cache, sizeof(ResolverEntry*), 0) < 0)
+        goto error;
+    if (create_vector(&resolver.jobs, sizeof(ResolverEntry*)) < 0)
+        goto error;
+    if (create_vector(&resolver.enumerations, sizeof(Enumeration*)) < 0)
+        goto error;
+
+    // Callers wait with deadlines computed from the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&resolver.done, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&resolver.queued, NULL);
+
+    for (size_t n = 0; n < nthreads; n++) {
+        pthread_t tid = 0;
+        int r = pthread_create(&tid, NULL, _resolver_thread, NULL);
+        if (r != 0) {
+            // Threads already running keep the pool usable
+            if (n > 0)
+                break;
+            errno = r;
+            goto error;
+        }
+        pthread_detach(tid);
+    }
+
+    resolver.running = true;
+    pthread_mutex_unlock(&resolver.lock);
+    return 0;
+
+error:
+    pthread_mutex_unlock(&resolver.lock);
+    return -1;
+}
+
+int resolve_uid(const char* username, uid_t* uid)
+{
+    assert(username && uid);
+
+    ResolverEntry result = { 0 };
+    _resolve(LOOKUP_USER, username, &result);
+    errno = result.error;
+    if (!result.found)
+        return -1;
+
+    *uid = result.id;
+    return 0;
+}
+
+int resolve_gid(const char* groupname, gid_t* gid)
+{
+    assert(groupname && gid);
+
+    ResolverEntry result = { 0 };
+    _resolve(LOOKUP_GROUP, groupname, &result);
+    errno = result.error;
+    if (!result.found)
+        return -1;
+
+    *gid = result.id;
+    return 0;
+}
+
+int resolve_usernames(char** usernames, size_t nnames, uid_t* uids,
+    bool* found, int* errors)
+{
+    assert(usernames && uids && found && errors);
+    return _resolve_many(LOOKUP_USER, usernames, nnames, uids, found, errors);
+}
+
+int resolve_groupnames(char** groupnames, size_t nnames, gid_t* gids,
+    bool* found, int* errors)
+{
+    assert(groupnames && gids && found && errors);
+    return _resolve_many(LOOKUP_GROUP, groupnames, nnames, gids, found, errors);
+}
+
+int resolve_uid_names(const uid_t* uids, size_t nuids, char** usernames)
+{
+    assert((uids && usernames) || nuids == 0);
+    return _resolve_ids(LOOKUP_USERNAME, uids, nuids, usernames);
+}
+
+int resolve_gid_names(const gid_t* gids, size_t ngids, char** groupnames)
+{
+    assert((gids && groupnames) || ngids == 0);
+    return _resolve_ids(LOOKUP_GROUPNAME, gids, ngids, groupnames);
+}
+
+int resolve_groups(uid_t uid, gid_t** gids, int* ngids)
+{
+    assert(gids && ngids);
+
+    char name[16];
+    snprintf(name, sizeof name, "%u", uid);
+
+    ResolverEntry result = { 0 };
+    _resolve(LOOKUP_GROUPLIST, name, &result);
+    errno = result.error;
+    if (!result.found)
+        return -1;
+
+    *gids = result.gids;
+    *ngids = result.ngids;
+    return 0;
+}
+
+int resolve_many_groups(const uid_t* uids, size_t nuids, uint64_t timeout_usec,
+    gid_t** gids, int* ngids, int* errors)
+{
+    assert((uids && gids && ngids && errors) || nuids == 0);
+    ResolverEntry** entries = calloc(nuids + 1, sizeof *entries);
+    if (!entries)
+        return -1;
+
+    pthread_mutex_lock(&resolver.lock);
+    bool running = resolver.running;
+    uint64_t now = monotonic_usec();
+    for (size_t n = 0; running && n < nuids; n++) {
+        char name[16];
+        snprintf(name, sizeof name, "%u", uids[n]);
+        entries[n] = _get_entry(LOOKUP_GROUPLIST, name);
+        if (entries[n] && _queue_entry(entries[n], now) < 0) {
+            _put_entry(entries[n]);
+            entries[n] = NULL;
+        }
+    }
+
+    if (timeout_usec > resolver.timeout_usec)
+        timeout_usec = resolver.timeout_usec;
+    uint64_t deadline = now + timeout_usec;
+    size_t ntimedout = 0;
+    for (size_t n = 0; n < nuids; n++) {
+        gids[n] = NULL;
+        ngids[n] = 0;
+        ResolverEntry result = { 0 };
+        if (running && !entries[n]) {
+            errors[n] = ENOMEM;
+            continue;
+        }
+        if (!entries[n]) {
+            // Not started, so look it up here
+            pthread_mutex_unlock(&resolver.lock);
+            char name[16];
+            snprintf(name, sizeof name, "%u", uids[n]);
+            _nss_lookup(LOOKUP_GROUPLIST, name, &result);
+            pthread_mutex_lock(&resolver.lock);
+        } else {
+            _wait_on_entry(entries[n], deadline);
+            if (entries[n]->pending) {
+                errors[n] = ETIMEDOUT;
+                ntimedout++;
+                continue;
+            }
+            result.found = entries[n]->found;
+            result.error = entries[n]->error;
+            if (result.found && entries[n]->gids) {
+                result.gids = malloc(sizeof *result.gids * entries[n]->ngids);
+                if (!result.gids) {
+                    result.found = false;
+                    result.error = ENOMEM;
+                } else {
+                    memcpy(result.gids, entries[n]->gids,
+                        sizeof *result.gids * entries[n]->ngids);
+                    result.ngids = entries[n]->ngids;
+                }
+            }
+        }
+
+        if (!result.found) {
+            errors[n] = result.error ? result.error : ENOENT;
+            continue;
+        }
+        errors[n] = 0;
+        gids[n] = result.gids;
+        ngids[n] = result.ngids;
+    }
+    _put_entries(entries, nuids);
+    pthread_mutex_unlock(&resolver.lock);
+    if (ntimedout > 0)
+        log_message(LOG_WARNING, "Timed out resolving the groups of %zu of %zu "
+                                 "users",
+            ntimedout, nuids);
+
+    free(entries);
+    return 0;
+}
+
+void expire_resolver_cache()
+{
+    pthread_mutex_lock(&resolver.lock);
+    if (resolver.running) {
+        ResolverEntry** entry = NULL;
+        while ((entry = iter_hashmap_values(&resolver.cache)))
+            (*entry)->expires_usec = 0;
+        iter_hashmap_end(&resolver.cache);
+    }
+    pthread_mutex_unlock(&resolver.lock);
+}
+
+/*
+ * Passes back the result of a lookup of the given kind, either from the
+ * cache or from a resolver thread. Any gids passed back are owned by the
+ * caller. If the lookup doesn't finish within the timeout, the error is
+ * ETIMEDOUT; the lookup still finishes in the background and is cached.
+ */
+static void
+_resolve(char kind, const char* name, ResolverEntry* result)
+{
+    if (kind != LOOKUP_GROUPLIST && _parse_numeric_id(name, &result->id)) {
+        result->found = true;
+        return;
+    }
+    if (!resolver.running) {
+        _nss_lookup(kind, name, result);
+        return;
+    }
+
+    pthread_mutex_lock(&resolver.lock);
+    ResolverEntry* entry = _get_entry(kind, name);
+    uint64_t now = monotonic_usec();
+    if (!entry || _queue_entry(entry, now) < 0) {
+        result->error = ENOMEM;
+        goto unlock;
+    }
+
+    // Lookups of the same name share the one in flight
+    _wait_on_entry(entry, now + resolver.timeout_usec);
+    if (entry->pending) {
+        log_message(LOG_WARNING, "Timed out resolving %s", name);
+        result->error = ETIMEDOUT;
+        goto unlock;
+    }
+
+    result->found = entry->found;
+    result->error = entry->error;
+    result->id = entry->id;
+    if (entry->found && entry->gids) {
+        result->gids = malloc(sizeof *result->gids * entry->ngids);
+        if (!result->gids) {
+            result->found = false;
+            result->error = ENOMEM;
+            goto unlock;
+        }
+        memcpy(result->gids, entry->gids, sizeof *result->gids * entry->ngids);
+        result->ngids = entry->ngids;
+    }
+
+unlock:
+    if (entry)
+        _put_entry(entry);
+    pthread_mutex_unlock(&resolver.lock);
+}
+
+/*
+ * Resolves many names of the given kind at once, passing back whether each
+ * was found and the errno of each whose lookup failed. Names that aren't
+ * cached are found with a single enumeration of the database if there are
+ * enough of them, and the rest are queued on the resolver threads together.
+ * Both are waited on under one timeout. Returns -1 if there was an error (and
+ * errno should be looked up), otherwise 0.
+ */
+static int
+_resolve_many(char kind, char** names, size_t nnames, id_t* ids, bool* found,
+    int* errors)
+{
+    size_t nmisses = 0;
+    char** misses = calloc(nnames + 1, sizeof *misses);
+    size_t* miss_index = calloc(nnames + 1, sizeof *miss_index);
+    id_t* miss_ids = calloc(nnames + 1, sizeof *miss_ids);
+    bool* miss_found = calloc(nnames + 1, sizeof *miss_found);
+    ResolverEntry** entries = calloc(nnames + 1, sizeof *entries);
+    if (!misses || !miss_index || !miss_ids || !miss_found || !entries)
+        goto error;
+
+    pthread_mutex_lock(&resolver.lock);
+    bool enumerate = resolver.enumerate;
+    uint64_t now = monotonic_usec();
+    uint64_t deadline = now + resolver.timeout_usec;
+    for (size_t n = 0; n < nnames; n++) {
+        errors[n] = 0;
+        found[n] = _parse_numeric_id(names[n], &ids[n]);
+        if (found[n])
+            continue;
+
+        ResolverEntry* entry = NULL;
+        if (resolver.running) {
+            entry = _get_entry(kind, names[n]);
+            if (!entry) {
+                pthread_mutex_unlock(&resolver.lock);
+                goto error;
+            }
+            if (!entry->pending && now < entry->expires_usec) {
+                found[n] = entry->found;
+                ids[n] = entry->id;
+                _put_entry(entry);
+                continue;
+            }
+        }
+        entries[nmisses] = entry;
+        miss_index[nmisses] = n;
+        misses[nmisses++] = names[n];
+    }
+    pthread_mutex_unlock(&resolver.lock);
+
+    // One pass over the database beats a round trip per name, but only
+    // when there are enough names to pay for reading all of it
+    if (enumerate && nmisses >= BULK_ENUMERATE_MIN) {
+        if (_enumerate_on_pool(kind, misses, nmisses, miss_ids, miss_found,
+                deadline)
+            < 0)
+            goto error;
+    }
+
+    pthread_mutex_lock(&resolver.lock);
+    now = monotonic_usec();
+    for (size_t m = 0; m < nmisses; m++) {
+        if (!miss_found[m] && entries[m] && _queue_entry(entries[m], now) < 0) {
+            pthread_mutex_unlock(&resolver.lock);
+            goto error;
+        }
+        if (!miss_found[m] || !entries[m] || entries[m]->pending)
+            continue;
+
+        // Enumerated names are cached like any other lookup
+        entries[m]->found = true;
+        entries[m]->error = 0;
+        entries[m]->id = miss_ids[m];
+        entries[m]->expires_usec = now + RESOLVER_POSITIVE_TTL_USEC;
+    }
+
+    size_t ntimedout = 0;
+    for (size_t m = 0; m < nmisses; m++) {
+        size_t n = miss_index[m];
+        if (miss_found[m]) {
+            found[n] = true;
+            ids[n] = miss_ids[m];
+            continue;
+        }
+        if (!entries[m]) {
+            // Not started, so look it up here
+            pthread_mutex_unlock(&resolver.lock);
+            ResolverEntry result = { 0 };
+            _nss_lookup(kind, misses[m], &result);
+            found[n] = result.found;
+            ids[n] = result.id;
+            errors[n] = result.error;
+            pthread_mutex_lock(&resolver.lock);
+            continue;
+        }
+
+        // Whatever wasn't enumerated shares what's left of the timeout
+        _wait_on_entry(entries[m], deadline);
+        if (entries[m]->pending) {
+            errors[n] = ETIMEDOUT;
+            ntimedout++;
+            continue;
+        }
+        found[n] = entries[m]->found;
+        ids[n] = entries[m]->id;
+        errors[n] = entries[m]->error;
+    }
+    _put_entries(entries, nmisses);
+    pthread_mutex_unlock(&resolver.lock);
+    if (ntimedout > 0)
+        log_message(LOG_WARNING, "Timed out resolving %zu of %zu names",
+            ntimedout, nnames);
+
+    free(misses);
+    free(miss_index);
+    free(miss_ids);
+    free(miss_found);
+    free(entries);
+    return 0;
+
+error:
+    if (entries) {
+        pthread_mutex_lock(&resolver.lock);
+        _put_entries(entries, nmisses);
+        pthread_mutex_unlock(&resolver.lock);
+    }
+    free(misses);
+    free(miss_index);
+    free(miss_ids);
+    free(miss_found);
+    free(entries);
+    errno = ENOMEM;
+    return -1;
+}
+
+/*
+ * Looks up the names of many ids of the given kind at once, passing back an
+ * allocated copy of each name, or NULL if there is none. Ids that aren't
+ * cached are queued on the resolver threads together and waited on under one
+ * timeout. Ids that can't be queued are treated like ones that timed out,
+ * rather than looked up where they would hold up the caller. Returns -1 if
+ * there was an error (and errno should be looked up), otherwise 0.
+ */
+static int
+_resolve_ids(char kind, const id_t* ids, size_t nids, char** names)
+{
+    ResolverEntry** entries = calloc(nids + 1, sizeof *entries);
+    if (!entries)
+        return -1;
+
+    pthread_mutex_lock(&resolver.lock);
+    bool running = resolver.running;
+    uint64_t now = monotonic_usec();
+    for (size_t n = 0; running && n < nids; n++) {
+        char id[16];
+        snprintf(id, sizeof id, "%u", ids[n]);
+        entries[n] = _get_entry(kind, id);
+        if (entries[n] && _queue_entry(entries[n], now) < 0) {
+            _put_entry(entries[n]);
+            entries[n] = NULL;
+        }
+    }
+
+    uint64_t deadline = now + resolver.timeout_usec;
+    for (size_t n = 0; n < nids; n++) {
+        names[n] = NULL;
+        ResolverEntry result = { 0 };
+        if (running && !entries[n]) {
+            log_message(LOG_WARNING, "Failed to queue lookup of the name of %u",
+                ids[n]);
+            continue;
+        }
+        if (!entries[n]) {
+            // Not started, so look it up here
+            pthread_mutex_unlock(&resolver.lock);
+            char id[16];
+            snprintf(id, sizeof id, "%u", ids[n]);
+            _nss_lookup(kind, id, &result);
+            names[n] = result.found_name;
+            pthread_mutex_lock(&resolver.lock);
+            continue;
+        }
+
+        _wait_on_entry(entries[n], deadline);
+        if (entries[n]->pending) {
+            log_message(LOG_WARNING, "Timed out resolving the name of %u", ids[n]);
+            continue;
+        }
+        if (entries[n]->found_name)
+            names[n] = strdup(entries[n]->found_name);
+    }
+    _put_entries(entries, nids);
+    pthread_mutex_unlock(&resolver.lock);
+
+    free(entries);
+    return 0;
+}
+
+/*
+ * Returns the cached entry for the lookup, creating it if it isn't there, and
+ * holds it until it's put back with _put_entry. Returns NULL if there was an
+ * error. Must be called with the resolver locked.
+ */
+static ResolverEntry*
+_get_entry(char kind, const char* name)
+{
+    char* key = NULL;
+    if (asprintf(&key, "%c:%s", kind, name) < 0)
+        return NULL;
+
+    ResolverEntry** cached = get_hashmap_entry(&resolver.cache, key);
+    ResolverEntry* entry = cached ? *cached : NULL;
+    if (!entry) {
+        // The cache is bounded, since any name may be looked up
+        if (get_hashmap_count(&resolver.cache) >= resolver.evict_at)
+            _evict_entries(monotonic_usec());
+        entry = calloc(1, sizeof *entry);
+        if (entry)
+            entry->name = strdup(name);
+        if (!entry || !entry->name || add_hashmap_entry(&resolver.cache, key, &entry) < 0) {
+            log_message(LOG_WARNING, "Failed to cache lookup of %s", name);
+            if (entry)
+                free(entry->name);
+            free(entry);
+            entry = NULL;
+        } else {
+            entry->kind = kind;
+        }
+    }
+    if (entry)
+        entry->refs++;
+    free(key);
+    return entry;
+}
+
+/*
+ * Puts back an entry held by _get_entry. Must be called with the resolver
+ * locked.
+ */
+static void
+_put_entry(ResolverEntry* entry)
+{
+    assert(entry->refs > 0);
+    entry->refs--;
+}
+
+/*
+ * Puts back each of the entries that isn't NULL. Must be called with the
+ * resolver locked.
+ */
+static void
+_put_entries(ResolverEntry** entries, size_t nentries)
+{
+    for (size_t n = 0; n < nentries; n++)
+        if (entries[n])
+            _put_entry(entries[n]);
+}
+
+/*
+ * Makes room in the full cache by dropping every expired entry and, if that
+ * isn't a quarter of it, the entries that were looked up longest ago. Entries
+ * being looked up or held by a caller are kept, so if too many are, the cache
+ * is let grow a little before trying again. Must be called with the resolver
+ * locked.
+ */
+static void
+_evict_entries(uint64_t now)
+{
+    size_t count = get_hashmap_count(&resolver.cache);
+    size_t target = count - RESOLVER_CACHE_SIZE * 3 / 4;
+    // Evicting is linear, so however it goes it isn't tried again right away
+    resolver.evict_at = count + RESOLVER_CACHE_SIZE / 4;
+    uint64_t* expiries = malloc(sizeof *expiries * count);
+    if (!expiries)
+        return;
+
+    // Entries expire a fixed time after their lookup, so the earliest to
+    // expire are the least recently looked up
+    size_t nevictable = 0;
+    for (size_t n = 0; n < count; n++) {
+        ResolverEntry** entry = NULL;
+        get_hashmap_entry_at(&resolver.cache, n, NULL, (void**)&entry);
+        if (!(*entry)->pending && (*entry)->refs == 0)
+            expiries[nevictable++] = (*entry)->expires_usec;
+    }
+    if (nevictable == 0) {
+        free(expiries);
+        return;
+    }
+    qsort(expiries, nevictable, sizeof *expiries, _compare_expiries);
+    size_t last = (target < nevictable ? target : nevictable) - 1;
+    uint64_t cutoff = expiries[last] > now ? expiries[last] : now;
+    free(expiries);
+
+    // Removing entries one by one is linear each, so the kept ones are
+    // moved to a new cache instead
+    HashMap kept;
+    if (create_hashmap(&kept, sizeof(ResolverEntry*), count) < 0)
+        return;
+    for (size_t n = 0; n < count; n++) {
+        char* key = NULL;
+        ResolverEntry** entry = NULL;
+        get_hashmap_entry_at(&resolver.cache, n, &key, (void**)&entry);
+        bool evict = !(*entry)->pending && (*entry)->refs == 0
+            && (*entry)->expires_usec <= cutoff;
+        if (!evict && add_hashmap_entry(&kept, key, entry) < 0) {
+            // Nothing has been freed yet, so give up on evicting
+            destroy_hashmap(&kept);
+            return;
+        }
+    }
+
+    size_t remaining = get_hashmap_count(&kept);
+    for (size_t n = 0; n < count; n++) {
+        ResolverEntry** entry = NULL;
+        get_hashmap_entry_at(&resolver.cache, n, NULL, (void**)&entry);
+        if (!(*entry)->pending && (*entry)->refs == 0
+            && (*entry)->expires_usec <= cutoff)
+            _free_entry(*entry);
+    }
+    destroy_hashmap(&resolver.cache);
+    resolver.cache = kept;
+    if (remaining + RESOLVER_CACHE_SIZE / 4 < RESOLVER_CACHE_SIZE)
+        resolver.evict_at = RESOLVER_CACHE_SIZE;
+    else
+        resolver.evict_at = remaining + RESOLVER_CACHE_SIZE / 4;
+    log_message(LOG_DEBUG, "Evicted %zu of %zu cached lookups",
+        count - remaining, count);
+}
+
+/*
+ * Orders expiry times, earliest first.
+ */
+static int
+_compare_expiries(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Frees a cached entry and what it holds.
+ */
+static void
+_free_entry(ResolverEntry* entry)
+{
+    free(entry->name);
+    free(entry->gids);
+    free(entry->found_name);
+    free(entry);
+}
+
+/*
+ * Queues the entry on the resolver threads if it has expired and isn't
+ * already being looked up. Returns -1 if there was an error (and errno should
+ * be looked up), otherwise 0. Must be called with the resolver locked.
+ */
+static int
+_queue_entry(ResolverEntry* entry, uint64_t now)
+{
+    if (entry->pending || now < entry->expires_usec)
+        return 0;
+    if (append_vector_item(&resolver.jobs, &entry) < 0)
+        return -1;
+    entry->pending = true;
+    pthread_cond_signal(&resolver.queued);
+    return 0;
+}
+
+/*
+ * Waits until the entry is no longer pending or the deadline (on the
+ * monotonic clock) passes. Must be called with the resolver locked.
+ */
+static void
+_wait_on_entry(ResolverEntry* entry, uint64_t deadline)
+{
+    struct timespec ts = {
+        .tv_sec = deadline / 1000000,
+        .tv_nsec = (deadline % 1000000) * 1000,
+    };
+    while (entry->pending && monotonic_usec() < deadline)
+        pthread_cond_timedwait(&resolver.done, &resolver.lock, &ts);
+}
+
+/*
+ * Enumerates the names of the given kind on a resolver thread, like
+ * _enumerate, waiting on it until the deadline (on the monotonic clock). An
+ * enumeration that doesn't finish in time finds nothing, and is left to
+ * finish in the background. Until the resolver is started, the names are
+ * enumerated on the calling thread. Returns -1 if there was an error (and
+ * errno should be looked up), otherwise 0.
+ */
+static int
+_enumerate_on_pool(char kind, char** names, size_t nnames, id_t* ids,
+    bool* found, uint64_t deadline)
+{
+    pthread_mutex_lock(&resolver.lock);
+    bool running = resolver.running;
+    pthread_mutex_unlock(&resolver.lock);
+    if (!running)
+        return _enumerate(kind, names, nnames, ids, found);
+
+    Enumeration* enumeration = _create_enumeration(kind, names, nnames);
+    if (!enumeration)
+        return -1;
+
+    pthread_mutex_lock(&resolver.lock);
+    if (append_vector_item(&resolver.enumerations, &enumeration) < 0) {
+        pthread_mutex_unlock(&resolver.lock);
+        _put_enumeration(enumeration);
+        return -1;
+    }
+    // One reference is handed to the resolver thread that takes it
+    enumeration->refs++;
+    pthread_cond_signal(&resolver.queued);
+
+    struct timespec ts = {
+        .tv_sec = deadline / 1000000,
+        .tv_nsec = (deadline % 1000000) * 1000,
+    };
+    while (enumeration->pending && monotonic_usec() < deadline)
+        pthread_cond_timedwait(&resolver.done, &resolver.lock, &ts);
+
+    if (enumeration->pending) {
+        log_message(LOG_WARNING, "Timed out enumerating %zu %s names",
+            nnames, kind == LOOKUP_GROUP ? "group" : "user");
+    } else if (enumeration->error) {
+        log_message(LOG_WARNING, "Failed to enumerate %s names: %s",
+            kind == LOOKUP_GROUP ? "group" : "user",
+            strerror(enumeration->error));
+    } else {
+        memcpy(ids, enumeration->ids, sizeof *ids * nnames);
+        memcpy(found, enumeration->found, sizeof *found * nnames);
+    }
+    _put_enumeration(enumeration);
+    pthread_mutex_unlock(&resolver.lock);
+    return 0;
+}
+
+/*
+ * Creates a pending enumeration of copies of the names, with a reference for
+ * the caller. Returns NULL if there was an error (and errno should be looked
+ * up).
+ */
+static Enumeration*
+_create_enumeration(char kind, char** names, size_t nnames)
+{
+    Enumeration* enumeration = calloc(1, sizeof *enumeration);
+    if (!enumeration)
+        return NULL;
+    enumeration->kind = kind;
+    enumeration->pending = true;
+    enumeration->refs = 1;
+    enumeration->names = calloc(nnames + 1, sizeof *enumeration->names);
+    enumeration->ids = calloc(nnames + 1, sizeof *enumeration->ids);
+    enumeration->found = calloc(nnames + 1, sizeof *enumeration->found);
+    if (!enumeration->names || !enumeration->ids || !enumeration->found) {
+        _put_enumeration(enumeration);
+        return NULL;
+    }
+    for (; enumeration->nnames < nnames; enumeration->nnames++) {
+        size_t n = enumeration->nnames;
+        enumeration->names[n] = strdup(names[n]);
+        if (!enumeration->names[n]) {
+            _put_enumeration(enumeration);
+            return NULL;
+        }
+    }
+    return enumeration;
+}
+
+/*
+ * Drops a reference to the enumeration, freeing it if it was the last. Must
+ * be called with the resolver locked once the enumeration has been queued.
+ */
+static void
+_put_enumeration(Enumeration* enumeration)
+{
+    if (--enumeration->refs > 0)
+        return;
+    for (size_t n = 0; n < enumeration->nnames; n++)
+        free(enumeration->names[n]);
+    free(enumeration->names);
+    free(enumeration->ids);
+    free(enumeration->found);
+    free(enumeration);
+}
+
+/*
+ * Does a queued enumeration and hands its results to whoever is waiting on
+ * it. Called on a resolver thread that holds a reference to it.
+ */
+static void
+_run_enumeration(Enumeration* enumeration)
+{
+    // Only the resolver thread touches the results until it's done
+    errno = 0;
+    int r = _enumerate(enumeration->kind, enumeration->names,
+        enumeration->nnames, enumeration->ids, enumeration->found);
+    int error = r < 0 ? (errno ? errno : ENOMEM) : 0;
+
+    pthread_mutex_lock(&resolver.lock);
+    enumeration->error = error;
+    enumeration->pending = false;
+    pthread_cond_broadcast(&resolver.done);
+    _put_enumeration(enumeration);
+    pthread_mutex_unlock(&resolver.lock);
+}
+
+/*
+ * Walks every user or group NSS will enumerate, passing back the ids of the
+ * given names that were seen. Names not seen may still exist, since
+ * databases like LDAP often don't allow enumeration. Returns -1 if there was
+ * an error (and errno should be looked up), otherwise 0.
+ */
+static int
+_enumerate(char kind, char** names, size_t nnames, id_t* ids, bool* found)
+{
+    // The indexes of the names, sorted by name
+    size_t* order = malloc(sizeof *order * nnames);
+    if (!order)
+        return -1;
+    for (size_t n = 0; n < nnames; n++)
+        order[n] = n;
+    qsort_r(order, nnames, sizeof *order, _compare_names, names);
+
+    long initial = sysconf(kind == LOOKUP_GROUP ? _SC_GETGR_R_SIZE_MAX : _SC_GETPW_R_SIZE_MAX);
+    size_t bufsize = initial > 0 ? (size_t)initial : 4096;
+    char* buf = malloc(bufsize);
+    if (!buf) {
+        free(order);
+        return -1;
+    }
+
+    pthread_mutex_lock(&resolver.enumerate_lock);
+    if (kind == LOOKUP_GROUP)
+        setgrent();
+    else
+        setpwent();
+
+    size_t seen = 0;
+    size_t matched = 0;
+    for (;;) {
+        struct passwd pwd;
+        struct passwd* pw = NULL;
+        struct group grp;
+        struct group* gr = NULL;
+        int r = kind == LOOKUP_GROUP
+            ? getgrent_r(&grp, buf, bufsize, &gr)
+            : getpwent_r(&pwd, buf, bufsize, &pw);
+        if (r == ERANGE) {
+            char* tmp = realloc(buf, bufsize * 2);
+            if (!tmp)
+                break;
+            buf = tmp;
+            bufsize *= 2;
+            continue;
+        }
+        if (r != 0)
+            break;
+
+        seen++;
+        const char* name = gr ? gr->gr_name : pw->pw_name;
+        id_t id = gr ? gr->gr_gid : pw->pw_uid;
+
+        // Every copy of the name is a match
+        size_t low = 0;
+        size_t high = nnames;
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            if (strcmp(names[order[mid]], name) < 0)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        for (; low < nnames && strcmp(names[order[low]], name) == 0; low++) {
+            found[order[low]] = true;
+            ids[order[low]] = id;
+            matched++;
+        }
+    }
+
+    if (kind == LOOKUP_GROUP)
+        endgrent();
+    else
+        endpwent();
+    pthread_mutex_unlock(&resolver.enumerate_lock);
+
+    log_message(LOG_DEBUG, "Enumerated %zu %s to resolve %zu of %zu names",
+        seen, kind == LOOKUP_GROUP ? "groups" : "users", matched, nnames);
+    free(buf);
+    free(order);
+    return 0;
+}
+
+/*
+ * Passes back the id if the name is numeric and ids are trusted without
+ * being looked up. Returns whether it was.
+ */
+static bool
+_parse_numeric_id(const char* name, id_t* id)
+{
+    if (resolver.validate_ids || name[0] == '\0' || !all_digits(name))
+        return false;
+
+    errno = 0;
+    char* end = NULL;
+    unsigned long long parsed = strtoull(name, &end, 10);
+    if (errno != 0 || *end != '\0' || parsed >= (id_t)-1)
+        return false;
+    *id = parsed;
+    return true;
+}
+
+/*
+ * Compares the names at two indexes for sorting.
+ */
+static int
+_compare_names(const void* a, const void* b, void* names)
+{
+    return strcmp(((char**)names)[*(const size_t*)a],
+        ((char**)names)[*(const size_t*)b]);
+}
+
+/*
+ * Does queued lookups and enumerations forever.
+ */
+static void*
+_resolver_thread(void* vargp)
+{
+    (void)vargp;
+
+    for (;;) {
+        pthread_mutex_lock(&resolver.lock);
+        while (resolver.next_job >= get_vector_count(&resolver.jobs)
+            && resolver.next_enumeration >= get_vector_count(&resolver.enumerations))
+            pthread_cond_wait(&resolver.queued, &resolver.lock);
+
+        // Enumerations go first, since a whole batch of names waits on each
+        if (resolver.next_enumeration < get_vector_count(&resolver.enumerations)) {
+            Enumeration* enumeration = *(Enumeration**)get_vector_item(
+                &resolver.enumerations, resolver.next_enumeration++);
+            if (resolver.next_enumeration == get_vector_count(&resolver.enumerations)) {
+                clear_vector(&resolver.enumerations);
+                resolver.next_enumeration = 0;
+            }
+            pthread_mutex_unlock(&resolver.lock);
+            _run_enumeration(enumeration);
+            continue;
+        }
+
+        ResolverEntry* entry = *(ResolverEntry**)get_vector_item(&resolver.jobs,
+            resolver.next_job++);
+        if (resolver.next_job == get_vector_count(&resolver.jobs)) {
+            clear_vector(&resolver.jobs);
+            resolver.next_job = 0;
+        }
+        pthread_mutex_unlock(&resolver.lock);
+
+        // The kind and name of an entry never change
+        ResolverEntry result = { 0 };
+        _nss_lookup(entry->kind, entry->name, &result);
+
+        pthread_mutex_lock(&resolver.lock);
+        free(entry->gids);
+        free(entry->found_name);
+        entry->found = result.found;
+        entry->error = result.error;
+        entry->id = result.id;
+        entry->gids = result.gids;
+        entry->ngids = result.ngids;
+        entry->found_name = result.found_name;
+
+        // Failed lookups are retried the next time they are asked for
+        uint64_t now = monotonic_usec();
+        if (result.error)
+            entry->expires_usec = now;
+        else if (result.found)
+            entry->expires_usec = now + RESOLVER_POSITIVE_TTL_USEC;
+        else
+            entry->expires_usec = now + RESOLVER_NEGATIVE_TTL_USEC;
+
+        entry->pending = false;
+        pthread_cond_broadcast(&resolver.done);
+        pthread_mutex_unlock(&resolver.lock);
+    }
+    return NULL;
+}
+
+/*
+ * Does a lookup of the given kind through NSS with the reentrant functions,
+ * growing the buffer they need as necessary.
+ */
+static void
+_nss_lookup(char kind, const char* name, ResolverEntry* result)
+{
+    result->found = false;
+    result->error = 0;
+
+    bool group = kind == LOOKUP_GROUP || kind == LOOKUP_GROUPNAME;
+    long initial = sysconf(group ? _SC_GETGR_R_SIZE_MAX : _SC_GETPW_R_SIZE_MAX);
+    size_t bufsize = initial > 0 ? (size_t)initial : 4096;
+    char* buf = NULL;
+    for (;;) {
+        char* tmp = realloc(buf, bufsize);
+        if (!tmp) {
+            result->error = ENOMEM;
+            break;
+        }
+        buf = tmp;
+
+        int r = _nss_lookup_with(kind, name, buf, bufsize, result);
+        if (r != ERANGE) {
+            result->error = r;
+            break;
+        }
+        bufsize *= 2;
+    }
+    free(buf);
+}
+
+/*
+ * Does a lookup of the given kind with the given buffer. Returns ERANGE if
+ * the buffer is too small, any other lookup error, or 0.
+ */
+static int
+_nss_lookup_with(char kind, const char* name, char* buf, size_t bufsize,
+    ResolverEntry* result)
+{
+    struct passwd pwd;
+    struct passwd* pw = NULL;
+    struct group grp;
+    struct group* gr = NULL;
+    int r = 0;
+
+    switch (kind) {
+    case LOOKUP_USER:
+        if (all_digits(name))
+            r = getpwuid_r((uid_t)strtoll(name, NULL, 10), &pwd, buf, bufsize, &pw);
+        else
+            r = getpwnam_r(name, &pwd, buf, bufsize, &pw);
+        break;
+    case LOOKUP_GROUP:
+        if (all_digits(name))
+            r = getgrgid_r((gid_t)strtoll(name, NULL, 10), &grp, buf, bufsize, &gr);
+        else
+            r = getgrnam_r(name, &grp, buf, bufsize, &gr);
+        break;
+    case LOOKUP_GROUPLIST:
+    case LOOKUP_USERNAME:
+        r = getpwuid_r((uid_t)strtoll(name, NULL, 10), &pwd, buf, bufsize, &pw);
+        break;
+    case LOOKUP_GROUPNAME:
+        r = getgrgid_r((gid_t)strtoll(name, NULL, 10), &grp, buf, bufsize, &gr);
+        break;
+    default:
+        return EINVAL;
+    }
+
+    // Some NSS modules report a missing entry as an error
+    if (r == ENOENT || r == ESRCH)
+        return 0;
+    if (r != 0)
+        return r;
+
+    if (kind == LOOKUP_GROUP || kind == LOOKUP_GROUPNAME) {
+        if (!gr)
+            return 0;
+        if (kind == LOOKUP_GROUPNAME && !(result->found_name = strdup(gr->gr_name)))
+            return ENOMEM;
+        result->found = true;
+        result->id = gr->gr_gid;
+        return 0;
+    }
+    if (!pw)
+        return 0;
+    if (kind == LOOKUP_GROUPLIST)
+        return _nss_grouplist(pw->pw_name, pw->pw_gid, result);
+    if (kind == LOOKUP_USERNAME && !(result->found_name = strdup(pw->pw_name)))
+        return ENOMEM;
+
+    result->found = true;
+    result->id = pw->pw_uid;
+    return 0;
+}
+
+/*
+ * Fills the result with the groups the user belongs to. Returns an errno if
+ * there was an error, otherwise 0.
+ */
+static int
+_nss_grouplist(const char* username, gid_t gid, ResolverEntry* result)
+{
+    int ngroups = 64;
+    gid_t* groups = NULL;
+    for (;;) {
+        gid_t* tmp = realloc(groups, sizeof *groups * ngroups);
+        if (!tmp) {
+            free(groups);
+            return ENOMEM;
+        }
+        groups = tmp;
+
+        // On failure, ngroups is set to the number of groups needed
+        int needed = ngroups;
+        if (getgrouplist(username, gid, groups, &needed) >= 0) {
+            ngroups = needed;
+            break;
+        }
+        ngroups = needed > ngroups ? needed : ngroups * 2;
+    }
+
+    result->found = true;
+    result->gids = groups;
+    result->ngids = ngroups;
+    return 0;
+}
@@ -0,0 +1,700 @@
+// SPDX-License-Identifier: GPL-3.0
+#define _GNU_SOURCE
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "classparser.h"
+#include "hashmap.h"
+#include "snapshot.h"
+#include "utils.h"
+#include "vector.h"
+
+/*
+ * The start of a snapshot. Offsets of sections are from the start of the
+ * snapshot, while offsets of strings are from the start of the strings.
+ */
+typedef struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t size;
+    // FNV-1a hash of everything after the header
+    uint64_t checksum;
+    // When the snapshot was built, in seconds since the epoch
+    int64_t built_sec;
+    // The configuration generation of an export; zero in snapshots
+    uint64_t generation;
+    uint32_t classdir;
+    uint32_t classext;
+    uint32_t nfiles;
+    uint32_t nclasses;
+    uint64_t files;
+    uint64_t classes;
+    uint64_t controls;
+    uint64_t ncontrols;
+    uint64_t ids;
+    uint64_t nids;
+    uint64_t parents;
+    uint64_t nparents;
+    uint64_t strings;
+    uint64_t strings_size;
+} SnapshotHeader;
+
+/*
+ * A class file in the class directory when the snapshot was built.
+ */
+typedef struct SnapshotFile {
+    uint32_t name;
+    // Whether the file was loaded as a class
+    uint32_t loaded;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t size;
+    uint64_t hash;
+} SnapshotFile;
+
+/*
+ * A resolved and flattened class. Its users and groups are sorted runs of
+ * ids, and its parents a run of strings.
+ */
+typedef struct SnapshotClass {
+    uint32_t name;
+    uint32_t filepath;
+    double priority;
+    uint32_t shared;
+    uint32_t ncontrols;
+    uint64_t hash;
+    uint64_t first_control;
+    uint64_t users;
+    uint64_t nusers;
+    uint64_t groups;
+    uint64_t ngroups;
+    uint64_t first_parent;
+    uint64_t nparents;
+} SnapshotClass;
+
+typedef struct SnapshotControl {
+    uint32_t key;
+    uint32_t value;
+} SnapshotControl;
+
+/*
+ * A section of a snapshot being built.
+ */
+typedef struct Buffer {
+    char* data;
+    size_t size;
+    size_t capacity;
+} Buffer;
+
+static int _build(const char* classdir, const char* classext,
+    HashMap* classes, bool persistent, uint64_t generation, char** data,
+    size_t* size);
+static int _snapshot_files(const char* classdir, const char* classext,
+    HashMap* classes, Buffer* files, Buffer* strings);
+static int _snapshot_class(char* classname, ClassProperties* props,
+    Buffer* records, Buffer* controls, Buffer* ids, Buffer* parents,
+    Buffer* strings);
+static int _append_ids(Buffer* ids, const uint32_t* members, size_t nmembers,
+    uint64_t* first, uint64_t* count);
+static int _append(Buffer* buf, const void* data, size_t len);
+static int _append_string(Buffer* strings, const char* string,
+    uint32_t* offset);
+static int _check_snapshot(const char* data, size_t size);
+static bool _in_bounds(uint64_t offset, uint64_t count, size_t item_size,
+    size_t size);
+static int _check_files(const char* data, const char* classdir,
+    const char* classext);
+static int _load_classes(const char* data, HashMap* classes);
+
+int build_snapshot(const char* classdir, const char* classext,
+    HashMap* classes, char** data, size_t* size)
+{
+    assert(classdir && classext && classes && data && size);
+
+    return _build(classdir, classext, classes, true, 0, data, size);
+}
+
+int build_export(const char* classdir, const char* classext,
+    HashMap* classes, uint64_t generation, char** data, size_t* size)
+{
+    assert(classdir && classext && classes && data && size);
+
+    return _build(classdir, classext, classes, false, generation, data, size);
+}
+
+int read_export(const char* data, size_t size, HashMap* classes,
+    uint64_t* generation)
+{
+    assert(data && classes);
+
+    if (size < sizeof(SnapshotHeader)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (_check_snapshot(data, size) < 0 || _load_classes(data, classes) < 0)
+        return -1;
+    if (generation)
+        *generation = ((const SnapshotHeader*)data)->generation;
+    return 0;
+}
+
+/*
+ * Builds a snapshot of the classes as of the given generation, passing back
+ * the allocated snapshot and its size. A persistent snapshot records the
+ * class files to be checked against when it's read, and can't hold
+ * transient controls. Returns the same as build_snapshot.
+ */
+static int
+_build(const char* classdir, const char* classext, HashMap* classes,
+    bool persistent, uint64_t generation, char** data, size_t* size)
+{
+    int ret = -1;
+    Buffer files = { 0 };
+    Buffer records = { 0 };
+    Buffer controls = { 0 };
+    Buffer ids = { 0 };
+    Buffer parents = { 0 };
+    Buffer strings = { 0 };
+
+    SnapshotHeader header = { 0 };
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof header.magic);
+    header.version = SNAPSHOT_VERSION;
+    header.header_size = sizeof header;
+    header.built_sec = time(NULL);
+    header.generation = generation;
+    if (_append_string(&strings, classdir, &header.classdir) < 0
+        || _append_string(&strings, classext, &header.classext) < 0)
+        goto cleanup;
+
+    // Transient controls must not outlive the daemon
+    size_t nclasses = get_hashmap_count(classes);
+    for (size_t n = 0; persistent && n < nclasses; n++) {
+        ClassProperties* props = NULL;
+        get_hashmap_entry_at(classes, n, NULL, (void**)&props);
+        if (props->transient) {
+            errno = EBUSY;
+            goto cleanup;
+        }
+    }
+
+    if (persistent
+        && _snapshot_files(classdir, classext, classes, &files, &strings) < 0)
+        goto cleanup;
+
+    for (size_t n = 0; n < nclasses; n++) {
+        char* classname = NULL;
+        ClassProperties* props = NULL;
+        get_hashmap_entry_at(classes, n, &classname, (void**)&props);
+        if (_snapshot_class(classname, props, &records, &controls, &ids,
+                &parents, &strings)
+            < 0)
+            goto cleanup;
+    }
+
+    header.nfiles = files.size / sizeof(SnapshotFile);
+    header.nclasses = nclasses;
+    header.ncontrols = controls.size / sizeof(SnapshotControl);
+    header.nids = ids.size / sizeof(uint32_t);
+    header.nparents = parents.size / sizeof(uint32_t);
+    header.strings_size = strings.size;
+
+    // Every section starts 8 byte aligned, so it can be used in place
+    Buffer* sections[] = { &files, &records, &controls, &ids, &parents,
+        &strings };
+    uint64_t* offsets[] = { &header.files, &header.classes, &header.controls,
+        &header.ids, &header.parents, &header.strings };
+    size_t total = sizeof header;
+    for (size_t s = 0; s < sizeof sections / sizeof *sections; s++) {
+        total = (total + 7) & ~(size_t)7;
+        *offsets[s] = total;
+        total += sections[s]->size;
+    }
+    header.size = total;
+
+    char* snapshot = calloc(1, total);
+    if (!snapshot)
+        goto cleanup;
+    for (size_t s = 0; s < sizeof sections / sizeof *sections; s++)
+        if (sections[s]->size > 0)
+            memcpy(snapshot + *offsets[s], sections[s]->data, sections[s]->size);
+    header.checksum = fnv1a_hash(FNV1A_OFFSET, snapshot + sizeof header,
+        total - sizeof header);
+    memcpy(snapshot, &header, sizeof header);
+
+    *data = snapshot;
+    *size = total;
+    ret = 0;
+
+cleanup:
+    free(files.data);
+    free(records.data);
+    free(controls.data);
+    free(ids.data);
+    free(parents.data);
+    free(strings.data);
+    return ret;
+}
+
+int write_snapshot(const char* path, const char* classdir,
+    const char* classext, HashMap* classes)
+{
+    assert(path);
+
+    char* data = NULL;
+    size_t size = 0;
+    if (build_snapshot(classdir, classext, classes, &data, &size) < 0)
+        return -1;
+
+    // A snapshot outlives a crash, so it must not be left empty by one
+    int ret = write_file_atomically(path, data, size, true);
+    free(data);
+    return ret;
+}
+
+int read_snapshot(const char* path, const char* classdir,
+    const char* classext, HashMap* classes)
+{
+    assert(path && classdir && classext && classes);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+
+    // The snapshot decides resource controls, so only trust our own
+    if (st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))
+        || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t size = st.st_size;
+    char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return -1;
+
+    int r = _check_snapshot(data, size);
+    if (r == 0) {
+        const SnapshotHeader* header = (const SnapshotHeader*)data;
+        const char* strings = data + header->strings;
+        if (strcmp(strings + header->classdir, classdir) != 0
+            || strcmp(strings + header->classext, classext) != 0) {
+            errno = ESTALE;
+            r = -1;
+        }
+    }
+    if (r == 0)
+        r = _check_files(data, classdir, classext);
+    if (r == 0)
+        r = _load_classes(data, classes);
+
+    int saved = errno;
+    munmap(data, size);
+    errno = saved;
+    return r;
+}
+
+/*
+ * Records every class file in the class directory. Each loaded class must
+ * still match its class file. Returns -1 if there was an error (and errno
+ * should be looked up), otherwise 0.
+ */
+static int
+_snapshot_files(const char* classdir, const char* classext, HashMap* classes,
+    Buffer* files, Buffer* strings)
+{
+    struct dirent** class_files = NULL;
+    int num_files = 0;
+    if (list_class_files(classdir, classext, &class_files, &num_files) < 0)
+        return -1;
+
+    int r = 0;
+    size_t nloaded = 0;
+    for (int i = 0; i < num_files; i++) {
+        char* classname = class_files[i]->d_name;
+        if (r < 0)
+            goto next;
+
+        const char* filepath = get_filepath(classdir, classname);
+        if (!filepath) {
+            r = -1;
+            goto next;
+        }
+
+        // Stat before hashing, so a change in between shows up as a newer
+        // mtime when the snapshot is checked
+        SnapshotFile file = { 0 };
+        struct stat st;
+        r = stat(filepath, &st);
+        if (r == 0)
+            r = hash_file(filepath, &file.hash);
+        free((char*)filepath);
+        if (r < 0)
+            goto next;
+
+        ClassProperties* props = get_hashmap_entry(classes, classname);
+        if (props && props->hash != file.hash) {
+            errno = ESTALE;
+            r = -1;
+            goto next;
+        }
+        nloaded += props != NULL;
+
+        file.loaded = props != NULL;
+        file.mtime_sec = st.st_mtim.tv_sec;
+        file.mtime_nsec = st.st_mtim.tv_nsec;
+        file.size = st.st_size;
+        if (_append_string(strings, classname, &file.name) < 0
+            || _append(files, &file, sizeof file) < 0)
+            r = -1;
+
+    next:
+        free(class_files[i]);
+    }
+    free(class_files);
+
+    // A class whose file is gone can't be told apart from a loaded one
+    if (r == 0 && nloaded != get_hashmap_count(classes)) {
+        errno = ESTALE;
+        r = -1;
+    }
+    return r;
+}
+
+/*
+ * Appends the class to the records, with its members sorted. Returns -1 if
+ * there was an error (and errno should be looked up), otherwise 0.
+ */
+static int
+_snapshot_class(char* classname, ClassProperties* props, Buffer* records,
+    Buffer* controls, Buffer* ids, Buffer* parents, Buffer* strings)
+{
+    SnapshotClass record = {
+        .priority = props->priority,
+        .shared = props->shared,
+        .hash = props->hash,
+        .first_control = controls->size / sizeof(SnapshotControl),
+        .first_parent = parents->size / sizeof(uint32_t),
+        .nparents = get_string_vector_count(&props->parents),
+    };
+    if (_append_string(strings, classname, &record.name) < 0
+        || _append_string(strings, props->filepath, &record.filepath) < 0
+        || _append_ids(ids, props->users.items, props->users.count,
+               &record.users, &record.nusers) < 0
+        || _append_ids(ids, props->groups.items, props->groups.count,
+               &record.groups, &record.ngroups) < 0)
+        return -1;
+
+    size_t ncontrols = get_hashmap_count(&props->controls);
+    for (size_t n = 0; n < ncontrols; n++) {
+        char* key = NULL;
+        char** value = NULL;
+        get_hashmap_entry_at(&props->controls, n, &key, (void**)&value);
+
+        SnapshotControl control = { 0 };
+        if (_append_string(strings, key, &control.key) < 0
+            || _append_string(strings, *value, &control.value) < 0
+            || _append(controls, &control, sizeof control) < 0)
+            return -1;
+    }
+    record.ncontrols = ncontrols;
+
+    // The parents are kept to know which classes to reload along with them
+    for (size_t n = 0; n < record.nparents; n++) {
+        char* name = get_string_vector_item(&props->parents, n);
+        uint32_t parent = 0;
+        if (_append_string(strings, name, &parent) < 0
+            || _append(parents, &parent, sizeof parent) < 0)
+            return -1;
+    }
+    return _append(records, &record, sizeof record);
+}
+
+/*
+ * Appends the members as a sorted run of ids, passing back where it starts
+ * and how long it is. Returns -1 if there was an error (and errno should be
+ * looked up), otherwise 0.
+ */
+static int
+_append_ids(Buffer* ids, const uint32_t* members, size_t nmembers,
+    uint64_t* first, uint64_t* count)
+{
+    *first = ids->size / sizeof(uint32_t);
+    *count = nmembers;
+    if (nmembers == 0)
+        return 0;
+    // Classes keep their members sorted already
+    return _append(ids, members, nmembers * sizeof(uint32_t));
+}
+
+/*
+ * Appends the data to the buffer. Returns -1 if there was an error (and errno
+ * should be looked up), otherwise 0.
+ */
+static int
+_append(Buffer* buf, const void* data, size_t len)
+{
+    if (buf->size + len > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity : 4096;
+        while (capacity < buf->size + len)
+            capacity *= 2;
+        char* tmp = realloc(buf->data, capacity);
+        if (!tmp)
+            return -1;
+        buf->data = tmp;
+        buf->capacity = capacity;
+    }
+    memcpy(buf->data + buf->size, data, len);
+    buf->size += len;
+    return 0;
+}
+
+/*
+ * Appends the zero-terminated string to the strings, passing back its offset.
+ * Returns -1 if there was an error (and errno should be looked up),
+ * otherwise 0.
+ */
+static int
+_append_string(Buffer* strings, const char* string, uint32_t* offset)
+{
+    if (strings->size > UINT32_MAX) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    *offset = strings->size;
+    return _append(strings, string, strlen(string) + 1);
+}
+
+/*
+ * Makes sure the snapshot is of this version, is intact and that everything
+ * it refers to is within it. Returns -1 with errno EINVAL if not, otherwise 0.
+ */
+static int
+_check_snapshot(const char* data, size_t size)
+{
+    const SnapshotHeader* header = (const SnapshotHeader*)data;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof header->magic) != 0
+        || header->version != SNAPSHOT_VERSION
+        || header->header_size != sizeof *header
+        || header->size != size
+        || header->checksum != fnv1a_hash(FNV1A_OFFSET, data + sizeof *header, size - sizeof *header))
+        goto invalid;
+
+    if (!_in_bounds(header->files, header->nfiles, sizeof(SnapshotFile), size)
+        || !_in_bounds(header->classes, header->nclasses, sizeof(SnapshotClass), size)
+        || !_in_bounds(header->controls, header->ncontrols, sizeof(SnapshotControl), size)
+        || !_in_bounds(header->ids, header->nids, sizeof(uint32_t), size)
+        || !_in_bounds(header->parents, header->nparents, sizeof(uint32_t), size)
+        || !_in_bounds(header->strings, header->strings_size, 1, size)
+        || header->strings_size == 0
+        || data[header->strings + header->strings_size - 1] != '\0')
+        goto invalid;
+
+    // Every string is terminated since the last one is
+    uint64_t nstrings = header->strings_size;
+    if (header->classdir >= nstrings || header->classext >= nstrings)
+        goto invalid;
+
+    const SnapshotFile* files = (const SnapshotFile*)(data + header->files);
+    for (uint32_t n = 0; n < header->nfiles; n++)
+        if (files[n].name >= nstrings)
+            goto invalid;
+
+    const SnapshotClass* classes = (const SnapshotClass*)(data + header->classes);
+    for (uint32_t n = 0; n < header->nclasses; n++) {
+        const SnapshotClass* class = &classes[n];
+        if (class->name >= nstrings || class->filepath >= nstrings
+            || !_in_bounds(class->users, class->nusers, 1, header->nids)
+            || !_in_bounds(class->groups, class->ngroups, 1, header->nids)
+            || !_in_bounds(class->first_control, class->ncontrols, 1, header->ncontrols)
+            || !_in_bounds(class->first_parent, class->nparents, 1, header->nparents))
+            goto invalid;
+    }
+
+    const uint32_t* parents = (const uint32_t*)(data + header->parents);
+    for (uint64_t n = 0; n < header->nparents; n++)
+        if (parents[n] >= nstrings)
+            goto invalid;
+
+    const SnapshotControl* controls = (const SnapshotControl*)(data + header->controls);
+    for (uint64_t n = 0; n < header->ncontrols; n++)
+        if (controls[n].key >= nstrings || controls[n].value >= nstrings)
+            goto invalid;
+    return 0;
+
+invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+/*
+ * Returns whether count items of item_size starting at offset fit in size,
+ * without overflowing.
+ */
+static bool
+_in_bounds(uint64_t offset, uint64_t count, size_t item_size, size_t size)
+{
+    if (offset > size)
+        return false;
+    return count <= (size - offset) / item_size;
+}
+
+/*
+ * Makes sure the class directory holds the same class files as when the
+ * snapshot was built. Files whose mtime and size changed, or that may have
+ * changed in the same second the snapshot was built, are hashed to find out.
+ * Returns -1 if there was an error (and errno should be looked up; ESTALE
+ * means a file changed), otherwise 0.
+ */
+static int
+_check_files(const char* data, const char* classdir, const char* classext)
+{
+    const SnapshotHeader* header = (const SnapshotHeader*)data;
+    const SnapshotFile* files = (const SnapshotFile*)(data + header->files);
+    const char* strings = data + header->strings;
+
+    struct dirent** class_files = NULL;
+    int num_files = 0;
+    if (list_class_files(classdir, classext, &class_files, &num_files) < 0)
+        return -1;
+
+    int r = 0;
+    if ((uint32_t)num_files != header->nfiles) {
+        errno = ESTALE;
+        r = -1;
+    }
+    for (int i = 0; i < num_files; i++) {
+        if (r < 0)
+            goto next;
+
+        // Both were listed in alphabetical order
+        const SnapshotFile* file = &files[i];
+        if (strcmp(class_files[i]->d_name, strings + file->name) != 0) {
+            errno = ESTALE;
+            r = -1;
+            goto next;
+        }
+
+        const char* filepath = get_filepath(classdir, class_files[i]->d_name);
+        if (!filepath) {
+            r = -1;
+            goto next;
+        }
+        struct stat st;
+        r = stat(filepath, &st);
+        if (r == 0 && (st.st_mtim.tv_sec != file->mtime_sec
+                          || st.st_mtim.tv_nsec != file->mtime_nsec
+                          || (uint64_t)st.st_size != file->size
+                          || st.st_mtim.tv_sec >= header->built_sec - 1)) {
+            uint64_t hash = 0;
+            r = hash_file(filepath, &hash);
+            if (r == 0 && hash != file->hash) {
+                errno = ESTALE;
+                r = -1;
+            }
+        }
+        free((char*)filepath);
+
+    next:
+        free(class_files[i]);
+    }
+    free(class_files);
+    return r;
+}
+
+/*
+ * Creates the classes out of the snapshot. Returns -1 if there was an error
+ * (and errno should be looked up), otherwise 0.
+ */
+static int
+_load_classes(const char* data, HashMap* classes)
+{
+    const SnapshotHeader* header = (const SnapshotHeader*)data;
+    const SnapshotClass* records = (const SnapshotClass*)(data + header->classes);
+    const SnapshotControl* controls = (const SnapshotControl*)(data + header->controls);
+    const uint32_t* ids = (const uint32_t*)(data + header->ids);
+    const uint32_t* parents = (const uint32_t*)(data + header->parents);
+    const char* strings = data + header->strings;
+
+    // The classes are all loaded together, so they share an arena
+    Arena* arena = create_arena();
+    if (!arena)
+        return -1;
+    if (create_hashmap(classes, sizeof(ClassProperties), header->nclasses) < 0) {
+        unref_arena(arena);
+        return -1;
+    }
+
+    for (uint32_t n = 0; n < header->nclasses; n++) {
+        const SnapshotClass* record = &records[n];
+        ClassProperties props;
+        if (init_class(strings + record->filepath, &props, arena) < 0)
+            goto error;
+        props.priority = record->priority;
+        props.shared = record->shared;
+        props.hash = record->hash;
+
+        // The ids were written sorted, so they can be appended as they are
+        int r = ensure_uid_vector_capacity(&props.users, record->nusers);
+        for (uint64_t i = 0; r == 0 && i < record->nusers; i++)
+            r = append_uid_vector_item(&props.users, ids[record->users + i]);
+        if (r == 0)
+            r = ensure_gid_vector_capacity(&props.groups, record->ngroups);
+        for (uint64_t i = 0; r == 0 && i < record->ngroups; i++)
+            r = append_gid_vector_item(&props.groups, ids[record->groups + i]);
+        for (uint32_t i = 0; r == 0 && i < record->ncontrols; i++) {
+            const SnapshotControl* control = &controls[record->first_control + i];
+            r = set_class_control(&props, (char*)strings + control->key,
+                strings + control->value);
+        }
+        for (uint64_t i = 0; r == 0 && i < record->nparents; i++) {
+            const char* parent = arena_intern(arena,
+                strings + parents[record->first_parent + i]);
+            r = parent ? append_string_vector_item(&props.parents, (char*)parent)
+                       : -1;
+        }
+        if (r == 0)
+            r = add_hashmap_entry(classes, (char*)strings + record->name, &props);
+        if (r < 0) {
+            destroy_class(&props);
+            goto error;
+        }
+    }
+    unref_arena(arena);
+    return 0;
+
+error:;
+    int saved = errno;
+    ClassProperties* props = NULL;
+    size_t nclasses = get_hashmap_count(classes);
+    for (size_t n = 0; n < nclasses; n++) {
+        get_hashmap_entry_at(classes, n, NULL, (void**)&props);
+        destroy_class(props);
+    }
+    destroy_hashmap(classes);
+    unref_arena(arena);
+    errno = saved;
+    return -1;
+}
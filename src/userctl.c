@@ -8,12 +8,16 @@ void show_help();
 int main(int argc, char* argv[])
 {
     static const Command cmds[] = {
+        { "batch", batch },
         { "edit", edit },
         { "cat", cat },
+        { "compile", compile },
         { "eval", eval },
+        { "export", export },
         { "-h", show_help },
         { "--help", show_help },
         { "list", list },
+        { "monitor", monitor },
         { "set-property", set_property },
         { "status", status },
         { "reload", reload },
@@ -29,9 +33,13 @@ void show_help()
            "Query or send commands to the userctld daemon.\n\n"
            "  -h --help\t\tShow this help.\n\n"
            "Commands:\n"
+           "  batch\t\t\tRuns many commands over one connection.\n"
+           "  compile\t\tCompiles the class files into a snapshot.\n"
            "  edit\t\t\tOpens up an editor and reloads the class upon exit.\n"
            "  eval\t\t\tEvaluates a user for what class they are in.\n"
+           "  export\t\tWrites out the daemon's whole configuration.\n"
            "  list\t\t\tList the possible classes.\n"
+           "  monitor\t\tFollows changes to the classes and their users.\n"
            "  set-property\t\tSets a transient resource control on a class.\n"
            "  status\t\tPrints the properties of the class.\n"
            "  reload\t\tReload the class.\n"
@@ -6,51 +6,129 @@
 #include <pthread.h>
 #include <signal.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
 #include <systemd/sd-bus.h>
+#include <systemd/sd-daemon.h>
+#include <systemd/sd-event.h>
+#include <unistd.h>
 
+#include "accountwatcher.h"
+#include "classmapwriter.h"
 #include "controller.h"
+#include "dispatcher.h"
+#include "logger.h"
+#include "membership.h"
+#include "notifier.h"
+#include "queryprotocol.h"
+#include "queryserver.h"
+#include "resolver.h"
+#include "snapshot.h"
+#include "watcher.h"
 
 static void* class_enforcer(void* vargp);
+static void* class_revalidator(void* vargp);
+static void publish_classmap(void* userdata);
+static int parse_msec(const char* arg, uint64_t* usec);
+static int get_log_counter(sd_bus* bus, const char* path,
+    const char* interface, const char* property, sd_bus_message* reply,
+    void* userdata, sd_bus_error* ret_error);
 
 static const sd_bus_vtable userctld_vtable[] = {
     SD_BUS_VTABLE_START(0),
     SD_BUS_METHOD("Evaluate", "u", "s", method_evaluate, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_METHOD("GetClass", "s", "sbdauau", method_get_class, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("GetClasses", "ast", "a(ssbdauauasasa{ss})", method_get_classes, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("ExportConfiguration", NULL, "h", method_export_configuration, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("GetUserStatus", "u", "stttb", method_get_user_status, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_METHOD("ListClasses", NULL, "as", method_list_classes, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("ListClassMembers", "s", "au", method_list_class_members, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_METHOD("Reload", "s", NULL, method_reload_class, 0),
     SD_BUS_METHOD("DaemonReload", NULL, NULL, method_daemon_reload, 0),
     SD_BUS_METHOD("SetProperty", "sss", NULL, method_set_property, 0),
+    SD_BUS_METHOD("SetProperties", "sa(ss)", NULL, method_set_properties, 0),
+    SD_BUS_SIGNAL("ClassesChanged", "asasast", 0),
+    SD_BUS_SIGNAL("UserClassChanged", "uss", 0),
+    SD_BUS_SIGNAL("Enforced", "ustttb", 0),
     SD_BUS_PROPERTY("DefaultPath", "s", NULL, offsetof(Context, classdir), 0),
     SD_BUS_PROPERTY("DefaultExtension", "s", NULL, offsetof(Context, classext), 0),
+    SD_BUS_PROPERTY("ReconcileUSec", "t", NULL, offsetof(Context, stats.reconcile_usec), 0),
+    SD_BUS_PROPERTY("ReconciledUsers", "t", NULL, offsetof(Context, stats.reconciled_users), 0),
+    SD_BUS_PROPERTY("ClassArenaBytes", "t", NULL, offsetof(Context, stats.arena_bytes), 0),
+    SD_BUS_PROPERTY("ResidentBytes", "t", NULL, offsetof(Context, stats.resident_bytes), 0),
+    SD_BUS_PROPERTY("DroppedLogMessages", "t", get_log_counter, 0, 0),
+    SD_BUS_PROPERTY("SuppressedLogMessages", "t", get_log_counter, 0, 0),
     SD_BUS_VTABLE_END
 };
 
 static const char* service_path = "/org/dylangardner/userctl";
 static const char* service_name = "org.dylangardner.userctl";
+static uint64_t max_delay_usec = DEFAULT_MAX_DELAY_MSEC * 1000;
+static uint64_t nss_timeout_usec = DEFAULT_NSS_TIMEOUT_MSEC * 1000;
+static uint64_t account_poll_usec = DEFAULT_ACCOUNT_POLL_MSEC * 1000;
+static const char* query_socket = DEFAULT_QUERY_SOCKET;
+static const char* classmap_path = DEFAULT_CLASSMAP_PATH;
+static int debug;
+static int no_enumerate;
+static int no_snapshot;
+static int validate_ids;
 
 void parse_args(int argc, char* argv[])
 {
-    static int version, help, stop, debug;
+    static int version, help, stop;
 
     while (true) {
         static struct option long_options[] = {
+            { "account-poll", required_argument, NULL, 'a' },
+            { "classmap", required_argument, NULL, 'c' },
             { "debug", no_argument, &debug, 'd' },
             { "help", no_argument, &help, 'h' },
+            { "max-delay", required_argument, NULL, 'm' },
+            { "no-enumerate", no_argument, &no_enumerate, 1 },
+            { "no-snapshot", no_argument, &no_snapshot, 1 },
+            { "nss-timeout", required_argument, NULL, 't' },
+            { "query-socket", required_argument, NULL, 'q' },
+            { "validate-ids", no_argument, &validate_ids, 1 },
             { "version", no_argument, &version, 'v' },
             { 0 }
         };
 
         int option_index = 0;
-        int c = getopt_long(argc, argv, "dhv", long_options, &option_index);
+        int c = getopt_long(argc, argv, "a:dhm:q:t:v", long_options, &option_index);
         if (c == -1)
             break;
+
         switch (c) {
+        case 'a':
+            if (parse_msec(optarg, &account_poll_usec) < 0) {
+                fprintf(stderr, "Invalid account poll interval: %s\n", optarg);
+                stop = 1;
+            }
+            break;
+        case 'c':
+            classmap_path = optarg;
+            break;
         case 'd':
             debug = 1;
             break;
+        case 'm':
+            if (parse_msec(optarg, &max_delay_usec) < 0) {
+                fprintf(stderr, "Invalid max delay: %s\n", optarg);
+                stop = 1;
+            }
+            break;
+        case 'q':
+            query_socket = optarg;
+            break;
+        case 't':
+            if (parse_msec(optarg, &nss_timeout_usec) < 0) {
+                fprintf(stderr, "Invalid NSS timeout: %s\n", optarg);
+                stop = 1;
+            }
+            break;
         case 'v':
             version = 1;
             break;
@@ -73,9 +151,28 @@ void parse_args(int argc, char* argv[])
         printf("userctld [OPTIONS...]\n\n"
                "Sets configurable and persistent resource controls on users and "
                "groups.\n\n"
+               "  -a --account-poll=MSEC\tHow often to poll the user and group "
+               "databases\n\t\t\tfor changes, or 0 to never (default %d).\n"
+               "     --classmap=PATH\tWhere to publish the class of each "
+               "logged in user,\n\t\t\tor empty to not (default %s).\n"
                "  -d --debug\t\tDebugging verbosity is turned on and sent to stderr.\n"
                "  -h --help\t\tShow this help.\n"
-               "  -v --version\t\tPrint version and exit.\n\n");
+               "  -m --max-delay=MSEC\tMaximum time a new user waits to be "
+               "batched (default %d).\n"
+               "     --no-enumerate\tLook up class members one by one rather "
+               "than\n\t\t\tenumerating every user and group.\n"
+               "     --no-snapshot\tParse every class file at startup rather "
+               "than\n\t\t\tstarting from a snapshot of them.\n"
+               "  -q --query-socket=PATH\tWhere to answer evaluations without "
+               "the bus,\n\t\t\tor empty to not (default %s).\n"
+               "  -t --nss-timeout=MSEC\tMaximum time to wait on a user or "
+               "group lookup (default %d).\n"
+               "     --validate-ids\tLook up numeric uids and gids in class "
+               "files\n\t\t\tto make sure they exist.\n"
+               "  -v --version\t\tPrint version and exit.\n\n",
+            DEFAULT_ACCOUNT_POLL_MSEC, DEFAULT_CLASSMAP_PATH,
+            DEFAULT_MAX_DELAY_MSEC,
+            DEFAULT_QUERY_SOCKET, DEFAULT_NSS_TIMEOUT_MSEC);
         exit(0);
     }
     if (version) {
@@ -83,75 +180,188 @@ void parse_args(int argc, char* argv[])
         exit(0);
     }
     if (debug) {
-        setlogmask(LOG_UPTO(LOG_DEBUG));
+        set_log_mask(LOG_UPTO(LOG_DEBUG));
         openlog(NULL, LOG_PERROR | LOG_CONS | LOG_PID | LOG_NDELAY, LOG_DAEMON);
     }
 }
 
 int main(int argc, char* argv[])
 {
-    setlogmask(LOG_UPTO(LOG_NOTICE));
+    set_log_mask(LOG_UPTO(LOG_NOTICE));
     openlog(NULL, LOG_CONS | LOG_PID | LOG_NDELAY, LOG_DAEMON);
 
     parse_args(argc, argv);
 
-    Context* context = malloc(sizeof *context);
-    if (!context || init_context(context) < 0)
-        syslog(LOG_ERR, "Failed to initialize userctld");
+    // From here on, logging no longer blocks on the syslog socket
+    if (start_logger(debug) < 0)
+        log_message(LOG_ERR, "Failed to start logger: %s", strerror(errno));
+
+    // A stuck NSS backend must not freeze the daemon while it holds locks.
+    // Classes are parsed on every core (up to MAX_PARSE_THREADS), so give
+    // each one a lookup in flight
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t resolver_threads = ncpus > RESOLVER_THREADS ? (size_t)ncpus : RESOLVER_THREADS;
+    if (resolver_threads > MAX_RESOLVER_THREADS)
+        resolver_threads = MAX_RESOLVER_THREADS;
+    configure_resolver(!no_enumerate, validate_ids);
+    if (start_resolver(resolver_threads, nss_timeout_usec) < 0)
+        log_message(LOG_ERR, "Failed to start resolver: %s", strerror(errno));
 
     pthread_rwlock_init(&context_lock, NULL);
 
+    // Starting from a snapshot skips parsing and resolving every class file;
+    // it is checked against the users and groups once we're ready
+    Context* context = calloc(1, sizeof *context);
+    bool from_snapshot = false;
+    if (context) {
+        context->snapshot_path = no_snapshot ? NULL : DEFAULT_SNAPSHOT_PATH;
+        from_snapshot = init_context_from_snapshot(context) == 0;
+        if (!from_snapshot && context->snapshot_path)
+            log_message(LOG_INFO, "Not starting from snapshot %s: %s",
+                context->snapshot_path, strerror(errno));
+    }
+    if (!context || (!from_snapshot && init_context(context) < 0))
+        log_message(LOG_ERR, "Failed to initialize userctld");
+    else if (!from_snapshot)
+        save_snapshot(context);
+
+    Dispatcher dispatcher;
+    if (create_dispatcher(&dispatcher, context, max_delay_usec) < 0) {
+        log_message(LOG_ERR, "Failed to create dispatcher: %s", strerror(errno));
+        return 1;
+    }
+    context->dispatcher = &dispatcher;
+
+    Membership membership;
+    if (create_membership(&membership) < 0)
+        log_message(LOG_ERR, "Failed to track logged in users: %s", strerror(errno));
+    else
+        context->membership = &membership;
+
+    // Changes are queued from the start and sent once we're on the bus
+    Notifier notifier;
+    bool notifying = create_notifier(&notifier) == 0;
+    if (!notifying)
+        log_message(LOG_ERR, "Failed to create notifier: %s", strerror(errno));
+    else
+        context->notifier = &notifier;
+
+    // Who is in what class is republished whenever it changes
+    bool publishing = context->membership && *classmap_path != '\0';
+    if (notifying && publishing)
+        set_notifier_hook(&notifier, publish_classmap, context);
+
+    pthread_t dispatcher_tid = 0;
+    int r = pthread_create(&dispatcher_tid, NULL, run_dispatcher, &dispatcher);
+    if (r != 0) {
+        log_message(LOG_ERR, "Failed to spawn off dispatcher: %s\n", strerror(r));
+        return 1;
+    }
+    pthread_detach(dispatcher_tid);
+
+    // Evaluations are answered on their own thread, away from the bus
+    QueryServer query_server;
+    bool querying = false;
+    if (*query_socket != '\0') {
+        querying = create_query_server(&query_server, context, query_socket) == 0;
+        if (!querying)
+            log_message(LOG_ERR, "Failed to create query socket %s: %s",
+                query_socket, strerror(errno));
+    }
+    pthread_t query_tid = 0;
+    if (querying) {
+        r = pthread_create(&query_tid, NULL, run_query_server, &query_server);
+        if (r != 0) {
+            log_message(LOG_ERR, "Failed to spawn off query server: %s",
+                strerror(r));
+            destroy_query_server(&query_server);
+            querying = false;
+        } else
+            pthread_detach(query_tid);
+    }
+
+    sd_bus* bus = NULL;
+    sd_event* event = NULL;
     pthread_t tid = 0;
-    int r = pthread_create(&tid, NULL, class_enforcer, context);
+    r = pthread_create(&tid, NULL, class_enforcer, context);
     if (r != 0) {
-        syslog(LOG_ERR, "Failed to spawn off class enforcer: %s\n", strerror(r));
+        log_message(LOG_ERR, "Failed to spawn off class enforcer: %s\n", strerror(r));
         goto cleanup;
     }
     pthread_detach(tid);
 
-    sd_bus* bus = NULL;
     r = sd_bus_open_system(&bus);
     if (r < 0) {
-        syslog(LOG_ERR, "Failed to connect to system bus: %s\n", strerror(-r));
+        log_message(LOG_ERR, "Failed to connect to system bus: %s\n", strerror(-r));
+        goto cleanup;
+    }
+
+    // The bus is run on an event loop so that the notifier can wake it up
+    r = sd_event_new(&event);
+    if (r < 0) {
+        log_message(LOG_ERR, "Failed to create event loop: %s\n", strerror(-r));
+        goto cleanup;
+    }
+    r = sd_bus_attach_event(bus, event, SD_EVENT_PRIORITY_NORMAL);
+    if (r < 0) {
+        log_message(LOG_ERR, "Failed to attach event loop: %s\n", strerror(-r));
         goto cleanup;
     }
 
     r = sd_bus_add_object_vtable(bus, NULL, service_path, service_name,
         userctld_vtable, context);
     if (r < 0) {
-        syslog(LOG_ERR, "Failed to issue method call: %s\n", strerror(-r));
+        log_message(LOG_ERR, "Failed to issue method call: %s\n", strerror(-r));
         goto cleanup;
     }
 
     r = sd_bus_request_name(bus, service_name, 0);
     if (r < 0) {
-        syslog(LOG_ERR, "Failed to acquire service name: %s\n", strerror(-r));
+        log_message(LOG_ERR, "Failed to acquire service name: %s\n", strerror(-r));
         goto cleanup;
     }
 
-    syslog(LOG_NOTICE, "Daemon has started.");
-    for (;;) {
-        r = sd_bus_process(bus, NULL);
-        if (r < 0) {
-            syslog(LOG_ERR, "Failed to process bus: %s\n", strerror(-r));
-            goto cleanup;
-        }
-        if (r > 0)
-            continue;
+    if (notifying
+        && attach_notifier(&notifier, event, bus, service_path, service_name) < 0)
+        log_message(LOG_ERR, "Failed to send change notifications: %s",
+            strerror(errno));
 
-        r = sd_bus_wait(bus, (uint64_t)-1);
-        if (r < 0) {
-            syslog(LOG_ERR, "Failed to wait on bus: %s\n", strerror(-r));
-            goto cleanup;
-        }
+    // Catch up on users who logged in while we weren't running before
+    // telling systemd we're ready
+    if (reconcile_active_users(context) < 0)
+        log_message(LOG_ERR, "Failed to reconcile logged in users: %s",
+            strerror(errno));
+    if (publishing)
+        publish_classmap(context);
+    sd_notify(0, "READY=1");
+
+    if (from_snapshot) {
+        pthread_t revalidator_tid = 0;
+        r = pthread_create(&revalidator_tid, NULL, class_revalidator, context);
+        if (r != 0)
+            log_message(LOG_ERR, "Failed to spawn off class revalidator: %s",
+                strerror(r));
+        else
+            pthread_detach(revalidator_tid);
     }
 
+    log_message(LOG_NOTICE, "Daemon has started.");
+    r = sd_event_loop(event);
+    if (r < 0)
+        log_message(LOG_ERR, "Failed to process bus: %s\n", strerror(-r));
+
 cleanup:
     pthread_rwlock_destroy(&context_lock);
     pthread_kill(tid, SIGKILL);
+    pthread_kill(dispatcher_tid, SIGKILL);
+    if (querying)
+        pthread_kill(query_tid, SIGKILL);
     destroy_context(context);
     free(context);
+    if (notifying)
+        destroy_notifier(&notifier);
     sd_bus_unref(bus);
+    sd_event_unref(event);
     return r < 0 ? 1 : 0;
 }
 
@@ -169,19 +379,19 @@ class_enforcer(void* vargp)
 
     int r = sd_bus_open_system(&bus);
     if (r < 0) {
-        syslog(LOG_ERR, "Failed to connect to system bus: %s", strerror(-r));
+        log_message(LOG_ERR, "Failed to connect to system bus: %s", strerror(-r));
         return NULL;
     }
 
     r = sd_event_default(&event);
     if (r < 0) {
-        syslog(LOG_ERR, "Failed to set default event: %s", strerror(-r));
+        log_message(LOG_ERR, "Failed to set default event: %s", strerror(-r));
         goto cleanup;
     }
 
     r = sd_bus_attach_event(bus, event, SD_EVENT_PRIORITY_NORMAL);
     if (r < 0) {
-        syslog(LOG_ERR, "Failed to attach event loop: %s", strerror(-r));
+        log_message(LOG_ERR, "Failed to attach event loop: %s", strerror(-r));
         goto cleanup;
     }
 
@@ -196,18 +406,127 @@ class_enforcer(void* vargp)
     r = sd_bus_add_match(bus, NULL, signal_match, match_user_new, context);
 
     if (r < 0) {
-        syslog(LOG_ERR, "Failed to watch for for new users: %s", strerror(-r));
+        log_message(LOG_ERR, "Failed to watch for for new users: %s", strerror(-r));
+        goto cleanup;
+    }
+
+    // Users who log out are dropped from the members of their class
+    const char* removed_match = ("type='signal',"
+                                 "sender='org.freedesktop.login1',"
+                                 "path='/org/freedesktop/login1',"
+                                 "interface='org.freedesktop.login1.Manager',"
+                                 "member='UserRemoved'");
+    r = sd_bus_add_match(bus, NULL, removed_match, match_user_removed, context);
+    if (r < 0) {
+        log_message(LOG_ERR, "Failed to watch for users logging out: %s",
+            strerror(-r));
         goto cleanup;
     }
 
-    syslog(LOG_INFO, "Running class enforcer event loop...");
+    // Class files are reloaded as they change, without a reload being asked for
+    Watcher watcher;
+    bool watching = watch_classes(&watcher, event, context) == 0;
+    if (!watching)
+        log_message(LOG_ERR, "Failed to watch class directory: %s",
+            strerror(errno));
+
+    // So are the users whose groups change in the user and group databases
+    AccountWatcher accounts;
+    bool watching_accounts = watch_accounts(&accounts, event, context,
+                                 account_poll_usec)
+        == 0;
+    if (!watching_accounts)
+        log_message(LOG_ERR, "Failed to watch user databases: %s",
+            strerror(errno));
+
+    log_message(LOG_INFO, "Running class enforcer event loop...");
     r = sd_event_loop(event);
     if (r < 0) {
-        syslog(LOG_ERR, "Failed to run event loop: %s", strerror(-r));
+        log_message(LOG_ERR, "Failed to run event loop: %s", strerror(-r));
         goto cleanup;
     }
 
+    if (watching)
+        destroy_watcher(&watcher);
+    if (watching_accounts)
+        destroy_account_watcher(&accounts);
+
 cleanup:
     sd_bus_flush_close_unref(bus);
     return NULL;
 }
+
+/*
+ * Checks the classes loaded from the snapshot against the users and groups
+ * they resolve to now.
+ */
+static void*
+class_revalidator(void* vargp)
+{
+    assert(vargp);
+
+    Context* context = vargp;
+    if (revalidate_classes(context) < 0)
+        log_message(LOG_ERR, "Failed to revalidate classes: %s", strerror(errno));
+    return NULL;
+}
+
+/*
+ * Replaces the classmap with who is in what class now. Called from the bus
+ * event loop whenever that changes.
+ */
+static void
+publish_classmap(void* userdata)
+{
+    Context* context = userdata;
+
+    pthread_rwlock_rdlock(&context_lock);
+    uint64_t generation = context->generation;
+    pthread_rwlock_unlock(&context_lock);
+    if (write_classmap(classmap_path, context->membership, generation) < 0)
+        log_message(LOG_ERR, "Failed to publish classmap %s: %s", classmap_path,
+            strerror(errno));
+}
+
+/*
+ * Replies with the logger's counter of dropped or suppressed messages, which
+ * are kept by the logger rather than in the context's stats.
+ */
+static int
+get_log_counter(sd_bus* bus, const char* path, const char* interface,
+    const char* property, sd_bus_message* reply, void* userdata,
+    sd_bus_error* ret_error)
+{
+    (void)bus;
+    (void)path;
+    (void)interface;
+    (void)userdata;
+    (void)ret_error;
+
+    LogStats stats;
+    get_log_stats(&stats);
+    uint64_t count = strcmp(property, "DroppedLogMessages") == 0
+        ? stats.dropped
+        : stats.suppressed;
+    return sd_bus_message_append_basic(reply, 't', &count);
+}
+
+/*
+ * Parses a non-negative number of milliseconds into usec. Returns -1 if it
+ * isn't one or doesn't fit in microseconds, otherwise 0.
+ */
+static int
+parse_msec(const char* arg, uint64_t* usec)
+{
+    // strtoull would skip spaces and happily wrap a negative number around
+    if (*arg < '0' || *arg > '9')
+        return -1;
+
+    char* end = NULL;
+    errno = 0;
+    unsigned long long msec = strtoull(arg, &end, 10);
+    if (errno != 0 || *end != '\0' || end == arg || msec > UINT64_MAX / 1000)
+        return -1;
+    *usec = msec * 1000;
+    return 0;
+}
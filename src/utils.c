@@ -1,19 +1,21 @@
 // SPDX-License-Identifier: GPL-3.0
+#define _GNU_SOURCE
 #include <ctype.h>
 #include <errno.h>
 #include <grp.h>
+#include <libgen.h>
 #include <pwd.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "utils.h"
 
-bool _alldigits(const char* string);
-
 void die(const char* quote)
 {
     fputs(quote, stderr);
@@ -30,7 +32,7 @@ int to_uid(const char* username, uid_t* uid)
 {
     errno = 0;
     struct passwd* pw = NULL;
-    if (_alldigits(username))
+    if (all_digits(username))
         pw = getpwuid((uid_t)strtoll(username, NULL, 10));
     else
         pw = getpwnam(username);
@@ -54,7 +56,7 @@ int to_gid(const char* groupname, gid_t* gid)
 {
     errno = 0;
     struct group* grp = NULL;
-    if (_alldigits(groupname))
+    if (all_digits(groupname))
         grp = getgrgid((gid_t)strtoll(groupname, NULL, 10));
     else
         grp = getgrnam(groupname);
@@ -74,11 +76,7 @@ int to_groupname(gid_t gid, const char** groupname)
     return 0;
 }
 
-/*
- * Returns whether the string is all digits. If the string is empty, returns
- * false.
- */
-bool _alldigits(const char* string)
+bool all_digits(const char* string)
 {
     if (!string)
         return false;
@@ -161,3 +159,116 @@ add_ext(const char* restrict string, const char* restrict ext)
     strcat(completed, ext);
     return completed;
 }
+
+uint64_t
+fnv1a_hash(uint64_t hash, const void* data, size_t len)
+{
+    const unsigned char* bytes = data;
+    for (size_t n = 0; n < len; n++) {
+        hash ^= bytes[n];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+int hash_file(const char* filepath, uint64_t* hash)
+{
+    FILE* file = fopen(filepath, "r");
+    if (!file)
+        return -1;
+
+    char buf[8192];
+    size_t nread = 0;
+    uint64_t h = FNV1A_OFFSET;
+    while ((nread = fread(buf, 1, sizeof buf, file)) > 0)
+        h = fnv1a_hash(h, buf, nread);
+
+    int r = ferror(file) ? -1 : 0;
+    fclose(file);
+    if (r == 0)
+        *hash = h;
+    return r;
+}
+
+uint64_t
+monotonic_usec()
+{
+    struct timespec ts = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t
+realtime_usec()
+{
+    struct timespec ts = { 0 };
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int get_resident_bytes(uint64_t* bytes)
+{
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (!file)
+        return -1;
+
+    unsigned long size = 0;
+    unsigned long resident = 0;
+    int r = fscanf(file, "%lu %lu", &size, &resident);
+    fclose(file);
+    if (r != 2) {
+        errno = EINVAL;
+        return -1;
+    }
+    *bytes = (uint64_t)resident * sysconf(_SC_PAGESIZE);
+    return 0;
+}
+
+int write_file_atomically(const char* path, const char* data, size_t size,
+    bool sync)
+{
+    int ret = -1;
+    char* tmppath = NULL;
+    char* dir = strdup(path);
+    if (!dir || asprintf(&tmppath, "%s.XXXXXX", path) < 0) {
+        tmppath = NULL;
+        goto cleanup;
+    }
+    if (mkdir(dirname(dir), 0755) < 0 && errno != EEXIST)
+        goto cleanup;
+
+    int fd = mkstemp(tmppath);
+    if (fd < 0)
+        goto cleanup;
+
+    size_t written = 0;
+    while (written < size) {
+        ssize_t r = write(fd, data + written, size - written);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            break;
+        written += r;
+    }
+    if (written < size || fchmod(fd, 0644) < 0 || (sync && fsync(fd) < 0)) {
+        int saved = errno;
+        close(fd);
+        unlink(tmppath);
+        errno = saved;
+        goto cleanup;
+    }
+    close(fd);
+
+    if (rename(tmppath, path) < 0) {
+        int saved = errno;
+        unlink(tmppath);
+        errno = saved;
+        goto cleanup;
+    }
+    ret = 0;
+
+cleanup:
+    free(dir);
+    free(tmppath);
+    return ret;
+}
@@ -1,5 +1,4 @@
 #include <assert.h>
-#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -59,6 +58,13 @@ int append_vector_item(Vector* vec, const void* item)
     return 0;
 }
 
+void clear_vector(Vector* vec)
+{
+    assert(vec);
+    vec->count = 0;
+    vec->iter_count = 0;
+}
+
 void* get_vector_item(Vector* vec, size_t index)
 {
     assert(vec);
@@ -73,26 +79,6 @@ get_vector_count(Vector* vec)
     return vec->count;
 }
 
-void* find_vector_item(Vector* vec, finder_t finder, ...)
-{
-    assert(vec);
-    va_list args;
-    va_start(args, finder);
-
-    void* item = NULL;
-    void* tmp_item = NULL;
-    while ((tmp_item = iter_vector(vec))) {
-        if (finder(tmp_item, args)) {
-            item = tmp_item;
-            break;
-        }
-    }
-    iter_vector_end(vec);
-
-    va_end(args);
-    return item;
-}
-
 void* iter_vector(Vector* vec)
 {
     assert(vec);
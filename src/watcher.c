@@ -0,0 +1,201 @@
+// SPDX-License-Identifier: GPL-3.0
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <syslog.h>
+#include <systemd/sd-event.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "controller.h"
+#include "logger.h"
+#include "utils.h"
+#include "vector.h"
+#include "watcher.h"
+
+// Editors tend to write a new file and rename it over the old one
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+
+static int _on_inotify(sd_event_source* source, int fd, uint32_t revents,
+    void* userdata);
+static int _on_debounce(sd_event_source* source, uint64_t usec,
+    void* userdata);
+static int _note_change(Watcher* watcher, const char* filename);
+static void _clear_changes(Watcher* watcher);
+
+int watch_classes(Watcher* watcher, sd_event* event, Context* context)
+{
+    assert(watcher && event && context);
+    memset(watcher, 0, sizeof *watcher);
+    watcher->context = context;
+    watcher->fd = -1;
+
+    if (create_vector(&watcher->changed, sizeof(char*)) < 0)
+        return -1;
+
+    pthread_rwlock_rdlock(&context_lock);
+    watcher->classext = strdup(context->classext);
+    if (watcher->classext)
+        watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watcher->fd >= 0
+        && inotify_add_watch(watcher->fd, context->classdir, WATCH_EVENTS) < 0) {
+        close(watcher->fd);
+        watcher->fd = -1;
+    }
+    pthread_rwlock_unlock(&context_lock);
+    if (watcher->fd < 0)
+        goto error;
+
+    int r = sd_event_add_io(event, &watcher->io, watcher->fd, EPOLLIN,
+        _on_inotify, watcher);
+    if (r < 0)
+        goto sd_error;
+
+    // Armed whenever a change comes in
+    r = sd_event_add_time(event, &watcher->debounce, CLOCK_MONOTONIC, 0, 0,
+        _on_debounce, watcher);
+    if (r < 0)
+        goto sd_error;
+    r = sd_event_source_set_enabled(watcher->debounce, SD_EVENT_OFF);
+    if (r < 0)
+        goto sd_error;
+    return 0;
+
+sd_error:
+    errno = -r;
+error:
+    r = errno;
+    destroy_watcher(watcher);
+    errno = r;
+    return -1;
+}
+
+void destroy_watcher(Watcher* watcher)
+{
+    assert(watcher);
+
+    sd_event_source_unref(watcher->debounce);
+    sd_event_source_unref(watcher->io);
+    if (watcher->fd >= 0)
+        close(watcher->fd);
+    _clear_changes(watcher);
+    destroy_vector(&watcher->changed);
+    free(watcher->classext);
+    memset(watcher, 0, sizeof *watcher);
+    watcher->fd = -1;
+}
+
+/*
+ * Notes the class files named in the inotify events and pushes back the
+ * reload until the directory has been quiet for RELOAD_DEBOUNCE_MSEC.
+ */
+static int
+_on_inotify(sd_event_source* source, int fd, uint32_t revents, void* userdata)
+{
+    (void)revents;
+    Watcher* watcher = userdata;
+
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t len = read(fd, buf, sizeof buf);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                break;
+            log_message(LOG_ERR, "Failed to read class directory events: %s",
+                strerror(errno));
+            return 0;
+        }
+
+        const struct inotify_event* event = NULL;
+        for (char* ptr = buf; ptr < buf + len;
+             ptr += sizeof *event + event->len) {
+            event = (const struct inotify_event*)ptr;
+            if (event->mask & IN_Q_OVERFLOW)
+                watcher->overflowed = true;
+            if (event->len == 0 || !has_ext(event->name, watcher->classext))
+                continue;
+            if (_note_change(watcher, event->name) < 0) {
+                // Fall back to checking everything rather than miss it
+                watcher->overflowed = true;
+            }
+        }
+    }
+
+    if (!watcher->overflowed && get_vector_count(&watcher->changed) == 0)
+        return 0;
+
+    uint64_t now = 0;
+    int r = sd_event_now(sd_event_source_get_event(source), CLOCK_MONOTONIC, &now);
+    if (r < 0)
+        now = monotonic_usec();
+    r = sd_event_source_set_time(watcher->debounce,
+        now + RELOAD_DEBOUNCE_MSEC * 1000);
+    if (r >= 0)
+        r = sd_event_source_set_enabled(watcher->debounce, SD_EVENT_ONESHOT);
+    if (r < 0)
+        log_message(LOG_ERR, "Failed to schedule class reload: %s", strerror(-r));
+    return 0;
+}
+
+/*
+ * Reloads the class files that changed since the last reload.
+ */
+static int
+_on_debounce(sd_event_source* source, uint64_t usec, void* userdata)
+{
+    (void)source;
+    (void)usec;
+    Watcher* watcher = userdata;
+
+    Vector* filenames = watcher->overflowed ? NULL : &watcher->changed;
+    if (reload_changed_classes(watcher->context, filenames) < 0)
+        log_message(LOG_ERR, "Failed to reload changed classes: %s",
+            strerror(errno));
+
+    _clear_changes(watcher);
+    watcher->overflowed = false;
+    return 0;
+}
+
+/*
+ * Adds the filename to the changed class files, if it isn't already there.
+ * Returns -1 if there was an error (and errno should be looked up), otherwise
+ * 0.
+ */
+static int
+_note_change(Watcher* watcher, const char* filename)
+{
+    size_t nchanged = get_vector_count(&watcher->changed);
+    for (size_t n = 0; n < nchanged; n++)
+        if (strcmp(*(char**)get_vector_item(&watcher->changed, n), filename) == 0)
+            return 0;
+
+    char* copy = strdup(filename);
+    if (!copy || append_vector_item(&watcher->changed, &copy) < 0) {
+        free(copy);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Frees the noted class filenames.
+ */
+static void
+_clear_changes(Watcher* watcher)
+{
+    size_t nchanged = get_vector_count(&watcher->changed);
+    for (size_t n = 0; n < nchanged; n++)
+        free(*(char**)get_vector_item(&watcher->changed, n));
+    clear_vector(&watcher->changed);
+}